@@ -44,224 +44,6 @@ extern AEGP_PluginID			S_mem_id;
 typedef	j2k_inData		format_inData;
 typedef	j2k_outData		format_outData;
 
-#ifndef CONVERT16TO8
-#define CONVERT16TO8(A)		( (((long)(A) * PF_MAX_CHAN8) + PF_HALF_CHAN16) / PF_MAX_CHAN16)
-#endif
-
-static A_Err
-EasyCopy(AEIO_BasicData	*basic_dataP, PF_EffectWorld *src, PF_EffectWorld *dest, PF_Boolean hq)
-{
-	A_Err err =	A_Err_NONE;
-	
-	AEGP_SuiteHandler suites(basic_dataP->pica_basicP);
-
-	if(hq)
-		err = suites.PFWorldTransformSuite()->copy_hq(NULL, src, dest, NULL, NULL);
-	else
-		err = suites.PFWorldTransformSuite()->copy(NULL, src, dest, NULL, NULL);
-	
-	return err;
-}
-
-template <typename InFormat, typename OutFormat>
-static inline OutFormat Convert(InFormat in);
-
-template <>
-static inline PF_FpShort Convert<A_u_char, PF_FpShort>(A_u_char in)
-{
-    return (PF_FpShort)in / (PF_FpShort)PF_MAX_CHAN8;
-}
-
-template <>
-static inline A_u_short Convert<A_u_char, A_u_short>(A_u_char in)
-{
-    return CONVERT8TO16(in);
-}
-
-
-template <>
-static inline PF_FpShort Convert<A_u_short, PF_FpShort>(A_u_short in)
-{
-    return (PF_FpShort)in / (PF_FpShort)PF_MAX_CHAN16;
-}
-
-template <>
-static inline A_u_char Convert<A_u_short, A_u_char>(A_u_short in)
-{
-    return static_cast<A_u_char>(CONVERT16TO8(in));
-}
-
-
-static inline PF_FpShort Clamp(PF_FpShort in)
-{
-    return (in > 1.f ? 1.f : in < 0.f ? 0.f : in);
-}
-
-template <>
-static inline A_u_char Convert<PF_FpShort, A_u_char>(PF_FpShort in)
-{
-    return static_cast<A_u_char>(( Clamp(in) * (PF_FpShort)PF_MAX_CHAN8 ) + 0.5f);
-}
-
-template <>
-static inline A_u_short Convert<PF_FpShort, A_u_short>(PF_FpShort in)
-{
-    return static_cast<A_u_char>(( Clamp(in) * (PF_FpShort)PF_MAX_CHAN16 ) + 0.5f);
-}
-
-typedef struct {
-	PF_EffectWorld	*src;
-	PF_EffectWorld	*dest;
-} CopyWorldData;
-
-template <typename InFormat, typename OutFormat>
-static A_Err CopyWorldIterate(	void 	*refconPV,
-								A_long 	thread_indexL,
-								A_long 	i,
-								A_long 	iterationsL)
-{
-	CopyWorldData *c_data = (CopyWorldData *)refconPV;
-	
-	InFormat *in_pixel = (InFormat *)((char *)c_data->src->data + (i * c_data->src->rowbytes));
-	OutFormat *out_pixel = (OutFormat *)((char *)c_data->dest->data + (i * c_data->dest->rowbytes));
-	
-	for(int x=0; x < c_data->dest->width; x++)
-	{
-		*out_pixel++ = Convert<InFormat, OutFormat>( *in_pixel++ ); // alpha
-		*out_pixel++ = Convert<InFormat, OutFormat>( *in_pixel++ ); // red
-		*out_pixel++ = Convert<InFormat, OutFormat>( *in_pixel++ ); // green
-		*out_pixel++ = Convert<InFormat, OutFormat>( *in_pixel++ ); // blue
-	}
-	
-	return A_Err_NONE;
-}
-
-static A_Err
-SmartCopyWorld(
-	AEIO_BasicData		*basic_dataP,
-	PF_EffectWorld 		*source_World,
-	PF_EffectWorld 		*dest_World,
-	PF_Boolean 			source_ext,
-	PF_Boolean	 		dest_ext, // _ext means 16bpc is true 16-bit (the EXTernal meaning of 16-bit)
-	PF_Boolean			source_writeable)
-{
-	// this is the world copy function AE should have provided
-	// with additional attention to external (true) 16-bit worlds
-	A_Err err =	A_Err_NONE;
-	
-	AEGP_SuiteHandler suites(basic_dataP->pica_basicP);
-	
-	PF_PixelFormat	source_format, dest_format;
-
-	suites.PFWorldSuite()->PF_GetPixelFormat(source_World, &source_format);
-	suites.PFWorldSuite()->PF_GetPixelFormat(dest_World, &dest_format);
-	
-	PF_Boolean hq = FALSE;			
-	
-	// can we just copy?
-	if( (source_format == dest_format) && (source_ext == dest_ext) ) // make sure you are always setting ext's
-	{
-		EasyCopy(basic_dataP, source_World, dest_World, hq);
-	}
-	else
-	{
-		// copy to a buffer of the same size, different bit depth
-		PF_EffectWorld temp_World_data;
-		PF_EffectWorld *temp_World = &temp_World_data;
-		
-		
-		// if out world is the same size, we'll copy directly, otherwise need temp
-		if( (source_World->height == dest_World->width) &&
-			(source_World->width  == dest_World->width) )
-		{
-			temp_World = dest_World;
-		}
-		else
-		{
-			suites.PFWorldSuite()->PF_NewWorld(NULL, source_World->width, source_World->height,
-													FALSE, dest_format, temp_World);
-		}
-		
-		
-		CopyWorldData c_data = { source_World, temp_World };
-		
-		
-		if(source_format == PF_PixelFormat_ARGB128)
-		{
-			if(dest_format == PF_PixelFormat_ARGB64)
-			{
-				err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(source_World->height,
-														(void *)&c_data,
-														CopyWorldIterate<PF_FpShort, A_u_short>);
-				if(!err && dest_ext)
-					err = PromoteWorld(basic_dataP, temp_World);
-			}
-			else if(dest_format == PF_PixelFormat_ARGB32)
-			{
-				err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(source_World->height,
-														(void *)&c_data,
-														CopyWorldIterate<PF_FpShort, A_u_char>);
-			}
-		}
-		else if(source_format == PF_PixelFormat_ARGB64)
-		{
-			if(source_ext)
-				DemoteWorld(basic_dataP, source_World);
-		
-			if(dest_format == PF_PixelFormat_ARGB128)
-			{
-				err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(source_World->height,
-														(void *)&c_data,
-														CopyWorldIterate<A_u_short, PF_FpShort>);
-			}
-			else if(dest_format == PF_PixelFormat_ARGB64)
-			{
-				EasyCopy(basic_dataP, source_World, temp_World, hq);
-																	
-				if(!err && dest_ext)
-					err = PromoteWorld(basic_dataP, temp_World);
-			}
-			else if(dest_format == PF_PixelFormat_ARGB32)
-			{
-				err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(source_World->height,
-														(void *)&c_data,
-														CopyWorldIterate<A_u_short, A_u_char>);
-			}
-			
-			if(source_ext)
-				PromoteWorld(basic_dataP, source_World);
-		}
-		else if(source_format == PF_PixelFormat_ARGB32)
-		{
-			if(dest_format == PF_PixelFormat_ARGB128)
-			{
-				err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(source_World->height,
-														(void *)&c_data,
-														CopyWorldIterate<A_u_char, PF_FpShort>);
-			}
-			else if(dest_format == PF_PixelFormat_ARGB64)
-			{
-				err = suites.AEGPIterateSuite()->AEGP_IterateGeneric(source_World->height,
-														(void *)&c_data,
-														CopyWorldIterate<A_u_char, A_u_short>);
-														
-				if(!err && dest_ext)
-					PromoteWorld(basic_dataP, temp_World);
-			}
-		}
-
-		// copy from temp world if necessary, dispose temp buffer
-		if(temp_World != dest_World)
-		{
-			EasyCopy(basic_dataP, temp_World, dest_World, hq);
-
-			suites.PFWorldSuite()->PF_DisposeWorld(NULL, temp_World);
-		}
-	}
-
-	return err;
-}
-
 static inline A_u_short Demote(A_u_short val)
 {
 	return (val > PF_MAX_CHAN16 ? ( (val - 1) >> 1 ) + 1 : val >> 1);
@@ -855,19 +637,6 @@ FrameSeq_DrawSparseFrame(
 	
 	if (!err) // so far so good?
 	{
-		PF_EffectWorld	temp_World_data;
-		
-		PF_EffectWorld	*temp_World = &temp_World_data,
-					*active_World = NULL;
-		
-		PF_PixelFormat	pixel_format;
-
-		suites.PFWorldSuite()->PF_GetPixelFormat(wP, &pixel_format);
-
-		A_long		wP_depth =	(pixel_format == PF_PixelFormat_ARGB128)? 32 :
-								(pixel_format == PF_PixelFormat_ARGB64) ? 16 : 8;
-		
-
 		// JPEG 2000 can subsample if that's what AE wants
 		PF_Point scale;
 		scale.h = sparse_framePPB->rs.x.den / sparse_framePPB->rs.x.num; // scale.h = 2 means 1/2 x scale
@@ -889,41 +658,15 @@ FrameSeq_DrawSparseFrame(
 			}
 		}
 
-		// here's the only time we won't need to make our own buffer
-		if(	(info.width / subsample == wP->width) && (info.height / subsample == wP->height) &&
-			!(wP_depth != 8 && options->has_LUT) ) // need to make an 8-bit world if we have a LUT
-		{
-			active_World = wP; // just use the PF_EffectWorld AE gave us
-			
-			temp_World = NULL; // won't be needing this
-		}
-		else
-		{
-			// make our own PF_EffectWorld
-			suites.PFWorldSuite()->PF_NewWorld(NULL, info.width / subsample, info.height / subsample, FALSE,
-										(options->has_LUT ? PF_PixelFormat_ARGB32 : pixel_format), temp_World);
-			
-			active_World = temp_World;
-		}
-
-
-		// should always pass a full-sized float world to write into (using options we pass)
-		err = j2k_DrawSparseFrame(basic_dataP, sparse_framePPB, active_World,
+		// j2k_DrawSparseFrame() can decode straight into any size world, at any
+		// depth, filtering down from the nearest reduction if it has to
+		err = j2k_DrawSparseFrame(basic_dataP, sparse_framePPB, wP,
 										draw_flagsP, file_nameZ, &info, options, subsample);
 
 		
 		// for single-channel images, copy R to GB
 		if (info.planes == 1)
-			WorldGreyToRGBA(basic_dataP, active_World);
-
-
-		if(temp_World)
-		{
-			// demotion, etc handled in j2k_DrawSparseFrame()
-			SmartCopyWorld(basic_dataP, temp_World, wP, FALSE, FALSE, TRUE);
-
-			suites.PFWorldSuite()->PF_DisposeWorld(NULL, temp_World);
-		}
+			WorldGreyToRGBA(basic_dataP, wP);
 
 
 		// done with options
@@ -1226,11 +969,6 @@ FrameSeq_OutputFrame(
 	AEIO_Handle			optionsH		=	NULL;
 	format_outData		*options		=	NULL;
 
-	PF_EffectWorld		temp_World_data;
-	
-	PF_EffectWorld		*temp_World		=	&temp_World_data,
-						*active_World	=	NULL;
-
 	PF_Pixel 			premult_color = {0, 0, 0, 255};
 	AEIO_AlphaLabel		alpha;
 	FIEL_Label			field;
@@ -1325,41 +1063,11 @@ FrameSeq_OutputFrame(
 	}
 	
 	
-	// in case we have to create an identical world
-	PF_PixelFormat	pixel_format;
-	suites.PFWorldSuite()->PF_GetPixelFormat(wP, &pixel_format);
-
-
-	// with JPEG 2000 we only have to copy the buffer for sYCC (format specific)
-	if(options->advanced && options->color_space == JP2_COLOR_sYCC)
-	{
-		// make our own float PF_EffectWorld
-		suites.PFWorldSuite()->PF_NewWorld(NULL, info.width, info.height, FALSE,
-												pixel_format, temp_World);
-		
-		// copy the world, promoting will be dealt with later
-		SmartCopyWorld(basic_dataP, (PF_EffectWorld *)wP, temp_World, FALSE, FALSE, FALSE);
-			
-		active_World = temp_World;
-	}
-	else
-	{
-		active_World = (PF_EffectWorld *)wP; // otherwise no
-		
-		temp_World = NULL;
-	}
-
-
-
 	// write out image (finally)
-	err = j2k_OutputFile(basic_dataP, file_pathZ, &info, options, active_World);
+	// sYCC is converted as the encoder copies, so the world is never touched
+	err = j2k_OutputFile(basic_dataP, file_pathZ, &info, options, (PF_EffectWorld *)wP);
 
 	
-	// dispose temp world if we made one	
-	if(temp_World)
-		suites.PFWorldSuite()->PF_DisposeWorld(NULL, temp_World);
-	
-	
 	// dispose profile if we got one
 	if(info.color_profile)
 		suites.ColorSettingsSuite()->AEGP_DisposeColorProfile(info.color_profile);
@@ -26,6 +26,8 @@
 
 #include "j2k_rgba_file.h"
 #include "j2k_platform_io.h"
+#include "j2k_selector.h"
+#include "j2k_openjpeg_codec.h"
 
 #include "j2k_OutUI.h"
 
@@ -87,6 +89,18 @@ j2k_PluginName(char *name)
 A_Err
 j2k_Init(struct SPBasicSuite *pica_basicP)
 {
+	// proxies, regions and draft renders only need some of a file, so
+	// OpenJPEG reads just those tiles and packets when the file has TLM
+	const j2k::CodecList &codecList = j2k::GetCodecList();
+	
+	for(j2k::CodecList::const_iterator i = codecList.begin(); i != codecList.end(); ++i)
+	{
+		j2k::OpenJPEGCodec *openjpeg = dynamic_cast<j2k::OpenJPEGCodec *>(*i);
+		
+		if(openjpeg != NULL)
+			openjpeg->SetSparseReads(true);
+	}
+	
 	return A_Err_NONE;
 }
 
@@ -338,7 +352,7 @@ WorldToBuffer(PF_EffectWorld *wP, PF_PixelFormat pixelFormat)
 
 	const j2k::SampleType sampleType = (pixelFormat == PF_PixelFormat_ARGB32 ? j2k::UCHAR :
 										pixelFormat == PF_PixelFormat_ARGB64 ? j2k::USHORT :
-										//pixelFormat == PF_PixelFormat_ARGB128 ? j2k::FLOAT :
+										pixelFormat == PF_PixelFormat_ARGB128 ? j2k::FLOAT :
 										j2k::UCHAR);
 
 
@@ -352,6 +366,7 @@ WorldToBuffer(PF_EffectWorld *wP, PF_PixelFormat pixelFormat)
 		rgbaChan.sampleType = sampleType;
 		rgbaChan.depth = static_cast<unsigned char>(pixelSize * 8);
 		rgbaChan.sgnd = false;
+		rgbaChan.fifteenPlusOne = (pixelFormat == PF_PixelFormat_ARGB64); // AE 16bpc is 15bit+1
 		
 		rgbaChan.buf = (unsigned char *)wP->data + (i * pixelSize);
 		rgbaChan.colbytes = (4 * pixelSize);
@@ -366,13 +381,18 @@ A_Boolean
 j2k_CanSubsample(
 	j2k_inData		*options)
 {
-	// reading with just the default codec
+	// reads go to whichever codec the CodecSelector picks, and it
+	// will pick one that can subsample if there is one
 	
-	j2k::Codec *codec = j2k::GetDefaultCodec();
+	const j2k::CodecList &codecList = j2k::GetCodecList();
 	
-	const j2k::Codec::ReadFlags flags = codec->GetReadFlags();
+	for(j2k::CodecList::const_iterator i = codecList.begin(); i != codecList.end(); ++i)
+	{
+		if((*i)->GetReadFlags() & j2k::Codec::J2K_CAN_SUBSAMPLE)
+			return TRUE;
+	}
 	
-	return !!(flags & j2k::Codec::J2K_CAN_SUBSAMPLE);
+	return FALSE;
 }
 
 
@@ -438,12 +458,15 @@ j2k_DrawSparseFrame(
 	{
 		PlatformInputFile input(file_pathZ);
 		
-		j2k::RGBAinputFile file(input);
+		// frames come from whichever render thread asks, so each read
+		// borrows a session to keep the decoder's buffers warm
+		j2k::RGBAinputFile file(input, j2k::GetDecodeSessionPool());
 		
 		const j2k::FileInfo &fileInfo = file.GetFileInfo();
 		
-		assert(fileInfo.width == wP->width * subsample);
-		assert(fileInfo.height == wP->height * subsample);
+		// if the world isn't an exact reduction, the file gets filtered to fit
+		const bool exactSize = (fileInfo.width == wP->width * subsample &&
+								fileInfo.height == wP->height * subsample);
 		
 		
 		PF_PixelFormat	pixelFormat;
@@ -479,17 +502,19 @@ j2k_DrawSparseFrame(
 	#endif
 		
 		
-		file.ReadFile(rgbaBuffer, subsample, progressPtr);
+		// draft renders only decode the first few quality layers
+		const unsigned int layers = ((sparse_framePPB != NULL && sparse_framePPB->qual == PF_Quality_LO) ?
+										file.DraftLayers() : 0);
+		
+		if(exactSize)
+			file.ReadFile(rgbaBuffer, subsample, progressPtr, layers);
+		else
+			file.ReadFileScaled(rgbaBuffer, progressPtr, layers);
 		
 		
 	#ifdef NDEBUG
 		err = aeProgressData.err;
 	#endif
-	
-		
-		// ReadFile returns regular 16-bit
-		if(pixelFormat == PF_PixelFormat_ARGB64 && err == A_Err_NONE)
-			DemoteWorld(basic_dataP, wP);
 	}
 	catch(...)
 	{
@@ -613,6 +638,9 @@ j2k_InitOutOptions(
 	options->dci_per_frame	= OUT_DEFAULT_PER_FRAME;
 	options->dci_frame_rate = OUT_DEFAULT_FRAME_RATE;
 	options->dci_stereo		= OUT_DEFAULT_STEREO;
+	options->block_modes	= OUT_DEFAULT_BLOCK_MODES;
+	options->code_block		= OUT_DEFAULT_CODE_BLOCK;
+	options->precinct_size	= OUT_DEFAULT_PRECINCTS;
 
 	return err;
 }
@@ -659,6 +687,9 @@ j2k_OutputFile(
 	JPEG_DCI_Per_Frame dci_per_frame	= advanced ? options->dci_per_frame : OUT_DEFAULT_PER_FRAME;
 	A_char dci_frame_rate				= advanced ? options->dci_frame_rate : OUT_DEFAULT_FRAME_RATE;
 	A_Boolean dci_stereo				= advanced ? options->dci_stereo : OUT_DEFAULT_STEREO;
+	A_u_char block_modes				= advanced ? options->block_modes : OUT_DEFAULT_BLOCK_MODES;
+	JPEG_CodeBlock code_block			= advanced ? options->code_block : OUT_DEFAULT_CODE_BLOCK;
+	A_u_short precinct_size				= advanced ? options->precinct_size : OUT_DEFAULT_PRECINCTS;
 	
 
 	const j2k::ColorSpace optionsColorSpace = (options->color_space == JP2_COLOR_sRGB ? j2k::sRGB :
@@ -708,9 +739,7 @@ j2k_OutputFile(
 	
 	if(advanced && (color_space == j2k::sYCC) )
 	{
-		// if you don't want to subsample, why are you using sYCC?
-		x_subsampling = 2, y_subsampling = 2;
-		/*
+		// JP2_SUBSAMPLE_NONE is 4:4:4
 		switch(options->sub)
 		{
 			case JP2_SUBSAMPLE_422:		x_subsampling = 2, y_subsampling = 1;	break;
@@ -721,7 +750,6 @@ j2k_OutputFile(
 			case JP2_SUBSAMPLE_3x3:		x_subsampling = 3, y_subsampling = 3;	break;
 			case JP2_SUBSAMPLE_4x4:		x_subsampling = 4, y_subsampling = 4;	break;
 		}
-		*/
 	}
 
 
@@ -753,6 +781,13 @@ j2k_OutputFile(
 		
 		fileInfo.colorSpace = color_space;
 		
+		if(fileInfo.colorSpace == j2k::sYCC)
+		{
+			// RGBAoutputFile puts Cb and Cr where green and blue would be
+			fileInfo.subsampling[1] = j2k::Subsampling(x_subsampling, y_subsampling);
+			fileInfo.subsampling[2] = j2k::Subsampling(x_subsampling, y_subsampling);
+		}
+		
 		
 		AEGP_MemHandle icc_profileH = NULL;
 		
@@ -813,6 +848,17 @@ j2k_OutputFile(
 		fileInfo.settings.ycc = A_BooleanToBool(ycc);
 		fileInfo.settings.reversible = A_BooleanToBool(reversible);
 		
+		fileInfo.settings.codeBlockWidth = (code_block == JP2_CODE_BLOCK_32x32 ? 32 :
+											code_block == JP2_CODE_BLOCK_32x128 ? 32 :
+											code_block == JP2_CODE_BLOCK_128x32 ? 128 :
+											64);
+		fileInfo.settings.codeBlockHeight = (code_block == JP2_CODE_BLOCK_32x32 ? 32 :
+											code_block == JP2_CODE_BLOCK_32x128 ? 128 :
+											code_block == JP2_CODE_BLOCK_128x32 ? 32 :
+											64);
+		fileInfo.settings.blockModes = (block_modes & (j2k::BLOCK_BYPASS | j2k::BLOCK_RESET));
+		fileInfo.settings.precinctSize = precinct_size;
+		
 		
 		if(fileInfo.settings.method == j2k::CINEMA)
 		{
@@ -839,22 +885,13 @@ j2k_OutputFile(
 		suites.PFWorldSuite()->PF_GetPixelFormat(wP, &pixel_format);
 		
 		
-		// we can't be bothered with 15bit+1
-		if(pixel_format ==  PF_PixelFormat_ARGB64)
-			PromoteWorld(basic_dataP, wP);
-			
-			
+		// 15bit+1 gets converted as the encoder copies it, so wP is left alone
 		j2k::RGBAbuffer buffer = WorldToBuffer(wP, pixel_format);
 		
 		
 		file.WriteFile(buffer);
 		
 		
-		// gotta switch it back!
-		if(pixel_format ==  PF_PixelFormat_ARGB64)
-			DemoteWorld(basic_dataP, wP);
-		
-		
 		// free profile
 		if(icc_profileH)
 			suites.MemorySuite()->AEGP_FreeMemHandle(icc_profileH);
@@ -926,12 +963,17 @@ j2k_WriteOptionsDialog(
 	params.ycc				= A_BooleanToBool(options->ycc);
 	params.order			= (DialogOrder)options->order;
 	params.tileSize			= options->tile_size;
+	params.sub				= (options->color_space == JP2_COLOR_sYCC ? (DialogSubsample)options->sub : DIALOG_SUBSAMPLE_NONE);
 	params.icc_profile		= (options->color_space == JP2_COLOR_ICC ? DIALOG_PROFILE_ICC : DIALOG_PROFILE_GENERIC);
 	params.dci_profile		= (DialogDCIProfile)options->dci_profile;
 	params.dci_data_rate	= options->dci_data_rate;
 	params.dci_per_frame	= (DialogDCIPerFrame)options->dci_per_frame;
 	params.dci_frame_rate	= options->dci_frame_rate;
 	params.dci_stereo		= A_BooleanToBool(options->dci_stereo);
+	params.codeBlock		= (DialogCodeBlock)options->code_block;
+	params.bypass			= !!(options->block_modes & j2k::BLOCK_BYPASS);
+	params.reset			= !!(options->block_modes & j2k::BLOCK_RESET);
+	params.precinctSize		= options->precinct_size;
 	
 #ifdef MAC_ENV
 	const char *plugHndl = "com.fnordware.AfterEffects.j2k";
@@ -943,7 +985,7 @@ j2k_WriteOptionsDialog(
 	suites.UtilitySuite()->AEGP_GetMainHWND((void *)&hwnd);
 #endif
 	
-	*user_interactedPB0 = j2k_OutUI(&params, "sRGB", profile_name, false, plugHndl, hwnd);
+	*user_interactedPB0 = j2k_OutUI(&params, "sRGB", profile_name, true, plugHndl, hwnd);
 	
 	if(*user_interactedPB0)
 	{
@@ -958,12 +1000,20 @@ j2k_WriteOptionsDialog(
 		options->ycc			= params.ycc;
 		options->order			= params.order;
 		options->tile_size		= params.tileSize;
-		options->color_space	= (params.icc_profile == DIALOG_PROFILE_GENERIC ? JP2_COLOR_sRGB : JP2_COLOR_ICC);
+		options->sub			= params.sub;
+		
+		// picking a subsampling is picking sYCC
+		options->color_space	= (params.sub != DIALOG_SUBSAMPLE_NONE ? JP2_COLOR_sYCC :
+									params.icc_profile == DIALOG_PROFILE_GENERIC ? JP2_COLOR_sRGB :
+									JP2_COLOR_ICC);
 		options->dci_profile	= params.dci_profile;
 		options->dci_data_rate	= params.dci_data_rate;
 		options->dci_per_frame	= params.dci_per_frame;
 		options->dci_frame_rate	= params.dci_frame_rate;
 		options->dci_stereo		= params.dci_stereo;
+		options->code_block		= params.codeBlock;
+		options->block_modes	= static_cast<A_u_char>((params.bypass ? j2k::BLOCK_BYPASS : 0) | (params.reset ? j2k::BLOCK_RESET : 0));
+		options->precinct_size	= params.precinctSize;
 	}
 	
 	if(iccH)
@@ -1054,7 +1104,18 @@ j2k_GetOutSpecInfo(
 					sub_type += "AE depth";
 				
 				// ycc
-				if(options->ycc)
+				if(options->color_space == JP2_COLOR_sYCC)
+				{
+					sub_type += (options->sub == JP2_SUBSAMPLE_422 ? ", sYCC 4:2:2" :
+									options->sub == JP2_SUBSAMPLE_411 ? ", sYCC 4:1:1" :
+									options->sub == JP2_SUBSAMPLE_420 ? ", sYCC 4:2:0" :
+									options->sub == JP2_SUBSAMPLE_311 ? ", sYCC 3:1:1" :
+									options->sub == JP2_SUBSAMPLE_2x2 ? ", sYCC 2x2" :
+									options->sub == JP2_SUBSAMPLE_3x3 ? ", sYCC 3x3" :
+									options->sub == JP2_SUBSAMPLE_4x4 ? ", sYCC 4x4" :
+									", sYCC");
+				}
+				else if(options->ycc)
 					sub_type += ", ycc";
 					
 				// reversible
@@ -1169,6 +1230,7 @@ j2k_FlattenOutputOptions(
 	options->tile_size	= SWAP_SHORT(options->tile_size);
 	options->color_space = SWAP_LONG(options->color_space);
 	options->dci_data_rate = SWAP_LONG(options->dci_data_rate);
+	options->precinct_size = SWAP_SHORT(options->precinct_size);
 #endif
 
 	return A_Err_NONE;
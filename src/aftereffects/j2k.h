@@ -96,6 +96,14 @@ typedef enum {
 } DCI_ENUM;
 typedef A_u_char JPEG_DCI_Per_Frame;
 
+enum {
+	JP2_CODE_BLOCK_64x64 = 0,
+	JP2_CODE_BLOCK_32x32,
+	JP2_CODE_BLOCK_128x32,
+	JP2_CODE_BLOCK_32x128
+};
+typedef A_u_char JPEG_CodeBlock;
+
 
 #define J2K_VERSION_MAJOR	2
 #define J2K_VERSION_MINOR	6
@@ -134,6 +142,9 @@ typedef struct j2k_inData
 #define OUT_DEFAULT_PER_FRAME	DCI_PER_SECOND
 #define OUT_DEFAULT_FRAME_RATE	24
 #define OUT_DEFAULT_STEREO		FALSE
+#define OUT_DEFAULT_BLOCK_MODES	0
+#define OUT_DEFAULT_CODE_BLOCK	JP2_CODE_BLOCK_64x64
+#define OUT_DEFAULT_PRECINCTS	0
 
 typedef struct j2k_outData
 {
@@ -158,6 +169,9 @@ typedef struct j2k_outData
 	JPEG_DCI_Per_Frame	dci_per_frame;
 	A_char				dci_frame_rate;
 	A_Boolean			dci_stereo;
+	A_u_char			block_modes; // BlockMode bits, only BYPASS and RESET (old "Fast" was 1, i.e. BYPASS)
+	JPEG_CodeBlock		code_block;
+	A_u_short			precinct_size; // 0 for full, older projects have 0 in all three
 } j2k_outData;
 
 
@@ -0,0 +1,2154 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// Command-line transcoder, for batch conversions and timing the codecs
+// outside of a host application.  The CMakeLists.txt at the top of the
+// tree builds it from src/common without the After Effects sources.
+
+#include "j2k_rgba_file.h"
+#include "j2k_openjpeg_codec.h"
+#include "j2k_platform_io.h"
+#include "j2k_scratch.h"
+#include "j2k_selector.h"
+#include "j2k_thread.h"
+#include "j2k_exception.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+	#include <Windows.h>
+	#include <Psapi.h>
+	#pragma comment(lib, "psapi.lib")
+#else
+	#include <glob.h>
+	#include <sys/resource.h>
+#endif
+
+
+using namespace j2k;
+
+
+enum FileType
+{
+	TYPE_UNKNOWN,
+	TYPE_J2K,
+	TYPE_PPM,
+	TYPE_TIFF,
+	TYPE_RAW
+};
+
+enum Stage
+{
+	STAGE_OPEN,		// reading the header
+	STAGE_DECODE,	// getting the pixels
+	STAGE_COPY,		// JPEG 2000 planes to RGBA
+	STAGE_CONVERT,	// or sYCC to RGBA
+	STAGE_ENCODE,	// compressing and writing them out
+	
+	STAGE_COUNT
+};
+
+static const char *StageNames[STAGE_COUNT] = { "open", "decode", "copy", "convert", "encode" };
+
+
+typedef struct Options
+{
+	// .raw input has no header
+	unsigned int rawWidth;
+	unsigned int rawHeight;
+	unsigned char rawChannels;
+	unsigned char rawDepth;
+	
+	unsigned int reduce;
+	unsigned int readLayers; // 0 for all
+	bool draft; // DraftLayers() instead
+	bool dropAlpha;
+	
+	unsigned char depth; // JPEG 2000 output, 0 means same as the input
+	Subsampling chroma; // other than 1x1 writes sYCC
+	CompressionSettings settings;
+	
+	Codec *codec; // NULL lets the CodecSelector pick the reader, writes use the default
+	unsigned int jobs;
+	bool verbose;
+	
+	Options() :
+		rawWidth(0),
+		rawHeight(0),
+		rawChannels(3),
+		rawDepth(8),
+		reduce(0),
+		readLayers(0),
+		draft(false),
+		dropAlpha(false),
+		depth(0),
+		codec(NULL),
+		jobs(0),
+		verbose(false)
+	{
+		settings.ycc = true; // as the plug-ins do
+	}
+	
+} Options;
+
+
+// Interleaved RGBA, 16-bit samples for anything deeper than 8 bits.
+// channels is what the file had, the alpha slot is always there.
+typedef struct Image
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned char channels;
+	unsigned char depth;
+	
+	std::vector<unsigned char> pixels;
+	
+	Image() : width(0), height(0), channels(0), depth(0) {}
+	
+	size_t SampleSize() const { return (depth > 8 ? sizeof(unsigned short) : sizeof(unsigned char)); }
+	size_t RowBytes() const { return (width * 4 * SampleSize()); }
+	
+	void Allocate(unsigned int w, unsigned int h, unsigned char c, unsigned char d)
+	{
+		if(w == 0 || h == 0 || d == 0 || d > 16)
+			throw Exception("Unsupported image");
+		
+		width = w;
+		height = h;
+		channels = c;
+		depth = d;
+		
+		pixels.assign(RowBytes() * height, 0);
+		
+		if(channels < 4)
+			FillAlpha();
+	}
+	
+	void FillAlpha()
+	{
+		const unsigned int white = ((1 << depth) - 1);
+		
+		for(size_t p=0; p < ((size_t)width * height); p++)
+		{
+			if(depth > 8)
+				((unsigned short *)&pixels[0])[(p * 4) + 3] = white;
+			else
+				pixels[(p * 4) + 3] = white;
+		}
+	}
+	
+	unsigned int Sample(size_t index) const
+	{
+		return (depth > 8 ? ((const unsigned short *)&pixels[0])[index] : pixels[index]);
+	}
+	
+	void SetSample(size_t index, unsigned int val)
+	{
+		if(depth > 8)
+			((unsigned short *)&pixels[0])[index] = val;
+		else
+			pixels[index] = val;
+	}
+	
+	RGBAbuffer Buffer()
+	{
+		RGBAbuffer buffer;
+		
+		Channel *chans[4] = { &buffer.r, &buffer.g, &buffer.b, &buffer.a };
+		
+		for(int c=0; c < 4; c++)
+		{
+			Channel &chan = *chans[c];
+			
+			chan.width = width;
+			chan.height = height;
+			chan.sampleType = (depth > 8 ? USHORT : UCHAR);
+			chan.depth = depth;
+			chan.buf = &pixels[c * SampleSize()];
+			chan.colbytes = (4 * SampleSize());
+			chan.rowbytes = RowBytes();
+		}
+		
+		return buffer;
+	}
+	
+} Image;
+
+
+static std::string
+Lowercase(const std::string &s)
+{
+	std::string result = s;
+	
+	for(size_t i=0; i < result.size(); i++)
+		result[i] = tolower(result[i]);
+	
+	return result;
+}
+
+
+// -modes takes a comma-separated list, like bypass,reset
+static bool
+ParseBlockModes(const std::string &list, unsigned char &modes)
+{
+	modes = 0;
+	
+	std::string::size_type start = 0;
+	
+	while(start <= list.size())
+	{
+		std::string::size_type end = list.find(',', start);
+		
+		if(end == std::string::npos)
+			end = list.size();
+		
+		const std::string mode = Lowercase(list.substr(start, end - start));
+		
+		if(mode == "bypass")
+			modes |= BLOCK_BYPASS;
+		else if(mode == "reset")
+			modes |= BLOCK_RESET;
+		else if(mode == "restart")
+			modes |= BLOCK_RESTART;
+		else if(mode == "vsc")
+			modes |= BLOCK_VSC;
+		else if(mode == "erterm")
+			modes |= BLOCK_ERTERM;
+		else if(mode == "segmark")
+			modes |= BLOCK_SEGMARK;
+		else if(mode != "none")
+			return false;
+		
+		start = end + 1;
+	}
+	
+	return true;
+}
+
+
+static bool
+IsPowerOf2(unsigned int n)
+{
+	return (n > 0 && (n & (n - 1)) == 0);
+}
+
+
+static std::string
+Extension(const std::string &path)
+{
+	const size_t dot = path.find_last_of('.');
+	const size_t slash = path.find_last_of("/\\");
+	
+	if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return std::string();
+	
+	return Lowercase(path.substr(dot + 1));
+}
+
+
+static FileType
+GetFileType(const std::string &path)
+{
+	const std::string ext = Extension(path);
+	
+	return ((ext == "j2c" || ext == "j2k" || ext == "jpc" || ext == "jp2" || ext == "jpf" || ext == "jpx") ? TYPE_J2K :
+			(ext == "ppm" || ext == "pgm" || ext == "pnm") ? TYPE_PPM :
+			(ext == "tif" || ext == "tiff") ? TYPE_TIFF :
+			(ext == "raw" || ext == "rgb" || ext == "rgba") ? TYPE_RAW :
+			TYPE_UNKNOWN);
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// closes the file when it goes out of scope
+class StdFile
+{
+  public:
+	StdFile(const std::string &path, const char *mode) : _fp(fopen(path.c_str(), mode))
+	{
+		if(_fp == NULL)
+			throw Exception("Can't open " + path);
+	}
+	
+	~StdFile() { if(_fp) fclose(_fp); }
+	
+	FILE * Get() const { return _fp; }
+	
+	void Read(void *buf, size_t size)
+	{
+		if(size > 0 && fread(buf, 1, size, _fp) != size)
+			throw Exception("File is too short");
+	}
+	
+	void Write(const void *buf, size_t size)
+	{
+		if(size > 0 && fwrite(buf, 1, size, _fp) != size)
+			throw Exception("Error writing file");
+	}
+	
+	void Seek(size_t position)
+	{
+		if(fseek(_fp, (long)position, SEEK_SET) != 0)
+			throw Exception("Error seeking");
+	}
+	
+  private:
+	StdFile(const StdFile &);
+	StdFile & operator=(const StdFile &);
+	
+	FILE *_fp;
+};
+
+
+static unsigned char
+DepthForMax(unsigned int maxVal)
+{
+	unsigned char depth = 1;
+	
+	while(depth < 16 && ((1U << depth) - 1) < maxVal)
+		depth++;
+	
+	return depth;
+}
+
+
+// Copies file samples into the image.  Big-endian and little-endian are
+// for 16-bit samples only.
+static void
+UnpackRow(Image &image, unsigned int y, const unsigned char *row, int fileChannels, bool bigEndian)
+{
+	const bool wide = (image.depth > 8);
+	
+	for(unsigned int x=0; x < image.width; x++)
+	{
+		for(int c=0; c < std::min(fileChannels, 4); c++)
+		{
+			unsigned int val;
+			
+			if(wide)
+			{
+				const unsigned char *p = &row[((x * fileChannels) + c) * 2];
+				
+				val = (bigEndian ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0]));
+			}
+			else
+				val = row[(x * fileChannels) + c];
+			
+			const size_t index = ((((size_t)y * image.width) + x) * 4);
+			
+			if(fileChannels == 1)
+			{
+				image.SetSample(index + 0, val);
+				image.SetSample(index + 1, val);
+				image.SetSample(index + 2, val);
+			}
+			else
+				image.SetSample(index + c, val);
+		}
+	}
+}
+
+
+static void
+PackRow(const Image &image, unsigned int y, unsigned char *row, int fileChannels, bool bigEndian)
+{
+	const bool wide = (image.depth > 8);
+	
+	for(unsigned int x=0; x < image.width; x++)
+	{
+		for(int c=0; c < fileChannels; c++)
+		{
+			const unsigned int val = image.Sample((((size_t)y * image.width) + x) * 4 + c);
+			
+			if(wide)
+			{
+				unsigned char *p = &row[((x * fileChannels) + c) * 2];
+				
+				p[bigEndian ? 0 : 1] = (val >> 8);
+				p[bigEndian ? 1 : 0] = (val & 0xff);
+			}
+			else
+				row[(x * fileChannels) + c] = val;
+		}
+	}
+}
+
+
+static void
+SkipPPMSpace(FILE *fp)
+{
+	int c = fgetc(fp);
+	
+	while(c == '#' || isspace(c))
+	{
+		if(c == '#')
+		{
+			while(c != '\n' && c != EOF)
+				c = fgetc(fp);
+		}
+		
+		c = fgetc(fp);
+	}
+	
+	ungetc(c, fp);
+}
+
+
+static void
+ReadPPM(const std::string &path, Image &image)
+{
+	StdFile file(path, "rb");
+	
+	FILE *fp = file.Get();
+	
+	char magic[3] = { 0, 0, 0 };
+	
+	file.Read(magic, 2);
+	
+	if(magic[0] != 'P' || (magic[1] != '6' && magic[1] != '5'))
+		throw Exception("Only binary PPM and PGM are supported");
+	
+	const int fileChannels = (magic[1] == '6' ? 3 : 1);
+	
+	unsigned int width = 0, height = 0, maxVal = 0;
+	
+	SkipPPMSpace(fp);
+	
+	if(fscanf(fp, "%u", &width) != 1)
+		throw Exception("Bad PPM header");
+	
+	SkipPPMSpace(fp);
+	
+	if(fscanf(fp, "%u", &height) != 1)
+		throw Exception("Bad PPM header");
+	
+	SkipPPMSpace(fp);
+	
+	if(fscanf(fp, "%u", &maxVal) != 1 || maxVal == 0 || maxVal > 65535)
+		throw Exception("Bad PPM header");
+	
+	fgetc(fp); // the single whitespace before the pixels
+	
+	image.Allocate(width, height, 3, DepthForMax(maxVal));
+	
+	std::vector<unsigned char> row(width * fileChannels * (maxVal > 255 ? 2 : 1));
+	
+	for(unsigned int y=0; y < height; y++)
+	{
+		file.Read(&row[0], row.size());
+		
+		UnpackRow(image, y, &row[0], fileChannels, true);
+	}
+}
+
+
+static void
+WritePPM(const std::string &path, const Image &image)
+{
+	StdFile file(path, "wb");
+	
+	// no alpha in PPM
+	fprintf(file.Get(), "P6\n%u %u\n%u\n", image.width, image.height, (1U << image.depth) - 1);
+	
+	std::vector<unsigned char> row(image.width * 3 * image.SampleSize());
+	
+	for(unsigned int y=0; y < image.height; y++)
+	{
+		PackRow(image, y, &row[0], 3, true);
+		
+		file.Write(&row[0], row.size());
+	}
+}
+
+
+static void
+ReadRaw(const std::string &path, Image &image, const Options &options)
+{
+	if(options.rawWidth == 0 || options.rawHeight == 0)
+		throw Exception("Use -raw to give the size of raw input");
+	
+	StdFile file(path, "rb");
+	
+	const int fileChannels = options.rawChannels;
+	
+	image.Allocate(options.rawWidth, options.rawHeight, (fileChannels == 4 ? 4 : 3), options.rawDepth);
+	
+	std::vector<unsigned char> row(image.width * fileChannels * image.SampleSize());
+	
+	for(unsigned int y=0; y < image.height; y++)
+	{
+		file.Read(&row[0], row.size());
+		
+		UnpackRow(image, y, &row[0], fileChannels, false);
+	}
+}
+
+
+static void
+WriteRaw(const std::string &path, const Image &image)
+{
+	StdFile file(path, "wb");
+	
+	std::vector<unsigned char> row(image.width * image.channels * image.SampleSize());
+	
+	for(unsigned int y=0; y < image.height; y++)
+	{
+		PackRow(image, y, &row[0], image.channels, false);
+		
+		file.Write(&row[0], row.size());
+	}
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// Baseline TIFF: uncompressed, chunky, 8 or 16 bits, 1, 3 or 4 samples
+
+enum
+{
+	TIFF_ImageWidth			= 256,
+	TIFF_ImageLength		= 257,
+	TIFF_BitsPerSample		= 258,
+	TIFF_Compression		= 259,
+	TIFF_Photometric		= 262,
+	TIFF_StripOffsets		= 273,
+	TIFF_SamplesPerPixel	= 277,
+	TIFF_RowsPerStrip		= 278,
+	TIFF_StripByteCounts	= 279,
+	TIFF_PlanarConfig		= 284,
+	TIFF_ExtraSamples		= 338
+};
+
+enum
+{
+	TIFF_SHORT = 3,
+	TIFF_LONG = 4
+};
+
+
+class TIFFReader
+{
+  public:
+	TIFFReader(const std::string &path) : _file(path, "rb"), _bigEndian(false) {}
+	
+	void Read(Image &image);
+	
+  private:
+	unsigned int Get16(const unsigned char *p) const { return (_bigEndian ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0])); }
+	unsigned int Get32(const unsigned char *p) const { return (_bigEndian ? ((Get16(p) << 16) | Get16(p + 2)) : ((Get16(p + 2) << 16) | Get16(p))); }
+	
+	// the values of an IFD entry, short or long
+	std::vector<unsigned int> Values(const unsigned char *entry);
+	
+	StdFile _file;
+	bool _bigEndian;
+};
+
+
+std::vector<unsigned int>
+TIFFReader::Values(const unsigned char *entry)
+{
+	const unsigned int type = Get16(entry + 2);
+	const unsigned int count = Get32(entry + 4);
+	
+	if((type != TIFF_SHORT && type != TIFF_LONG) || count == 0 || count > 0x100000)
+		throw Exception("Unsupported TIFF");
+	
+	const size_t size = (type == TIFF_SHORT ? 2 : 4);
+	
+	std::vector<unsigned char> data(size * count);
+	
+	if(data.size() <= 4)
+	{
+		memcpy(&data[0], entry + 8, data.size());
+	}
+	else
+	{
+		const long here = ftell(_file.Get());
+		
+		_file.Seek(Get32(entry + 8));
+		_file.Read(&data[0], data.size());
+		_file.Seek(here);
+	}
+	
+	std::vector<unsigned int> values(count);
+	
+	for(unsigned int i=0; i < count; i++)
+		values[i] = (type == TIFF_SHORT ? Get16(&data[i * 2]) : Get32(&data[i * 4]));
+	
+	return values;
+}
+
+
+void
+TIFFReader::Read(Image &image)
+{
+	unsigned char header[8];
+	
+	_file.Read(header, 8);
+	
+	if(header[0] == 'M' && header[1] == 'M')
+		_bigEndian = true;
+	else if(header[0] != 'I' || header[1] != 'I')
+		throw Exception("Not a TIFF");
+	
+	if(Get16(header + 2) != 42)
+		throw Exception("Not a TIFF");
+	
+	_file.Seek(Get32(header + 4));
+	
+	unsigned char countBytes[2];
+	
+	_file.Read(countBytes, 2);
+	
+	const unsigned int entryCount = Get16(countBytes);
+	
+	unsigned int width = 0, height = 0, bits = 8, samples = 1, rowsPerStrip = 0;
+	unsigned int compression = 1, planar = 1;
+	std::vector<unsigned int> offsets, byteCounts;
+	
+	for(unsigned int i=0; i < entryCount; i++)
+	{
+		unsigned char entry[12];
+		
+		_file.Read(entry, 12);
+		
+		const unsigned int tag = Get16(entry);
+		
+		switch(tag)
+		{
+			case TIFF_ImageWidth:		width = Values(entry)[0];			break;
+			case TIFF_ImageLength:		height = Values(entry)[0];			break;
+			case TIFF_BitsPerSample:	bits = Values(entry)[0];			break;
+			case TIFF_Compression:		compression = Values(entry)[0];		break;
+			case TIFF_SamplesPerPixel:	samples = Values(entry)[0];			break;
+			case TIFF_RowsPerStrip:		rowsPerStrip = Values(entry)[0];	break;
+			case TIFF_PlanarConfig:		planar = Values(entry)[0];			break;
+			case TIFF_StripOffsets:		offsets = Values(entry);			break;
+			case TIFF_StripByteCounts:	byteCounts = Values(entry);			break;
+		}
+	}
+	
+	if(compression != 1 || planar != 1 || (bits != 8 && bits != 16) ||
+		(samples != 1 && samples != 3 && samples != 4) || offsets.empty())
+	{
+		throw Exception("Only uncompressed 8 or 16 bit chunky TIFFs are supported");
+	}
+	
+	if(rowsPerStrip == 0 || rowsPerStrip > height)
+		rowsPerStrip = height;
+	
+	image.Allocate(width, height, (samples == 4 ? 4 : 3), bits);
+	
+	std::vector<unsigned char> row(width * samples * (bits / 8));
+	
+	for(unsigned int y=0; y < height; y++)
+	{
+		const unsigned int strip = (y / rowsPerStrip);
+		
+		if(strip >= offsets.size())
+			throw Exception("TIFF is missing strips");
+		
+		_file.Seek(offsets[strip] + ((y % rowsPerStrip) * row.size()));
+		_file.Read(&row[0], row.size());
+		
+		UnpackRow(image, y, &row[0], samples, _bigEndian);
+	}
+}
+
+
+static void
+Put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (v & 0xff);
+	p[1] = ((v >> 8) & 0xff);
+}
+
+static void
+Put32(unsigned char *p, unsigned int v)
+{
+	Put16(p, v & 0xffff);
+	Put16(p + 2, v >> 16);
+}
+
+
+static void
+WriteTIFF(const std::string &path, const Image &image)
+{
+	// little-endian, one strip, the pixels right after the header
+	const unsigned int samples = image.channels;
+	const unsigned int bits = (image.depth > 8 ? 16 : 8);
+	const unsigned int stripBytes = (image.width * image.height * samples * (bits / 8));
+	
+	const unsigned int entryCount = (samples == 4 ? 11 : 10);
+	const unsigned int ifdOffset = 8;
+	const unsigned int bitsOffset = (ifdOffset + 2 + (entryCount * 12) + 4);
+	const unsigned int pixelOffset = (bitsOffset + (samples * 2));
+	
+	std::vector<unsigned char> header(pixelOffset, 0);
+	
+	header[0] = header[1] = 'I';
+	Put16(&header[2], 42);
+	Put32(&header[4], ifdOffset);
+	Put16(&header[ifdOffset], entryCount);
+	
+	unsigned char *entry = &header[ifdOffset + 2];
+	
+	#define TIFF_ENTRY(TAG, TYPE, COUNT, VALUE) \
+		Put16(entry, TAG); Put16(entry + 2, TYPE); Put32(entry + 4, COUNT); \
+		if(TYPE == TIFF_SHORT && COUNT == 1) Put16(entry + 8, VALUE); else Put32(entry + 8, VALUE); \
+		entry += 12;
+	
+	TIFF_ENTRY(TIFF_ImageWidth, TIFF_LONG, 1, image.width);
+	TIFF_ENTRY(TIFF_ImageLength, TIFF_LONG, 1, image.height);
+	TIFF_ENTRY(TIFF_BitsPerSample, TIFF_SHORT, samples, bitsOffset);
+	TIFF_ENTRY(TIFF_Compression, TIFF_SHORT, 1, 1);
+	TIFF_ENTRY(TIFF_Photometric, TIFF_SHORT, 1, 2); // RGB
+	TIFF_ENTRY(TIFF_StripOffsets, TIFF_LONG, 1, pixelOffset);
+	TIFF_ENTRY(TIFF_SamplesPerPixel, TIFF_SHORT, 1, samples);
+	TIFF_ENTRY(TIFF_RowsPerStrip, TIFF_LONG, 1, image.height);
+	TIFF_ENTRY(TIFF_StripByteCounts, TIFF_LONG, 1, stripBytes);
+	TIFF_ENTRY(TIFF_PlanarConfig, TIFF_SHORT, 1, 1);
+	
+	if(samples == 4)
+	{
+		TIFF_ENTRY(TIFF_ExtraSamples, TIFF_SHORT, 1, 2); // unassociated alpha
+	}
+	
+	#undef TIFF_ENTRY
+	
+	Put32(entry, 0); // no more IFDs
+	
+	for(unsigned int c=0; c < samples; c++)
+		Put16(&header[bitsOffset + (c * 2)], bits);
+	
+	
+	StdFile file(path, "wb");
+	
+	file.Write(&header[0], header.size());
+	
+	std::vector<unsigned char> row(image.width * samples * (bits / 8));
+	
+	// samples go out at full scale
+	
+	Image scaled;
+	
+	const Image *source = &image;
+	
+	if(image.depth != bits)
+	{
+		scaled = image;
+		scaled.depth = bits;
+		
+		const unsigned int inMax = ((1U << image.depth) - 1);
+		const unsigned int outMax = ((1U << bits) - 1);
+		
+		for(size_t i=0; i < ((size_t)image.width * image.height * 4); i++)
+			scaled.SetSample(i, ((image.Sample(i) * outMax) + (inMax / 2)) / inMax);
+		
+		source = &scaled;
+	}
+	
+	for(unsigned int y=0; y < image.height; y++)
+	{
+		PackRow(*source, y, &row[0], samples, false);
+		
+		file.Write(&row[0], row.size());
+	}
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+static void
+DecodeJ2K(InputFile &file, Image &image, const Options &options, double seconds[STAGE_COUNT])
+{
+	double start = CurrentSeconds();
+	
+	RGBAinputFile input(file, options.codec);
+	
+	const FileInfo &info = input.GetFileInfo();
+	
+	const unsigned int subsample = (1U << options.reduce);
+	
+	const bool hasAlpha = (info.LUTsize == 0 && (info.channels == 2 || info.channels >= 4));
+	
+	seconds[STAGE_OPEN] += (CurrentSeconds() - start);
+	
+	// not part of the decode, and -bench reuses the image from frame to frame
+	image.Allocate(SubsampledSize(info.width, subsample),
+					SubsampledSize(info.height, subsample),
+					(hasAlpha ? 4 : 3),
+					std::min<unsigned char>(info.depth, 16));
+	
+	RGBAbuffer buffer = image.Buffer();
+	
+	start = CurrentSeconds();
+	
+	input.ReadFile(buffer, subsample, NULL, (options.draft ? input.DraftLayers() : options.readLayers));
+	
+	const ReadTimes &times = input.GetReadTimes();
+	
+	// decode gets whatever the copy and conversion didn't use
+	seconds[STAGE_DECODE] += ((CurrentSeconds() - start) - (times.copy + times.convert));
+	seconds[STAGE_COPY] += times.copy;
+	seconds[STAGE_CONVERT] += times.convert;
+}
+
+
+static void
+ReadJ2K(const std::string &path, Image &image, const Options &options, double seconds[STAGE_COUNT])
+{
+#ifdef J2K_POSIX_IO
+	PlatformInputFile file(path.c_str(), true);
+#else
+	PlatformInputFile file(path.c_str());
+#endif
+	
+	DecodeJ2K(file, image, options, seconds);
+}
+
+
+static void
+EncodeJ2K(OutputFile &file, Format format, Image &image, const Options &options)
+{
+	FileInfo info;
+	
+	info.width = image.width;
+	info.height = image.height;
+	info.channels = image.channels;
+	info.depth = (options.depth > 0 ? options.depth : image.depth);
+	
+	info.format = format;
+	
+	info.alpha = (image.channels == 4 ? STRAIGHT : NO_ALPHA);
+	
+	if(options.chroma.x != 1 || options.chroma.y != 1)
+	{
+		// RGBAoutputFile puts Cb and Cr where green and blue would be
+		info.colorSpace = sYCC;
+		info.subsampling[1] = options.chroma;
+		info.subsampling[2] = options.chroma;
+	}
+	else
+		info.colorSpace = sRGB;
+	
+	info.settings = options.settings;
+	
+	RGBAoutputFile output(file, info, options.codec);
+	
+	RGBAbuffer buffer = image.Buffer();
+	
+	output.WriteFile(buffer);
+}
+
+
+static void
+WriteJ2K(const std::string &path, Image &image, const Options &options)
+{
+	const std::string ext = Extension(path);
+	
+	const Format format = ((ext == "jp2" || ext == "jpf") ? JP2 : ext == "jpx" ? JPX : J2C);
+	
+	PlatformOutputFile file(path.c_str());
+	
+	EncodeJ2K(file, format, image, options);
+}
+
+
+static void
+ReadImage(const std::string &path, Image &image, const Options &options, double seconds[STAGE_COUNT])
+{
+	const FileType type = GetFileType(path);
+	
+	if(type == TYPE_J2K)
+	{
+		ReadJ2K(path, image, options, seconds);
+	}
+	else
+	{
+		const double start = CurrentSeconds();
+		
+		if(type == TYPE_PPM)
+			ReadPPM(path, image);
+		else if(type == TYPE_TIFF)
+			TIFFReader(path).Read(image);
+		else if(type == TYPE_RAW)
+			ReadRaw(path, image, options);
+		else
+			throw Exception("Don't know how to read " + path);
+		
+		seconds[STAGE_DECODE] += (CurrentSeconds() - start);
+	}
+	
+	if(options.dropAlpha && image.channels == 4)
+	{
+		image.channels = 3;
+		image.FillAlpha();
+	}
+}
+
+
+static void
+WriteImage(const std::string &path, Image &image, const Options &options, double seconds[STAGE_COUNT])
+{
+	const FileType type = GetFileType(path);
+	
+	const double start = CurrentSeconds();
+	
+	if(type == TYPE_J2K)
+		WriteJ2K(path, image, options);
+	else if(type == TYPE_PPM)
+		WritePPM(path, image);
+	else if(type == TYPE_TIFF)
+		WriteTIFF(path, image);
+	else if(type == TYPE_RAW)
+		WriteRaw(path, image);
+	else
+		throw Exception("Don't know how to write " + path);
+	
+	seconds[STAGE_ENCODE] += (CurrentSeconds() - start);
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+static std::vector<std::string>
+Glob(const std::string &pattern)
+{
+	// # stands for a digit of the frame number
+	std::string wildcards = pattern;
+	
+	std::replace(wildcards.begin(), wildcards.end(), '#', '?');
+	
+	std::vector<std::string> paths;
+	
+	if(wildcards.find_first_of("*?") == std::string::npos)
+	{
+		paths.push_back(pattern);
+		
+		return paths;
+	}
+	
+#ifdef WIN32
+	const size_t slash = wildcards.find_last_of("/\\");
+	const std::string dir = (slash != std::string::npos ? wildcards.substr(0, slash + 1) : std::string());
+	
+	WIN32_FIND_DATAA findData;
+	
+	HANDLE findH = FindFirstFileA(wildcards.c_str(), &findData);
+	
+	if(findH != INVALID_HANDLE_VALUE)
+	{
+		do{
+			if( !(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) )
+				paths.push_back(dir + findData.cFileName);
+		}while( FindNextFileA(findH, &findData) );
+		
+		FindClose(findH);
+	}
+#else
+	glob_t globbed;
+	
+	if(glob(wildcards.c_str(), 0, NULL, &globbed) == 0)
+	{
+		for(size_t i=0; i < globbed.gl_pathc; i++)
+			paths.push_back(globbed.gl_pathv[i]);
+	}
+	
+	globfree(&globbed);
+#endif
+	
+	std::sort(paths.begin(), paths.end());
+	
+	return paths;
+}
+
+
+// the last run of digits in the file name
+static bool
+FrameNumber(const std::string &path, unsigned long &frame)
+{
+	const size_t slash = path.find_last_of("/\\");
+	
+	const std::string name = (slash != std::string::npos ? path.substr(slash + 1) : path);
+	
+	const size_t last = name.find_last_of("0123456789");
+	
+	if(last == std::string::npos)
+		return false;
+	
+	size_t first = last;
+	
+	while(first > 0 && isdigit(name[first - 1]))
+		first--;
+	
+	frame = strtoul(name.substr(first, last - first + 1).c_str(), NULL, 10);
+	
+	return true;
+}
+
+
+static std::string
+OutputPath(const std::string &pattern, const std::string &input, unsigned int index)
+{
+	const size_t first = pattern.find_last_of('#');
+	
+	if(first == std::string::npos)
+		return pattern;
+	
+	size_t start = first;
+	
+	while(start > 0 && pattern[start - 1] == '#')
+		start--;
+	
+	unsigned long frame = index;
+	
+	FrameNumber(input, frame); // otherwise just number them in order
+	
+	char number[32];
+	
+	sprintf(number, "%0*lu", (int)(first - start + 1), frame);
+	
+	return (pattern.substr(0, start) + number + pattern.substr(first + 1));
+}
+
+
+typedef struct TranscodeContext
+{
+	const std::vector<std::string> &inputs;
+	const std::vector<std::string> &outputs;
+	const Options &options;
+	
+	double seconds[STAGE_COUNT]; // added up over all the frames
+	unsigned int failures;
+	
+	Mutex mutex;
+	
+	TranscodeContext(const std::vector<std::string> &in, const std::vector<std::string> &out, const Options &opt) :
+		inputs(in),
+		outputs(out),
+		options(opt),
+		failures(0)
+	{
+		for(int s=0; s < STAGE_COUNT; s++)
+			seconds[s] = 0.0;
+	}
+	
+} TranscodeContext;
+
+
+static void
+TranscodeFrame(void *refCon, unsigned int index, unsigned int thread)
+{
+	TranscodeContext &context = *(TranscodeContext *)refCon;
+	
+	const std::string &input = context.inputs[index];
+	const std::string &output = context.outputs[index];
+	
+	double seconds[STAGE_COUNT];
+	
+	for(int s=0; s < STAGE_COUNT; s++)
+		seconds[s] = 0.0;
+	
+	std::string error;
+	
+	try
+	{
+		Image image;
+		
+		ReadImage(input, image, context.options, seconds);
+		
+		WriteImage(output, image, context.options, seconds);
+	}
+	catch(std::exception &e)
+	{
+		error = e.what();
+	}
+	catch(...)
+	{
+		error = "Unknown error";
+	}
+	
+	Lock lock(context.mutex);
+	
+	if(error.empty())
+	{
+		for(int s=0; s < STAGE_COUNT; s++)
+			context.seconds[s] += seconds[s];
+		
+		if(context.options.verbose)
+		{
+			printf("%s -> %s ", input.c_str(), output.c_str());
+			
+			for(int s=0; s < STAGE_COUNT; s++)
+			{
+				if(seconds[s] > 0.0)
+					printf(" %s %.1f ms", StageNames[s], seconds[s] * 1000.0);
+			}
+			
+			printf("\n");
+		}
+	}
+	else
+	{
+		fprintf(stderr, "%s: %s\n", input.c_str(), error.c_str());
+		
+		context.failures++;
+	}
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// -bench encodes synthetic frames into memory and decodes them again,
+// then does the same for any JPEG 2000 files given (decode only, which
+// is how palette files get covered).
+
+// in megabytes, the peak for the whole process
+static double
+ProcessPeakMemory()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	
+	if( GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) )
+		return (counters.PeakWorkingSetSize / (1024.0 * 1024.0));
+	
+	return 0.0;
+#else
+	struct rusage usage;
+	
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0.0;
+	
+  #ifdef __APPLE__
+	return (usage.ru_maxrss / (1024.0 * 1024.0)); // bytes
+  #else
+	return (usage.ru_maxrss / 1024.0); // kilobytes
+  #endif
+#endif
+}
+
+
+// Linux can reset the high-water mark, then it's in /proc/self/status.
+// Elsewhere the peak only goes up, so a case gets how far it pushed the
+// peak past where it was when the case started, 0 if it didn't.
+static bool g_PeakWasReset = false;
+static double g_PeakBaseline = 0.0;
+
+static void
+ResetPeakMemory()
+{
+	g_PeakWasReset = false;
+	
+#ifdef __linux__
+	FILE *fp = fopen("/proc/self/clear_refs", "w");
+	
+	if(fp != NULL)
+	{
+		g_PeakWasReset = (fputs("5", fp) >= 0);
+		
+		if(fclose(fp) != 0)
+			g_PeakWasReset = false;
+	}
+#endif
+	
+	g_PeakBaseline = (g_PeakWasReset ? 0.0 : ProcessPeakMemory());
+}
+
+
+// in megabytes, since ResetPeakMemory()
+static double
+PeakMemory()
+{
+#ifdef __linux__
+	if(g_PeakWasReset)
+	{
+		FILE *fp = fopen("/proc/self/status", "r");
+		
+		if(fp != NULL)
+		{
+			char line[256];
+			unsigned long kilobytes = 0;
+			bool found = false;
+			
+			while(!found && fgets(line, sizeof(line), fp) != NULL)
+				found = (sscanf(line, "VmHWM: %lu kB", &kilobytes) == 1);
+			
+			fclose(fp);
+			
+			if(found)
+				return (kilobytes / 1024.0);
+		}
+	}
+#endif
+	
+	return std::max(0.0, ProcessPeakMemory() - g_PeakBaseline);
+}
+
+
+typedef struct BenchCase
+{
+	std::string name;
+	
+	// synthetic
+	unsigned int width;
+	unsigned int height;
+	unsigned char depth;
+	bool tiled;
+	bool lossy;
+	bool ycc;
+	
+	std::string path; // a file from the corpus instead
+	
+	BenchCase() : width(0), height(0), depth(8), tiled(false), lossy(false), ycc(false) {}
+	
+} BenchCase;
+
+
+typedef struct BenchResult
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned char channels;
+	unsigned char depth;
+	
+	size_t codestreamBytes;
+	
+	double seconds[STAGE_COUNT]; // per frame
+	double peakMemory[STAGE_COUNT]; // after the stage, MB since the case started
+	
+	double batchSeconds; // per frame, all the frames at once through Codec::DecodeBatch()
+	
+	BenchResult() : width(0), height(0), channels(0), depth(0), codestreamBytes(0), batchSeconds(0.0)
+	{
+		for(int s=0; s < STAGE_COUNT; s++)
+			seconds[s] = peakMemory[s] = 0.0;
+	}
+	
+	double ImageMegabytes() const
+	{
+		return (((double)width * height * channels * (depth > 8 ? 2 : 1)) / (1024.0 * 1024.0));
+	}
+	
+} BenchResult;
+
+
+// Smooth ramps with some noise, so lossless isn't coding pure noise
+// or a flat field.
+static void
+FillSynthetic(Image &image)
+{
+	const unsigned int maxVal = ((1U << image.depth) - 1);
+	
+	unsigned int seed = 12345;
+	
+	for(unsigned int y=0; y < image.height; y++)
+	{
+		for(unsigned int x=0; x < image.width; x++)
+		{
+			const size_t index = ((((size_t)y * image.width) + x) * 4);
+			
+			for(int c=0; c < image.channels; c++)
+			{
+				seed = (seed * 1103515245) + 12345;
+				
+				const double ramp = (c == 0 ? (double)x / image.width :
+										c == 1 ? (double)y / image.height :
+										c == 2 ? (double)(x + y) / (image.width + image.height) :
+										1.0 - ((double)x / image.width));
+				
+				const double noise = ((double)((seed >> 16) & 0xff) / 255.0 - 0.5) * 0.04;
+				
+				const double val = std::max(0.0, std::min(ramp + noise, 1.0));
+				
+				image.SetSample(index + c, (unsigned int)((val * maxVal) + 0.5));
+			}
+		}
+	}
+}
+
+
+static void
+DecodeBenchFrames(InputFile &file, const Options &options, unsigned int frames, BenchResult &result)
+{
+	Image image;
+	
+	for(unsigned int f=0; f < frames; f++)
+	{
+		double seconds[STAGE_COUNT];
+		
+		for(int s=0; s < STAGE_COUNT; s++)
+			seconds[s] = 0.0;
+		
+		file.Seek(0);
+		
+		DecodeJ2K(file, image, options, seconds);
+		
+		for(int s=STAGE_OPEN; s < STAGE_ENCODE; s++)
+		{
+			result.seconds[s] += (seconds[s] / frames);
+			
+			if(seconds[s] > 0.0)
+				result.peakMemory[s] = PeakMemory();
+		}
+		
+		result.width = image.width;
+		result.height = image.height;
+		result.channels = image.channels;
+		result.depth = image.depth;
+	}
+}
+
+
+// Decodes the same codestream as a batch of frames, the way a host reading
+// ahead in a sequence would.  Straight into planes, no RGBA copy.
+static double
+DecodeBatchFrames(const std::vector<unsigned char> &codestream, const Options &options, unsigned int frames)
+{
+	Codec *codec = (options.codec != NULL ? options.codec : GetDefaultCodec());
+	
+	if(codec == NULL)
+		throw Exception("No codec");
+	
+	MemoryInputFile header(&codestream[0], codestream.size());
+	
+	FileInfo info;
+	
+	codec->GetFileInfo(header, info);
+	
+	const unsigned int subsample = (1U << options.reduce);
+	
+	const int channels = std::min<int>(((info.LUTsize > 0 && (codec->GetReadFlags() & Codec::J2K_APPLIES_LUT)) ? 3 : info.channels),
+										J2K_CODEC_MAX_CHANNELS);
+	
+	std::vector<MemoryInputFile> files(frames, header);
+	std::vector< std::vector<unsigned char> > planes(frames * channels);
+	std::vector<DecodeJob> jobs(frames);
+	
+	for(unsigned int f=0; f < frames; f++)
+	{
+		DecodeJob &job = jobs[f];
+		
+		job.file = &files[f];
+		job.subsample = subsample;
+		job.layers = (options.draft ? 0 : options.readLayers);
+		job.buffer.channels = channels;
+		
+		for(int c=0; c < channels; c++)
+		{
+			Channel &chan = job.buffer.channel[c];
+			
+			chan.width = SubsampledSize(info.width, info.subsampling[c].x * subsample);
+			chan.height = SubsampledSize(info.height, info.subsampling[c].y * subsample);
+			chan.subsampling = info.subsampling[c];
+			chan.sampleType = (info.depth > 8 ? USHORT : UCHAR);
+			chan.depth = std::min<unsigned char>(info.depth, 16);
+			chan.colbytes = SizeOfSample(chan.sampleType);
+			chan.rowbytes = (chan.colbytes * chan.width);
+			
+			std::vector<unsigned char> &plane = planes[(f * channels) + c];
+			
+			plane.resize(chan.rowbytes * chan.height);
+			
+			chan.buf = &plane[0];
+		}
+	}
+	
+	if(info.iccProfile != NULL)
+		free(info.iccProfile);
+	
+	const double start = CurrentSeconds();
+	
+	codec->DecodeBatch(jobs);
+	
+	const double seconds = (CurrentSeconds() - start);
+	
+	for(unsigned int f=0; f < frames; f++)
+	{
+		if(!jobs[f].success)
+			throw Exception("Batch decode failed: " + jobs[f].error);
+	}
+	
+	return (seconds / frames);
+}
+
+
+static void
+RunBenchCase(const BenchCase &bench, const Options &options, unsigned int frames, BenchResult &result)
+{
+	ResetPeakMemory();
+	
+	std::vector<unsigned char> codestream;
+	
+	if(bench.path.empty())
+	{
+		Image image;
+		
+		image.Allocate(bench.width, bench.height, 3, bench.depth);
+		
+		FillSynthetic(image);
+		
+		Options encodeOptions = options;
+		
+		encodeOptions.settings.tileSize = (bench.tiled ? 1024 : 0);
+		encodeOptions.settings.method = (bench.lossy ? QUALITY : LOSSLESS);
+		encodeOptions.chroma = (bench.ycc ? Subsampling(2, 2) : Subsampling(1, 1));
+		
+		for(unsigned int f=0; f < frames; f++)
+		{
+			MemoryOutputFile file;
+			
+			const double start = CurrentSeconds();
+			
+			EncodeJ2K(file, J2C, image, encodeOptions);
+			
+			result.seconds[STAGE_ENCODE] += ((CurrentSeconds() - start) / frames);
+			
+			if(f == 0)
+				codestream = file.Data();
+		}
+		
+		result.peakMemory[STAGE_ENCODE] = PeakMemory();
+	}
+	else
+	{
+		StdFile file(bench.path, "rb");
+		
+		fseek(file.Get(), 0, SEEK_END);
+		
+		codestream.resize(ftell(file.Get()));
+		
+		file.Seek(0);
+		file.Read(&codestream[0], codestream.size());
+	}
+	
+	if(codestream.empty())
+		throw Exception("Nothing to decode");
+	
+	result.codestreamBytes = codestream.size();
+	
+	MemoryInputFile file(&codestream[0], codestream.size());
+	
+	DecodeBenchFrames(file, options, frames, result);
+	
+	if(frames > 1)
+		result.batchSeconds = DecodeBatchFrames(codestream, options, frames);
+}
+
+
+static std::vector<BenchCase>
+BenchCases(const std::string &sizes, const std::vector<std::string> &corpus)
+{
+	static const struct { const char *name; unsigned int width, height; } frameSizes[] = {
+		{ "2k", 2048, 1080 },
+		{ "4k", 4096, 2160 },
+		{ "8k", 8192, 4320 }
+	};
+	
+	static const unsigned char depths[] = { 8, 12, 16 };
+	
+	std::vector<BenchCase> cases;
+	
+	for(int z=0; z < 3; z++)
+	{
+		if(Lowercase(sizes).find(frameSizes[z].name) == std::string::npos)
+			continue;
+		
+		for(int d=0; d < 3; d++)
+		{
+			for(int variant=0; variant < 8; variant++)
+			{
+				BenchCase bench;
+				
+				bench.width = frameSizes[z].width;
+				bench.height = frameSizes[z].height;
+				bench.depth = depths[d];
+				bench.tiled = !!(variant & 4);
+				bench.lossy = !!(variant & 2);
+				bench.ycc = !!(variant & 1);
+				
+				char name[64];
+				
+				sprintf(name, "%s-%ubit-%s-%s-%s", frameSizes[z].name, (unsigned int)bench.depth,
+						(bench.tiled ? "tiled" : "untiled"), (bench.lossy ? "lossy" : "lossless"),
+						(bench.ycc ? "sycc420" : "rgb"));
+				
+				bench.name = name;
+				
+				cases.push_back(bench);
+			}
+		}
+	}
+	
+	for(size_t i=0; i < corpus.size(); i++)
+	{
+		BenchCase bench;
+		
+		bench.name = corpus[i];
+		bench.path = corpus[i];
+		
+		cases.push_back(bench);
+	}
+	
+	return cases;
+}
+
+
+static std::string
+JSONString(const std::string &s)
+{
+	std::string result = "\"";
+	
+	for(size_t i=0; i < s.size(); i++)
+	{
+		if(s[i] == '"' || s[i] == '\\')
+			result += '\\';
+		
+		result += s[i];
+	}
+	
+	return (result + "\"");
+}
+
+
+static void
+WriteBenchJSON(const std::string &path, const std::vector<BenchCase> &cases,
+				const std::vector<BenchResult> &results, const std::vector<std::string> &errors,
+				const Options &options, unsigned int frames)
+{
+	StdFile file(path, "w");
+	
+	FILE *fp = file.Get();
+	
+	const Codec *codec = (options.codec != NULL ? options.codec : GetDefaultCodec());
+	
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"codec\": %s,\n", JSONString(codec != NULL ? codec->Name() : "").c_str());
+	fprintf(fp, "  \"threads\": %u,\n", options.settings.threads);
+	fprintf(fp, "  \"frames\": %u,\n", frames);
+	fprintf(fp, "  \"cases\": [\n");
+	
+	for(size_t i=0; i < cases.size(); i++)
+	{
+		const BenchCase &bench = cases[i];
+		const BenchResult &result = results[i];
+		
+		fprintf(fp, "    {\n");
+		fprintf(fp, "      \"name\": %s,\n", JSONString(bench.name).c_str());
+		
+		if(!errors[i].empty())
+		{
+			fprintf(fp, "      \"error\": %s\n", JSONString(errors[i]).c_str());
+		}
+		else
+		{
+			fprintf(fp, "      \"width\": %u, \"height\": %u, \"channels\": %u, \"depth\": %u,\n",
+					result.width, result.height, (unsigned int)result.channels, (unsigned int)result.depth);
+			fprintf(fp, "      \"codestreamBytes\": %lu,\n", (unsigned long)result.codestreamBytes);
+			fprintf(fp, "      \"stages\": {");
+			
+			bool first = true;
+			
+			for(int s=0; s < STAGE_COUNT; s++)
+			{
+				const double seconds = result.seconds[s];
+				
+				if(seconds <= 0.0)
+					continue;
+				
+				fprintf(fp, "%s\n        %s: { \"seconds\": %.6f, \"fps\": %.3f, ",
+						(first ? "" : ","), JSONString(StageNames[s]).c_str(), seconds, (1.0 / seconds));
+				
+				if(s != STAGE_OPEN)
+					fprintf(fp, "\"MBps\": %.2f, ", (result.ImageMegabytes() / seconds));
+				
+				fprintf(fp, "\"peakRSSMB\": %.1f }", result.peakMemory[s]);
+				
+				first = false;
+			}
+			
+			fprintf(fp, "\n      }");
+			
+			if(result.batchSeconds > 0.0)
+			{
+				fprintf(fp, ",\n      \"batchDecode\": { \"seconds\": %.6f, \"fps\": %.3f }",
+						result.batchSeconds, (1.0 / result.batchSeconds));
+			}
+			
+			fprintf(fp, "\n");
+		}
+		
+		fprintf(fp, "    }%s\n", (i + 1 < cases.size() ? "," : ""));
+	}
+	
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+}
+
+
+static int
+RunBenchmarks(const Options &options, const std::string &sizes, unsigned int frames,
+				const std::vector<std::string> &corpus, const std::string &jsonPath)
+{
+	const std::vector<BenchCase> cases = BenchCases(sizes, corpus);
+	
+	std::vector<BenchResult> results(cases.size());
+	std::vector<std::string> errors(cases.size());
+	
+	unsigned int failures = 0;
+	
+	printf("%-36s %8s", "case", "KB");
+	
+	for(int s=0; s < STAGE_COUNT; s++)
+		printf(" %9s", StageNames[s]);
+	
+	printf(" %9s   (ms/frame, MB/s)\n", "batch");
+	
+	for(size_t i=0; i < cases.size(); i++)
+	{
+		const BenchCase &bench = cases[i];
+		BenchResult &result = results[i];
+		
+		try
+		{
+			RunBenchCase(bench, options, frames, result);
+		}
+		catch(std::exception &e)
+		{
+			errors[i] = e.what();
+		}
+		catch(...)
+		{
+			errors[i] = "Unknown error";
+		}
+		
+		if(errors[i].empty())
+		{
+			printf("%-36s %8lu", bench.name.c_str(), (unsigned long)(result.codestreamBytes / 1024));
+			
+			for(int s=0; s < STAGE_COUNT; s++)
+			{
+				if(result.seconds[s] > 0.0)
+					printf(" %9.1f", result.seconds[s] * 1000.0);
+				else
+					printf(" %9s", "-");
+			}
+			
+			if(result.batchSeconds > 0.0)
+				printf(" %9.1f", result.batchSeconds * 1000.0);
+			else
+				printf(" %9s", "-");
+			
+			printf("\n%-36s %8s", "", "");
+			
+			for(int s=0; s < STAGE_COUNT; s++)
+			{
+				if(result.seconds[s] > 0.0 && s != STAGE_OPEN) // header size has nothing to do with the pixels
+					printf(" %9.0f", result.ImageMegabytes() / result.seconds[s]);
+				else
+					printf(" %9s", "");
+			}
+			
+			printf("\n");
+		}
+		else
+		{
+			fprintf(stderr, "%s: %s\n", bench.name.c_str(), errors[i].c_str());
+			
+			failures++;
+		}
+		
+		fflush(stdout);
+	}
+	
+	printf("peak memory %.1f MB\n", ProcessPeakMemory());
+	
+	if(!jsonPath.empty())
+		WriteBenchJSON(jsonPath, cases, results, errors, options, frames);
+	
+	return (failures > 0 ? 1 : 0);
+}
+
+
+// -scaling runs the same cases at 1, 2, 4... threads up to the CPU count
+// and prints how much faster each one is than a single thread.
+static int
+RunScaling(const Options &options, const std::string &sizes, unsigned int frames,
+				const std::vector<std::string> &corpus)
+{
+	const std::vector<BenchCase> cases = BenchCases(sizes, corpus);
+	
+	const unsigned int cpus = Codec::NumberOfCPUs();
+	
+	std::vector<unsigned int> threadCounts;
+	
+	for(unsigned int t=1; t < cpus; t *= 2)
+		threadCounts.push_back(t);
+	
+	threadCounts.push_back(cpus);
+	
+	unsigned int failures = 0;
+	
+	printf("%-36s %8s %9s %8s %9s %8s   (ms/frame, speedup)\n", "case", "threads", "encode", "", "decode", "");
+	
+	for(size_t i=0; i < cases.size(); i++)
+	{
+		const BenchCase &bench = cases[i];
+		
+		double encodeBase = 0.0;
+		double decodeBase = 0.0;
+		
+		for(size_t n=0; n < threadCounts.size(); n++)
+		{
+			const unsigned int threads = threadCounts[n];
+			
+			Options threadOptions = options;
+			
+			threadOptions.settings.threads = threads;
+			
+			Codec::SetNumberOfCPUs(threads);
+			
+			BenchResult result;
+			
+			try
+			{
+				RunBenchCase(bench, threadOptions, frames, result);
+			}
+			catch(std::exception &e)
+			{
+				fprintf(stderr, "%s: %s\n", bench.name.c_str(), e.what());
+				
+				failures++;
+				
+				break;
+			}
+			
+			const double encode = result.seconds[STAGE_ENCODE];
+			const double decode = (result.seconds[STAGE_OPEN] + result.seconds[STAGE_DECODE] +
+									result.seconds[STAGE_COPY] + result.seconds[STAGE_CONVERT]);
+			
+			if(n == 0)
+			{
+				encodeBase = encode;
+				decodeBase = decode;
+			}
+			
+			printf("%-36s %8u", (n == 0 ? bench.name.c_str() : ""), threads);
+			
+			if(encode > 0.0)
+				printf(" %9.1f %7.2fx", encode * 1000.0, encodeBase / encode);
+			else
+				printf(" %9s %8s", "-", "");
+			
+			printf(" %9.1f %7.2fx\n", decode * 1000.0, decodeBase / decode);
+			
+			fflush(stdout);
+		}
+	}
+	
+	Codec::SetNumberOfCPUs(options.settings.threads);
+	
+	return (failures > 0 ? 1 : 0);
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+static void
+Usage()
+{
+	printf(
+		"usage: j2k_transcode [options] <input> <output>\n"
+		"\n"
+		"  Inputs and outputs are files, or sequences where #### stands for the\n"
+		"  frame number.  Inputs can also use * and ? wildcards.  The format\n"
+		"  comes from the extension: .j2c .j2k .jp2 .ppm .pgm .tif .raw\n"
+		"\n"
+		"  -jobs N           frames to work on at once (default: number of CPUs)\n"
+		"  -threads N        threads each frame's codec uses (default: CPUs / jobs)\n"
+		"  -scratch MB       temporary planes to keep between frames\n"
+		"  -codec NAME       use this codec instead of the fastest one measured\n"
+		"  -reduce N         decode JPEG 2000 at 1/2^N size\n"
+		"  -readlayers N     only decode the first N quality layers\n"
+		"  -draft            decode a draft's worth of quality layers\n"
+		"  -sparse           with OpenJPEG, only read the tiles and packets a\n"
+		"                    reduced, region or draft decode needs (.j2c with\n"
+		"                    TLM markers, see -markers)\n"
+		"  -raw WxHxCxD      size, channels and bit depth of .raw input\n"
+		"                    (16-bit .raw samples are little-endian)\n"
+		"  -noalpha          drop the alpha channel\n"
+		"\n"
+		"  JPEG 2000 output:\n"
+		"  -depth N          bit depth (default: same as the input)\n"
+		"  -lossless         (default)\n"
+		"  -quality Q        0-100\n"
+		"  -size KB          target file size\n"
+		"  -layers N         quality layers\n"
+		"  -tile N           tile size, 0 for no tiles\n"
+		"  -order ORDER      LRCP, RLCP, RPCL, PCRL or CPRL\n"
+		"  -reversible       reversible wavelet for lossy files\n"
+		"  -noycc            skip the RGB to YCC component transform\n"
+		"  -cblk WxH         code-block size (default: 64x64)\n"
+		"  -modes LIST       code-block switches: bypass, reset, restart,\n"
+		"                    vsc, erterm, segmark or none\n"
+		"  -precincts N      precinct size, 0 for none\n"
+		"  -fast             the fast preset: 64x64 code-blocks with bypass\n"
+		"  -markers          write TLM and PLT so readers can seek to tiles\n"
+		"  -sub 444|422|420  write sYCC with this chroma subsampling\n"
+		"\n"
+		"  -v                print each frame's timings\n"
+		"\n"
+		"usage: j2k_transcode -bench [options] [file.j2c ...]\n"
+		"\n"
+		"  Encodes and decodes synthetic frames in memory: 8, 12 and 16 bits,\n"
+		"  tiled and untiled, lossless and lossy, RGB and 4:2:0 sYCC.  Files\n"
+		"  given are decoded too.  Times each stage and the peak memory after it,\n"
+		"  then decodes all the frames at once as a batch.\n"
+		"\n"
+		"  -sizes LIST       any of 2k,4k,8k (default: 2k)\n"
+		"  -frames N         frames to average over (default: 3)\n"
+		"  -json FILE        also write the results as JSON\n"
+		"  -scaling          run each case at 1, 2, 4... threads up to the\n"
+		"                    number of CPUs, or -threads, and print the speedups\n"
+		"  -codec, -threads, -reduce, -readlayers, -draft, -quality and the\n"
+		"  code-block options work as above\n");
+}
+
+
+static Codec *
+FindCodec(const std::string &name)
+{
+	const CodecList &codecList = GetCodecList();
+	
+	for(CodecList::const_iterator i = codecList.begin(); i != codecList.end(); ++i)
+	{
+		if(Lowercase((*i)->Name()) == Lowercase(name) || Lowercase((*i)->FourCharCode()) == Lowercase(name))
+			return *i;
+	}
+	
+	return NULL;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	Options options;
+	
+	unsigned int codecThreads = 0;
+	
+	bool bench = false;
+	std::string benchSizes = "2k";
+	unsigned int benchFrames = 3;
+	std::string jsonPath;
+	bool scaling = false;
+	bool sparseReads = false;
+	
+	std::vector<std::string> args;
+	
+	for(int i=1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		const bool haveValue = (i + 1 < argc);
+		
+		if(arg == "-jobs" && haveValue)
+			options.jobs = atoi(argv[++i]);
+		else if(arg == "-threads" && haveValue)
+			codecThreads = atoi(argv[++i]);
+		else if(arg == "-scratch" && haveValue)
+			GetScratchPool().SetLimit((size_t)std::max(0, atoi(argv[++i])) * 1024 * 1024);
+		else if(arg == "-codec" && haveValue)
+		{
+			options.codec = FindCodec(argv[++i]);
+			
+			if(options.codec == NULL)
+			{
+				fprintf(stderr, "No codec called %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if(arg == "-reduce" && haveValue)
+			options.reduce = std::min(atoi(argv[++i]), 5);
+		else if(arg == "-readlayers" && haveValue)
+			options.readLayers = std::max(0, atoi(argv[++i]));
+		else if(arg == "-draft")
+			options.draft = true;
+		else if(arg == "-sparse")
+			sparseReads = true;
+		else if(arg == "-raw" && haveValue)
+		{
+			unsigned int w = 0, h = 0, c = 0, d = 0;
+			
+			if(sscanf(argv[++i], "%ux%ux%ux%u", &w, &h, &c, &d) != 4 ||
+				(c != 1 && c != 3 && c != 4) || d < 1 || d > 16)
+			{
+				fprintf(stderr, "-raw wants WxHxCxD, like 1920x1080x3x16\n");
+				return 1;
+			}
+			
+			options.rawWidth = w;
+			options.rawHeight = h;
+			options.rawChannels = c;
+			options.rawDepth = d;
+		}
+		else if(arg == "-noalpha")
+			options.dropAlpha = true;
+		else if(arg == "-depth" && haveValue)
+			options.depth = std::max(1, std::min(atoi(argv[++i]), 16));
+		else if(arg == "-lossless")
+			options.settings.method = LOSSLESS;
+		else if(arg == "-quality" && haveValue)
+		{
+			options.settings.method = QUALITY;
+			options.settings.quality = std::max(0, std::min(atoi(argv[++i]), 100));
+		}
+		else if(arg == "-size" && haveValue)
+		{
+			options.settings.method = SIZE;
+			options.settings.fileSize = atoi(argv[++i]);
+		}
+		else if(arg == "-layers" && haveValue)
+			options.settings.layers = std::max(1, std::min(atoi(argv[++i]), 255));
+		else if(arg == "-tile" && haveValue)
+			options.settings.tileSize = std::max(0, std::min(atoi(argv[++i]), 65535));
+		else if(arg == "-order" && haveValue)
+		{
+			const std::string order = Lowercase(argv[++i]);
+			
+			options.settings.order = (order == "lrcp" ? LRCP :
+										order == "rlcp" ? RLCP :
+										order == "pcrl" ? PCRL :
+										order == "cprl" ? CPRL :
+										RPCL);
+		}
+		else if(arg == "-reversible")
+			options.settings.reversible = true;
+		else if(arg == "-noycc")
+			options.settings.ycc = false;
+		else if(arg == "-cblk" && haveValue)
+		{
+			unsigned int w = 0, h = 0;
+			
+			if(sscanf(argv[++i], "%ux%u", &w, &h) != 2 ||
+				!IsPowerOf2(w) || !IsPowerOf2(h) || w < 4 || h < 4 || w > 1024 || h > 1024 || (w * h) > 4096)
+			{
+				fprintf(stderr, "-cblk wants powers of 2 from 4 to 1024, 4096 samples at most, like 64x64\n");
+				return 1;
+			}
+			
+			options.settings.codeBlockWidth = w;
+			options.settings.codeBlockHeight = h;
+		}
+		else if(arg == "-modes" && haveValue)
+		{
+			if(!ParseBlockModes(argv[++i], options.settings.blockModes))
+			{
+				fprintf(stderr, "-modes wants bypass, reset, restart, vsc, erterm, segmark or none\n");
+				return 1;
+			}
+		}
+		else if(arg == "-precincts" && haveValue)
+		{
+			const int size = atoi(argv[++i]);
+			
+			if(size != 0 && (size < 2 || size > 32768 || !IsPowerOf2(size)))
+			{
+				fprintf(stderr, "-precincts wants a power of 2, or 0\n");
+				return 1;
+			}
+			
+			options.settings.precinctSize = size;
+		}
+		else if(arg == "-fast")
+			SetFastCoding(options.settings);
+		else if(arg == "-markers")
+			options.settings.lengthMarkers = true;
+		else if(arg == "-sub" && haveValue)
+		{
+			const std::string sub = argv[++i];
+			
+			options.chroma = (sub == "422" ? Subsampling(2, 1) :
+								sub == "420" ? Subsampling(2, 2) :
+								Subsampling(1, 1));
+		}
+		else if(arg == "-v")
+			options.verbose = true;
+		else if(arg == "-bench")
+			bench = true;
+		else if(arg == "-sizes" && haveValue)
+			benchSizes = argv[++i];
+		else if(arg == "-frames" && haveValue)
+			benchFrames = std::max(1, atoi(argv[++i]));
+		else if(arg == "-json" && haveValue)
+			jsonPath = argv[++i];
+		else if(arg == "-scaling")
+			scaling = true;
+		else if(arg == "-h" || arg == "-help" || arg == "--help")
+		{
+			Usage();
+			return 0;
+		}
+		else if(!arg.empty() && arg[0] == '-' && arg.size() > 1)
+		{
+			fprintf(stderr, "Unknown option %s\n\n", arg.c_str());
+			Usage();
+			return 1;
+		}
+		else
+			args.push_back(arg);
+	}
+	
+	if(sparseReads)
+	{
+		const CodecList &codecList = GetCodecList();
+		
+		for(CodecList::const_iterator i = codecList.begin(); i != codecList.end(); ++i)
+		{
+			OpenJPEGCodec *openjpeg = dynamic_cast<OpenJPEGCodec *>(*i);
+			
+			if(openjpeg != NULL)
+				openjpeg->SetSparseReads(true);
+		}
+	}
+	
+	if(bench)
+	{
+		// one frame at a time, with all the CPUs
+		options.settings.threads = (codecThreads > 0 ? codecThreads : Codec::NumberOfCPUs());
+		
+		Codec::SetNumberOfCPUs(options.settings.threads);
+		
+		try
+		{
+			if(options.codec == NULL)
+				options.codec = GetDefaultCodec(); // the selector would switch codecs part way through
+			
+			if(scaling)
+				return RunScaling(options, benchSizes, benchFrames, args);
+			
+			return RunBenchmarks(options, benchSizes, benchFrames, args, jsonPath);
+		}
+		catch(std::exception &e)
+		{
+			fprintf(stderr, "%s\n", e.what());
+			
+			return 1;
+		}
+	}
+	
+	if(args.size() != 2)
+	{
+		Usage();
+		return 1;
+	}
+	
+	
+	const std::vector<std::string> inputs = Glob(args[0]);
+	
+	if(inputs.empty())
+	{
+		fprintf(stderr, "Nothing matches %s\n", args[0].c_str());
+		return 1;
+	}
+	
+	if(inputs.size() > 1 && args[1].find('#') == std::string::npos)
+	{
+		fprintf(stderr, "Use #### in the output name for sequences\n");
+		return 1;
+	}
+	
+	std::vector<std::string> outputs;
+	
+	for(unsigned int i=0; i < inputs.size(); i++)
+		outputs.push_back( OutputPath(args[1], inputs[i], i) );
+	
+	
+	// Frames run in parallel, and the codec inside each one gets its share of
+	// the CPUs.  The CodecSelector times the frames as they go by.
+	const unsigned int cpus = Codec::NumberOfCPUs();
+	const unsigned int frames = static_cast<unsigned int>(inputs.size());
+	const unsigned int jobs = std::max(1U, std::min(options.jobs > 0 ? options.jobs : cpus, frames));
+	
+	if(codecThreads == 0)
+		codecThreads = std::max(1U, cpus / jobs);
+	
+	Codec::SetNumberOfCPUs(codecThreads);
+	
+	options.settings.threads = codecThreads;
+	
+	
+	TranscodeContext context(inputs, outputs, options);
+	
+	const double start = CurrentSeconds();
+	
+	ParallelFor(TranscodeFrame, &context, frames, jobs);
+	
+	const double wallSeconds = (CurrentSeconds() - start);
+	
+	
+	const unsigned int done = (frames - context.failures);
+	
+	printf("%u frame%s in %.2f s (%.2f fps), %u job%s x %u codec thread%s\n",
+			done, (done == 1 ? "" : "s"), wallSeconds, (wallSeconds > 0.0 ? done / wallSeconds : 0.0),
+			jobs, (jobs == 1 ? "" : "s"), codecThreads, (codecThreads == 1 ? "" : "s"));
+	
+	if(done > 0)
+	{
+		for(int s=0; s < STAGE_COUNT; s++)
+		{
+			if(context.seconds[s] > 0.0)
+			{
+				printf("  %-7s %9.2f s total %9.1f ms/frame\n", StageNames[s],
+						context.seconds[s], (context.seconds[s] * 1000.0) / done);
+			}
+		}
+	}
+	
+	if(context.failures > 0)
+		fprintf(stderr, "%u frame%s failed\n", context.failures, (context.failures == 1 ? "" : "s"));
+	
+	return (context.failures > 0 ? 1 : 0);
+}
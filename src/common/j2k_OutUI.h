@@ -76,6 +76,13 @@ typedef enum {
 	DIALOG_DCI_PER_SECOND
 } DialogDCIPerFrame;
 
+typedef enum {
+	DIALOG_CODE_BLOCK_64x64 = 0,
+	DIALOG_CODE_BLOCK_32x32,
+	DIALOG_CODE_BLOCK_128x32,
+	DIALOG_CODE_BLOCK_32x128
+} DialogCodeBlock;
+
 typedef struct {
 	DialogMethod		method;
 	long				size;
@@ -89,6 +96,10 @@ typedef struct {
 	DialogSubsample		sub;
 	DialogOrder			order;
 	int					tileSize;
+	DialogCodeBlock		codeBlock;
+	bool				bypass;
+	bool				reset;
+	int					precinctSize;
 	DialogProfile		icc_profile;
 	DialogDCIProfile	dci_profile;
 	int					dci_data_rate; // always in kilobytes
@@ -0,0 +1,211 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#include "j2k_cache.h"
+
+#include "j2k_exception.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace j2k
+{
+
+
+FileInfoCache::FileInfoCache(size_t capacity) :
+	_capacity(capacity),
+	_hits(0),
+	_misses(0)
+{
+
+}
+
+
+FileInfoCache::~FileInfoCache()
+{
+	Clear();
+}
+
+
+static std::string
+FullKey(const std::string &key, const Codec &codec)
+{
+	return (std::string(codec.FourCharCode()) + ":" + key);
+}
+
+
+bool
+FileInfoCache::Get(const std::string &key, const Codec &codec, FileInfo &info)
+{
+	Lock lock(_mutex);
+	
+	EntryMap::iterator found = _lookup.find( FullKey(key, codec) );
+	
+	if(found == _lookup.end())
+	{
+		_misses++;
+		
+		return false;
+	}
+	
+	// move to the front
+	_entries.splice(_entries.begin(), _entries, found->second);
+	
+	CopyInfo(info, found->second->info);
+	
+	_hits++;
+	
+	return true;
+}
+
+
+void
+FileInfoCache::Put(const std::string &key, const Codec &codec, const FileInfo &info)
+{
+	Lock lock(_mutex);
+	
+	const std::string fullKey = FullKey(key, codec);
+	
+	EntryMap::iterator found = _lookup.find(fullKey);
+	
+	if(found != _lookup.end())
+	{
+		FreeInfo(found->second->info);
+		
+		_entries.erase(found->second);
+		_lookup.erase(found);
+	}
+	
+	_entries.push_front(Entry());
+	
+	Entry &entry = _entries.front();
+	
+	entry.key = fullKey;
+	
+	CopyInfo(entry.info, info);
+	
+	_lookup[fullKey] = _entries.begin();
+	
+	Trim();
+}
+
+
+size_t
+FileInfoCache::Hits() const
+{
+	Lock lock(_mutex);
+	
+	return _hits;
+}
+
+
+size_t
+FileInfoCache::Misses() const
+{
+	Lock lock(_mutex);
+	
+	return _misses;
+}
+
+
+void
+FileInfoCache::Clear()
+{
+	Lock lock(_mutex);
+	
+	for(EntryList::iterator i = _entries.begin(); i != _entries.end(); ++i)
+		FreeInfo(i->info);
+	
+	_entries.clear();
+	_lookup.clear();
+}
+
+
+void
+FileInfoCache::SetCapacity(size_t capacity)
+{
+	Lock lock(_mutex);
+	
+	_capacity = capacity;
+	
+	Trim();
+}
+
+
+void
+FileInfoCache::Trim()
+{
+	while(_entries.size() > _capacity)
+	{
+		Entry &oldest = _entries.back();
+		
+		FreeInfo(oldest.info);
+		
+		_lookup.erase(oldest.key);
+		_entries.pop_back();
+	}
+}
+
+
+void
+FileInfoCache::CopyInfo(FileInfo &dest, const FileInfo &src)
+{
+	dest = src;
+	
+	if(src.iccProfile != NULL)
+	{
+		dest.iccProfile = malloc(src.profileLen);
+		
+		if(dest.iccProfile == NULL)
+			throw Exception("out of memory");
+		
+		memcpy(dest.iccProfile, src.iccProfile, src.profileLen);
+	}
+}
+
+
+void
+FileInfoCache::FreeInfo(FileInfo &info)
+{
+	if(info.iccProfile != NULL)
+	{
+		free(info.iccProfile);
+		
+		info.iccProfile = NULL;
+		info.profileLen = 0;
+	}
+}
+
+
+static FileInfoCache g_FileInfoCache;
+
+
+FileInfoCache & GetFileInfoCache()
+{
+	return g_FileInfoCache;
+}
+
+
+}; // namespace j2k
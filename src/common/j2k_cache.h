@@ -0,0 +1,94 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef J2K_CACHE_H
+#define J2K_CACHE_H
+
+#include "j2k_codec.h"
+#include "j2k_thread.h"
+
+#include <string>
+#include <list>
+#include <map>
+
+#define J2K_FILE_INFO_CACHE_SIZE 256
+
+
+namespace j2k
+{
+
+
+// Remembers the FileInfo for recently parsed files so the main header
+// doesn't have to be parsed again every time somebody asks.
+// Keyed by InputFile::CacheKey() and the codec that did the parsing.
+
+class FileInfoCache
+{
+  public:
+	FileInfoCache(size_t capacity = J2K_FILE_INFO_CACHE_SIZE);
+	~FileInfoCache();
+	
+	// on a hit, info gets its own copy of the ICC profile, which the caller frees
+	bool Get(const std::string &key, const Codec &codec, FileInfo &info);
+	void Put(const std::string &key, const Codec &codec, const FileInfo &info);
+	
+	void Clear();
+	void SetCapacity(size_t capacity);
+	
+	size_t Hits() const;
+	size_t Misses() const;
+	
+  private:
+	typedef struct Entry
+	{
+		std::string key;
+		FileInfo info;
+		
+	} Entry;
+	
+	typedef std::list<Entry> EntryList;
+	typedef std::map<std::string, EntryList::iterator> EntryMap;
+	
+	void Trim();
+	
+	static void CopyInfo(FileInfo &dest, const FileInfo &src);
+	static void FreeInfo(FileInfo &info);
+	
+	EntryList _entries; // most recently used at the front
+	EntryMap _lookup;
+	
+	size_t _capacity;
+	size_t _hits;
+	size_t _misses;
+	
+	mutable Mutex _mutex;
+};
+
+
+FileInfoCache & GetFileInfoCache();
+
+
+}; // namespace j2k
+
+#endif // J2K_CACHE_H
@@ -25,10 +25,16 @@
 #include "j2k_codec.h"
 
 #include "j2k_exception.h"
+#include "j2k_simd.h"
+#include "j2k_thread.h"
+#include "j2k_scratch.h"
 
-#include "j2k_grok_codec.h"
 #include "j2k_openjpeg_codec.h"
 
+#ifdef J2K_USE_GROK
+	#include "j2k_grok_codec.h"
+#endif
+
 #ifdef J2K_USE_KAKADU
 	#include "j2k_kakadu_codec.h"
 #endif
@@ -41,11 +47,22 @@
 
 #ifdef WIN32
 	#include <Windows.h>
+#else
+	#include <unistd.h>
+#endif
+
+#ifdef __linux__
+	#include <sched.h>
 #endif
 
 #include <algorithm>
 #include <limits>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
 #include <assert.h>
 
 namespace j2k
@@ -59,6 +76,34 @@ Codec::Verify(InputFile &file)
 }
 
 
+void
+Codec::ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample, Progress *progress, unsigned int layers)
+{
+	throw Exception("Codec can't read regions");
+}
+
+
+DecodeSession *
+Codec::CreateDecodeSession()
+{
+	return new DecodeSession(*this);
+}
+
+
+void
+DecodeSession::ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample, Progress *progress, unsigned int layers)
+{
+	_codec.ReadFile(file, buffer, subsample, progress, layers);
+}
+
+
+void
+DecodeSession::ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample, Progress *progress, unsigned int layers)
+{
+	_codec.ReadRegion(file, buffer, region, subsample, progress, layers);
+}
+
+
 static inline unsigned int
 PlatformSwap(const unsigned int &v)
 {
@@ -219,9 +264,10 @@ Codec::IssRGBProfile(const void *iccProfile, size_t profileSize)
 }
 
 
+// scratch holds one promoted source row when src is 15+1
 template <typename DESTTYPE, typename SRCTYPE>
 static void
-CopyChannel(const Channel &dest, const Channel &src)
+CopyChannel(const Channel &dest, const Channel &src, void *scratch)
 {
 	if(dest.buf == NULL || src.buf == NULL)
 		return;
@@ -237,7 +283,7 @@ CopyChannel(const Channel &dest, const Channel &src)
 									src.subsampling.y / dest.subsampling.y);
 	
 	const int destStep = static_cast<const int>(dest.colbytes / sizeof(DESTTYPE));
-	const int srcStep = static_cast<const int>(src.colbytes / sizeof(SRCTYPE));
+	const int srcSampleStep = static_cast<const int>(src.colbytes / sizeof(SRCTYPE));
 
 	assert(dest.depth <= (sizeof(DESTTYPE) * 8)); // make sure the specified depth
 	assert(src.depth <= (sizeof(SRCTYPE) * 8));   // fits in the specified type
@@ -253,6 +299,19 @@ CopyChannel(const Channel &dest, const Channel &src)
 	
 	const int bitShift = ((int)dest.depth - (int)src.depth);
 	
+	// After Effects 15+1 channels get converted a row at a time, so the
+	// math below always sees true 16-bit
+	assert(!dest.fifteenPlusOne || (sizeof(DESTTYPE) == sizeof(unsigned short) && dest.depth == 16));
+	assert(!src.fifteenPlusOne || (sizeof(SRCTYPE) == sizeof(unsigned short) && src.depth == 16));
+	
+	const int srcRowSamples = ((width + relatativeSub.x - 1) / relatativeSub.x);
+	
+	SRCTYPE *promotedRow = (SRCTYPE *)scratch;
+	
+	assert(!src.fifteenPlusOne || promotedRow != NULL);
+	
+	const int srcStep = (src.fifteenPlusOne ? 1 : srcSampleStep);
+	
 	
 	unsigned char *destRow = dest.buf;
 	unsigned char *srcRow = src.buf;
@@ -262,6 +321,14 @@ CopyChannel(const Channel &dest, const Channel &src)
 		DESTTYPE *d = (DESTTYPE *)destRow;
 		SRCTYPE *s = (SRCTYPE *)srcRow;
 		
+		if(src.fifteenPlusOne)
+		{
+			for(int x=0; x < srcRowSamples; x++)
+				promotedRow[x] = From15PlusOne(s[x * srcSampleStep]);
+			
+			s = promotedRow;
+		}
+		
 		if(bitShift == 0)
 		{
 			// no shift
@@ -370,6 +437,18 @@ CopyChannel(const Channel &dest, const Channel &src)
 			}
 		}
 		
+		if(dest.fifteenPlusOne)
+		{
+			d = (DESTTYPE *)destRow;
+			
+			for(int x=0; x < width; x++)
+			{
+				*d = To15PlusOne(*d);
+				
+				d += destStep;
+			}
+		}
+		
 		destRow += dest.rowbytes;
 		
 		if(y % relatativeSub.y == 0)
@@ -377,31 +456,432 @@ CopyChannel(const Channel &dest, const Channel &src)
 	}
 }
 
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// Float channels hold 0.0 - 1.0, integer channels 0 - (2^depth - 1) with
+// signed channels shifted up by 2^(depth - 1), same as the sign conversion above.
+
+static inline float
+NormalizeScale(unsigned char depth)
+{
+	return static_cast<float>(1.0 / (pow(2.0, depth) - 1.0));
+}
+
+template <typename SRCTYPE>
+static inline float
+LoadSample(const SRCTYPE &val, int offset, float scale)
+{
+	return ((float)(val + offset) * scale);
+}
+
+static inline float
+LoadSample(const float &val, int offset, float scale)
+{
+	return val;
+}
+
+static inline float
+LoadSample(const Half &val, int offset, float scale)
+{
+	return HalfToFloat(val);
+}
+
 template <typename DESTTYPE>
+static inline void
+StoreSample(DESTTYPE &dest, float val, double maxVal, int offset)
+{
+	const double v = (val <= 0.f ? 0.0 : val >= 1.f ? maxVal : ((val * maxVal) + 0.5));
+
+	dest = static_cast<DESTTYPE>(static_cast<long long>(v) - offset);
+}
+
+static inline void
+StoreSample(float &dest, float val, double maxVal, int offset)
+{
+	dest = val;
+}
+
+static inline void
+StoreSample(Half &dest, float val, double maxVal, int offset)
+{
+	dest = FloatToHalf(val);
+}
+
+// at least one of DESTTYPE and SRCTYPE is float or Half
+template <typename DESTTYPE, typename SRCTYPE>
 static void
-CopyChannel(const Channel &dest, const Channel &src)
+CopyChannelFloat(const Channel &dest, const Channel &src)
+{
+	if(dest.buf == NULL || src.buf == NULL)
+		return;
+
+	const int height = dest.height;
+	const int width = dest.width;
+	
+	assert((dest.subsampling.x == 1 && dest.subsampling.y == 1) ||
+			(dest.subsampling.x == src.subsampling.x && dest.subsampling.y == src.subsampling.y));
+	
+	const Subsampling relatativeSub(src.subsampling.x / dest.subsampling.x,
+									src.subsampling.y / dest.subsampling.y);
+	
+	const int destStep = static_cast<const int>(dest.colbytes / sizeof(DESTTYPE));
+	const int srcStep = static_cast<const int>(src.colbytes / sizeof(SRCTYPE));
+	
+	// After Effects 15+1 is just a different maximum here
+	const int srcOffset = (src.sgnd ? static_cast<const int>(pow(2, src.depth - 1)) : 0);
+	const float srcScale = (src.fifteenPlusOne ? (1.f / 32768.f) : NormalizeScale(src.depth));
+	
+	const int destOffset = (dest.sgnd ? static_cast<const int>(pow(2, dest.depth - 1)) : 0);
+	const double destMax = (dest.fifteenPlusOne ? 32768.0 : (pow(2.0, dest.depth) - 1.0));
+	
+	unsigned char *destRow = dest.buf;
+	unsigned char *srcRow = src.buf;
+	
+	for(int y=1; y <= height; y++)
+	{
+		DESTTYPE *d = (DESTTYPE *)destRow;
+		SRCTYPE *s = (SRCTYPE *)srcRow;
+		
+		for(int x=1; x <= width; x++)
+		{
+			StoreSample(*d, LoadSample(*s, srcOffset, srcScale), destMax, destOffset);
+			
+			d += destStep;
+			
+			if(x % relatativeSub.x == 0)
+				s += srcStep;
+		}
+		
+		destRow += dest.rowbytes;
+		
+		if(y % relatativeSub.y == 0)
+			srcRow += src.rowbytes;
+	}
+}
+
+template <typename DESTTYPE>
+static void
+CopyChannelFloat(const Channel &dest, const Channel &src)
 {
 	if(src.sampleType == UCHAR)
 	{
-		CopyChannel<DESTTYPE, unsigned char>(dest, src);
+		CopyChannelFloat<DESTTYPE, unsigned char>(dest, src);
 	}
 	else if(src.sampleType == USHORT)
 	{
-		CopyChannel<DESTTYPE, unsigned short>(dest, src);
+		CopyChannelFloat<DESTTYPE, unsigned short>(dest, src);
 	}
 	else if(src.sampleType == UINT)
 	{
-		CopyChannel<DESTTYPE, unsigned int>(dest, src);
+		CopyChannelFloat<DESTTYPE, unsigned int>(dest, src);
 	}
 	else if(src.sampleType == INT)
 	{
-		CopyChannel<DESTTYPE, int>(dest, src);
+		CopyChannelFloat<DESTTYPE, int>(dest, src);
+	}
+	else if(src.sampleType == FLOAT)
+	{
+		CopyChannelFloat<DESTTYPE, float>(dest, src);
+	}
+	else if(src.sampleType == HALF)
+	{
+		CopyChannelFloat<DESTTYPE, Half>(dest, src);
 	}
 }
 
+template <typename DESTTYPE>
+static void
+CopyChannel(const Channel &dest, const Channel &src, void *scratch)
+{
+	if(src.sampleType == UCHAR)
+	{
+		CopyChannel<DESTTYPE, unsigned char>(dest, src, scratch);
+	}
+	else if(src.sampleType == USHORT)
+	{
+		CopyChannel<DESTTYPE, unsigned short>(dest, src, scratch);
+	}
+	else if(src.sampleType == UINT)
+	{
+		CopyChannel<DESTTYPE, unsigned int>(dest, src, scratch);
+	}
+	else if(src.sampleType == INT)
+	{
+		CopyChannel<DESTTYPE, int>(dest, src, scratch);
+	}
+	else if(src.sampleType == FLOAT)
+	{
+		CopyChannelFloat<DESTTYPE, float>(dest, src);
+	}
+	else if(src.sampleType == HALF)
+	{
+		CopyChannelFloat<DESTTYPE, Half>(dest, src);
+	}
+}
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// Fast paths for the common decode cases: contiguous source rows (OpenJPEG
+// planes and tiles) going into 8, 16-bit or float destinations, with 1x or 2x
+// horizontal subsampling.  The row kernels in j2k_simd.cpp do the math the
+// same way CopyChannel() above does, so the results are identical.
+
+static bool
+GetRowConversion(RowConversion &conv, Subsampling &relativeSub, const Channel &dest, const Channel &src)
+{
+	if(dest.buf == NULL || src.buf == NULL)
+		return false;
+
+	if(dest.sampleType != UCHAR && dest.sampleType != USHORT && dest.sampleType != FLOAT)
+		return false;
+	
+	if(src.sampleType != UCHAR && src.sampleType != USHORT && src.sampleType != INT)
+		return false;
+	
+	if(src.colbytes != (intptr_t)SizeOfSample(src.sampleType) || dest.sgnd)
+		return false;
+	
+	// 15+1 sources go through CopyChannel(), the kernels only convert to it
+	if(src.fifteenPlusOne || (dest.fifteenPlusOne && (dest.sampleType != USHORT || dest.depth != 16)))
+		return false;
+	
+	if(!(dest.subsampling.x == 1 && dest.subsampling.y == 1) &&
+		!(dest.subsampling.x == src.subsampling.x && dest.subsampling.y == src.subsampling.y))
+		return false;
+	
+	relativeSub = Subsampling(src.subsampling.x / dest.subsampling.x,
+								src.subsampling.y / dest.subsampling.y);
+	
+	if(relativeSub.x != 1 && relativeSub.x != 2)
+		return false;
+	
+	conv.offset = (!src.sgnd ? 0 : static_cast<const int>(pow(2, src.depth - 1)));
+	conv.fifteenPlusOne = dest.fifteenPlusOne;
+	
+	if(dest.sampleType == FLOAT)
+	{
+		conv.scale = NormalizeScale(src.depth);
+		
+		return true;
+	}
+	
+	const int bitShift = ((int)dest.depth - (int)src.depth);
+	
+	if(bitShift > 0)
+	{
+		// the two-fill cases stay in CopyChannel()
+		if(src.depth < 8 || bitShift > (int)src.depth)
+			return false;
+		
+		conv.upShift = bitShift;
+		conv.fillShift = (src.depth - bitShift);
+	}
+	else
+		conv.downShift = -bitShift;
+	
+	return true;
+}
+
+
+template <typename DESTTYPE>
+static void
+ConvertChannelRow(DESTTYPE *dest, DESTTYPE *halfRow, const Channel &src, const unsigned char *srcRow,
+					int width, const Subsampling &relativeSub, const RowConversion &conv)
+{
+	const int count = (relativeSub.x == 2 ? ((width + 1) / 2) : width);
+	
+	DESTTYPE *out = (relativeSub.x == 2 ? halfRow : dest);
+	
+	if(src.sampleType == UCHAR)
+		ConvertRow(out, (const unsigned char *)srcRow, count, conv);
+	else if(src.sampleType == USHORT)
+		ConvertRow(out, (const unsigned short *)srcRow, count, conv);
+	else
+		ConvertRow(out, (const int *)srcRow, count, conv);
+	
+	if(relativeSub.x == 2)
+	{
+		UpsampleRow2x(dest, halfRow, width / 2);
+		
+		if(width & 1)
+			dest[width - 1] = halfRow[width / 2];
+	}
+}
+
+
+template <typename DESTTYPE>
+static bool
+CopyChannelFast(const Channel &dest, const Channel &src, DESTTYPE *scratch)
+{
+	RowConversion conv;
+	Subsampling relativeSub;
+	
+	if(!GetRowConversion(conv, relativeSub, dest, src))
+		return false;
+	
+	const int height = dest.height;
+	const int width = dest.width;
+	
+	const int destStep = static_cast<const int>(dest.colbytes / sizeof(DESTTYPE));
+	
+	DESTTYPE *rowBuf = scratch;
+	DESTTYPE *halfRow = scratch + width;
+	
+	unsigned char *destRow = dest.buf;
+	unsigned char *srcRow = src.buf;
+	
+	for(int y=1; y <= height; y++)
+	{
+		DESTTYPE *d = (DESTTYPE *)destRow;
+		
+		if(destStep == 1)
+		{
+			ConvertChannelRow(d, halfRow, src, srcRow, width, relativeSub, conv);
+		}
+		else
+		{
+			ConvertChannelRow(rowBuf, halfRow, src, srcRow, width, relativeSub, conv);
+			
+			for(int x=0; x < width; x++)
+			{
+				*d = rowBuf[x];
+				
+				d += destStep;
+			}
+		}
+		
+		destRow += dest.rowbytes;
+		
+		if(y % relativeSub.y == 0)
+			srcRow += src.rowbytes;
+	}
+	
+	return true;
+}
+
+
+// 4 planar channels going into one interleaved buffer (After Effects ARGB)
+template <typename DESTTYPE>
+static bool
+CopyBufferInterleaved(const Buffer &destination, const Buffer &source, DESTTYPE *scratch)
+{
+	if(destination.channels != 4 || source.channels < 4)
+		return false;
+	
+	const Channel &first = destination.channel[0];
+	
+	if(first.colbytes != (4 * sizeof(DESTTYPE)))
+		return false;
+	
+	RowConversion conv[4];
+	Subsampling relativeSub[4];
+	
+	unsigned char *base = first.buf;
+	
+	for(int c=0; c < 4; c++)
+	{
+		const Channel &dest = destination.channel[c];
+		
+		if(dest.sampleType != first.sampleType || dest.colbytes != first.colbytes ||
+			dest.rowbytes != first.rowbytes || dest.width != first.width || dest.height != first.height)
+			return false;
+		
+		if(!GetRowConversion(conv[c], relativeSub[c], dest, source.channel[c]))
+			return false;
+		
+		if(dest.buf < base)
+			base = dest.buf;
+	}
+	
+	int order[4] = { -1, -1, -1, -1 }; // order[k] is the channel at pixel position k
+	
+	for(int c=0; c < 4; c++)
+	{
+		const ptrdiff_t offset = (destination.channel[c].buf - base);
+		
+		if(offset % sizeof(DESTTYPE) != 0)
+			return false;
+		
+		const ptrdiff_t k = (offset / sizeof(DESTTYPE));
+		
+		if(k < 0 || k > 3 || order[k] != -1)
+			return false;
+		
+		order[k] = c;
+	}
+	
+	const int height = first.height;
+	const int width = first.width;
+	
+	DESTTYPE *channelRow[4];
+	const DESTTYPE *rows[4];
+	
+	for(int c=0; c < 4; c++)
+		channelRow[c] = scratch + (c * width);
+	
+	for(int k=0; k < 4; k++)
+		rows[k] = channelRow[order[k]];
+	
+	DESTTYPE *halfRow = scratch + (4 * width);
+	
+	unsigned char *destRow = base;
+	unsigned char *srcRow[4];
+	
+	for(int c=0; c < 4; c++)
+		srcRow[c] = source.channel[c].buf;
+	
+	for(int y=1; y <= height; y++)
+	{
+		for(int c=0; c < 4; c++)
+		{
+			ConvertChannelRow(channelRow[c], halfRow, source.channel[c], srcRow[c], width, relativeSub[c], conv[c]);
+			
+			if(y % relativeSub[c].y == 0)
+				srcRow[c] += source.channel[c].rowbytes;
+		}
+		
+		InterleaveRows((DESTTYPE *)destRow, rows, width);
+		
+		destRow += first.rowbytes;
+	}
+	
+	return true;
+}
+
+
 void
 Codec::CopyBuffer(const Buffer &destination, const Buffer &source)
 {
+	// Row scratch for the fast paths and promoted 15+1 rows, taken once for
+	// the whole copy: four rows and a half row of the widest sample, for the
+	// interleaved case.
+	unsigned int width = 0;
+	
+	for(int i=0; i < destination.channels; i++)
+		width = std::max(width, destination.channel[i].width);
+	
+	ScratchBuffer scratch(sizeof(float) * ((4 * width) + ((width + 1) / 2)));
+	
+	if(destination.channels > 0 && destination.channel[0].sampleType == UCHAR)
+	{
+		if( CopyBufferInterleaved<unsigned char>(destination, source, (unsigned char *)scratch.Get()) )
+			return;
+	}
+	else if(destination.channels > 0 && destination.channel[0].sampleType == USHORT)
+	{
+		if( CopyBufferInterleaved<unsigned short>(destination, source, (unsigned short *)scratch.Get()) )
+			return;
+	}
+	else if(destination.channels > 0 && destination.channel[0].sampleType == FLOAT)
+	{
+		if( CopyBufferInterleaved<float>(destination, source, (float *)scratch.Get()) )
+			return;
+	}
+
 	for(int i=0; i < destination.channels && i < source.channels; i++)
 	{
 		const Channel &dest = destination.channel[i];
@@ -409,50 +889,378 @@ Codec::CopyBuffer(const Buffer &destination, const Buffer &source)
 		
 		if(dest.sampleType == UCHAR)
 		{
-			CopyChannel<unsigned char>(dest, src);
+			if( !CopyChannelFast<unsigned char>(dest, src, (unsigned char *)scratch.Get()) )
+				CopyChannel<unsigned char>(dest, src, scratch.Get());
 		}
 		else if(dest.sampleType == USHORT)
 		{
-			CopyChannel<unsigned short>(dest, src);
+			if( !CopyChannelFast<unsigned short>(dest, src, (unsigned short *)scratch.Get()) )
+				CopyChannel<unsigned short>(dest, src, scratch.Get());
 		}
 		else if(dest.sampleType == UINT)
 		{
-			CopyChannel<unsigned int>(dest, src);
+			CopyChannel<unsigned int>(dest, src, scratch.Get());
 		}
 		else if(dest.sampleType == INT)
 		{
-			CopyChannel<int>(dest, src);
+			CopyChannel<int>(dest, src, scratch.Get());
+		}
+		else if(dest.sampleType == FLOAT)
+		{
+			if( !CopyChannelFast<float>(dest, src, (float *)scratch.Get()) )
+				CopyChannelFloat<float>(dest, src);
+		}
+		else if(dest.sampleType == HALF)
+		{
+			CopyChannelFloat<Half>(dest, src);
 		}
 	}
 }
 
 
-unsigned int
-Codec::NumberOfCPUs()
+size_t
+Codec::RowScratchSize(unsigned int width)
 {
-	static unsigned int cpus = 0;
+	// a half row of the widest sample, or a promoted 15+1 row
+	return std::max(sizeof(float) * ((width + 1) / 2), sizeof(unsigned short) * width);
+}
+
+
+void
+Codec::CopyRow(void *dest, SampleType type, unsigned char depth, unsigned int width,
+				const Channel &src, unsigned int y, void *scratch)
+{
+	Channel destChan;
 	
-	if(cpus == 0)
+	destChan.width = width;
+	destChan.height = 1;
+	destChan.sampleType = type;
+	destChan.depth = depth;
+	destChan.buf = (unsigned char *)dest;
+	destChan.colbytes = SizeOfSample(type);
+	destChan.rowbytes = (destChan.colbytes * width);
+	
+	Channel srcChan = src;
+	
+	srcChan.height = 1;
+	srcChan.buf = (src.buf + ((y / src.subsampling.y) * src.rowbytes));
+	
+	RowConversion conv;
+	Subsampling relativeSub;
+	
+	if( GetRowConversion(conv, relativeSub, destChan, srcChan) )
 	{
-	#ifdef __APPLE__
-		// get number of CPUs using Mach calls
-		host_basic_info_data_t hostInfo;
-		mach_msg_type_number_t infoCount;
+		// straight to the row kernels
+		if(type == UCHAR)
+			ConvertChannelRow((unsigned char *)dest, (unsigned char *)scratch, srcChan, srcChan.buf, width, relativeSub, conv);
+		else if(type == USHORT)
+			ConvertChannelRow((unsigned short *)dest, (unsigned short *)scratch, srcChan, srcChan.buf, width, relativeSub, conv);
+		else
+			ConvertChannelRow((float *)dest, (float *)scratch, srcChan, srcChan.buf, width, relativeSub, conv);
+	}
+	else if(type == UCHAR)
+		CopyChannel<unsigned char>(destChan, srcChan, scratch);
+	else if(type == USHORT)
+		CopyChannel<unsigned short>(destChan, srcChan, scratch);
+	else if(type == UINT)
+		CopyChannel<unsigned int>(destChan, srcChan, scratch);
+	else if(type == INT)
+		CopyChannel<int>(destChan, srcChan, scratch);
+	else if(type == FLOAT)
+		CopyChannelFloat<float>(destChan, srcChan);
+	else if(type == HALF)
+		CopyChannelFloat<Half>(destChan, srcChan);
+}
+
+
+#ifdef __linux__
+static unsigned int
+CgroupCPUQuota()
+{
+	// 0 means no limit
+	unsigned int cpus = 0;
+	
+	long long quota = -1;
+	long long period = 0;
+	
+	// cgroup v2
+	FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r");
+	
+	if(f)
+	{
+		char max[32] = "";
+		
+		if(fscanf(f, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0)
+			quota = atoll(max);
 		
-		infoCount = HOST_BASIC_INFO_COUNT;
-		host_info(mach_host_self(), HOST_BASIC_INFO, 
-				  (host_info_t)&hostInfo, &infoCount);
+		fclose(f);
+	}
+	else
+	{
+		// cgroup v1
+		const char *quotaPaths[] = { "/sys/fs/cgroup/cpu/cpu.cfs_quota_us",
+										"/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us" };
+		const char *periodPaths[] = { "/sys/fs/cgroup/cpu/cpu.cfs_period_us",
+										"/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us" };
 		
-		cpus = hostInfo.avail_cpus;
-	#else // WIN_ENV
+		for(int i=0; i < 2 && quota < 0; i++)
+		{
+			f = fopen(quotaPaths[i], "r");
+			
+			if(f)
+			{
+				if(fscanf(f, "%lld", &quota) != 1)
+					quota = -1;
+				
+				fclose(f);
+				
+				f = fopen(periodPaths[i], "r");
+				
+				if(f)
+				{
+					if(fscanf(f, "%lld", &period) != 1)
+						period = 0;
+					
+					fclose(f);
+				}
+			}
+		}
+	}
+	
+	if(quota > 0 && period > 0)
+		cpus = static_cast<unsigned int>(std::max<long long>(1, (quota + period - 1) / period));
+	
+	return cpus;
+}
+#endif // __linux__
+
+
+static unsigned int
+SystemNumberOfCPUs()
+{
+	unsigned int cpus = 0;
+	
+#if defined(__APPLE__)
+	// get number of CPUs using Mach calls
+	host_basic_info_data_t hostInfo;
+	mach_msg_type_number_t infoCount;
+	
+	infoCount = HOST_BASIC_INFO_COUNT;
+	host_info(mach_host_self(), HOST_BASIC_INFO, 
+			  (host_info_t)&hostInfo, &infoCount);
+	
+	cpus = hostInfo.avail_cpus;
+#elif defined(WIN32)
+	DWORD_PTR processMask = 0;
+	DWORD_PTR systemMask = 0;
+	
+	if( GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) )
+	{
+		while(processMask)
+		{
+			if(processMask & 1)
+				cpus++;
+			
+			processMask >>= 1;
+		}
+	}
+	
+	if(cpus == 0)
+	{
 		SYSTEM_INFO systemInfo;
 		GetSystemInfo(&systemInfo);
 
 		cpus = systemInfo.dwNumberOfProcessors;
+	}
+#else
+	#ifdef __linux__
+	cpu_set_t cpuSet;
+	
+	CPU_ZERO(&cpuSet);
+	
+	if(sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
+		cpus = CPU_COUNT(&cpuSet);
 	#endif
+	
+	if(cpus == 0)
+	{
+		const long online = sysconf(_SC_NPROCESSORS_ONLN);
+		
+		if(online > 0)
+			cpus = static_cast<unsigned int>(online);
 	}
 	
-	return cpus;
+	#ifdef __linux__
+	// containers are often given a slice of a big machine
+	const unsigned int quota = CgroupCPUQuota();
+	
+	if(quota > 0 && quota < cpus)
+		cpus = quota;
+	#endif
+#endif
+
+	const char *env = getenv("J2K_NUM_THREADS");
+	
+	if(env != NULL && atoi(env) > 0)
+		cpus = atoi(env);
+	
+	return (cpus > 0 ? cpus : 1);
+}
+
+
+typedef struct BatchContext
+{
+	std::vector<DecodeJob> &jobs;
+	std::vector<DecodeSession *> sessions; // one for each thread
+	
+	unsigned int cpus;
+	unsigned int frameThreads;
+	
+	Progress *progress;
+	
+	Mutex mutex;
+	size_t started;
+	size_t finished;
+	bool keepGoing;
+	
+	BatchContext(std::vector<DecodeJob> &j, unsigned int c, unsigned int f, Progress *p) :
+		jobs(j), cpus(c), frameThreads(f), progress(p), started(0), finished(0), keepGoing(true) {}
+	
+} BatchContext;
+
+
+static void
+DecodeBatchJob(void *refCon, unsigned int index, unsigned int thread)
+{
+	BatchContext &context = *(BatchContext *)refCon;
+	
+	DecodeJob &job = context.jobs[index];
+	
+	DecodeSession &session = *context.sessions[thread];
+	
+	{
+		Lock lock(context.mutex);
+		
+		if(!context.keepGoing)
+		{
+			job.success = false;
+			job.error = "Canceled";
+			
+			return;
+		}
+		
+		// Once there are fewer frames left than frame threads, give the
+		// spare CPUs to the codec for the frames that are left.
+		const size_t remaining = (context.jobs.size() - context.started);
+		
+		const size_t frames = std::min<size_t>(context.frameThreads, remaining);
+		
+		session.SetThreads(std::max<unsigned int>(1, context.cpus / static_cast<unsigned int>(frames)));
+		
+		context.started++;
+	}
+	
+	try
+	{
+		if(job.file == NULL)
+			throw Exception("No file");
+		
+		session.ReadFile(*job.file, job.buffer, job.subsample, NULL, job.layers);
+		
+		job.success = true;
+	}
+	catch(const std::exception &e)
+	{
+		job.success = false;
+		job.error = e.what();
+	}
+	catch(...)
+	{
+		job.success = false;
+		job.error = "Unknown error";
+	}
+	
+	size_t finished = 0;
+	
+	{
+		Lock lock(context.mutex);
+		
+		finished = ++context.finished;
+	}
+	
+	// progress callbacks only get made from the calling thread
+	Progress *progress = context.progress;
+	
+	if(thread == 0 && progress != NULL && progress->keepGoing)
+	{
+		if(progress->progressProc != NULL)
+			progress->keepGoing = progress->progressProc(progress->refCon, finished, context.jobs.size());
+		else if(progress->abortProc != NULL)
+			progress->keepGoing = progress->abortProc(progress->refCon);
+		
+		if(!progress->keepGoing)
+		{
+			Lock lock(context.mutex);
+			
+			context.keepGoing = false;
+		}
+	}
+}
+
+
+void
+Codec::DecodeBatch(std::vector<DecodeJob> &jobs, Progress *progress)
+{
+	if(jobs.empty())
+		return;
+	
+	// Decoding separate frames in parallel scales better than threads inside
+	// one frame, so run as many frames at once as we have CPUs for.  Unless
+	// the codec can't be told to use fewer threads for each one, like Grok
+	// with its one thread pool for the whole process, which already has a
+	// thread for each CPU.
+	const unsigned int cpus = NumberOfCPUs();
+	const unsigned int frameThreads = ((GetReadFlags() & J2K_SESSION_THREADS) ?
+										static_cast<unsigned int>(std::min<size_t>(cpus, jobs.size())) : 1);
+	
+	BatchContext context(jobs, cpus, frameThreads, progress);
+	
+	for(unsigned int i=0; i < frameThreads; i++)
+		context.sessions.push_back( CreateDecodeSession() );
+	
+	ParallelFor(DecodeBatchJob, &context, static_cast<unsigned int>(jobs.size()), frameThreads);
+	
+	for(std::vector<DecodeSession *>::iterator i = context.sessions.begin(); i != context.sessions.end(); ++i)
+		delete *i;
+}
+
+
+static Mutex gCPUMutex;
+static unsigned int gCPUs = 0;
+static unsigned int gCPUOverride = 0;
+
+
+unsigned int
+Codec::NumberOfCPUs()
+{
+	Lock lock(gCPUMutex);
+	
+	if(gCPUOverride > 0)
+		return gCPUOverride;
+	
+	if(gCPUs == 0)
+		gCPUs = SystemNumberOfCPUs();
+	
+	return gCPUs;
+}
+
+
+void
+Codec::SetNumberOfCPUs(unsigned int cpus)
+{
+	Lock lock(gCPUMutex);
+	
+	gCPUOverride = cpus;
 }
 
 
@@ -465,6 +1273,8 @@ SizeOfSample(SampleType type)
 		case USHORT:	return sizeof(unsigned short);
 		case UINT:		return sizeof(unsigned int);
 		case INT:		return sizeof(int);
+		case FLOAT:		return sizeof(float);
+		case HALF:		return sizeof(Half);
 		
 		default:
 			throw Exception("invalid type!");
@@ -472,6 +1282,103 @@ SizeOfSample(SampleType type)
 }
 
 
+float
+HalfToFloat(Half h)
+{
+	const unsigned int sign = ((unsigned int)(h.bits & 0x8000) << 16);
+	unsigned int exponent = ((h.bits >> 10) & 0x1f);
+	unsigned int mantissa = (h.bits & 0x3ff);
+	
+	unsigned int bits = sign;
+	
+	if(exponent == 0)
+	{
+		if(mantissa != 0)
+		{
+			// denormal, becomes a normal float
+			exponent = (127 - 15 + 1);
+			
+			while( !(mantissa & 0x400) )
+			{
+				mantissa <<= 1;
+				exponent--;
+			}
+			
+			bits |= ((exponent << 23) | ((mantissa & 0x3ff) << 13));
+		}
+	}
+	else if(exponent == 0x1f)
+	{
+		bits |= (0x7f800000 | (mantissa << 13)); // infinity or NaN
+	}
+	else
+		bits |= (((exponent + 127 - 15) << 23) | (mantissa << 13));
+	
+	float f;
+	
+	memcpy(&f, &bits, sizeof(f));
+	
+	return f;
+}
+
+
+Half
+FloatToHalf(float f)
+{
+	unsigned int bits;
+	
+	memcpy(&bits, &f, sizeof(bits));
+	
+	const unsigned short sign = ((bits >> 16) & 0x8000);
+	const int floatExponent = ((bits >> 23) & 0xff);
+	const int exponent = (floatExponent - 127 + 15);
+	const unsigned int mantissa = (bits & 0x7fffff);
+	
+	Half h;
+	
+	if(floatExponent == 0xff)
+	{
+		h.bits = (sign | 0x7c00 | (mantissa ? 0x200 : 0)); // infinity or NaN
+	}
+	else if(exponent >= 0x1f)
+	{
+		h.bits = (sign | 0x7c00); // too big
+	}
+	else if(exponent <= 0)
+	{
+		if(exponent < -10)
+		{
+			h.bits = sign; // too small
+		}
+		else
+		{
+			// denormal
+			const unsigned int m = (mantissa | 0x800000);
+			const int shift = (14 - exponent);
+			const unsigned int rem = (m & ((1 << shift) - 1));
+			const unsigned int halfway = (1 << (shift - 1));
+			
+			h.bits = (sign | (m >> shift));
+			
+			if(rem > halfway || (rem == halfway && (h.bits & 1)))
+				h.bits++;
+		}
+	}
+	else
+	{
+		const unsigned int rem = (mantissa & 0x1fff);
+		
+		h.bits = (sign | (exponent << 10) | (mantissa >> 13));
+		
+		// a carry here correctly rolls over into the exponent
+		if(rem > 0x1000 || (rem == 0x1000 && (h.bits & 1)))
+			h.bits++;
+	}
+	
+	return h;
+}
+
+
 unsigned int
 SubsampledSize(unsigned int size, int subsampling)
 {
@@ -484,6 +1391,70 @@ SubsampledSize(unsigned int size, int subsampling)
 }
 
 
+std::vector<float>
+LayerTargets(const FileInfo &info)
+{
+	const CompressionSettings &settings = info.settings;
+	
+	const unsigned int layers = std::min<unsigned int>(std::max<unsigned int>(settings.layers, 1), J2K_CODEC_MAX_LAYERS);
+	
+	std::vector<float> targets(layers, 0.f);
+	
+	// the first layer is this many times smaller than the last
+	const double spread = 256.0;
+	
+	if(settings.method == QUALITY)
+	{
+		// 0-99 maps to 25-60 dB, the first layer starting at 20 dB
+		const double lowest = 20.0;
+		const double best = 25.0 + 0.35 * std::min<int>(settings.quality, 100);
+		
+		for(unsigned int i = 0; i < layers; i++)
+			targets[i] = lowest + (best - lowest) * (i + 1) / layers;
+		
+		// and 100 means lossless at the end
+		if(settings.quality >= 100)
+			targets[layers - 1] = 0.f;
+	}
+	else
+	{
+		double best = 1.0; // LOSSLESS ends with a 0 below
+		
+		if(settings.method == SIZE)
+		{
+			// The encoders turn a rate back into bytes as if every component
+			// were the size and precision of the first one, so work it out the
+			// same way or 12-bit and subsampled files miss the target.
+			const double uncompressed = ((double)info.channels * info.depth * info.width * info.height) /
+											(8.0 * info.subsampling[0].x * info.subsampling[0].y);
+			
+			const double target = std::max<double>(settings.fileSize, 1) * 1024.0;
+			
+			best = std::max(uncompressed / target, 1.0);
+		}
+		
+		const double step = (layers > 1 ? pow(spread, 1.0 / (layers - 1)) : 1.0);
+		
+		for(unsigned int i = 0; i < layers; i++)
+			targets[i] = best * pow(step, (double)(layers - 1 - i));
+		
+		if(settings.method != SIZE)
+			targets[layers - 1] = 0.f;
+	}
+	
+	return targets;
+}
+
+
+void
+SetFastCoding(CompressionSettings &settings)
+{
+	settings.codeBlockWidth = 64;
+	settings.codeBlockHeight = 64;
+	settings.blockModes = BLOCK_BYPASS;
+}
+
+
 static bool CodecCompare(const Codec *first, const Codec *second)
 {
 	const std::string s1 = first->Name();
@@ -507,10 +1478,12 @@ class CodecContainer
 
 CodecContainer::CodecContainer()
 {
-	// un-comment the line below to start testing the Grok codec!
-	//_codecList.push_back(new GrokCodec);
 	_codecList.push_back(new OpenJPEGCodec);
 	
+#ifdef J2K_USE_GROK
+	_codecList.push_back(new GrokCodec);
+#endif
+	
 #ifdef J2K_USE_KAKADU
 	_codecList.push_back(new KakaduCodec);
 #endif
@@ -28,6 +28,8 @@
 #include "j2k_io.h"
 
 #include <list>
+#include <vector>
+#include <string>
 
 namespace j2k
 {
@@ -66,6 +68,18 @@ typedef struct Subsampling
 	
 } Subsampling;
 
+typedef struct Rect
+{
+	unsigned int x; // in full-resolution image coordinates
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+	
+	Rect(unsigned int xin = 0, unsigned int yin = 0, unsigned int w = 0, unsigned int h = 0) :
+		x(xin), y(yin), width(w), height(h) {}
+	
+} Rect;
+
 enum ColorSpace
 {
 	UNKNOWN_COLOR_SPACE,
@@ -128,6 +142,17 @@ enum DCIProfile
 	DCI_4K
 };
 
+// code-block coding switches, same bits as the COD marker
+enum BlockMode
+{
+	BLOCK_BYPASS	= 0x01, // raw (not arithmetic) coding of the lower bit-planes
+	BLOCK_RESET		= 0x02, // reset the contexts after each pass
+	BLOCK_RESTART	= 0x04, // terminate after each pass
+	BLOCK_VSC		= 0x08, // vertically causal contexts
+	BLOCK_ERTERM	= 0x10, // predictable termination
+	BLOCK_SEGMARK	= 0x20  // segmentation symbols
+};
+
 typedef struct CompressionSettings
 {
 	CompressionMethod method;
@@ -139,6 +164,12 @@ typedef struct CompressionSettings
 	unsigned short tileSize;
 	bool ycc;
 	bool reversible;
+	unsigned short codeBlockWidth; // powers of 2 from 4 to 1024, no more than 4096 samples
+	unsigned short codeBlockHeight;
+	unsigned char blockModes; // BlockMode flags
+	unsigned short precinctSize; // 0 for one precinct per resolution
+	bool lengthMarkers; // TLM and PLT, so readers can seek straight to tiles and packets
+	unsigned int threads; // for encoding, 0 means NumberOfCPUs()
 	
 	CompressionSettings() :
 		method(LOSSLESS),
@@ -149,7 +180,13 @@ typedef struct CompressionSettings
 		dciProfile(DCI_2K),
 		tileSize(1024),
 		ycc(false),
-		reversible(false)
+		reversible(false),
+		codeBlockWidth(64),
+		codeBlockHeight(64),
+		blockModes(0),
+		precinctSize(0),
+		lengthMarkers(false),
+		threads(0)
 	{
 	}
 	
@@ -163,6 +200,7 @@ typedef struct FileInfo
 	unsigned char channels;
 	unsigned char depth;
 	Subsampling subsampling[J2K_CODEC_MAX_CHANNELS];
+	unsigned char resolutions; // wavelet levels + 1, so 1 << (resolutions - 1) is the most it can be reduced, 0 if not known
 	
 	Format format;
 	Rational pixelAspect;
@@ -186,6 +224,7 @@ typedef struct FileInfo
 		height(0),
 		channels(0),
 		depth(0),
+		resolutions(0),
 		format(UNKNOWN_FORMAT),
 		pixelAspect( Rational(0, 1) ),
 		dpi(0),
@@ -215,9 +254,22 @@ enum SampleType
 	USHORT,
 	UINT,
 	
-	INT
+	INT,
+	
+	FLOAT,	// 0.0 - 1.0, depth is 32
+	HALF	// 16-bit float, same range, depth is 16
 };
 
+
+// IEEE half float, as used by 16-bit float buffers
+typedef struct Half
+{
+	unsigned short bits;
+	
+	Half() : bits(0) {}
+	
+} Half;
+
 typedef struct Channel
 {
 	unsigned int width;
@@ -227,6 +279,7 @@ typedef struct Channel
 	SampleType sampleType;
 	unsigned char depth;
 	bool sgnd; // signed (which is a C keyword, hence the Hungarian)
+	bool fifteenPlusOne; // USHORT samples go 0 - 32768, like After Effects 16bpc (depth stays 16)
 	
 	unsigned char *buf;
 	intptr_t colbytes;
@@ -238,6 +291,7 @@ typedef struct Channel
 		sampleType(UCHAR),
 		depth(8),
 		sgnd(false),
+		fifteenPlusOne(false),
 		buf(NULL),
 		colbytes(0),
 		rowbytes(0)
@@ -276,6 +330,52 @@ typedef struct Progress
 } Progress;
 
 
+class Codec;
+
+typedef struct DecodeJob
+{
+	InputFile *file;
+	Buffer buffer;
+	unsigned int subsample;
+	unsigned int layers; // 0 for all of them
+	
+	bool success; // set by DecodeBatch
+	std::string error;
+	
+	DecodeJob(InputFile *f = NULL, const Buffer &b = Buffer(), unsigned int s = 1, unsigned int l = 0) :
+		file(f), buffer(b), subsample(s), layers(l), success(false) {}
+	
+} DecodeJob;
+
+// Holds on to whatever a codec can reuse between the frames of a sequence.
+// Get one from Codec::CreateDecodeSession() and delete it when you're done,
+// or borrow one from the DecodeSessionPool (j2k_selector.h).  A session is
+// for one thread at a time.
+class DecodeSession
+{
+  public:
+	DecodeSession(Codec &codec) : _codec(codec), _threads(0) {}
+	virtual ~DecodeSession() {}
+	
+	Codec & GetCodec() const { return _codec; }
+	
+	void SetThreads(unsigned int threads) { _threads = threads; }
+	unsigned int GetThreads() const { return _threads; }
+	// Threads the codec may use inside one frame, 0 means its usual number.
+	
+	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
+	virtual void ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
+	
+  protected:
+	Codec &_codec;
+	unsigned int _threads;
+	
+  private:
+	DecodeSession(const DecodeSession &);
+	DecodeSession & operator=(const DecodeSession &);
+};
+
+
 class Codec
 {
   public:
@@ -283,7 +383,9 @@ class Codec
 		J2K_CAN_NOT_READ	= 0,
 		J2K_CAN_READ		= (1L << 0),
 		J2K_CAN_SUBSAMPLE	= (1L << 1),
-		J2K_APPLIES_LUT		= (1L << 2) // can't get the index, just the applied LUT
+		J2K_APPLIES_LUT		= (1L << 2), // can't get the index, just the applied LUT
+		J2K_CAN_READ_REGION	= (1L << 3),
+		J2K_SESSION_THREADS	= (1L << 4) // DecodeSession::SetThreads() changes how many it uses
 	};
 	
 	typedef unsigned int ReadFlags;
@@ -308,19 +410,43 @@ class Codec
 	
 	virtual bool Verify(InputFile &file);
 	virtual void GetFileInfo(InputFile &file, FileInfo &info) = 0;
-	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 1, Progress *progress = NULL) = 0;
+	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0) = 0;
 	// Subsample 1 means normal resolution.  Buffer width = image width / subsample.
 	// But for all known JPEG 2000 implementations, subsample should be a power of 2.
+	// Layers caps the quality layers decoded, for quicker and rougher previews.
+	// 0 means all of them, and so does a codec that can't stop early.
+	
+	virtual void ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
+	// Only decodes the region.  Buffer width = region width / subsample.
+	// Codecs that can do this have J2K_CAN_READ_REGION set.
 	
 	virtual void WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer, Progress *progress = NULL) = 0;
+	
+	virtual DecodeSession * CreateDecodeSession();
+	// The default session just calls ReadFile() and ReadRegion().
 
 	static Format GetFileFormat(InputFile &file);
 	static void *CreateProfile(ColorSpace colorSpace, size_t &profileSize);
 	static bool IssRGBProfile(const void *iccProfile, size_t profileSize);
 	
 	static void CopyBuffer(const Buffer &destination, const Buffer &source);
-
-  protected:
+	
+	static void CopyRow(void *dest, SampleType type, unsigned char depth, unsigned int width,
+						const Channel &src, unsigned int y, void *scratch);
+	static size_t RowScratchSize(unsigned int width);
+	// Converts row y of the full-size image, from a possibly subsampled
+	// channel, into a packed row.  For converting a row at a time on many
+	// threads: nothing is allocated, scratch holds RowScratchSize() bytes.
+	
+	void DecodeBatch(std::vector<DecodeJob> &jobs, Progress *progress = NULL);
+	// Decodes all the jobs, several frames at once if the codec has
+	// J2K_SESSION_THREADS, otherwise one after another.  Doesn't throw, check
+	// each job's success and error.  Progress is reported in frames.
+	
+	static void SetNumberOfCPUs(unsigned int cpus);
+	// Replaces the thread count codecs use, above the CPU count too (for
+	// oversubscribing).  0 goes back to asking the system, which also
+	// respects the J2K_NUM_THREADS environment variable.
 	
 	static unsigned int NumberOfCPUs();
 };
@@ -328,8 +454,21 @@ class Codec
 
 size_t SizeOfSample(SampleType type);
 
+float HalfToFloat(Half h);
+Half FloatToHalf(float f); // rounds to nearest even
+
 unsigned int SubsampledSize(unsigned int size, int subsampling);
 
+// What each quality layer of an encode should aim for, first layer first.
+// SIZE gives compression ratios (uncompressed size over layer size),
+// QUALITY gives PSNR in dB, and a 0 means lossless.  The ratios fall
+// geometrically, so the early layers make a usable draft.
+std::vector<float> LayerTargets(const FileInfo &info);
+
+// The "fast" preset: 64x64 code-blocks with bypass, which skips the
+// arithmetic coder for most of the bits, encoding and decoding.
+void SetFastCoding(CompressionSettings &settings);
+
 
 typedef std::list<Codec *> CodecList;
 
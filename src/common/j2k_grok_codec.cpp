@@ -22,40 +22,748 @@
 // 
 // -------------------------------------------------------------------*/
 
+
 #include "j2k_grok_codec.h"
 
 #include "j2k_exception.h"
 
+#ifdef J2K_USE_GROK
+
+#include "grok.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
 namespace j2k
 {
 
+// Grok pulls the file through here, which is also where we check for an abort
+typedef struct GrokInputStream
+{
+	InputFile &file;
+	const unsigned char *data; // the whole file, if it's already in memory
+	size_t size;
+	size_t position;
+	Progress *progress;
+	
+	GrokInputStream(InputFile &f, Progress *p) :
+		file(f),
+		data((f.Flags() & InputFile::J2K_READ_MEMORY) ? f.Data() : NULL),
+		size(f.FileSize()),
+		position(0),
+		progress(p)
+	{
+		if(data == NULL)
+			file.Seek(0);
+	}
+	
+} GrokInputStream;
+
+typedef struct GrokOutputStream
+{
+	OutputFile &file;
+	Progress *progress;
+	
+	GrokOutputStream(OutputFile &f, Progress *p) : file(f), progress(p) {}
+	
+} GrokOutputStream;
+
+
+#define PROG(COUNT, TOTAL) (progress == NULL ? true : \
+								!progress->keepGoing ? false : \
+								progress->progressProc != NULL ? \
+									(progress->keepGoing = progress->progressProc(progress->refCon, COUNT, TOTAL)) : \
+									progress->abortProc != NULL ? \
+										(progress->keepGoing = progress->abortProc(progress->refCon)) : \
+										true)
+
+#define NOABORT() (progress == NULL ? true : \
+					!progress->keepGoing ? false : \
+					progress->abortProc == NULL ? true : \
+						(progress->keepGoing = progress->abortProc(progress->refCon)))
+
+
+static size_t
+InputStreamRead(uint8_t *buffer, size_t numBytes, void *user_data)
+{
+	GrokInputStream *stream = (GrokInputStream *)user_data;
+	
+	Progress *progress = stream->progress;
+	
+	// returning nothing makes Grok give up
+	if( !PROG(stream->position, stream->size) )
+		return 0;
+	
+	size_t count = 0;
+	
+	if(stream->data != NULL)
+	{
+		if(stream->position < stream->size)
+		{
+			count = std::min<size_t>(numBytes, stream->size - stream->position);
+			
+			memcpy(buffer, stream->data + stream->position, count);
+		}
+	}
+	else
+		count = stream->file.Read(buffer, numBytes);
+	
+	stream->position += count;
+	
+	return count;
+}
+
+static bool
+InputStreamSeek(uint64_t offset, void *user_data)
+{
+	GrokInputStream *stream = (GrokInputStream *)user_data;
+	
+	if(offset > stream->size)
+		return false;
+	
+	if(stream->data == NULL && !stream->file.Seek(static_cast<size_t>(offset)))
+		return false;
+	
+	stream->position = static_cast<size_t>(offset);
+	
+	return true;
+}
+
+static void
+SetupInputStream(grk_stream_params &streamParams, GrokInputStream &stream)
+{
+	memset(&streamParams, 0, sizeof(streamParams));
+	
+	streamParams.read_fn = InputStreamRead;
+	streamParams.seek_fn = InputStreamSeek;
+	streamParams.user_data = &stream;
+	streamParams.stream_len = stream.size;
+}
+
+static size_t
+OutputStreamWrite(const uint8_t *buffer, size_t numBytes, void *user_data)
+{
+	GrokOutputStream *stream = (GrokOutputStream *)user_data;
+	
+	Progress *progress = stream->progress;
+	
+	if( !NOABORT() )
+		return 0;
+	
+	return stream->file.Write(buffer, numBytes);
+}
+
+static bool
+OutputStreamSeek(uint64_t offset, void *user_data)
+{
+	GrokOutputStream *stream = (GrokOutputStream *)user_data;
+	
+	return stream->file.Seek(static_cast<size_t>(offset));
+}
+
+
+static void
+ErrorHandler(const char *msg, void *client_data)
+{
+	printf("grok error: %s", msg);
+}
+
+static void
+WarningHandler(const char *msg, void *client_data)
+{
+	printf("grok warning: %s", msg);
+}
+
+static void
+InfoHandler(const char *msg, void *client_data)
+{
+	printf("grok info: %s", msg);
+}
+
+// Unrefs a codec however we leave, exceptions included
+class GrokCodecRef
+{
+  public:
+	GrokCodecRef(grk_codec *codec) : _codec(codec) {}
+	~GrokCodecRef() { if(_codec != NULL) grk_object_unref(_codec); }
+	
+	grk_codec * Get() const { return _codec; }
+	
+  private:
+	GrokCodecRef(const GrokCodecRef &);
+	GrokCodecRef & operator=(const GrokCodecRef &);
+	
+	grk_codec *_codec;
+};
+
+
+static Order
+FileOrder(GRK_PROG_ORDER order)
+{
+	switch(order)
+	{
+		case GRK_LRCP:	return LRCP;
+		case GRK_RLCP:	return RLCP;
+		case GRK_RPCL:	return RPCL;
+		case GRK_PCRL:	return PCRL;
+		case GRK_CPRL:	return CPRL;
+		default:		break;
+	}
+	
+	return RPCL;
+}
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+
+GrokCodec::~GrokCodec()
+{
+	if(_initialized)
+		grk_deinitialize();
+}
+
+
+void
+GrokCodec::Initialize()
+{
+	Lock lock(_initMutex);
+	
+	if(!_initialized)
+	{
+		grk_initialize(NULL, NumberOfCPUs(), false);
+		
+		grk_set_msg_handlers(InfoHandler, NULL, WarningHandler, NULL, ErrorHandler, NULL);
+		
+		_initialized = true;
+	}
+}
+
 
 bool
 GrokCodec::Verify(InputFile &file)
 {
-	throw Exception("nothing here!");
+	const Format format = GetFileFormat(file);
+	
+	return (format == JP2 || format == J2C);
 }
 
 
 void
 GrokCodec::GetFileInfo(InputFile &file, FileInfo &info)
 {
-	throw Exception("nothing here!");
+	const Format format = GetFileFormat(file);
+	
+	if(format != JP2 && format != J2C)
+		throw Exception("Can't read this format");
+	
+	Initialize();
+	
+	bool success = true;
+	
+	
+	GrokInputStream inputStream(file, NULL);
+	
+	grk_stream_params streamParams;
+	
+	SetupInputStream(streamParams, inputStream);
+	
+	grk_decompress_parameters params;
+	grk_decompress_set_default_params(&params);
+	
+	GrokCodecRef codecRef(grk_decompress_init(&streamParams, &params.core));
+	
+	grk_codec *codec = codecRef.Get();
+	
+	if(codec)
+	{
+		grk_header_info header_info;
+		
+		memset(&header_info, 0, sizeof(header_info));
+		
+		const grk_image *image = (grk_decompress_read_header(codec, &header_info) ?
+									grk_decompress_get_composited_image(codec) : NULL);
+		
+		if(image != NULL)
+		{
+			info.format = format;
+			
+			info.width = (image->x1 - image->x0);
+			info.height = (image->y1 - image->y0);
+			
+			info.channels = std::min<uint8_t>(static_cast<uint8_t>(image->numcomps), J2K_CODEC_MAX_CHANNELS);
+			
+			info.depth = static_cast<uint8_t>(image->comps[0].prec);
+			
+			for(int i=0; i < info.channels; i++)
+			{
+				const grk_image_comp &comp = image->comps[i];
+				
+				info.subsampling[i].x = comp.dx;
+				info.subsampling[i].y = comp.dy;
+			}
+			
+			// Grok applies the palette while decoding (J2K_APPLIES_LUT), but we still
+			// report it so the file is known to be RGB
+			const grk_palette_data *palette = (image->meta != NULL ? image->meta->color.palette : NULL);
+			
+			if(palette != NULL)
+			{
+				assert(palette->num_entries <= J2K_CODEC_MAX_LUT_ENTRIES);
+				
+				info.LUTsize = std::min<unsigned int>(palette->num_entries, J2K_CODEC_MAX_LUT_ENTRIES);
+				
+				const int lutChannels = std::min<int>(palette->num_channels, J2K_CODEC_MAX_CHANNELS);
+				
+				for(unsigned int i=0; i < info.LUTsize; i++)
+				{
+					for(int c=0; c < lutChannels; c++)
+					{
+						info.LUT[i].channel[c] = static_cast<uint8_t>(palette->lut[(i * palette->num_channels) + c]);
+					}
+				}
+			}
+			
+			info.colorSpace = (image->color_space == GRK_CLRSPC_SRGB ? sRGB :
+								image->color_space == GRK_CLRSPC_GRAY ? sLUM :
+								image->color_space == GRK_CLRSPC_SYCC ? sYCC :
+								image->color_space == GRK_CLRSPC_EYCC ? esYCC :
+								image->color_space == GRK_CLRSPC_CMYK ? CMYK :
+								UNKNOWN_COLOR_SPACE);
+			
+			if(image->meta != NULL && image->meta->color.icc_profile_buf != NULL)
+			{
+				const grk_color &color = image->meta->color;
+				
+				assert(color.icc_profile_len > 0);
+				
+				// make my own copy
+				info.iccProfile = malloc(color.icc_profile_len);
+				
+				if(info.iccProfile == NULL)
+					throw Exception("out of memory");
+				
+				info.profileLen = color.icc_profile_len;
+				
+				memcpy(info.iccProfile, color.icc_profile_buf, info.profileLen);
+				
+				info.colorSpace = (info.channels >= 3 ? iccRGB :
+									info.channels == 1 ? iccLUM :
+									iccANY);
+			}
+			
+			info.settings.reversible = !header_info.irreversible;
+			
+			// tiling and coding, so the CodecSelector can tell files apart
+			info.settings.tileSize = ((header_info.t_grid_width * header_info.t_grid_height) > 1 ?
+										static_cast<unsigned short>(std::min<uint32_t>(header_info.t_width, 0xffff)) :
+										0);
+			
+			info.settings.layers = static_cast<unsigned char>(std::min<uint32_t>(header_info.numlayers, 0xff));
+			info.settings.order = FileOrder(header_info.prog_order);
+			
+			info.settings.codeBlockWidth = static_cast<unsigned short>(header_info.cblockw_init);
+			info.settings.codeBlockHeight = static_cast<unsigned short>(header_info.cblockh_init);
+			info.settings.blockModes = static_cast<unsigned char>(header_info.cblk_sty & 0x3f);
+			
+			info.resolutions = header_info.numresolutions;
+		}
+		else
+			success = false;
+	}
+	else
+		success = false;
+	
+	
+	if(!success)
+		throw Exception("Error reading file");
 }
 
 
 void
-GrokCodec::ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample)
+GrokCodec::ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample, Progress *progress, unsigned int layers)
 {
-	throw Exception("nothing here!");
+	Decode(file, buffer, NULL, subsample, layers, progress);
 }
 
 
 void
-GrokCodec::WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer)
+GrokCodec::ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample, Progress *progress, unsigned int layers)
 {
-	throw Exception("nothing here!");
+	Decode(file, buffer, &region, subsample, layers, progress);
 }
 
 
-}; // namespace j2k
\ No newline at end of file
+void
+GrokCodec::Decode(InputFile &file, const Buffer &buffer, const Rect *region, unsigned int subsample, unsigned int layers, Progress *progress)
+{
+	const Format format = GetFileFormat(file);
+	
+	if(format != JP2 && format != J2C)
+		throw Exception("Can't read this format");
+	
+	Initialize();
+	
+	bool success = true;
+	
+	
+	GrokInputStream inputStream(file, progress);
+	
+	grk_stream_params streamParams;
+	
+	SetupInputStream(streamParams, inputStream);
+	
+	grk_decompress_parameters params;
+	grk_decompress_set_default_params(&params);
+	
+	// subsample is a power of two, each reduction halves the image
+	uint8_t reduce = 0;
+	
+	while((2U << reduce) <= subsample)
+		reduce++;
+	
+	params.core.reduce = reduce;
+	params.core.max_layers = static_cast<uint16_t>(std::min<unsigned int>(layers, 0xffff)); // 0 is all
+	
+	GrokCodecRef codecRef(grk_decompress_init(&streamParams, &params.core));
+	
+	grk_codec *codec = codecRef.Get();
+	
+	if(codec)
+	{
+		grk_header_info header_info;
+		
+		memset(&header_info, 0, sizeof(header_info));
+		
+		bool decoded = grk_decompress_read_header(codec, &header_info);
+		
+		if(decoded && region != NULL)
+		{
+			const grk_image *header = grk_decompress_get_composited_image(codec);
+			
+			assert(header != NULL);
+			
+			const uint32_t imageWidth = (header->x1 - header->x0);
+			const uint32_t imageHeight = (header->y1 - header->y0);
+			
+			if(region->width == 0 || region->height == 0 ||
+				region->x >= imageWidth || region->width > imageWidth - region->x ||
+				region->y >= imageHeight || region->height > imageHeight - region->y)
+			{
+				throw Exception("Invalid region");
+			}
+			
+			// the window is in full resolution coordinates, whatever the reduction
+			decoded = grk_decompress_set_window(codec,
+												header->x0 + region->x,
+												header->y0 + region->y,
+												header->x0 + region->x + region->width,
+												header->y0 + region->y + region->height);
+		}
+		
+		if(decoded)
+			decoded = grk_decompress(codec, NULL);
+		
+		if(decoded && NOABORT())
+		{
+			const grk_image *image = grk_decompress_get_composited_image(codec);
+			
+			assert(image != NULL);
+			
+			const uint8_t channels = std::min<uint8_t>(static_cast<uint8_t>(image->numcomps), J2K_CODEC_MAX_CHANNELS);
+			
+			Buffer grokBuffer;
+			
+			grokBuffer.channels = channels;
+			
+			for(int i=0; i < channels; i++)
+			{
+				Channel &chan = grokBuffer.channel[i];
+				
+				const grk_image_comp &comp = image->comps[i];
+				
+				chan.width = comp.w;
+				chan.height = comp.h;
+				
+				chan.subsampling.x = comp.dx;
+				chan.subsampling.y = comp.dy;
+				
+				chan.sampleType = INT;
+				chan.depth = static_cast<uint8_t>(comp.prec);
+				chan.sgnd = comp.sgnd;
+				
+				assert(comp.prec > 0);
+				
+				chan.buf = (unsigned char *)comp.data;
+				chan.colbytes = sizeof(int32_t);
+				chan.rowbytes = (sizeof(int32_t) * comp.stride);
+				
+				assert(comp.data != NULL);
+			}
+			
+			CopyBuffer(buffer, grokBuffer);
+			
+			PROG(1, 1);
+		}
+		else if(!decoded && NOABORT())
+			success = false;
+	}
+	else
+		success = false;
+	
+	
+	if(!success)
+		throw Exception("Error reading file");
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+
+static grk_image *
+CreateEncodeImage(const FileInfo &info, const Buffer &buffer)
+{
+	grk_image_comp compParam[J2K_CODEC_MAX_CHANNELS];
+	
+	memset(compParam, 0, sizeof(compParam));
+	
+	assert(info.channels == buffer.channels);
+	
+	for(int i=0; i < buffer.channels; i++)
+	{
+		const Channel &chan = buffer.channel[i];
+		
+		const Subsampling &sub = info.subsampling[i];
+		
+		grk_image_comp &param = compParam[i];
+		
+		assert(chan.width == SubsampledSize(info.width, sub.x) && chan.height == SubsampledSize(info.height, sub.y));
+		
+		param.dx = sub.x;
+		param.dy = sub.y;
+		param.w = chan.width;
+		param.h = chan.height;
+		param.prec = info.depth;
+		param.sgnd = false;
+	}
+	
+	const GRK_COLOR_SPACE colorSpace = (info.colorSpace == sRGB ? GRK_CLRSPC_SRGB :
+											info.colorSpace == sLUM ? GRK_CLRSPC_GRAY :
+											info.colorSpace == sYCC ? GRK_CLRSPC_SYCC :
+											info.colorSpace == esYCC ? GRK_CLRSPC_EYCC :
+											info.colorSpace == CMYK ? GRK_CLRSPC_CMYK :
+											GRK_CLRSPC_UNKNOWN);
+	
+	grk_image *image = grk_image_new(buffer.channels, compParam, colorSpace, true);
+	
+	if(image)
+	{
+		image->x0 = 0;
+		image->y0 = 0;
+		image->x1 = info.width;
+		image->y1 = info.height;
+		
+		Buffer grokBuffer;
+		
+		grokBuffer.channels = static_cast<uint8_t>(image->numcomps);
+		
+		for(int i=0; i < grokBuffer.channels; i++)
+		{
+			Channel &chan = grokBuffer.channel[i];
+			
+			const grk_image_comp &comp = image->comps[i];
+			
+			chan.width = comp.w;
+			chan.height = comp.h;
+			
+			chan.sampleType = INT;
+			chan.depth = static_cast<uint8_t>(comp.prec);
+			chan.sgnd = false;
+			
+			chan.buf = (unsigned char *)comp.data;
+			chan.colbytes = sizeof(int32_t);
+			chan.rowbytes = (sizeof(int32_t) * comp.stride);
+			
+			assert(comp.data != NULL);
+		}
+		
+		// the planes are already at their subsampled sizes
+		Buffer source = buffer;
+		
+		for(int i=0; i < source.channels; i++)
+			source.channel[i].subsampling = Subsampling();
+		
+		try
+		{
+			Codec::CopyBuffer(grokBuffer, source);
+		}
+		catch(...)
+		{
+			grk_object_unref(&image->obj);
+			
+			throw;
+		}
+	}
+	
+	return image;
+}
+
+
+static bool
+IsSubsampled(const FileInfo &info)
+{
+	for(int i=0; i < info.channels; i++)
+	{
+		if(info.subsampling[i].x != 1 || info.subsampling[i].y != 1)
+			return true;
+	}
+	
+	return false;
+}
+
+
+void
+GrokCodec::WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer, Progress *progress)
+{
+	assert(file.Tell() == 0);
+	
+	Initialize();
+	
+	bool success = true;
+	
+	
+	grk_cparameters params;
+	grk_compress_set_default_params(&params);
+	
+	// Grok seeks back to fill in the box lengths, which our files can do
+	params.cod_format = (info.format == JP2 ? GRK_FMT_JP2 : GRK_FMT_J2K);
+	
+	const CompressionSettings &settings = info.settings;
+	
+	if(settings.method == CINEMA)
+	{
+		// Grok applies the rest of the DCI rules for the profile
+		params.rsiz = (settings.dciProfile == DCI_4K ? GRK_PROFILE_CINEMA_4K : GRK_PROFILE_CINEMA_2K);
+		params.max_cs_size = std::max<size_t>(settings.fileSize, 1) * 1024;
+		params.max_comp_size = (uint64_t)((double)params.max_cs_size * GRK_CINEMA_24_COMP / GRK_CINEMA_24_CS);
+		
+		params.numlayers = 1;
+		params.layer_rate[0] = 0;
+		params.allocation_by_rate_distortion = true;
+		params.irreversible = true;
+		params.prog_order = GRK_CPRL;
+		params.mct = (info.channels >= 3 && !IsSubsampled(info) ? 1 : 0);
+	}
+	else
+	{
+		const std::vector<float> targets = LayerTargets(info);
+		
+		params.numlayers = static_cast<uint16_t>(targets.size());
+		
+		if(settings.method == QUALITY)
+		{
+			params.allocation_by_quality = true;
+			
+			for(unsigned int i=0; i < targets.size(); i++)
+				params.layer_distortion[i] = targets[i];
+		}
+		else
+		{
+			params.allocation_by_rate_distortion = true;
+			
+			for(unsigned int i=0; i < targets.size(); i++)
+				params.layer_rate[i] = targets[i];
+		}
+		
+		params.prog_order = (settings.order == LRCP ? GRK_LRCP :
+								settings.order == RLCP ? GRK_RLCP :
+								settings.order == PCRL ? GRK_PCRL :
+								settings.order == CPRL ? GRK_CPRL :
+								GRK_RPCL);
+		
+		// lossless has to use the 5/3 wavelet, and quality 100 ends with a lossless layer
+		const bool lossless = (settings.method == LOSSLESS || (settings.method == QUALITY && settings.quality >= 100));
+		
+		params.irreversible = (!lossless && !settings.reversible);
+		
+		// MCT needs all the components the same size
+		params.mct = (settings.ycc && info.channels >= 3 && !IsSubsampled(info) ? 1 : 0);
+		
+		if(settings.tileSize > 0)
+		{
+			params.tile_size_on = true;
+			params.tx0 = 0;
+			params.ty0 = 0;
+			params.t_width = settings.tileSize;
+			params.t_height = settings.tileSize;
+		}
+		
+		params.cblockw_init = settings.codeBlockWidth;
+		params.cblockh_init = settings.codeBlockHeight;
+		params.cblk_sty = settings.blockModes;
+		
+		if(settings.precinctSize > 0)
+		{
+			params.csty |= 0x01;
+			params.res_spec = params.numresolution;
+			
+			for(unsigned int i=0; i < params.res_spec; i++)
+			{
+				params.prcw_init[i] = settings.precinctSize;
+				params.prch_init[i] = settings.precinctSize;
+			}
+		}
+	}
+	
+	params.write_tlm = settings.lengthMarkers;
+	params.write_plt = settings.lengthMarkers;
+	
+	
+	grk_image *image = CreateEncodeImage(info, buffer);
+	
+	if(image)
+	{
+		GrokOutputStream outputStream(file, progress);
+		
+		grk_stream_params streamParams;
+		
+		memset(&streamParams, 0, sizeof(streamParams));
+		
+		streamParams.write_fn = OutputStreamWrite;
+		streamParams.seek_fn = OutputStreamSeek;
+		streamParams.user_data = &outputStream;
+		
+		grk_codec *codec = grk_compress_init(&streamParams, &params, image);
+		
+		if(codec)
+		{
+			const uint64_t length = grk_compress(codec, NULL);
+			
+			if(length == 0 && NOABORT())
+				success = false;
+			
+			grk_object_unref(codec);
+		}
+		else
+			success = false;
+		
+		grk_object_unref(&image->obj);
+	}
+	else
+		success = false;
+	
+	
+	if(!success)
+		throw Exception("Error writing file");
+}
+
+
+}; // namespace j2k
+
+#endif // J2K_USE_GROK
@@ -26,6 +26,7 @@
 #define J2K_GROK_CODEC_H
 
 #include "j2k_codec.h"
+#include "j2k_thread.h"
 
 
 namespace j2k
@@ -35,20 +36,30 @@ namespace j2k
 class GrokCodec : public Codec
 {
   public:
-	GrokCodec() {}
-	virtual ~GrokCodec() {}
+	GrokCodec() : _initialized(false) {}
+	virtual ~GrokCodec();
 	
 	virtual const char * Name() const { return "Grok"; }
 	virtual const char * FourCharCode() const { return "grok"; }
 	
-	virtual ReadFlags GetReadFlags() { return (J2K_CAN_READ | J2K_CAN_SUBSAMPLE); }
+	virtual ReadFlags GetReadFlags() { return (J2K_CAN_READ | J2K_CAN_SUBSAMPLE | J2K_APPLIES_LUT | J2K_CAN_READ_REGION); }
 	virtual WriteFlags GetWriteFlags() { return (J2K_CAN_WRITE); }
 	
 	virtual bool Verify(InputFile &file);
 	virtual void GetFileInfo(InputFile &file, FileInfo &info);
-	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 0);
+	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
+	virtual void ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
 	
-	virtual void WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer);
+	virtual void WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer, Progress *progress = NULL);
+	
+  private:
+	void Decode(InputFile &file, const Buffer &buffer, const Rect *region, unsigned int subsample, unsigned int layers, Progress *progress);
+	
+	// Grok keeps one thread pool for the whole process, started on first use
+	void Initialize();
+	
+	bool _initialized;
+	Mutex _initMutex;
 };
 
 
@@ -25,3 +25,93 @@
 
 #include "j2k_io.h"
 
+#include <string.h>
+
+#include <algorithm>
+
+
+namespace j2k
+{
+
+
+MemoryInputFile::MemoryInputFile(const void *data, size_t size) :
+	InputFile(),
+	_data((const unsigned char *)data),
+	_size(size),
+	_position(0)
+{
+
+}
+
+
+size_t
+MemoryInputFile::Read(void *buf, size_t num_bytes)
+{
+	size_t count = num_bytes;
+	
+	const unsigned char *src = Map(count);
+	
+	if(count > 0)
+		memcpy(buf, src, count);
+	
+	return count;
+}
+
+
+bool
+MemoryInputFile::Seek(size_t position)
+{
+	if(position > _size)
+		return false;
+	
+	_position = position;
+	
+	return true;
+}
+
+
+const unsigned char *
+MemoryInputFile::Map(size_t &num_bytes)
+{
+	const unsigned char *ptr = (_data + _position);
+
+	num_bytes = (_position < _size ? std::min(num_bytes, _size - _position) : 0);
+	
+	_position += num_bytes;
+	
+	return ptr;
+}
+
+
+size_t
+MemoryOutputFile::Read(void *buf, size_t num_bytes)
+{
+	const size_t available = (_position < _data.size() ? (_data.size() - _position) : 0);
+	
+	const size_t count = std::min(num_bytes, available);
+	
+	if(count > 0)
+		memcpy(buf, &_data[_position], count);
+	
+	_position += count;
+	
+	return count;
+}
+
+
+size_t
+MemoryOutputFile::Write(const void *buf, size_t num_bytes)
+{
+	if(_position + num_bytes > _data.size())
+		_data.resize(_position + num_bytes);
+	
+	if(num_bytes > 0)
+		memcpy(&_data[_position], buf, num_bytes);
+	
+	_position += num_bytes;
+	
+	return num_bytes;
+}
+
+
+}; // namespace j2k
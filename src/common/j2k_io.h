@@ -27,6 +27,11 @@
 #ifndef J2K_IO_H
 #define J2K_IO_H
 
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
 
 namespace j2k
 {
@@ -36,7 +41,8 @@ class InputFile
 {
   public:
 	enum {
-		J2K_READ_SEEKABLE = (1L << 0)
+		J2K_READ_SEEKABLE	= (1L << 0),
+		J2K_READ_MEMORY		= (1L << 1) // whole file is available through Data()
 	};
 	
 	typedef unsigned int ReadFlags;
@@ -52,6 +58,40 @@ class InputFile
 	virtual size_t Read(void *buf, size_t num_bytes) = 0;
 	virtual bool Seek(size_t position) = 0;
 	virtual size_t Tell() = 0;
+	
+	// only for J2K_READ_MEMORY files, FileSize() bytes long
+	virtual const unsigned char * Data() { return NULL; }
+	
+	// Something that identifies this file and changes when the file does,
+	// like path + size + modification date.  Empty means don't cache.
+	virtual std::string CacheKey() { return std::string(); }
+};
+
+
+class MemoryInputFile : public InputFile
+{
+  public:
+	// memory belongs to the caller and must outlive this object
+	MemoryInputFile(const void *data, size_t size);
+	virtual ~MemoryInputFile() {}
+	
+	virtual ReadFlags Flags() const { return (J2K_READ_SEEKABLE | J2K_READ_MEMORY); }
+	
+	virtual size_t FileSize() { return _size; }
+	virtual size_t Read(void *buf, size_t num_bytes);
+	virtual bool Seek(size_t position);
+	virtual size_t Tell() { return _position; }
+	
+	virtual const unsigned char * Data() { return _data; }
+	
+	// Like Read(), but hands out a pointer into the buffer instead of copying.
+	// num_bytes gets changed to the number of bytes actually available.
+	const unsigned char * Map(size_t &num_bytes);
+	
+  private:
+	const unsigned char *_data;
+	size_t _size;
+	size_t _position;
 };
 
 
@@ -79,6 +119,28 @@ class OutputFile
 };
 
 
+class MemoryOutputFile : public OutputFile
+{
+  public:
+	MemoryOutputFile() : _position(0) {}
+	virtual ~MemoryOutputFile() {}
+	
+	virtual WriteFlags Flags() const { return (J2K_WRITE_SEEKABLE | J2K_WRITE_READABLE); }
+	
+	virtual size_t Read(void *buf, size_t num_bytes);
+	virtual size_t Write(const void *buf, size_t num_bytes);
+	virtual bool Seek(size_t position) { _position = position; return true; }
+	virtual size_t Tell() { return _position; }
+	
+	// everything written so far
+	const std::vector<unsigned char> & Data() const { return _data; }
+	
+  private:
+	std::vector<unsigned char> _data;
+	size_t _position;
+};
+
+
 }; // namespace j2k
 
 
@@ -68,16 +68,63 @@
 #include "j2k_openjpeg_codec.h"
 
 #include "j2k_exception.h"
+#include "j2k_thread.h"
 
 #include "openjpeg.h"
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <algorithm>
+#include <vector>
 
 
 namespace j2k
 {
 
+static inline unsigned int
+ReadBigEndian16(const unsigned char *p)
+{
+	return ((p[0] << 8) | p[1]);
+}
+
+static inline unsigned int
+ReadBigEndian32(const unsigned char *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static inline void
+WriteBigEndian16(unsigned char *p, unsigned int v)
+{
+	p[0] = ((v >> 8) & 0xff);
+	p[1] = (v & 0xff);
+}
+
+static inline void
+WriteBigEndian32(unsigned char *p, unsigned int v)
+{
+	p[0] = ((v >> 24) & 0xff);
+	p[1] = ((v >> 16) & 0xff);
+	p[2] = ((v >> 8) & 0xff);
+	p[3] = (v & 0xff);
+}
+
+#define J2K_MARKER_SOC	0xff4f
+#define J2K_MARKER_SIZ	0xff51
+#define J2K_MARKER_COD	0xff52
+#define J2K_MARKER_COC	0xff53
+#define J2K_MARKER_TLM	0xff55
+#define J2K_MARKER_PLT	0xff58
+#define J2K_MARKER_POC	0xff5f
+#define J2K_MARKER_PPM	0xff60
+#define J2K_MARKER_PPT	0xff61
+#define J2K_MARKER_SOT	0xff90
+#define J2K_MARKER_SOD	0xff93
+#define J2K_MARKER_EOC	0xffd9
+
+
 static OPJ_SIZE_T
 InputStreamRead(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
 {
@@ -111,164 +158,879 @@ InputStreamSeek(OPJ_OFF_T p_nb_bytes, void * p_user_data)
 	return file->Seek(p_nb_bytes);
 }
 
-static OPJ_SIZE_T
-OutputStreamRead(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
+// When the whole file is already in memory, we read straight out of it
+// rather than going through the virtual InputFile calls.
+typedef struct MemoryStream
 {
-	OutputFile *file = (OutputFile *)p_user_data;
+	const unsigned char *data;
+	size_t size;
+	size_t position;
 	
-	return file->Read(p_buffer, p_nb_bytes);
-}
+	MemoryStream(const unsigned char *d = NULL, size_t s = 0) : data(d), size(s), position(0) {}
+	
+} MemoryStream;
 
 static OPJ_SIZE_T
-OutputStreamWrite(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
+MemoryStreamRead(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
 {
-	OutputFile *file = (OutputFile *)p_user_data;
+	MemoryStream *stream = (MemoryStream *)p_user_data;
 	
-	return file->Write(p_buffer, p_nb_bytes);
+	if(stream->position >= stream->size)
+		return (OPJ_SIZE_T)-1; // end of stream
+	
+	const size_t count = std::min<size_t>(p_nb_bytes, stream->size - stream->position);
+	
+	memcpy(p_buffer, stream->data + stream->position, count);
+	
+	stream->position += count;
+	
+	return count;
 }
 
 static OPJ_OFF_T
-OutputStreamSkip(OPJ_OFF_T p_nb_bytes, void * p_user_data)
+MemoryStreamSkip(OPJ_OFF_T p_nb_bytes, void * p_user_data)
 {
-	OutputFile *file = (OutputFile *)p_user_data;
+	MemoryStream *stream = (MemoryStream *)p_user_data;
 	
-	const size_t currentPos = file->Tell();
+	const OPJ_OFF_T newPos = (OPJ_OFF_T)stream->position + p_nb_bytes;
 	
-	const size_t newPos = (currentPos + p_nb_bytes);
+	if(newPos < 0 || newPos > (OPJ_OFF_T)stream->size)
+		return -1;
 	
-	const bool success = file->Seek(newPos);
+	stream->position = (size_t)newPos;
 	
-	if(success)
-		return p_nb_bytes;
-	else
-		return -1;
+	return p_nb_bytes;
 }
 
 static OPJ_BOOL
-OutputStreamSeek(OPJ_OFF_T p_nb_bytes, void * p_user_data)
+MemoryStreamSeek(OPJ_OFF_T p_nb_bytes, void * p_user_data)
 {
-	OutputFile *file = (OutputFile *)p_user_data;
+	MemoryStream *stream = (MemoryStream *)p_user_data;
 	
-	return file->Seek(p_nb_bytes);
+	if(p_nb_bytes < 0 || p_nb_bytes > (OPJ_OFF_T)stream->size)
+		return OPJ_FALSE;
+	
+	stream->position = (size_t)p_nb_bytes;
+	
+	return OPJ_TRUE;
 }
 
+// OpenJPEG only runs reads through its chunk buffer when they're smaller than the
+// chunk, so with a small chunk the tile data gets copied once, straight from our
+// memory into the codec's tile buffer.
+#define J2K_MEMORY_STREAM_CHUNK_SIZE 8192
 
-static void
-ErrorHandler(const char *msg, void *client_data)
+static opj_stream_t *
+CreateInputStream(InputFile &file, MemoryStream &memoryStream)
 {
-	printf("openjpeg error: %s", msg);
+	const bool inMemory = ((file.Flags() & InputFile::J2K_READ_MEMORY) && file.Data() != NULL);
+	
+	opj_stream_t *stream = opj_stream_create((inMemory ? J2K_MEMORY_STREAM_CHUNK_SIZE : OPJ_J2K_STREAM_CHUNK_SIZE), OPJ_TRUE);
+	
+	if(stream)
+	{
+		if(inMemory)
+		{
+			memoryStream = MemoryStream(file.Data(), file.FileSize());
+			
+			opj_stream_set_user_data(stream, &memoryStream, NULL);
+			opj_stream_set_user_data_length(stream, memoryStream.size);
+			opj_stream_set_read_function(stream, MemoryStreamRead);
+			opj_stream_set_skip_function(stream, MemoryStreamSkip);
+			opj_stream_set_seek_function(stream, MemoryStreamSeek);
+		}
+		else
+		{
+			file.Seek(0);
+			
+			opj_stream_set_user_data(stream, &file, NULL);
+			opj_stream_set_user_data_length(stream, file.FileSize());
+			opj_stream_set_read_function(stream, InputStreamRead);
+			opj_stream_set_skip_function(stream, InputStreamSkip);
+			opj_stream_set_seek_function(stream, InputStreamSeek);
+		}
+	}
+	
+	return stream;
 }
 
+// A codestream with TLM (tile-part lengths) in the main header lets us
+// find every tile-part without reading through the ones before it.  So for a region
+// we build a stream out of just the tiles it touches.  If the tile-parts also have
+// PLT (packet lengths) and the packets go by resolution, a reduced read can stop
+// each tile after the resolutions it uses, or by layer for a draft read.
+typedef struct CodestreamPiece
+{
+	size_t start; // in the stream we give OpenJPEG
+	size_t length;
+	size_t offset; // in the file, when bytes is empty
+	std::vector<unsigned char> bytes; // headers we rewrote
+	
+	CodestreamPiece(size_t s, size_t l, size_t o) : start(s), length(l), offset(o) {}
+	
+} CodestreamPiece;
+
+typedef struct SparseStream
+{
+	InputFile *file;
+	std::vector<CodestreamPiece> pieces;
+	size_t size;
+	size_t position;
+	
+	SparseStream() : file(NULL), size(0), position(0) {}
+	
+} SparseStream;
+
 static void
-WarningHandler(const char *msg, void *client_data)
+AddFilePiece(SparseStream &stream, size_t offset, size_t length)
 {
-	printf("openjpeg warning: %s", msg);
+	if(length > 0)
+	{
+		stream.pieces.push_back(CodestreamPiece(stream.size, length, offset));
+		
+		stream.size += length;
+	}
 }
 
 static void
-InfoHandler(const char *msg, void *client_data)
+AddMemoryPiece(SparseStream &stream, const std::vector<unsigned char> &bytes)
 {
-	printf("openjpeg info: %s", msg);
+	if(bytes.size() > 0)
+	{
+		stream.pieces.push_back(CodestreamPiece(stream.size, bytes.size(), 0));
+		
+		stream.pieces.back().bytes = bytes;
+		
+		stream.size += bytes.size();
+	}
 }
 
-#ifdef __APPLE__
-#pragma mark-
-#endif
-
-
-static OPJ_CODEC_FORMAT
-GetFormat(InputFile &file)
+static size_t
+FindPiece(const SparseStream &stream, size_t position)
 {
-	// taken from obj_decompress.c
-#define JP2_RFC3745_MAGIC "\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a"
-#define JP2_MAGIC "\x0d\x0a\x87\x0a"
-/* position 45: "\xff\x52" */
-#define J2K_CODESTREAM_MAGIC "\xff\x4f\xff\x51"
+	// last piece starting at or before position
+	size_t low = 0;
+	size_t high = stream.pieces.size();
 	
-	unsigned char buf[12];
+	while(high - low > 1)
+	{
+		const size_t mid = ((low + high) / 2);
+		
+		if(stream.pieces[mid].start <= position)
+			low = mid;
+		else
+			high = mid;
+	}
 	
-	memset(buf, 0, 12);
+	return low;
+}
+
+static OPJ_SIZE_T
+SparseStreamRead(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
+{
+	SparseStream *stream = (SparseStream *)p_user_data;
 	
-	file.Seek(0);
+	if(stream->position >= stream->size)
+		return (OPJ_SIZE_T)-1; // end of stream
 	
-	const size_t read = file.Read(buf, 12);
+	unsigned char *out = (unsigned char *)p_buffer;
 	
-	if(read == 12)
+	size_t count = 0;
+	size_t p = FindPiece(*stream, stream->position);
+	
+	while(count < p_nb_bytes && p < stream->pieces.size())
 	{
-		if(memcmp(buf, JP2_RFC3745_MAGIC, 12) == 0 || memcmp(buf, JP2_MAGIC, 4) == 0)
-		{
-			return OPJ_CODEC_JP2;
-		}
-		else if(memcmp(buf, J2K_CODESTREAM_MAGIC, 4) == 0)
+		const CodestreamPiece &piece = stream->pieces[p++];
+		
+		const size_t pieceOffset = (stream->position - piece.start);
+		const size_t n = std::min<size_t>(p_nb_bytes - count, piece.length - pieceOffset);
+		
+		if(piece.bytes.empty())
 		{
-			return OPJ_CODEC_J2K;
+			if(!stream->file->Seek(piece.offset + pieceOffset) || stream->file->Read(out + count, n) != n)
+				break;
 		}
+		else
+			memcpy(out + count, &piece.bytes[pieceOffset], n);
+		
+		count += n;
+		stream->position += n;
 	}
 	
-	return OPJ_CODEC_UNKNOWN;
+	return (count > 0 ? count : (OPJ_SIZE_T)-1);
 }
 
+static OPJ_OFF_T
+SparseStreamSkip(OPJ_OFF_T p_nb_bytes, void * p_user_data)
+{
+	SparseStream *stream = (SparseStream *)p_user_data;
+	
+	const OPJ_OFF_T newPos = (OPJ_OFF_T)stream->position + p_nb_bytes;
+	
+	if(newPos < 0 || newPos > (OPJ_OFF_T)stream->size)
+		return -1;
+	
+	stream->position = (size_t)newPos;
+	
+	return p_nb_bytes;
+}
 
-bool
-OpenJPEGCodec::Verify(InputFile &file)
+static OPJ_BOOL
+SparseStreamSeek(OPJ_OFF_T p_nb_bytes, void * p_user_data)
 {
-	const OPJ_CODEC_FORMAT format = GetFormat(file);
+	SparseStream *stream = (SparseStream *)p_user_data;
 	
-	return (format != OPJ_CODEC_UNKNOWN);
+	if(p_nb_bytes < 0 || p_nb_bytes > (OPJ_OFF_T)stream->size)
+		return OPJ_FALSE;
+	
+	stream->position = (size_t)p_nb_bytes;
+	
+	return OPJ_TRUE;
 }
 
 
-void
-OpenJPEGCodec::GetFileInfo(InputFile &file, FileInfo &info)
+typedef struct TilePartIndex
 {
-	const OPJ_CODEC_FORMAT format = GetFormat(file);
+	unsigned int tile;
+	size_t offset;
+	size_t length;
 	
-	if(format == OPJ_CODEC_UNKNOWN)
-		throw Exception("Can't read this format");
+	TilePartIndex(unsigned int t, size_t l) : tile(t), offset(0), length(l) {}
+	
+} TilePartIndex;
+
+// What we need out of the main header to find and count packets
+typedef struct CodestreamIndex
+{
+	std::vector<unsigned char> header; // without TLM
+	
+	OPJ_UINT32 x0, y0, x1, y1; // image area on the reference grid
+	OPJ_UINT32 tx0, ty0, tdx, tdy; // tile grid
+	OPJ_UINT32 tilesX, tilesY;
+	std::vector<OPJ_UINT32> dx, dy; // component subsampling
+	
+	unsigned int order;
+	unsigned int layers;
+	unsigned int levels;
+	std::vector<unsigned char> precincts; // PPx | (PPy << 4) for each resolution
+	
+	bool countable; // no COC, POC or PPM, so COD alone lays out the packets
+	
+	std::vector<TilePartIndex> tileParts;
+	
+	CodestreamIndex() : x0(0), y0(0), x1(0), y1(0), tx0(0), ty0(0), tdx(0), tdy(0), tilesX(0), tilesY(0),
+						order(0), layers(0), levels(0), countable(true) {}
+	
+} CodestreamIndex;
+
+static inline OPJ_UINT64
+CeilDivU64(OPJ_UINT64 a, OPJ_UINT64 b)
+{
+	return ((a + b - 1) / b);
+}
+
+static bool
+ReadSIZ(const std::vector<unsigned char> &segment, CodestreamIndex &index)
+{
+	// marker, Lsiz, Rsiz, Xsiz, Ysiz, XOsiz, YOsiz, XTsiz, YTsiz, XTOsiz, YTOsiz, Csiz,
+	// then Ssiz, XRsiz, YRsiz for each component
+	if(segment.size() < 40)
+		return false;
+	
+	const unsigned char *p = &segment[0];
+	
+	index.x1 = ReadBigEndian32(p + 6);
+	index.y1 = ReadBigEndian32(p + 10);
+	index.x0 = ReadBigEndian32(p + 14);
+	index.y0 = ReadBigEndian32(p + 18);
+	index.tdx = ReadBigEndian32(p + 22);
+	index.tdy = ReadBigEndian32(p + 26);
+	index.tx0 = ReadBigEndian32(p + 30);
+	index.ty0 = ReadBigEndian32(p + 34);
+	
+	const unsigned int components = ReadBigEndian16(p + 38);
+	
+	if(segment.size() < 40 + (3 * components) || components == 0 ||
+		index.tdx == 0 || index.tdy == 0 || index.x1 <= index.x0 || index.y1 <= index.y0 ||
+		index.tx0 > index.x0 || index.ty0 > index.y0)
+	{
+		return false;
+	}
+	
+	index.tilesX = static_cast<OPJ_UINT32>(CeilDivU64(index.x1 - index.tx0, index.tdx));
+	index.tilesY = static_cast<OPJ_UINT32>(CeilDivU64(index.y1 - index.ty0, index.tdy));
+	
+	for(unsigned int c=0; c < components; c++)
+	{
+		const OPJ_UINT32 dx = p[41 + (3 * c)];
+		const OPJ_UINT32 dy = p[42 + (3 * c)];
 		
-	file.Seek(0);
+		if(dx == 0 || dy == 0)
+			return false;
+		
+		index.dx.push_back(dx);
+		index.dy.push_back(dy);
+	}
 	
+	return true;
+}
+
+static bool
+ReadCOD(const std::vector<unsigned char> &segment, CodestreamIndex &index)
+{
+	// marker, Lcod, Scod, progression, layers, MCT, levels, code-block size and style,
+	// transform, then the precinct sizes if Scod says so
+	if(segment.size() < 14)
+		return false;
 	
-	bool success = true;
+	const unsigned char *p = &segment[0];
+	
+	index.order = p[5];
+	index.layers = ReadBigEndian16(p + 6);
+	index.levels = p[9];
+	
+	const bool precincts = (p[4] & 0x01);
+	
+	if(precincts && segment.size() < 14 + index.levels + 1)
+		return false;
+	
+	index.precincts.resize(index.levels + 1);
 	
+	for(unsigned int r=0; r <= index.levels; r++)
+		index.precincts[r] = (precincts ? p[14 + r] : 0xff);
+	
+	return (index.layers > 0);
+}
 
-	opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE);
+static bool
+ReadTLM(const std::vector<unsigned char> &segment, CodestreamIndex &index)
+{
+	// marker, Ltlm, Ztlm, Stlm, then Ttlm and Ptlm for each tile-part.
+	// Ttlm is 0, 1 or 2 bytes (0 means the tile-parts go one per tile in order),
+	// Ptlm 2 or 4.
+	if(segment.size() < 6)
+		return false;
 	
-	if(stream)
+	const unsigned int st = ((segment[5] >> 4) & 0x03);
+	const unsigned int sp = ((segment[5] >> 6) & 0x01);
+	
+	const size_t entrySize = (st + (sp ? 4 : 2));
+	
+	if(st == 3 || (segment.size() - 6) % entrySize != 0)
+		return false;
+	
+	for(size_t pos = 6; pos < segment.size(); pos += entrySize)
 	{
-		opj_stream_set_user_data(stream, &file, NULL);
-		opj_stream_set_user_data_length(stream, file.FileSize());
-		opj_stream_set_read_function(stream, InputStreamRead);
-		opj_stream_set_skip_function(stream, InputStreamSkip);
-		opj_stream_set_seek_function(stream, InputStreamSeek);
+		const unsigned char *p = &segment[pos];
 		
+		const unsigned int tile = (st == 0 ? static_cast<unsigned int>(index.tileParts.size()) :
+									st == 1 ? p[0] :
+									ReadBigEndian16(p));
 		
-		opj_codec_t *codec = opj_create_decompress(format);
+		const size_t length = (sp ? ReadBigEndian32(p + st) : ReadBigEndian16(p + st));
 		
-		if(codec)
+		index.tileParts.push_back(TilePartIndex(tile, length));
+	}
+	
+	return true;
+}
+
+static bool
+ReadMainHeader(InputFile &file, CodestreamIndex &index)
+{
+	unsigned char soc[2];
+	
+	if(!file.Seek(0) || file.Read(soc, 2) != 2 || ReadBigEndian16(soc) != J2K_MARKER_SOC)
+		return false;
+	
+	index.header.assign(soc, soc + 2);
+	
+	size_t pos = 2;
+	
+	bool haveSIZ = false;
+	bool haveCOD = false;
+	
+	while(true)
+	{
+		unsigned char marker[4];
+		
+		if(file.Read(marker, 4) != 4)
+			return false;
+		
+		const unsigned int code = ReadBigEndian16(marker);
+		
+		if(code == J2K_MARKER_SOT)
+			break;
+		
+		const unsigned int length = ReadBigEndian16(marker + 2);
+		
+		if(length < 2)
+			return false;
+		
+		std::vector<unsigned char> segment(2 + length);
+		
+		memcpy(&segment[0], marker, 4);
+		
+		if(length > 2 && file.Read(&segment[4], length - 2) != (length - 2))
+			return false;
+		
+		pos += segment.size();
+		
+		if(code == J2K_MARKER_SIZ)
+			haveSIZ = ReadSIZ(segment, index);
+		else if(code == J2K_MARKER_COD)
+			haveCOD = ReadCOD(segment, index);
+		else if(code == J2K_MARKER_COC || code == J2K_MARKER_POC || code == J2K_MARKER_PPM)
+			index.countable = false;
+		
+		// OpenJPEG would use TLM to find tiles, and we're about to move them
+		if(code == J2K_MARKER_TLM)
 		{
-			opj_set_error_handler(codec, ErrorHandler, NULL);
-			opj_set_warning_handler(codec, WarningHandler, NULL);
-			opj_set_info_handler(codec, InfoHandler, NULL);
-			
-			
-		#define AARONs_OPENJPEG_PATCH 1
-			
-			opj_image_t *image = NULL;
-			
-		#ifdef AARONs_OPENJPEG_PATCH
-			opj_header_info_t header_info;
-			
-			memset(&header_info, 0, sizeof(header_info));
+			if( !ReadTLM(segment, index) )
+				return false;
+		}
+		else
+			index.header.insert(index.header.end(), segment.begin(), segment.end());
+	}
+	
+	if(!haveSIZ || !haveCOD || index.tileParts.empty())
+		return false;
+	
+	// the tile-parts follow one another from the first SOT
+	const size_t tiles = (index.tilesX * index.tilesY);
+	
+	for(size_t i=0; i < index.tileParts.size(); i++)
+	{
+		TilePartIndex &part = index.tileParts[i];
+		
+		if(part.tile >= tiles || part.length < 14) // SOT + SOD
+			return false;
+		
+		part.offset = pos;
+		
+		pos += part.length;
+	}
+	
+	return (pos <= file.FileSize());
+}
+
+static bool
+ReadTilePartHeader(InputFile &file, const TilePartIndex &part,
+					std::vector<unsigned char> &header, std::vector<size_t> &packets, size_t &dataOffset)
+{
+	// Copies the tile-part header minus PLT, and the packet lengths from the PLTs.
+	// Anything else that changes where the packets go and we leave the tile alone.
+	header.resize(12);
+	
+	// SOT: marker, Lsot, Isot, Psot, TPsot, TNsot
+	if(!file.Seek(part.offset) || file.Read(&header[0], 12) != 12 ||
+		ReadBigEndian16(&header[0]) != J2K_MARKER_SOT ||
+		ReadBigEndian16(&header[4]) != part.tile ||
+		header[10] != 0)
+	{
+		return false;
+	}
+	
+	size_t pos = 12;
+	size_t length = 0; // Iplt is 7 bits a byte, high bit set until the last one
+	
+	while(pos + 2 <= part.length)
+	{
+		unsigned char marker[4];
+		
+		if(file.Read(marker, 2) != 2)
+			return false;
+		
+		const unsigned int code = ReadBigEndian16(marker);
+		
+		if(code == J2K_MARKER_SOD)
+		{
+			header.insert(header.end(), marker, marker + 2);
 			
-			const OPJ_BOOL headerRead = opj_read_header_ex(stream, codec, &header_info, &image);
-		#else
-			const OPJ_BOOL headerRead = opj_read_header(stream, codec, &image);
-		#endif
+			dataOffset = (part.offset + pos + 2);
 			
-			if(headerRead && image != NULL)
+			return (packets.size() > 0);
+		}
+		
+		if(code == J2K_MARKER_COD || code == J2K_MARKER_COC || code == J2K_MARKER_POC || code == J2K_MARKER_PPT)
+			return false;
+		
+		if(file.Read(marker + 2, 2) != 2)
+			return false;
+		
+		const unsigned int segmentLength = ReadBigEndian16(marker + 2);
+		
+		if(segmentLength < 2 || pos + 2 + segmentLength > part.length)
+			return false;
+		
+		std::vector<unsigned char> segment(2 + segmentLength);
+		
+		memcpy(&segment[0], marker, 4);
+		
+		if(segmentLength > 2 && file.Read(&segment[4], segmentLength - 2) != (segmentLength - 2))
+			return false;
+		
+		pos += segment.size();
+		
+		if(code == J2K_MARKER_PLT)
+		{
+			// marker, Lplt, Zplt, Iplt...
+			for(size_t i=5; i < segment.size(); i++)
 			{
-				info.format = (format == OPJ_CODEC_JP2 ? JP2 : J2C);
+				length = ((length << 7) | (segment[i] & 0x7f));
+				
+				if( !(segment[i] & 0x80) )
+				{
+					packets.push_back(length);
+					
+					length = 0;
+				}
+			}
+		}
+		else
+			header.insert(header.end(), segment.begin(), segment.end());
+	}
+	
+	return false;
+}
+
+static void
+TileBounds(const CodestreamIndex &index, unsigned int tile,
+			OPJ_UINT32 &x0, OPJ_UINT32 &y0, OPJ_UINT32 &x1, OPJ_UINT32 &y1)
+{
+	const OPJ_UINT64 p = (tile % index.tilesX);
+	const OPJ_UINT64 q = (tile / index.tilesX);
+	
+	x0 = static_cast<OPJ_UINT32>(std::max<OPJ_UINT64>(index.tx0 + (p * index.tdx), index.x0));
+	y0 = static_cast<OPJ_UINT32>(std::max<OPJ_UINT64>(index.ty0 + (q * index.tdy), index.y0));
+	x1 = static_cast<OPJ_UINT32>(std::min<OPJ_UINT64>(index.tx0 + ((p + 1) * index.tdx), index.x1));
+	y1 = static_cast<OPJ_UINT32>(std::min<OPJ_UINT64>(index.ty0 + ((q + 1) * index.tdy), index.y1));
+}
+
+static size_t
+PacketsPerLayer(const CodestreamIndex &index, unsigned int tile, unsigned int resolutions)
+{
+	// one packet per precinct, for every component in the first resolutions
+	OPJ_UINT32 x0, y0, x1, y1;
+	
+	TileBounds(index, tile, x0, y0, x1, y1);
+	
+	size_t packets = 0;
+	
+	for(size_t c=0; c < index.dx.size(); c++)
+	{
+		const OPJ_UINT64 cx0 = CeilDivU64(x0, index.dx[c]);
+		const OPJ_UINT64 cy0 = CeilDivU64(y0, index.dy[c]);
+		const OPJ_UINT64 cx1 = CeilDivU64(x1, index.dx[c]);
+		const OPJ_UINT64 cy1 = CeilDivU64(y1, index.dy[c]);
+		
+		for(unsigned int r=0; r < resolutions; r++)
+		{
+			const OPJ_UINT64 scale = ((OPJ_UINT64)1 << (index.levels - r));
+			
+			const OPJ_UINT64 rx0 = CeilDivU64(cx0, scale);
+			const OPJ_UINT64 ry0 = CeilDivU64(cy0, scale);
+			const OPJ_UINT64 rx1 = CeilDivU64(cx1, scale);
+			const OPJ_UINT64 ry1 = CeilDivU64(cy1, scale);
+			
+			if(rx1 > rx0 && ry1 > ry0)
+			{
+				const unsigned int ppx = (index.precincts[r] & 0x0f);
+				const unsigned int ppy = (index.precincts[r] >> 4);
+				
+				const OPJ_UINT64 across = (CeilDivU64(rx1, (OPJ_UINT64)1 << ppx) - (rx0 >> ppx));
+				const OPJ_UINT64 down = (CeilDivU64(ry1, (OPJ_UINT64)1 << ppy) - (ry0 >> ppy));
+				
+				packets += static_cast<size_t>(across * down);
+			}
+		}
+	}
+	
+	return packets;
+}
+
+static bool
+BuildSparseStream(InputFile &file, const Rect *region, unsigned int reduce, unsigned int layers, SparseStream &stream)
+{
+	CodestreamIndex index;
+	
+	if( !ReadMainHeader(file, index) )
+		return false;
+	
+	// RLCP and RPCL put the low resolutions first, LRCP the first layers
+	const bool byResolution = (index.countable && reduce > 0 && reduce <= index.levels &&
+								(index.order == OPJ_RLCP || index.order == OPJ_RPCL));
+	
+	const bool byLayer = (index.countable && layers > 0 && layers < index.layers && index.order == OPJ_LRCP);
+	
+	// we only cut short tiles that come in one part
+	std::vector<unsigned int> partsPerTile(index.tilesX * index.tilesY, 0);
+	
+	for(size_t i=0; i < index.tileParts.size(); i++)
+		partsPerTile[index.tileParts[i].tile]++;
+	
+	stream.file = &file;
+	
+	AddMemoryPiece(stream, index.header);
+	
+	bool saved = false;
+	
+	for(size_t i=0; i < index.tileParts.size(); i++)
+	{
+		const TilePartIndex &part = index.tileParts[i];
+		
+		if(region != NULL)
+		{
+			OPJ_UINT32 x0, y0, x1, y1;
+			
+			TileBounds(index, part.tile, x0, y0, x1, y1);
+			
+			const OPJ_UINT64 rx0 = (OPJ_UINT64)index.x0 + region->x;
+			const OPJ_UINT64 ry0 = (OPJ_UINT64)index.y0 + region->y;
+			
+			if(x1 <= rx0 || y1 <= ry0 || x0 >= rx0 + region->width || y0 >= ry0 + region->height)
+			{
+				saved = true;
+				
+				continue;
+			}
+		}
+		
+		if((byResolution || byLayer) && partsPerTile[part.tile] == 1)
+		{
+			std::vector<unsigned char> header;
+			std::vector<size_t> packets;
+			size_t dataOffset = 0;
+			
+			if( ReadTilePartHeader(file, part, header, packets, dataOffset) )
+			{
+				const size_t allPackets = (PacketsPerLayer(index, part.tile, index.levels + 1) * index.layers);
+				
+				const size_t needed = (byResolution ?
+										PacketsPerLayer(index, part.tile, index.levels + 1 - reduce) * index.layers :
+										PacketsPerLayer(index, part.tile, index.levels + 1) * layers);
+				
+				// if the PLTs don't add up to what we counted, we don't understand this tile
+				if(packets.size() == allPackets && needed <= allPackets)
+				{
+					size_t dataLength = 0;
+					
+					for(size_t p=0; p < needed; p++)
+						dataLength += packets[p];
+					
+					if(dataOffset + dataLength <= part.offset + part.length)
+					{
+						WriteBigEndian32(&header[6], static_cast<unsigned int>(header.size() + dataLength));
+						
+						AddMemoryPiece(stream, header);
+						AddFilePiece(stream, dataOffset, dataLength);
+						
+						saved = true;
+						
+						continue;
+					}
+				}
+			}
+		}
+		
+		AddFilePiece(stream, part.offset, part.length);
+	}
+	
+	std::vector<unsigned char> eoc(2);
+	
+	WriteBigEndian16(&eoc[0], J2K_MARKER_EOC);
+	
+	AddMemoryPiece(stream, eoc);
+	
+	// no point if we'd read the whole thing anyway
+	return saved;
+}
+
+static opj_stream_t *
+CreateSparseInputStream(SparseStream &sparseStream)
+{
+	opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE);
+	
+	if(stream)
+	{
+		opj_stream_set_user_data(stream, &sparseStream, NULL);
+		opj_stream_set_user_data_length(stream, sparseStream.size);
+		opj_stream_set_read_function(stream, SparseStreamRead);
+		opj_stream_set_skip_function(stream, SparseStreamSkip);
+		opj_stream_set_seek_function(stream, SparseStreamSeek);
+	}
+	
+	return stream;
+}
+
+
+static OPJ_SIZE_T
+OutputStreamRead(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
+{
+	OutputFile *file = (OutputFile *)p_user_data;
+	
+	return file->Read(p_buffer, p_nb_bytes);
+}
+
+static OPJ_SIZE_T
+OutputStreamWrite(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
+{
+	OutputFile *file = (OutputFile *)p_user_data;
+	
+	return file->Write(p_buffer, p_nb_bytes);
+}
+
+static OPJ_OFF_T
+OutputStreamSkip(OPJ_OFF_T p_nb_bytes, void * p_user_data)
+{
+	OutputFile *file = (OutputFile *)p_user_data;
+	
+	const size_t currentPos = file->Tell();
+	
+	const size_t newPos = (currentPos + p_nb_bytes);
+	
+	const bool success = file->Seek(newPos);
+	
+	if(success)
+		return p_nb_bytes;
+	else
+		return -1;
+}
+
+static OPJ_BOOL
+OutputStreamSeek(OPJ_OFF_T p_nb_bytes, void * p_user_data)
+{
+	OutputFile *file = (OutputFile *)p_user_data;
+	
+	return file->Seek(p_nb_bytes);
+}
+
+
+static void
+ErrorHandler(const char *msg, void *client_data)
+{
+	printf("openjpeg error: %s", msg);
+}
+
+static void
+WarningHandler(const char *msg, void *client_data)
+{
+	printf("openjpeg warning: %s", msg);
+}
+
+static void
+InfoHandler(const char *msg, void *client_data)
+{
+	printf("openjpeg info: %s", msg);
+}
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+
+static OPJ_CODEC_FORMAT
+GetFormat(InputFile &file)
+{
+	// taken from obj_decompress.c
+#define JP2_RFC3745_MAGIC "\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a"
+#define JP2_MAGIC "\x0d\x0a\x87\x0a"
+/* position 45: "\xff\x52" */
+#define J2K_CODESTREAM_MAGIC "\xff\x4f\xff\x51"
+	
+	unsigned char buf[12];
+	
+	memset(buf, 0, 12);
+	
+	file.Seek(0);
+	
+	const size_t read = file.Read(buf, 12);
+	
+	if(read == 12)
+	{
+		if(memcmp(buf, JP2_RFC3745_MAGIC, 12) == 0 || memcmp(buf, JP2_MAGIC, 4) == 0)
+		{
+			return OPJ_CODEC_JP2;
+		}
+		else if(memcmp(buf, J2K_CODESTREAM_MAGIC, 4) == 0)
+		{
+			return OPJ_CODEC_J2K;
+		}
+	}
+	
+	return OPJ_CODEC_UNKNOWN;
+}
+
+
+bool
+OpenJPEGCodec::Verify(InputFile &file)
+{
+	const OPJ_CODEC_FORMAT format = GetFormat(file);
+	
+	return (format != OPJ_CODEC_UNKNOWN);
+}
+
+
+static Order
+FileOrder(OPJ_PROG_ORDER order)
+{
+	switch(order)
+	{
+		case OPJ_LRCP:	return LRCP;
+		case OPJ_RLCP:	return RLCP;
+		case OPJ_RPCL:	return RPCL;
+		case OPJ_PCRL:	return PCRL;
+		case OPJ_CPRL:	return CPRL;
+		default:		break;
+	}
+	
+	return RPCL;
+}
+
+
+void
+OpenJPEGCodec::GetFileInfo(InputFile &file, FileInfo &info)
+{
+	const OPJ_CODEC_FORMAT format = GetFormat(file);
+	
+	if(format == OPJ_CODEC_UNKNOWN)
+		throw Exception("Can't read this format");
+		
+	bool success = true;
+	
+	
+	MemoryStream memoryStream;
+
+	opj_stream_t *stream = CreateInputStream(file, memoryStream);
+	
+	if(stream)
+	{
+		opj_codec_t *codec = opj_create_decompress(format);
+		
+		if(codec)
+		{
+			opj_set_error_handler(codec, ErrorHandler, NULL);
+			opj_set_warning_handler(codec, WarningHandler, NULL);
+			opj_set_info_handler(codec, InfoHandler, NULL);
+			
+			
+		#define AARONs_OPENJPEG_PATCH 1
+			
+			opj_image_t *image = NULL;
+			
+		#ifdef AARONs_OPENJPEG_PATCH
+			opj_header_info_t header_info;
+			
+			memset(&header_info, 0, sizeof(header_info));
+			
+			const OPJ_BOOL headerRead = opj_read_header_ex(stream, codec, &header_info, &image);
+		#else
+			const OPJ_BOOL headerRead = opj_read_header(stream, codec, &image);
+		#endif
+			
+			if(headerRead && image != NULL)
+			{
+				info.format = (format == OPJ_CODEC_JP2 ? JP2 : J2C);
 			
 				info.width = (image->x1 - image->x0);
 				info.height = (image->y1 - image->y0);
@@ -296,6 +1058,36 @@ OpenJPEGCodec::GetFileInfo(InputFile &file, FileInfo &info)
 					sub.y = comp.dy;
 				}
 				
+				// tiling, so the CodecSelector can tell files apart
+				opj_codestream_info_v2_t *cstrInfo = opj_get_cstr_info(codec);
+				
+				if(cstrInfo != NULL)
+				{
+					info.settings.tileSize = ((cstrInfo->tw * cstrInfo->th) > 1 ?
+												static_cast<unsigned short>(std::min<OPJ_UINT32>(cstrInfo->tdx, 0xffff)) :
+												0);
+					
+					info.settings.layers = static_cast<unsigned char>(std::min<OPJ_UINT32>(cstrInfo->m_default_tile_info.numlayers, 0xff));
+					info.settings.order = FileOrder(cstrInfo->m_default_tile_info.prg);
+					
+					const opj_tccp_info_t *tccp = cstrInfo->m_default_tile_info.tccp_info;
+					
+					if(tccp != NULL)
+					{
+						info.resolutions = static_cast<unsigned char>(std::min<OPJ_UINT32>(tccp->numresolutions, 0xff));
+						
+						// cblkw and friends are exponents
+						info.settings.codeBlockWidth = static_cast<unsigned short>(1 << tccp->cblkw);
+						info.settings.codeBlockHeight = static_cast<unsigned short>(1 << tccp->cblkh);
+						info.settings.blockModes = static_cast<unsigned char>(tccp->cblksty & 0x3f);
+						info.settings.precinctSize = ((tccp->csty & 0x01) && tccp->numresolutions > 0 ?
+														static_cast<unsigned short>(1 << tccp->prcw[tccp->numresolutions - 1]) :
+														0);
+					}
+					
+					opj_destroy_cstr_info(&cstrInfo);
+				}
+				
 				assert(image->color_space == OPJ_CLRSPC_UNSPECIFIED); // only read by opj_decode()
 			
 				assert(image->icc_profile_buf == NULL);
@@ -448,172 +1240,401 @@ static int log2(int input)
 #endif
 
 
-void
-OpenJPEGCodec::ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample, Progress *progress)
+#define PROG(COUNT, TOTAL) (progress == NULL ? true : \
+								!progress->keepGoing ? false : \
+								progress->progressProc != NULL ? \
+									(progress->keepGoing = progress->progressProc(progress->refCon, COUNT, TOTAL)) : \
+									progress->abortProc != NULL ? \
+										(progress->keepGoing = progress->abortProc(progress->refCon)) : \
+										true)
+
+#define NOABORT() (progress == NULL ? true : \
+					!progress->keepGoing ? false : \
+					progress->abortProc == NULL ? true : \
+						(progress->keepGoing = progress->abortProc(progress->refCon)))
+
+
+static inline OPJ_INT32
+CeilDiv(OPJ_INT32 a, OPJ_INT32 b)
 {
-	const OPJ_CODEC_FORMAT format = GetFormat(file);
+	return ((a + b - 1) / b);
+}
+
+static inline OPJ_INT32
+CeilDivPow2(OPJ_INT32 a, OPJ_UINT32 b)
+{
+	return ((a + (1 << b) - 1) >> b);
+}
+
+
+static bool
+CanDecodeTiles(const opj_image_t *image)
+{
+	// opj_decode_tile_data() hands back 8 and 16-bit samples in chars and shorts,
+	// and we have no signed versions of those
+	for(OPJ_UINT32 i=0U; i < image->numcomps; i++)
+	{
+		const opj_image_comp_t &comp = image->comps[i];
+		
+		if(comp.sgnd && comp.prec <= 16)
+			return false;
+	}
 	
-	if(format == OPJ_CODEC_UNKNOWN)
-		throw Exception("Can't read this format");
+	return true;
+}
+
+
+typedef struct DecoderKey
+{
+	OPJ_CODEC_FORMAT format;
+	OPJ_UINT32 width;
+	OPJ_UINT32 height;
+	OPJ_UINT32 channels;
+	OPJ_UINT32 depth;
+	OPJ_UINT32 reduce;
+	
+	DecoderKey(OPJ_CODEC_FORMAT f = OPJ_CODEC_UNKNOWN, const opj_image_t *image = NULL, OPJ_UINT32 r = 0) :
+		format(f),
+		width(image ? (image->x1 - image->x0) : 0),
+		height(image ? (image->y1 - image->y0) : 0),
+		channels(image ? image->numcomps : 0),
+		depth((image && image->numcomps > 0) ? image->comps[0].prec : 0),
+		reduce(r)
+	{
+	}
+	
+	bool operator == (const DecoderKey &other) const
+	{
+		return (format == other.format && width == other.width && height == other.height &&
+				channels == other.channels && depth == other.depth && reduce == other.reduce);
+	}
+	
+} DecoderKey;
+
+
+// What we keep between frames.  OpenJPEG's codec and stream objects can't be
+// pointed at a new codestream, and the codec owns its thread pool with no
+// way to hand it another one, so those still get made for every frame.
+// Our own buffers stay allocated, and single-threaded sessions (the ones
+// DecodeBatch runs side by side) don't start a pool at all.
+class DecoderContext
+{
+  public:
+	DecoderContext(const DecoderKey &key = DecoderKey()) : _key(key), _tileBuf(NULL), _tileBufSize(0) {}
+	~DecoderContext() { if(_tileBuf != NULL) free(_tileBuf); }
+	
+	const DecoderKey & Key() const { return _key; }
+	void SetKey(const DecoderKey &key) { _key = key; }
+	
+	OPJ_BYTE * TileBuffer(OPJ_UINT32 size)
+	{
+		if(size > _tileBufSize)
+		{
+			OPJ_BYTE *newBuf = (OPJ_BYTE *)realloc(_tileBuf, size);
+			
+			if(newBuf == NULL)
+				return NULL;
+			
+			_tileBuf = newBuf;
+			_tileBufSize = size;
+		}
 		
-	file.Seek(0);
+		return _tileBuf;
+	}
 	
+  private:
+	DecoderContext(const DecoderContext &);
+	DecoderContext & operator=(const DecoderContext &);
+	
+	DecoderKey _key;
+	
+	OPJ_BYTE *_tileBuf;
+	OPJ_UINT32 _tileBufSize;
+};
 
+
+static bool
+DecodeTiles(opj_codec_t *codec, opj_stream_t *stream, const opj_image_t *image,
+			OPJ_UINT32 reduce, const Buffer &buffer, DecoderContext &context, Progress *progress)
+{
+	// Decode one tile at a time, copying each into the destination as we go,
+	// so we only ever hold one tile's worth of samples.
 	bool success = true;
 	
-
-	opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE);
+	const uint8_t channels = std::min<uint8_t>(static_cast<uint8_t>(image->numcomps), J2K_CODEC_MAX_CHANNELS);
 	
-	if(stream)
+	size_t totalTiles = 1;
+	
+	opj_codestream_info_v2_t *cstrInfo = opj_get_cstr_info(codec);
+	
+	if(cstrInfo)
 	{
-		opj_stream_set_user_data(stream, &file, NULL);
-		opj_stream_set_user_data_length(stream, file.FileSize());
-		opj_stream_set_read_function(stream, InputStreamRead);
-		opj_stream_set_skip_function(stream, InputStreamSkip);
-		opj_stream_set_seek_function(stream, InputStreamSeek);
+		totalTiles = (cstrInfo->tw * cstrInfo->th);
 		
+		opj_destroy_cstr_info(&cstrInfo);
+	}
+	
+	size_t tilesDone = 0;
+	
+	OPJ_BOOL keepReading = OPJ_TRUE;
+	
+	while(success && keepReading && NOABORT())
+	{
+		OPJ_UINT32 tileIndex = 0, dataSize = 0, numComps = 0;
+		OPJ_INT32 tx0 = 0, ty0 = 0, tx1 = 0, ty1 = 0;
 		
-		opj_codec_t *codec = opj_create_decompress(format);
+		if( !opj_read_tile_header(codec, stream, &tileIndex, &dataSize,
+									&tx0, &ty0, &tx1, &ty1, &numComps, &keepReading) )
+		{
+			success = false;
+			break;
+		}
 		
-		if(codec)
+		if(!keepReading)
+			break;
+		
+		OPJ_BYTE *tileBuf = context.TileBuffer(dataSize);
+		
+		if(tileBuf == NULL)
 		{
-			opj_set_error_handler(codec, ErrorHandler, NULL);
-			opj_set_warning_handler(codec, WarningHandler, NULL);
-			opj_set_info_handler(codec, InfoHandler, NULL);
+			success = false;
+			break;
+		}
+		
+		if( !opj_decode_tile_data(codec, tileIndex, tileBuf, dataSize, stream) )
+		{
+			success = false;
+			break;
+		}
+		
+		
+		Buffer tileBuffer;
+		Buffer destBuffer;
+		
+		tileBuffer.channels = destBuffer.channels = std::min<uint8_t>(channels, buffer.channels);
+		
+		OPJ_BYTE *compData = tileBuf;
+		
+		for(OPJ_UINT32 i=0U; i < channels; i++)
+		{
+			const opj_image_comp_t &comp = image->comps[i];
 			
-			opj_codec_set_threads(codec, NumberOfCPUs());
+			const OPJ_INT32 dx = comp.dx;
+			const OPJ_INT32 dy = comp.dy;
 			
+			// tile-component bounds at the decoded resolution
+			const OPJ_INT32 rx0 = CeilDivPow2(CeilDiv(tx0, dx), reduce);
+			const OPJ_INT32 ry0 = CeilDivPow2(CeilDiv(ty0, dy), reduce);
+			const OPJ_INT32 rx1 = CeilDivPow2(CeilDiv(tx1, dx), reduce);
+			const OPJ_INT32 ry1 = CeilDivPow2(CeilDiv(ty1, dy), reduce);
 			
-			opj_image_t *image = NULL;
+			// where the component starts
+			const OPJ_INT32 cx0 = CeilDivPow2(CeilDiv(image->x0, dx), reduce);
+			const OPJ_INT32 cy0 = CeilDivPow2(CeilDiv(image->y0, dy), reduce);
 			
-			OPJ_BOOL imageRead = opj_read_header(stream, codec, &image);
+			const size_t sampleSize = (comp.prec <= 8 ? sizeof(unsigned char) :
+										comp.prec <= 16 ? sizeof(unsigned short) :
+										sizeof(int));
 			
-			if(imageRead && image != NULL)
+			const int tileWidth = (rx1 - rx0);
+			const int tileHeight = (ry1 - ry0);
+			
+			if(i < tileBuffer.channels)
 			{
-				opj_dparameters_t params;
-				opj_set_default_decoder_parameters(&params);
+				const Channel &dest = buffer.channel[i];
 				
-				// When you cp_reduce, the buffer doesn't change size, but the image is shrunk
-				// into the upper left hand corner.  This means the OpenJPEG buffer doesn't match the
-				// buffer we provide, but it works out because CopyBuffer is based on the destination
-				// size.
+				Channel &src = tileBuffer.channel[i];
+				Channel &dst = destBuffer.channel[i];
 				
-				params.cp_reduce = log2(subsample);
+				src.width = tileWidth;
+				src.height = tileHeight;
 				
-				params.flags |= OPJ_DPARAMETERS_IGNORE_PALETTE_FLAG; // don't apply LUT if you happen to have one
+				src.subsampling.x = dx;
+				src.subsampling.y = dy;
 				
-				const OPJ_BOOL configured = opj_setup_decoder(codec, &params);
+				src.sampleType = (comp.prec <= 8 ? UCHAR :
+									comp.prec <= 16 ? USHORT :
+									INT);
+				src.depth = static_cast<uint8_t>(comp.prec);
+				src.sgnd = comp.sgnd ? true : false;
 				
-				assert(configured);
-			
+				src.buf = compData;
+				src.colbytes = sampleSize;
+				src.rowbytes = (sampleSize * tileWidth);
 				
-				// TODO: read one tile at a time and let the user interrupt
+				// destination might be at full resolution, even if this component isn't
+				const int relX = (dest.subsampling.x == 1 ? dx : 1);
+				const int relY = (dest.subsampling.y == 1 ? dy : 1);
 				
-				imageRead = opj_decode(codec, stream, image);
-			
-			
-			#define PROG(COUNT, TOTAL) (progress == NULL ? true : \
-											!progress->keepGoing ? false : \
-											progress->progressProc != NULL ? \
-												(progress->keepGoing = progress->progressProc(progress->refCon, COUNT, TOTAL)) : \
-												progress->abortProc != NULL ? \
-													(progress->keepGoing = progress->abortProc(progress->refCon)) : \
-													true)
+				const int destX = ((rx0 - cx0) * relX);
+				const int destY = ((ry0 - cy0) * relY);
 				
-			#define NOABORT() (progress == NULL ? true : \
-								!progress->keepGoing ? false : \
-								progress->abortProc == NULL ? true : \
-									(progress->keepGoing = progress->abortProc(progress->refCon)))
+				dst = dest;
 				
-				if(imageRead && NOABORT())
+				if(dest.buf != NULL && destX < (int)dest.width && destY < (int)dest.height && tileWidth > 0 && tileHeight > 0)
 				{
-					const uint8_t channels = std::min<uint8_t>(static_cast<uint8_t>(image->numcomps), J2K_CODEC_MAX_CHANNELS);
-					
-					Buffer openjpegBuffer;
-					
-					openjpegBuffer.channels = channels;
-					
-					for(OPJ_UINT32 i=0U; i < channels; i++)
-					{
-						Channel &chan = openjpegBuffer.channel[i];
-						
-						const opj_image_comp_t &comp = image->comps[i];
-						
-						chan.width = comp.w;
-						chan.height = comp.h;
-						
-						chan.subsampling.x = comp.dx;
-						chan.subsampling.y = comp.dy;
-						
-						chan.sampleType = INT;
-						chan.depth = static_cast<uint8_t>(comp.prec);
-						chan.sgnd = comp.sgnd ? true : false;
-						
-						assert(comp.prec > 0);
-						assert(comp.bpp == 0); // unused?
-						
-						chan.buf = (unsigned char *)comp.data;
-						chan.colbytes = sizeof(int);
-						chan.rowbytes = (sizeof(int) * comp.w);
-						
-						assert(comp.data != NULL);
-					}
+					dst.width = std::min<int>(tileWidth * relX, dest.width - destX);
+					dst.height = std::min<int>(tileHeight * relY, dest.height - destY);
 					
-					CopyBuffer(buffer, openjpegBuffer);
+					dst.buf = (dest.buf + (destY * dest.rowbytes) + (destX * dest.colbytes));
+				}
+				else
+				{
+					dst.buf = NULL;
 				}
-				else if(!imageRead)
-					success = false;
 			}
-			else
-				success = false;
 			
-			if(image)
-				opj_image_destroy(image);
-			
-			opj_destroy_codec(codec);
+			compData += (sampleSize * tileWidth * tileHeight);
 		}
-		else
-			success = false;
 		
-		opj_stream_destroy(stream);
+		Codec::CopyBuffer(destBuffer, tileBuffer);
+		
+		tilesDone++;
+		
+		PROG(tilesDone, totalTiles);
 	}
-	else
-		success = false;
 	
+	if(success && !keepReading)
+		success = opj_end_decompress(codec, stream) ? true : false;
 	
-	if(!success)
-		throw Exception("Error reading file");
+	return success;
+}
+
+
+static bool
+DefaultSparseReads()
+{
+	const char *env = getenv("J2K_SPARSE_READS");
+	
+	return (env != NULL && atoi(env) > 0);
+}
+
+
+OpenJPEGCodec::OpenJPEGCodec() :
+	_sparseReads(DefaultSparseReads())
+{
+
+}
+
+
+OpenJPEGCodec::~OpenJPEGCodec()
+{
+	for(std::list<DecoderContext *>::iterator i = _contextPool.begin(); i != _contextPool.end(); ++i)
+		delete *i;
 }
 
 
 void
-OpenJPEGCodec::WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer, Progress *progress)
+OpenJPEGCodec::ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample, Progress *progress, unsigned int layers)
 {
-	assert(file.Tell() == 0);
+	Decode(file, buffer, NULL, subsample, layers, progress, NULL, 0);
+}
+
+
+void
+OpenJPEGCodec::ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample, Progress *progress, unsigned int layers)
+{
+	Decode(file, buffer, &region, subsample, layers, progress, NULL, 0);
+}
+
+
+class OpenJPEGDecodeSession : public DecodeSession
+{
+  public:
+	OpenJPEGDecodeSession(OpenJPEGCodec &codec) : DecodeSession(codec), _openjpeg(codec) {}
+	virtual ~OpenJPEGDecodeSession() {}
+	
+	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0)
+	{
+		_openjpeg.Decode(file, buffer, NULL, subsample, layers, progress, &_context, _threads);
+	}
 	
+	virtual void ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0)
+	{
+		_openjpeg.Decode(file, buffer, &region, subsample, layers, progress, &_context, _threads);
+	}
 	
-	OPJ_BOOL success = OPJ_TRUE;
+  private:
+	OpenJPEGCodec &_openjpeg;
+	DecoderContext _context;
+};
+
+
+DecodeSession *
+OpenJPEGCodec::CreateDecodeSession()
+{
+	return new OpenJPEGDecodeSession(*this);
+}
+
+
+#define J2K_DECODER_POOL_SIZE 8
+
+DecoderContext *
+OpenJPEGCodec::AcquireContext(const DecoderKey &key)
+{
+	{
+		Lock lock(_poolMutex);
+		
+		for(std::list<DecoderContext *>::iterator i = _contextPool.begin(); i != _contextPool.end(); ++i)
+		{
+			if((*i)->Key() == key)
+			{
+				DecoderContext *context = *i;
+				
+				_contextPool.erase(i);
+				
+				return context;
+			}
+		}
+	}
 	
+	return new DecoderContext(key);
+}
+
+
+void
+OpenJPEGCodec::ReleaseContext(DecoderContext *context)
+{
+	Lock lock(_poolMutex);
 	
-	opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_FALSE);
+	_contextPool.push_front(context);
 	
-	if(stream)
+	while(_contextPool.size() > J2K_DECODER_POOL_SIZE)
 	{
-		opj_stream_set_user_data(stream, &file, NULL);
-		opj_stream_set_read_function(stream, OutputStreamRead);
-		opj_stream_set_write_function(stream, OutputStreamWrite);
-		opj_stream_set_skip_function(stream, OutputStreamSkip);
-		opj_stream_set_seek_function(stream, OutputStreamSeek);
-		
-		
-		// TODO: enable JP2
-		// Only writing J2K format right now because JP2 is trying to skip past the end of
-		// the file.  Is that really a good idea?  What does fseek() do?
+		delete _contextPool.back();
 		
-		//const OPJ_CODEC_FORMAT format = (info.format == J2C ? OPJ_CODEC_J2K : OPJ_CODEC_JP2);
-		const OPJ_CODEC_FORMAT format = OPJ_CODEC_J2K;
+		_contextPool.pop_back();
+	}
+}
 
-		opj_codec_t *codec = opj_create_compress(format);
+
+void
+OpenJPEGCodec::Decode(InputFile &file, const Buffer &buffer, const Rect *region, unsigned int subsample, unsigned int layers,
+						Progress *progress, DecoderContext *sessionContext, unsigned int threads)
+{
+	const OPJ_CODEC_FORMAT format = GetFormat(file);
+	
+	if(format == OPJ_CODEC_UNKNOWN)
+		throw Exception("Can't read this format");
+		
+	bool success = true;
+	
+	
+	MemoryStream memoryStream;
+	SparseStream sparseStream;
+	
+	const bool inMemory = ((file.Flags() & InputFile::J2K_READ_MEMORY) && file.Data() != NULL);
+	
+	// only worth it when we don't need the whole file and reading it costs something
+	const bool sparse = (_sparseReads && format == OPJ_CODEC_J2K && !inMemory && (file.Flags() & InputFile::J2K_READ_SEEKABLE) &&
+							(region != NULL || subsample > 1 || layers > 0) &&
+							BuildSparseStream(file, region, log2(subsample), layers, sparseStream));
+	
+	opj_stream_t *stream = (sparse ? CreateSparseInputStream(sparseStream) : CreateInputStream(file, memoryStream));
+	
+	if(stream)
+	{
+		opj_codec_t *codec = opj_create_decompress(format);
 		
 		if(codec)
 		{
@@ -621,127 +1642,134 @@ OpenJPEGCodec::WriteFile(OutputFile &file, const FileInfo &info, const Buffer &b
 			opj_set_warning_handler(codec, WarningHandler, NULL);
 			opj_set_info_handler(codec, InfoHandler, NULL);
 			
-			//opj_codec_set_threads(codec, NumberOfCPUs());
 			
+			opj_dparameters_t params;
+			opj_set_default_decoder_parameters(&params);
 			
-			opj_image_cmptparm_t compParam[J2K_CODEC_MAX_CHANNELS];
+			// When you cp_reduce, the buffer doesn't change size, but the image is shrunk
+			// into the upper left hand corner.  This means the OpenJPEG buffer doesn't match the
+			// buffer we provide, but it works out because CopyBuffer is based on the destination
+			// size.
 			
-			assert(info.channels == buffer.channels);
+			params.cp_reduce = log2(subsample);
 			
-			for(int i=0; i < buffer.channels; i++)
+			// Only the first layers' code-block passes get tier-1 decoded, so this
+			// saves time roughly in proportion.  0 is all of them.
+			params.cp_layer = layers;
+			
+			params.flags |= OPJ_DPARAMETERS_IGNORE_PALETTE_FLAG; // don't apply LUT if you happen to have one
+			
+			const OPJ_BOOL configured = opj_setup_decoder(codec, &params);
+			
+			assert(configured);
+			
+			// A new codec decodes on this thread.  Asking for 1 thread would start
+			// a pool with one worker just to wait on it, for every frame.
+			const unsigned int decodeThreads = (threads > 0 ? threads : NumberOfCPUs());
+			
+			if(decodeThreads > 1)
+				opj_codec_set_threads(codec, decodeThreads);
+			
+			
+			opj_image_t *image = NULL;
+			
+			OPJ_BOOL imageRead = opj_read_header(stream, codec, &image);
+			
+			if(imageRead && image != NULL && region != NULL)
 			{
-				const Channel &chan = buffer.channel[i];
-				
-				opj_image_cmptparm_t &param = compParam[i];
+				const OPJ_UINT32 imageWidth = (image->x1 - image->x0);
+				const OPJ_UINT32 imageHeight = (image->y1 - image->y0);
 				
-				assert(chan.width == info.width && chan.height == info.height);
+				if(region->width == 0 || region->height == 0 ||
+					region->x >= imageWidth || region->width > imageWidth - region->x ||
+					region->y >= imageHeight || region->height > imageHeight - region->y)
+				{
+					opj_image_destroy(image);
+					opj_destroy_codec(codec);
+					opj_stream_destroy(stream);
+					
+					throw Exception("Invalid region");
+				}
 				
-				param.dx = 1;
-				param.dy = 1;
-				param.w = chan.width;
-				param.h = chan.height;
-				param.x0 = 0;
-				param.y0 = 0;
-				param.prec = info.depth;
-				param.bpp = (chan.sampleType == USHORT ? 16 : 8);
-				param.sgnd = OPJ_FALSE;
+				// Only the code-blocks covering the area get decoded, and the image
+				// components come back sized to the area.
+				imageRead = opj_set_decode_area(codec, image,
+												image->x0 + region->x,
+												image->y0 + region->y,
+												image->x0 + region->x + region->width,
+												image->y0 + region->y + region->height);
 			}
 			
-			const OPJ_COLOR_SPACE colorSpace = (info.colorSpace == sRGB ? OPJ_CLRSPC_SRGB :
-													info.colorSpace == sLUM ? OPJ_CLRSPC_GRAY :
-													info.colorSpace == sYCC ? OPJ_CLRSPC_SYCC :
-													//info.colorSpace == esRGB ? JP2_esRGB_SPACE :
-													info.colorSpace == esYCC ? OPJ_CLRSPC_EYCC :
-													//info.colorSpace == ROMM ? JP2_ROMMRGB_SPACE :
-													info.colorSpace == CMYK ? OPJ_CLRSPC_CMYK :
-													//info.colorSpace == CIELab ? JP2_CIELab_SPACE :
-													//info.colorSpace == iccLUM ? JP2_iccLUM_SPACE :
-													//info.colorSpace == iccRGB ? JP2_iccRGB_SPACE :
-													//info.colorSpace == iccANY ? JP2_iccANY_SPACE :
-													OPJ_CLRSPC_UNSPECIFIED);
-			
-			opj_image_t *image = opj_image_create(buffer.channels, compParam, colorSpace);
-			
-			if(image)
+			if(imageRead && image != NULL)
 			{
-				image->x0 = 0;
-				image->y0 = 0;
-				image->x1 = info.width;
-				image->y1 = info.height;
-				
-				Buffer openjpegBuffer;
-				
-				openjpegBuffer.channels = static_cast<uint8_t>(image->numcomps);
-				
-				for(OPJ_UINT32 i=0U; i < image->numcomps; i++)
+				if(region == NULL && CanDecodeTiles(image))
 				{
-					Channel &chan = openjpegBuffer.channel[i];
-					
-					const opj_image_comp_t &comp = image->comps[i];
-					
-					chan.width = comp.w;
-					chan.height = comp.h;
+					const DecoderKey key(format, image, params.cp_reduce);
 					
-					chan.sampleType = INT;
-					chan.depth = static_cast<uint8_t>(comp.prec);
-					chan.sgnd = comp.sgnd ? true : false;
+					DecoderContext *context = sessionContext;
 					
-					assert(comp.prec == info.depth);
-					assert(comp.bpp == (buffer.channel[i].sampleType == USHORT ? 16 : 8));
-					assert(!comp.sgnd);
+					if(context != NULL)
+						context->SetKey(key);
+					else
+						context = AcquireContext(key);
 					
-					chan.buf = (unsigned char *)comp.data;
-					chan.colbytes = sizeof(int);
-					chan.rowbytes = (sizeof(int) * comp.w);
+					success = DecodeTiles(codec, stream, image, params.cp_reduce, buffer, *context, progress);
 					
-					assert(comp.data != NULL);
-				}
-				
-				CopyBuffer(openjpegBuffer, buffer);
-				
-			
-				opj_cparameters_t params;
-				
-				opj_set_default_encoder_parameters(&params);
-				
-				// TODO: copy more settings from info to here
-				params.tcp_numlayers = info.settings.layers;
-				params.cp_disto_alloc = OPJ_TRUE;
-				
-				
-				if(info.settings.tileSize > 0)
-				{
-					params.tile_size_on = OPJ_TRUE;
-					params.cp_tx0 = 0;
-					params.cp_ty0 = 0;
-					params.cp_tdx = info.settings.tileSize;
-					params.cp_tdy = info.settings.tileSize;
+					if(context != sessionContext)
+						ReleaseContext(context);
 				}
-				
-				
-				success = opj_setup_encoder(codec, &params, image);
-				
-				if(success)
+				else
 				{
-					success = opj_start_compress(codec, image, stream);
+					imageRead = opj_decode(codec, stream, image);
 					
-					if(success)
+					if(imageRead && NOABORT())
 					{
-						success = opj_encode(codec, stream);
+						const uint8_t channels = std::min<uint8_t>(static_cast<uint8_t>(image->numcomps), J2K_CODEC_MAX_CHANNELS);
 						
-						if(success)
+						Buffer openjpegBuffer;
+						
+						openjpegBuffer.channels = channels;
+						
+						for(OPJ_UINT32 i=0U; i < channels; i++)
 						{
-							success = opj_end_compress(codec, stream);
+							Channel &chan = openjpegBuffer.channel[i];
+							
+							const opj_image_comp_t &comp = image->comps[i];
+							
+							chan.width = comp.w;
+							chan.height = comp.h;
+							
+							chan.subsampling.x = comp.dx;
+							chan.subsampling.y = comp.dy;
+							
+							chan.sampleType = INT;
+							chan.depth = static_cast<uint8_t>(comp.prec);
+							chan.sgnd = comp.sgnd ? true : false;
+							
+							assert(comp.prec > 0);
+							assert(comp.bpp == 0); // unused?
+							
+							chan.buf = (unsigned char *)comp.data;
+							chan.colbytes = sizeof(int);
+							chan.rowbytes = (sizeof(int) * comp.w);
+							
+							assert(comp.data != NULL);
 						}
+						
+						CopyBuffer(buffer, openjpegBuffer);
+						
+						PROG(1, 1);
 					}
+					else if(!imageRead)
+						success = false;
 				}
-				
-			
-				opj_image_destroy(image);
 			}
 			else
 				success = false;
 			
+			if(image)
+				opj_image_destroy(image);
+			
 			opj_destroy_codec(codec);
 		}
 		else
@@ -753,6 +1781,790 @@ OpenJPEGCodec::WriteFile(OutputFile &file, const FileInfo &info, const Buffer &b
 		success = false;
 	
 	
+	if(!success)
+		throw Exception("Error reading file");
+}
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// OpenJPEG 2.4 added multithreaded encoding.  Before that, opj_codec_set_threads()
+// only worked for decompressors, so we encode the tiles in parallel ourselves.
+// 2.4 is also where opj_encoder_set_extra_options() came in, for writing PLT.
+#if defined(OPJ_VERSION_MAJOR) && (OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 4))
+	#define J2K_OPENJPEG_ENCODER_THREADS 1
+	#define J2K_OPENJPEG_EXTRA_OPTIONS 1
+#endif
+
+
+static opj_image_t *
+CreateEncodeImage(const FileInfo &info, const Buffer &buffer,
+					OPJ_UINT32 x0, OPJ_UINT32 y0, OPJ_UINT32 x1, OPJ_UINT32 y1)
+{
+	// makes an image covering (x0, y0) - (x1, y1) and copies that part of the buffer in
+	opj_image_cmptparm_t compParam[J2K_CODEC_MAX_CHANNELS];
+	
+	assert(info.channels == buffer.channels);
+	
+	for(int i=0; i < buffer.channels; i++)
+	{
+		const Channel &chan = buffer.channel[i];
+		
+		const Subsampling &sub = info.subsampling[i];
+		
+		opj_image_cmptparm_t &param = compParam[i];
+		
+		assert(chan.width == SubsampledSize(info.width, sub.x) && chan.height == SubsampledSize(info.height, sub.y));
+		
+		// component coordinates are the image's divided by the subsampling, rounded up
+		param.dx = sub.x;
+		param.dy = sub.y;
+		param.x0 = CeilDiv(x0, sub.x);
+		param.y0 = CeilDiv(y0, sub.y);
+		param.w = (CeilDiv(x1, sub.x) - param.x0);
+		param.h = (CeilDiv(y1, sub.y) - param.y0);
+		param.prec = info.depth;
+		param.bpp = (chan.sampleType == USHORT ? 16 : 8);
+		param.sgnd = OPJ_FALSE;
+	}
+	
+	const OPJ_COLOR_SPACE colorSpace = (info.colorSpace == sRGB ? OPJ_CLRSPC_SRGB :
+											info.colorSpace == sLUM ? OPJ_CLRSPC_GRAY :
+											info.colorSpace == sYCC ? OPJ_CLRSPC_SYCC :
+											//info.colorSpace == esRGB ? JP2_esRGB_SPACE :
+											info.colorSpace == esYCC ? OPJ_CLRSPC_EYCC :
+											//info.colorSpace == ROMM ? JP2_ROMMRGB_SPACE :
+											info.colorSpace == CMYK ? OPJ_CLRSPC_CMYK :
+											//info.colorSpace == CIELab ? JP2_CIELab_SPACE :
+											//info.colorSpace == iccLUM ? JP2_iccLUM_SPACE :
+											//info.colorSpace == iccRGB ? JP2_iccRGB_SPACE :
+											//info.colorSpace == iccANY ? JP2_iccANY_SPACE :
+											OPJ_CLRSPC_UNSPECIFIED);
+	
+	opj_image_t *image = opj_image_create(buffer.channels, compParam, colorSpace);
+	
+	if(image)
+	{
+		image->x0 = x0;
+		image->y0 = y0;
+		image->x1 = x1;
+		image->y1 = y1;
+		
+		Buffer openjpegBuffer;
+		
+		openjpegBuffer.channels = static_cast<uint8_t>(image->numcomps);
+		
+		for(OPJ_UINT32 i=0U; i < image->numcomps; i++)
+		{
+			Channel &chan = openjpegBuffer.channel[i];
+			
+			const opj_image_comp_t &comp = image->comps[i];
+			
+			chan.width = comp.w;
+			chan.height = comp.h;
+			
+			chan.sampleType = INT;
+			chan.depth = static_cast<uint8_t>(comp.prec);
+			chan.sgnd = comp.sgnd ? true : false;
+			
+			assert(comp.prec == info.depth);
+			assert(comp.bpp == (buffer.channel[i].sampleType == USHORT ? 16 : 8));
+			assert(!comp.sgnd);
+			
+			chan.buf = (unsigned char *)comp.data;
+			chan.colbytes = sizeof(int);
+			chan.rowbytes = (sizeof(int) * comp.w);
+			
+			assert(comp.data != NULL);
+		}
+		
+		Buffer source = buffer;
+		
+		for(int i=0; i < source.channels; i++)
+		{
+			Channel &chan = source.channel[i];
+			
+			const opj_image_comp_t &comp = image->comps[i];
+			
+			chan.buf += (comp.y0 * chan.rowbytes) + (comp.x0 * chan.colbytes);
+			chan.width = comp.w;
+			chan.height = comp.h;
+			chan.subsampling = Subsampling();
+		}
+		
+		try
+		{
+			Codec::CopyBuffer(openjpegBuffer, source);
+		}
+		catch(...)
+		{
+			opj_image_destroy(image);
+			
+			throw;
+		}
+	}
+	
+	return image;
+}
+
+
+static bool
+IsSubsampled(const FileInfo &info)
+{
+	for(int i=0; i < info.channels; i++)
+	{
+		if(info.subsampling[i].x != 1 || info.subsampling[i].y != 1)
+			return true;
+	}
+	
+	return false;
+}
+
+
+static OPJ_PROG_ORDER
+ProgressionOrder(Order order)
+{
+	switch(order)
+	{
+		case LRCP:	return OPJ_LRCP;
+		case RLCP:	return OPJ_RLCP;
+		case RPCL:	return OPJ_RPCL;
+		case PCRL:	return OPJ_PCRL;
+		case CPRL:	return OPJ_CPRL;
+	}
+	
+	return OPJ_RPCL;
+}
+
+
+static void
+SetupEncoderParameters(opj_cparameters_t &params, const FileInfo &info)
+{
+	opj_set_default_encoder_parameters(&params);
+	
+	const CompressionSettings &settings = info.settings;
+	
+	if(settings.method == CINEMA)
+	{
+		// OpenJPEG fills in the rest of the DCI rules (code blocks, precincts,
+		// levels) from the profile, we just say which one and the frame size
+		params.rsiz = (settings.dciProfile == DCI_4K ? OPJ_PROFILE_CINEMA_4K : OPJ_PROFILE_CINEMA_2K);
+		params.max_cs_size = static_cast<int>(std::max<size_t>(settings.fileSize, 1) * 1024);
+		params.max_comp_size = static_cast<int>((double)params.max_cs_size * OPJ_CINEMA_24_COMP / OPJ_CINEMA_24_CS);
+		
+		params.tcp_numlayers = 1;
+		params.tcp_rates[0] = 0;
+		params.cp_disto_alloc = OPJ_TRUE;
+		params.irreversible = OPJ_TRUE;
+		params.prog_order = OPJ_CPRL;
+		params.tcp_mct = (info.channels >= 3 && !IsSubsampled(info) ? 1 : 0);
+		
+		return; // no tiles in DCI
+	}
+	
+	const std::vector<float> targets = LayerTargets(info);
+	
+	params.tcp_numlayers = static_cast<int>(targets.size());
+	
+	if(settings.method == QUALITY)
+	{
+		params.cp_fixed_quality = OPJ_TRUE;
+		
+		for(int i=0; i < params.tcp_numlayers; i++)
+			params.tcp_distoratio[i] = targets[i];
+	}
+	else
+	{
+		params.cp_disto_alloc = OPJ_TRUE;
+		
+		for(int i=0; i < params.tcp_numlayers; i++)
+			params.tcp_rates[i] = targets[i];
+	}
+	
+	params.prog_order = ProgressionOrder(settings.order);
+	
+	// lossless has to use the 5/3 wavelet, and quality 100 ends with a lossless layer
+	const bool lossless = (settings.method == LOSSLESS || (settings.method == QUALITY && settings.quality >= 100));
+	
+	params.irreversible = (!lossless && !settings.reversible ? OPJ_TRUE : OPJ_FALSE);
+	
+	// MCT needs all the components the same size
+	params.tcp_mct = (settings.ycc && info.channels >= 3 && !IsSubsampled(info) ? 1 : 0);
+	
+	if(settings.tileSize > 0)
+	{
+		params.tile_size_on = OPJ_TRUE;
+		params.cp_tx0 = 0;
+		params.cp_ty0 = 0;
+		params.cp_tdx = settings.tileSize;
+		params.cp_tdy = settings.tileSize;
+	}
+	
+	params.cblockw_init = settings.codeBlockWidth;
+	params.cblockh_init = settings.codeBlockHeight;
+	params.mode = settings.blockModes;
+	
+	if(settings.precinctSize > 0)
+	{
+		// the same size at every resolution, OpenJPEG would halve them going down
+		params.csty |= 0x01;
+		params.res_spec = params.numresolution;
+		
+		for(int i=0; i < params.res_spec; i++)
+		{
+			params.prcw_init[i] = settings.precinctSize;
+			params.prch_init[i] = settings.precinctSize;
+		}
+	}
+}
+
+
+static bool
+Encode(opj_stream_t *stream, opj_image_t *image, const opj_cparameters_t &parameters,
+		OPJ_CODEC_FORMAT format, unsigned int threads, bool packetLengths)
+{
+	bool success = false;
+	
+	opj_codec_t *codec = opj_create_compress(format);
+	
+	if(codec)
+	{
+		opj_set_error_handler(codec, ErrorHandler, NULL);
+		opj_set_warning_handler(codec, WarningHandler, NULL);
+		opj_set_info_handler(codec, InfoHandler, NULL);
+		
+	#ifdef J2K_OPENJPEG_ENCODER_THREADS
+		if(threads > 1)
+			opj_codec_set_threads(codec, threads);
+	#endif
+		
+		opj_cparameters_t params = parameters;
+		
+		success = opj_setup_encoder(codec, &params, image);
+		
+	#ifdef J2K_OPENJPEG_EXTRA_OPTIONS
+		// has to come after opj_setup_encoder()
+		if(success && packetLengths)
+		{
+			const char * const options[] = { "PLT=YES", NULL };
+			
+			success = opj_encoder_set_extra_options(codec, options);
+		}
+	#endif
+		
+		success = success &&
+					opj_start_compress(codec, image, stream) &&
+					opj_encode(codec, stream) &&
+					opj_end_compress(codec, stream);
+		
+		opj_destroy_codec(codec);
+	}
+	
+	return success;
+}
+
+
+// Codestream encoded into memory, for a tile on a worker thread or so
+// we can add TLM once we know how long the tile-parts are
+typedef struct MemoryOutputStream
+{
+	std::vector<unsigned char> data;
+	size_t position;
+	
+	MemoryOutputStream() : position(0) {}
+	
+} MemoryOutputStream;
+
+static OPJ_SIZE_T
+MemoryOutputStreamWrite(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
+{
+	MemoryOutputStream *stream = (MemoryOutputStream *)p_user_data;
+	
+	// exceptions can't go back up through OpenJPEG
+	try
+	{
+		if(stream->position + p_nb_bytes > stream->data.size())
+			stream->data.resize(stream->position + p_nb_bytes);
+	}
+	catch(...)
+	{
+		return (OPJ_SIZE_T)-1;
+	}
+	
+	if(p_nb_bytes > 0)
+		memcpy(&stream->data[stream->position], p_buffer, p_nb_bytes);
+	
+	stream->position += p_nb_bytes;
+	
+	return p_nb_bytes;
+}
+
+static OPJ_BOOL
+MemoryOutputStreamSeek(OPJ_OFF_T p_nb_bytes, void * p_user_data)
+{
+	MemoryOutputStream *stream = (MemoryOutputStream *)p_user_data;
+	
+	if(p_nb_bytes < 0)
+		return OPJ_FALSE;
+	
+	try
+	{
+		if((size_t)p_nb_bytes > stream->data.size())
+			stream->data.resize((size_t)p_nb_bytes);
+	}
+	catch(...)
+	{
+		return OPJ_FALSE;
+	}
+	
+	stream->position = (size_t)p_nb_bytes;
+	
+	return OPJ_TRUE;
+}
+
+static OPJ_OFF_T
+MemoryOutputStreamSkip(OPJ_OFF_T p_nb_bytes, void * p_user_data)
+{
+	MemoryOutputStream *stream = (MemoryOutputStream *)p_user_data;
+	
+	if( MemoryOutputStreamSeek((OPJ_OFF_T)stream->position + p_nb_bytes, p_user_data) )
+		return p_nb_bytes;
+	else
+		return -1;
+}
+
+
+typedef struct TileEncodeContext
+{
+	const FileInfo &info;
+	const Buffer &buffer;
+	const opj_cparameters_t &params;
+	OPJ_CODEC_FORMAT format;
+	Progress *progress;
+	
+	unsigned int tilesX;
+	unsigned int tileCount;
+	
+	Mutex mutex;
+	unsigned int finished;
+	bool failed;
+	bool keepGoing;
+	std::vector< std::vector<unsigned char> > codestreams;
+	
+	TileEncodeContext(const FileInfo &i, const Buffer &b, const opj_cparameters_t &p, OPJ_CODEC_FORMAT f,
+						Progress *prog, unsigned int tx, unsigned int ty) :
+		info(i), buffer(b), params(p), format(f), progress(prog),
+		tilesX(tx), tileCount(tx * ty),
+		finished(0), failed(false), keepGoing(true), codestreams(tx * ty)
+	{
+	}
+	
+} TileEncodeContext;
+
+
+static void
+EncodeTile(void *refCon, unsigned int tile, unsigned int thread)
+{
+	TileEncodeContext &context = *(TileEncodeContext *)refCon;
+	
+	const FileInfo &info = context.info;
+	const unsigned int tileSize = info.settings.tileSize;
+	
+	{
+		Lock lock(context.mutex);
+		
+		if(context.failed || !context.keepGoing)
+			return;
+	}
+	
+	// Every tile gets encoded as its own image that happens to sit where
+	// the tile does on the full image's tile grid.
+	const OPJ_UINT32 x0 = ((tile % context.tilesX) * tileSize);
+	const OPJ_UINT32 y0 = ((tile / context.tilesX) * tileSize);
+	const OPJ_UINT32 x1 = std::min<OPJ_UINT32>(x0 + tileSize, info.width);
+	const OPJ_UINT32 y1 = std::min<OPJ_UINT32>(y0 + tileSize, info.height);
+	
+	bool success = false;
+	
+	// this is a worker thread, so nothing can be thrown from here
+	opj_image_t *image = NULL;
+	
+	try
+	{
+		image = CreateEncodeImage(info, context.buffer, x0, y0, x1, y1);
+	}
+	catch(...)
+	{
+		image = NULL;
+	}
+	
+	if(image)
+	{
+		MemoryOutputStream output;
+		
+		opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_FALSE);
+		
+		if(stream)
+		{
+			opj_stream_set_user_data(stream, &output, NULL);
+			opj_stream_set_write_function(stream, MemoryOutputStreamWrite);
+			opj_stream_set_skip_function(stream, MemoryOutputStreamSkip);
+			opj_stream_set_seek_function(stream, MemoryOutputStreamSeek);
+			
+			success = Encode(stream, image, context.params, context.format, 1, info.settings.lengthMarkers);
+			
+			opj_stream_destroy(stream);
+		}
+		
+		opj_image_destroy(image);
+		
+		if(success)
+		{
+			Lock lock(context.mutex);
+			
+			context.codestreams[tile].swap(output.data);
+		}
+	}
+	
+	unsigned int finished = 0;
+	
+	{
+		Lock lock(context.mutex);
+		
+		if(!success)
+			context.failed = true;
+		
+		finished = ++context.finished;
+	}
+	
+	// progress callbacks only get made from the calling thread
+	Progress *progress = context.progress;
+	
+	if(thread == 0 && success && !PROG(finished, context.tileCount))
+	{
+		Lock lock(context.mutex);
+		
+		context.keepGoing = false;
+	}
+}
+
+
+static size_t
+MainHeaderSize(const std::vector<unsigned char> &codestream)
+{
+	// offset of the first SOT marker, 0 if we can't find it
+	if(codestream.size() < 4 || ReadBigEndian16(&codestream[0]) != J2K_MARKER_SOC)
+		return 0;
+	
+	size_t pos = 2;
+	
+	while(pos + 4 <= codestream.size())
+	{
+		if(ReadBigEndian16(&codestream[pos]) == J2K_MARKER_SOT)
+			return pos;
+		
+		pos += 2 + ReadBigEndian16(&codestream[pos + 2]);
+	}
+	
+	return 0;
+}
+
+
+// A tile-part sitting in an encoded codestream, starting with its SOT
+typedef struct TilePart
+{
+	const unsigned char *data;
+	size_t length;
+	unsigned int tile;
+	
+	TilePart(const unsigned char *d, size_t l, unsigned int t) : data(d), length(l), tile(t) {}
+	
+} TilePart;
+
+static bool
+FindTileParts(const std::vector<unsigned char> &codestream, std::vector<TilePart> &parts)
+{
+	size_t pos = MainHeaderSize(codestream);
+	
+	if(pos == 0)
+		return false;
+	
+	// SOT: marker, Lsot, Isot, Psot, TPsot, TNsot
+	while(pos + 12 <= codestream.size() && ReadBigEndian16(&codestream[pos]) == J2K_MARKER_SOT)
+	{
+		size_t length = ReadBigEndian32(&codestream[pos + 6]);
+		
+		if(length == 0) // last tile-part, goes to EOC
+			length = (codestream.size() - 2 - pos);
+		
+		if(length < 12 || pos + length > codestream.size())
+			return false;
+		
+		parts.push_back(TilePart(&codestream[pos], length, ReadBigEndian16(&codestream[pos + 4])));
+		
+		pos += length;
+	}
+	
+	return true;
+}
+
+static bool
+AppendTileLengths(std::vector<unsigned char> &header, const std::vector<TilePart> &parts)
+{
+	// TLM: marker, Ltlm, Ztlm, Stlm, then Ttlm and Ptlm for each tile-part.
+	// We use 16-bit tile numbers and 32-bit lengths, so 6 bytes apiece, and
+	// as many TLMs as it takes to fit them under the 64k segment limit.
+	const size_t perSegment = ((0xffff - 4) / 6);
+	const size_t segments = ((parts.size() + perSegment - 1) / perSegment);
+	
+	if(segments > 256) // Ztlm is one byte
+		return false;
+	
+	for(size_t z=0; z < segments; z++)
+	{
+		const size_t first = (z * perSegment);
+		const size_t count = std::min(perSegment, parts.size() - first);
+		
+		size_t pos = header.size();
+		
+		header.resize(pos + 6 + (6 * count));
+		
+		WriteBigEndian16(&header[pos], J2K_MARKER_TLM);
+		WriteBigEndian16(&header[pos + 2], static_cast<unsigned int>(4 + (6 * count)));
+		header[pos + 4] = static_cast<unsigned char>(z);
+		header[pos + 5] = 0x60; // ST = 2, SP = 1
+		
+		pos += 6;
+		
+		for(size_t i=0; i < count; i++, pos += 6)
+		{
+			const TilePart &part = parts[first + i];
+			
+			WriteBigEndian16(&header[pos], part.tile);
+			WriteBigEndian32(&header[pos + 2], static_cast<unsigned int>(part.length));
+		}
+	}
+	
+	return true;
+}
+
+static bool
+WriteCodestream(OutputFile &file, const std::vector<unsigned char> &mainHeader,
+				const std::vector<TilePart> &parts, bool tileLengths)
+{
+	// TLM goes at the end of the main header, where it's sure to come after SIZ
+	std::vector<unsigned char> header = mainHeader;
+	
+	if(tileLengths && !AppendTileLengths(header, parts))
+		return false;
+	
+	if(file.Write(&header[0], header.size()) != header.size())
+		return false;
+	
+	for(size_t i=0; i < parts.size(); i++)
+	{
+		const TilePart &part = parts[i];
+		
+		// Psot gets the real length, in case it was the 0 for "up to EOC"
+		unsigned char sot[12];
+		
+		memcpy(sot, part.data, 12);
+		
+		WriteBigEndian16(&sot[4], part.tile);
+		WriteBigEndian32(&sot[6], static_cast<unsigned int>(part.length));
+		
+		if(file.Write(sot, 12) != 12)
+			return false;
+		
+		if(file.Write(part.data + 12, part.length - 12) != (part.length - 12))
+			return false;
+	}
+	
+	unsigned char eoc[2];
+	
+	WriteBigEndian16(eoc, J2K_MARKER_EOC);
+	
+	return (file.Write(eoc, 2) == 2);
+}
+
+
+static bool
+WriteTileCodestreams(OutputFile &file, const FileInfo &info, const std::vector< std::vector<unsigned char> > &codestreams)
+{
+	// The main headers only differ in the image size, so we write the first
+	// one with the full size and then all the tile-parts, renumbered.
+	const std::vector<unsigned char> &first = codestreams.front();
+	
+	const size_t headerSize = MainHeaderSize(first);
+	
+	// SIZ comes right after SOC: marker, Lsiz, Rsiz, Xsiz, Ysiz, XOsiz, YOsiz...
+	if(headerSize < 16 || ReadBigEndian16(&first[2]) != J2K_MARKER_SIZ)
+		return false;
+	
+	std::vector<unsigned char> header(first.begin(), first.begin() + headerSize);
+	
+	WriteBigEndian32(&header[8], info.width);
+	WriteBigEndian32(&header[12], info.height);
+	
+	std::vector<TilePart> parts;
+	
+	for(size_t tile=0; tile < codestreams.size(); tile++)
+	{
+		const size_t firstPart = parts.size();
+		
+		if( !FindTileParts(codestreams[tile], parts) )
+			return false;
+		
+		for(size_t i = firstPart; i < parts.size(); i++)
+			parts[i].tile = static_cast<unsigned int>(tile);
+	}
+	
+	return WriteCodestream(file, header, parts, info.settings.lengthMarkers);
+}
+
+
+static bool
+WriteWithTileLengths(OutputFile &file, const std::vector<unsigned char> &codestream)
+{
+	// OpenJPEG only writes TLM from 2.5, and not at all for our stitched
+	// codestreams, so we always add it ourselves
+	const size_t headerSize = MainHeaderSize(codestream);
+	
+	std::vector<TilePart> parts;
+	
+	if(headerSize == 0 || !FindTileParts(codestream, parts))
+		return false;
+	
+	const std::vector<unsigned char> header(codestream.begin(), codestream.begin() + headerSize);
+	
+	return WriteCodestream(file, header, parts, true);
+}
+
+
+// Each tile goes in its own image, and OpenJPEG only gets the component
+// offsets right if the tile origins land on the subsampling grid.
+static bool
+TilesAlignWithSubsampling(const FileInfo &info, unsigned int tileSize)
+{
+	for(int i=0; i < info.channels; i++)
+	{
+		if((tileSize % info.subsampling[i].x) != 0 || (tileSize % info.subsampling[i].y) != 0)
+			return false;
+	}
+	
+	return true;
+}
+
+
+static bool
+EncodeTilesParallel(OutputFile &file, const FileInfo &info, const Buffer &buffer,
+					const opj_cparameters_t &params, OPJ_CODEC_FORMAT format,
+					unsigned int tilesX, unsigned int tilesY, unsigned int threads, Progress *progress)
+{
+	// only for raw codestreams, we'd have to patch up the boxes for JP2
+	assert(format == OPJ_CODEC_J2K);
+	
+	if(format != OPJ_CODEC_J2K || (tilesX * tilesY) > 0xffff)
+		return false;
+	
+	TileEncodeContext context(info, buffer, params, format, progress, tilesX, tilesY);
+	
+	ParallelFor(EncodeTile, &context, context.tileCount, std::min(threads, context.tileCount));
+	
+	if(context.failed)
+		return false;
+	
+	// the host asked to stop, so that's not an error, but there's nothing to write
+	if(!context.keepGoing)
+		return true;
+	
+	return WriteTileCodestreams(file, info, context.codestreams);
+}
+
+
+void
+OpenJPEGCodec::WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer, Progress *progress)
+{
+	assert(file.Tell() == 0);
+	
+	
+	bool success = true;
+	
+	
+	// TODO: enable JP2
+	// Only writing J2K format right now because JP2 is trying to skip past the end of
+	// the file.  Is that really a good idea?  What does fseek() do?
+	
+	//const OPJ_CODEC_FORMAT format = (info.format == J2C ? OPJ_CODEC_J2K : OPJ_CODEC_JP2);
+	const OPJ_CODEC_FORMAT format = OPJ_CODEC_J2K;
+	
+	opj_cparameters_t params;
+	
+	SetupEncoderParameters(params, info);
+	
+	
+	const unsigned int threads = (info.settings.threads > 0 ? info.settings.threads : NumberOfCPUs());
+	
+	// cinema turns tiling off whatever the settings say
+	const unsigned int tileSize = (params.tile_size_on ? info.settings.tileSize : 0);
+	const unsigned int tilesX = (tileSize > 0 ? CeilDiv(info.width, tileSize) : 1);
+	const unsigned int tilesY = (tileSize > 0 ? CeilDiv(info.height, tileSize) : 1);
+	
+#ifndef J2K_OPENJPEG_ENCODER_THREADS
+	if(threads > 1 && (tilesX * tilesY) > 1 && format == OPJ_CODEC_J2K && TilesAlignWithSubsampling(info, tileSize))
+	{
+		success = EncodeTilesParallel(file, info, buffer, params, format, tilesX, tilesY, threads, progress);
+	}
+	else
+#endif
+	{
+		// for TLM we need the tile-part lengths before we write the main header
+		const bool tileLengths = (info.settings.lengthMarkers && format == OPJ_CODEC_J2K);
+		
+		MemoryOutputStream output;
+		
+		opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_FALSE);
+		
+		if(stream)
+		{
+			if(tileLengths)
+			{
+				opj_stream_set_user_data(stream, &output, NULL);
+				opj_stream_set_write_function(stream, MemoryOutputStreamWrite);
+				opj_stream_set_skip_function(stream, MemoryOutputStreamSkip);
+				opj_stream_set_seek_function(stream, MemoryOutputStreamSeek);
+			}
+			else
+			{
+				opj_stream_set_user_data(stream, &file, NULL);
+				opj_stream_set_read_function(stream, OutputStreamRead);
+				opj_stream_set_write_function(stream, OutputStreamWrite);
+				opj_stream_set_skip_function(stream, OutputStreamSkip);
+				opj_stream_set_seek_function(stream, OutputStreamSeek);
+			}
+			
+			opj_image_t *image = CreateEncodeImage(info, buffer, 0, 0, info.width, info.height);
+			
+			if(image)
+			{
+				success = Encode(stream, image, params, format, threads, info.settings.lengthMarkers);
+				
+				opj_image_destroy(image);
+			}
+			else
+				success = false;
+			
+			opj_stream_destroy(stream);
+			
+			if(success && tileLengths)
+				success = WriteWithTileLengths(file, output.data);
+		}
+		else
+			success = false;
+	}
+	
+	
 	if(!success)
 		throw Exception("Error writing file");
 }
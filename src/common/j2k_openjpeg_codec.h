@@ -27,29 +27,59 @@
 #define J2K_OPENJPEG_CODEC_H
 
 #include "j2k_codec.h"
+#include "j2k_thread.h"
+
+#include <list>
 
 
 namespace j2k
 {
 
 
+struct DecoderKey;
+class DecoderContext;
+
 class OpenJPEGCodec : public Codec
 {
   public:
-	OpenJPEGCodec() {}
-	virtual ~OpenJPEGCodec() {}
+	OpenJPEGCodec();
+	virtual ~OpenJPEGCodec();
 	
 	virtual const char * Name() const { return "OpenJPEG"; }
 	virtual const char * FourCharCode() const { return "ojpg"; }
 	
-	virtual ReadFlags GetReadFlags() { return (J2K_CAN_READ | J2K_CAN_SUBSAMPLE); }
+	virtual ReadFlags GetReadFlags() { return (J2K_CAN_READ | J2K_CAN_SUBSAMPLE | J2K_CAN_READ_REGION | J2K_SESSION_THREADS); }
 	virtual WriteFlags GetWriteFlags() { return (J2K_CAN_WRITE); }
 	
 	virtual bool Verify(InputFile &file);
 	virtual void GetFileInfo(InputFile &file, FileInfo &info);
-	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 1, Progress *progress = NULL);
+	virtual void ReadFile(InputFile &file, const Buffer &buffer, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
+	virtual void ReadRegion(InputFile &file, const Buffer &buffer, const Rect &region, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
 	
 	virtual void WriteFile(OutputFile &file, const FileInfo &info, const Buffer &buffer, Progress *progress = NULL);
+	
+	virtual DecodeSession * CreateDecodeSession();
+	
+	// Raw codestreams with TLM markers can be read by handing OpenJPEG only
+	// the tiles, resolutions or layers a read needs.  Off unless asked for,
+	// or J2K_SPARSE_READS=1 is in the environment.  After Effects turns it on.
+	void SetSparseReads(bool sparse) { _sparseReads = sparse; }
+	bool GetSparseReads() const { return _sparseReads; }
+	
+  private:
+	friend class OpenJPEGDecodeSession;
+	
+	void Decode(InputFile &file, const Buffer &buffer, const Rect *region, unsigned int subsample, unsigned int layers,
+				Progress *progress, DecoderContext *sessionContext, unsigned int threads);
+	
+	// contexts for decodes that aren't part of a session
+	DecoderContext * AcquireContext(const DecoderKey &key);
+	void ReleaseContext(DecoderContext *context);
+	
+	std::list<DecoderContext *> _contextPool;
+	Mutex _poolMutex;
+	
+	bool _sparseReads;
 };
 
 
@@ -28,13 +28,56 @@
 #include "j2k_exception.h"
 
 #include <assert.h>
+#include <stdio.h>
+
+#ifdef J2K_POSIX_IO
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <string.h>
+	
+	#include <algorithm>
+#endif
 
 using j2k::Exception;
 
+
+static std::string
+MakeCacheKey(const std::string &path, unsigned long long size, unsigned long long modDate)
+{
+	char numbers[64];
+	
+	sprintf(numbers, ":%llu:%llu", size, modDate);
+	
+	return (path + numbers);
+}
+
+#if !defined(J2K_POSIX_IO)
+// UTF-16 path as-is, only used to tell files apart
+static std::string
+PathBytes(const uint16_t *path)
+{
+	std::string result;
+	
+	while(*path != 0)
+	{
+		result += static_cast<char>(*path & 0xff);
+		result += static_cast<char>(*path >> 8);
+		
+		path++;
+	}
+	
+	return result;
+}
+#endif
+
 #if defined(__APPLE__) || defined(macintosh)
 
 PlatformInputFile::PlatformInputFile(const char *path) :
-	InputFile()
+	InputFile(),
+	_path(path)
 {
 	OSErr result = noErr;
 	
@@ -63,7 +106,8 @@ PlatformInputFile::PlatformInputFile(const char *path) :
 
 
 PlatformInputFile::PlatformInputFile(const uint16_t *path) :
-	InputFile()
+	InputFile(),
+	_path( PathBytes(path) )
 {
 	OSErr result = noErr;
 	
@@ -155,6 +199,26 @@ PlatformInputFile::Tell()
 }
 
 
+std::string
+PlatformInputFile::CacheKey()
+{
+	FSCatalogInfo catalogInfo;
+	
+	OSErr result = FSGetCatalogInfo(&_fsRef, (kFSCatInfoContentMod | kFSCatInfoDataSizes), &catalogInfo, NULL, NULL, NULL);
+	
+	if(result != noErr)
+		return std::string();
+	
+	const UTCDateTime &mod = catalogInfo.contentModDate;
+	
+	const unsigned long long modDate = ((unsigned long long)mod.highSeconds << 48) |
+										((unsigned long long)mod.lowSeconds << 16) |
+										mod.fraction;
+	
+	return MakeCacheKey(_path, catalogInfo.dataLogicalSize, modDate);
+}
+
+
 PlatformOutputFile::PlatformOutputFile(const char *path) :
 	OutputFile()
 {
@@ -364,11 +428,12 @@ PlatformOutputFile::Tell()
 }
 
 
-#else
+#elif defined(WIN32)
 
 
 PlatformInputFile::PlatformInputFile(const char *path) :
-	InputFile()
+	InputFile(),
+	_path(path)
 {
 	_hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
@@ -378,7 +443,8 @@ PlatformInputFile::PlatformInputFile(const char *path) :
 
 
 PlatformInputFile::PlatformInputFile(const uint16_t *path) :
-	InputFile()
+	InputFile(),
+	_path( PathBytes(path) )
 {
 	_hFile = CreateFileW((LPCWSTR)path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
@@ -442,6 +508,21 @@ PlatformInputFile::Tell()
 }
 
 
+std::string
+PlatformInputFile::CacheKey()
+{
+	LARGE_INTEGER size;
+	FILETIME writeTime;
+	
+	if(!GetFileSizeEx(_hFile, &size) || !GetFileTime(_hFile, NULL, NULL, &writeTime))
+		return std::string();
+	
+	const unsigned long long modDate = ((unsigned long long)writeTime.dwHighDateTime << 32) | writeTime.dwLowDateTime;
+	
+	return MakeCacheKey(_path, size.QuadPart, modDate);
+}
+
+
 PlatformOutputFile::PlatformOutputFile(const char *path) :
 	OutputFile()
 {
@@ -520,5 +601,312 @@ PlatformOutputFile::Tell()
 	return pos;
 }
 
+#else // J2K_POSIX_IO
+
+
+// AE hands us UTF-16 paths, the file system wants UTF-8
+static std::string
+UTF16toUTF8(const uint16_t *path)
+{
+	std::string result;
+	
+	while(*path != 0)
+	{
+		unsigned int c = *path++;
+		
+		if(c >= 0xd800 && c <= 0xdbff && *path >= 0xdc00 && *path <= 0xdfff)
+		{
+			c = 0x10000 + ((c - 0xd800) << 10) + (*path++ - 0xdc00);
+		}
+		
+		if(c < 0x80)
+		{
+			result += static_cast<char>(c);
+		}
+		else if(c < 0x800)
+		{
+			result += static_cast<char>(0xc0 | (c >> 6));
+			result += static_cast<char>(0x80 | (c & 0x3f));
+		}
+		else if(c < 0x10000)
+		{
+			result += static_cast<char>(0xe0 | (c >> 12));
+			result += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+			result += static_cast<char>(0x80 | (c & 0x3f));
+		}
+		else
+		{
+			result += static_cast<char>(0xf0 | (c >> 18));
+			result += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+			result += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+			result += static_cast<char>(0x80 | (c & 0x3f));
+		}
+	}
+	
+	return result;
+}
+
+
+PlatformInputFile::PlatformInputFile(const char *path, bool memoryMap) :
+	InputFile(),
+	_path(path),
+	_fd(-1),
+	_size(0),
+	_position(0),
+	_map(NULL)
+{
+	Open(path, memoryMap);
+}
+
+
+PlatformInputFile::PlatformInputFile(const uint16_t *path, bool memoryMap) :
+	InputFile(),
+	_path( UTF16toUTF8(path) ),
+	_fd(-1),
+	_size(0),
+	_position(0),
+	_map(NULL)
+{
+	Open(_path.c_str(), memoryMap);
+}
+
+
+void
+PlatformInputFile::Open(const char *path, bool memoryMap)
+{
+	_fd = open(path, O_RDONLY);
+	
+	if(_fd < 0)
+		throw Exception("Couldn't open file.");
+	
+	struct stat st;
+	
+	if(fstat(_fd, &st) != 0)
+	{
+		close(_fd);
+		
+		throw Exception("Couldn't stat file.");
+	}
+	
+	_size = st.st_size;
+	
+	if(memoryMap && _size > 0)
+	{
+		void *map = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+		
+		if(map != MAP_FAILED)
+		{
+			_map = (unsigned char *)map;
+			
+			posix_madvise(_map, _size, POSIX_MADV_SEQUENTIAL);
+		}
+	}
+	
+#ifdef POSIX_FADV_SEQUENTIAL
+	// codestreams are mostly read front to back
+	if(_map == NULL)
+		posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+
+PlatformInputFile::~PlatformInputFile()
+{
+	if(_map != NULL)
+	{
+		int result = munmap(_map, _size);
+		
+		assert(result == 0);
+	}
+	
+	if(_fd >= 0)
+	{
+		int result = close(_fd);
+		
+		assert(result == 0);
+	}
+}
+
+
+size_t
+PlatformInputFile::FileSize()
+{
+	return _size;
+}
+
+
+size_t
+PlatformInputFile::Read(void *buf, size_t num_bytes)
+{
+	if(_position >= _size)
+		return 0;
+
+	size_t count = 0;
+	
+	if(_map != NULL)
+	{
+		count = std::min(num_bytes, _size - _position);
+		
+		memcpy(buf, _map + _position, count);
+	}
+	else
+	{
+		unsigned char *dest = (unsigned char *)buf;
+	
+		while(count < num_bytes)
+		{
+			const ssize_t result = pread(_fd, dest + count, num_bytes - count, _position + count);
+			
+			if(result > 0)
+				count += result;
+			else if(result < 0 && errno == EINTR)
+				continue;
+			else
+				break;
+		}
+	}
+	
+	_position += count;
+	
+	return count;
+}
+
+
+bool
+PlatformInputFile::Seek(size_t position)
+{
+	_position = position;
+	
+	return true;
+}
+
+
+size_t
+PlatformInputFile::Tell()
+{
+	return _position;
+}
+
+
+std::string
+PlatformInputFile::CacheKey()
+{
+	struct stat st;
+	
+	if(fstat(_fd, &st) != 0)
+		return std::string();
+	
+	// st_mtime only has seconds, and a file can be rewritten inside one
+	const unsigned long long modDate = ((unsigned long long)st.st_mtim.tv_sec * 1000000000ULL) + st.st_mtim.tv_nsec;
+	
+	return MakeCacheKey(_path, st.st_size, modDate);
+}
+
+
+PlatformOutputFile::PlatformOutputFile(const char *path) :
+	OutputFile(),
+	_fd(-1),
+	_position(0)
+{
+	Open(path);
+}
+
+
+PlatformOutputFile::PlatformOutputFile(const uint16_t *path) :
+	OutputFile(),
+	_fd(-1),
+	_position(0)
+{
+	Open(UTF16toUTF8(path).c_str());
+}
+
+
+void
+PlatformOutputFile::Open(const char *path)
+{
+	// read/write because we say we're J2K_WRITE_READABLE
+	_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	
+	if(_fd < 0)
+		throw Exception("Couldn't open file.");
+}
+
+
+PlatformOutputFile::~PlatformOutputFile()
+{
+	if(_fd >= 0)
+	{
+		int result = close(_fd);
+		
+		assert(result == 0);
+	}
+}
+
+
+size_t
+PlatformOutputFile::Read(void *buf, size_t num_bytes)
+{
+	unsigned char *dest = (unsigned char *)buf;
+	
+	size_t count = 0;
+	
+	while(count < num_bytes)
+	{
+		const ssize_t result = pread(_fd, dest + count, num_bytes - count, _position + count);
+		
+		if(result > 0)
+			count += result;
+		else if(result < 0 && errno == EINTR)
+			continue;
+		else
+			break;
+	}
+	
+	_position += count;
+	
+	return count;
+}
+
+
+size_t
+PlatformOutputFile::Write(const void *buf, size_t num_bytes)
+{
+	const unsigned char *src = (const unsigned char *)buf;
+	
+	size_t count = 0;
+	
+	while(count < num_bytes)
+	{
+		const ssize_t result = pwrite(_fd, src + count, num_bytes - count, _position + count);
+		
+		if(result > 0)
+			count += result;
+		else if(result < 0 && errno == EINTR)
+			continue;
+		else
+			break;
+	}
+	
+	_position += count;
+	
+	return count;
+}
+
+
+bool
+PlatformOutputFile::Seek(size_t position)
+{
+	_position = position;
+	
+	return true;
+}
+
+
+size_t
+PlatformOutputFile::Tell()
+{
+	return _position;
+}
+
 #endif // defined(__APPLE__) || defined(macintosh)
 
@@ -27,6 +27,8 @@
 
 #include "j2k_io.h"
 
+#include <string>
+
 
 #ifdef WIN32
 #include <Windows.h>
@@ -50,22 +52,46 @@ typedef SInt16 FSIORefNum;
 #endif
 #endif // __APPLE__
 
+#if !defined(__APPLE__) && !defined(macintosh) && !defined(WIN32)
+#define J2K_POSIX_IO 1
+#include <stdint.h>
+#include <sys/types.h>
+#endif
+
 
 class PlatformInputFile : public j2k::InputFile
 {
   public:
+#ifdef J2K_POSIX_IO
+	// memoryMap will mmap the whole file instead of calling pread()
+	PlatformInputFile(const char *path, bool memoryMap = false);
+	PlatformInputFile(const uint16_t *path, bool memoryMap = false);
+#else
 	PlatformInputFile(const char *path);
 	PlatformInputFile(const uint16_t *path);
+#endif
 	virtual ~PlatformInputFile();
 	
+#ifdef J2K_POSIX_IO
+	virtual ReadFlags Flags() const { return (_map != NULL ? (J2K_READ_SEEKABLE | J2K_READ_MEMORY) : J2K_READ_SEEKABLE); }
+#else
 	virtual ReadFlags Flags() const { return J2K_READ_SEEKABLE; }
+#endif
 	
 	virtual size_t FileSize();
 	virtual size_t Read(void *buf, size_t num_bytes);
 	virtual bool Seek(size_t position);
 	virtual size_t Tell();
+	
+#ifdef J2K_POSIX_IO
+	virtual const unsigned char * Data() { return _map; }
+#endif
+
+	virtual std::string CacheKey();
 
   private:
+	std::string _path;
+	
 #if defined(__APPLE__) || defined(macintosh)
 	FSRef _fsRef;
 	FSIORefNum _refNum;
@@ -74,6 +100,15 @@ class PlatformInputFile : public j2k::InputFile
 #ifdef WIN32
 	HANDLE _hFile;
 #endif
+
+#ifdef J2K_POSIX_IO
+	void Open(const char *path, bool memoryMap);
+
+	int _fd;
+	size_t _size;
+	size_t _position; // we keep our own position and use pread()
+	unsigned char *_map;
+#endif
 };
 
 
@@ -100,6 +135,13 @@ class PlatformOutputFile : public j2k::OutputFile
 #ifdef WIN32
 	HANDLE _hFile;
 #endif
+
+#ifdef J2K_POSIX_IO
+	void Open(const char *path);
+
+	int _fd;
+	size_t _position;
+#endif
 };
 
 
@@ -24,33 +24,171 @@
 
 #include "j2k_rgba_file.h"
 
+#include "j2k_cache.h"
 #include "j2k_exception.h"
+#include "j2k_scratch.h"
+#include "j2k_selector.h"
+#include "j2k_simd.h"
+#include "j2k_thread.h"
 
 #include <assert.h>
+#include <math.h>
+#include <string.h>
 #include <algorithm>
+#include <vector>
 
 namespace j2k
 {
 
+// The palette expanded to the output's type and depth, so each index is a
+// single lookup.  Interleaved outputs get whole pixels, alpha included, in
+// table[0].  Otherwise r, g, and b get their own tables.
+typedef struct PackedLUT
+{
+	SampleType sampleType;
+	unsigned char depth;
+	bool fifteenPlusOne;
+	bool interleaved;
+	int order[4]; // channel (r, g, b, a) at each pixel position
+	
+	size_t sampleSize;
+	std::vector<unsigned char> table[4];
+	
+	PackedLUT() : sampleType(UCHAR), depth(0), fifteenPlusOne(false), interleaved(false), sampleSize(0) {}
+	
+} PackedLUT;
+
+
 RGBAinputFile::RGBAinputFile(InputFile &file, Codec *codec) :
 	_file(file),
-	_codec(codec)
+	_codec(codec),
+	_session(NULL),
+	_sessionPool(NULL),
+	_selectCodec(codec == NULL),
+	_packedLUT(NULL)
 {
 	if(_codec == NULL)
 	{
+		// parses the header, reads go to whichever codec the selector picks
 		_codec = GetDefaultCodec();
 	}
 	
+	Init();
+}
+
+RGBAinputFile::RGBAinputFile(InputFile &file, DecodeSession &session) :
+	_file(file),
+	_codec(&session.GetCodec()),
+	_session(&session),
+	_sessionPool(NULL),
+	_selectCodec(false),
+	_packedLUT(NULL)
+{
+	Init();
+}
+
+RGBAinputFile::RGBAinputFile(InputFile &file, DecodeSessionPool &pool) :
+	_file(file),
+	_codec(GetDefaultCodec()),
+	_session(NULL),
+	_sessionPool(&pool),
+	_selectCodec(true),
+	_packedLUT(NULL)
+{
+	Init();
+}
+
+void
+RGBAinputFile::Init()
+{
 	if(_codec == NULL)
 		throw Exception("No codec!!!");
 	
-	_codec->GetFileInfo(file, _fileInfo);
+	const std::string cacheKey = _file.CacheKey();
+	
+	FileInfoCache &cache = GetFileInfoCache();
+	
+	if(cacheKey.empty() || !cache.Get(cacheKey, *_codec, _fileInfo))
+	{
+		_codec->GetFileInfo(_file, _fileInfo);
+		
+		if(!cacheKey.empty())
+			cache.Put(cacheKey, *_codec, _fileInfo);
+	}
 }
 
 RGBAinputFile::~RGBAinputFile()
 {
 	if(_fileInfo.iccProfile != NULL)
 		free(_fileInfo.iccProfile);
+	
+	delete _packedLUT;
+}
+
+
+Codec::ReadFlags
+RGBAinputFile::ReadFlags() const
+{
+	if(!_selectCodec)
+		return _codec->GetReadFlags();
+	
+	// the selector will find a codec that can do it
+	Codec::ReadFlags flags = Codec::J2K_CAN_NOT_READ;
+	
+	const CodecList &codecList = GetCodecList();
+	
+	for(CodecList::const_iterator i = codecList.begin(); i != codecList.end(); ++i)
+		flags |= (*i)->GetReadFlags();
+	
+	return flags;
+}
+
+
+// Same test as CopyBufferInterleaved() in j2k_codec.cpp.  Returns the first
+// pixel, or NULL if the channels aren't interleaved.  order[k] is the channel
+// (r, g, b, a) at pixel position k.
+static unsigned char *
+GetInterleaving(const RGBAbuffer &rgb, size_t sampleSize, int order[4])
+{
+	const Channel *channels[4] = { &rgb.r, &rgb.g, &rgb.b, &rgb.a };
+	
+	if(rgb.r.colbytes != (4 * (intptr_t)sampleSize))
+		return NULL;
+	
+	unsigned char *base = rgb.r.buf;
+	
+	for(int c=0; c < 4; c++)
+	{
+		const Channel &chan = *channels[c];
+		
+		if(chan.buf == NULL || chan.sampleType != rgb.r.sampleType || chan.colbytes != rgb.r.colbytes ||
+			chan.rowbytes != rgb.r.rowbytes || chan.width != rgb.r.width || chan.height != rgb.r.height ||
+			chan.fifteenPlusOne != rgb.r.fifteenPlusOne)
+			return NULL;
+		
+		if(chan.buf < base)
+			base = chan.buf;
+	}
+	
+	for(int k=0; k < 4; k++)
+		order[k] = -1;
+	
+	for(int c=0; c < 4; c++)
+	{
+		const ptrdiff_t offset = (channels[c]->buf - base);
+		
+		if(offset % sampleSize != 0)
+			return NULL;
+		
+		const ptrdiff_t k = (offset / sampleSize);
+		
+		if(k < 0 || k > 3 || order[k] != -1)
+			return NULL;
+		
+		order[k] = c;
+	}
+	
+	return base;
 }
 
 
@@ -58,46 +196,110 @@ template <typename PIXTYPE>
 static inline PIXTYPE ConvertToType(const unsigned char &val);
 
 template <>
-static inline unsigned char ConvertToType<unsigned char>(const unsigned char &val)
+inline unsigned char ConvertToType<unsigned char>(const unsigned char &val)
 {
 	return val;
 }
 
 template <>
-static inline unsigned short ConvertToType<unsigned short>(const unsigned char &val)
+inline unsigned short ConvertToType<unsigned short>(const unsigned char &val)
 {
 	return (((unsigned short)val << 8) | val);
 }
 
-template <typename PIXTYPE>
+template <>
+inline float ConvertToType<float>(const unsigned char &val)
+{
+	return ((float)val / 255.f);
+}
+
+template <>
+inline Half ConvertToType<Half>(const unsigned char &val)
+{
+	return FloatToHalf((float)val / 255.f);
+}
+
+// A palette sample in the LUT's output type and depth
 static void
-CopyWithLutType(const RGBAbuffer &buffer, const Channel &idxChan, LUTentry LUT[], unsigned int LUTsize, ChannelName LUTmap[])
+StorePaletteSample(unsigned char *dest, unsigned char val, const PackedLUT &lut)
 {
-	const Channel *channels[4] = { &buffer.r,
-									&buffer.g,
-									&buffer.b,
-									&buffer.a };
-	
-	ChannelName names[4] = { RED, GREEN, BLUE, ALPHA };
+	if(lut.sampleType == USHORT)
+	{
+		unsigned short sample = (ConvertToType<unsigned short>(val) >> (16 - lut.depth));
+		
+		if(lut.fifteenPlusOne)
+			sample = To15PlusOne(sample);
+		
+		memcpy(dest, &sample, sizeof(sample));
+	}
+	else if(lut.sampleType == FLOAT)
+	{
+		const float sample = ConvertToType<float>(val);
+		
+		memcpy(dest, &sample, sizeof(sample));
+	}
+	else if(lut.sampleType == HALF)
+	{
+		const Half sample = ConvertToType<Half>(val);
+		
+		memcpy(dest, &sample, sizeof(sample));
+	}
+	else
+	{
+		assert(lut.sampleType == UCHAR);
+		
+		*dest = (ConvertToType<unsigned char>(val) >> (8 - lut.depth));
+	}
+}
 
-	int chanMap[4] = { 0, 1, 2, 3};
+
+// Only rebuilds the tables if the buffer's layout is different from last time
+static void
+PreparePackedLUT(PackedLUT &lut, const FileInfo &info, const RGBAbuffer &buffer)
+{
+	const size_t sampleSize = SizeOfSample(buffer.r.sampleType);
 	
-	bool assigned[4] = { false, false, false, false };
+	int order[4];
 	
+	const bool interleaved = (GetInterleaving(buffer, sampleSize, order) != NULL);
+	
+	if(!lut.table[0].empty() &&
+		lut.sampleType == buffer.r.sampleType &&
+		lut.depth == buffer.r.depth &&
+		lut.fifteenPlusOne == buffer.r.fifteenPlusOne &&
+		lut.interleaved == interleaved &&
+		(!interleaved || std::equal(order, order + 4, lut.order)))
+	{
+		return;
+	}
+	
+	lut.sampleType = buffer.r.sampleType;
+	lut.depth = buffer.r.depth;
+	lut.fifteenPlusOne = buffer.r.fifteenPlusOne;
+	lut.interleaved = interleaved;
+	lut.sampleSize = sampleSize;
+	
+	
+	// which LUT entry channel goes to r, g, and b
+	ChannelName names[3] = { RED, GREEN, BLUE };
+	
+	int chanMap[3] = { 0, 1, 2 };
+	
+	bool assigned[3] = { false, false, false };
 	
 	for(int c=0; c < 3; c++)
 	{
-		const ChannelName j2kName = LUTmap[c];
+		const ChannelName j2kName = info.LUTmap[c];
 		
-		for(int i=0; i < 4; i++)
+		for(int i=0; i < 3; i++)
 		{
-			const ChannelName rgbaName = names[i];
-			
-			if(j2kName == rgbaName)
+			if(j2kName == names[i])
 			{
 				if(assigned[i] == false)
 				{
 					chanMap[i] = c;
+					
+					assigned[i] = true;
 				}
 				else
 					assert(false); // channel appears twice?
@@ -106,57 +308,135 @@ CopyWithLutType(const RGBAbuffer &buffer, const Channel &idxChan, LUTentry LUT[]
 	}
 	
 	
-	const int idxStep = static_cast<const int>(idxChan.colbytes / sizeof(unsigned char));
-	const int rStep = static_cast<const int>(channels[0]->colbytes / sizeof(PIXTYPE));
-	const int gStep = static_cast<const int>(channels[1]->colbytes / sizeof(PIXTYPE));
-	const int bStep = static_cast<const int>(channels[2]->colbytes / sizeof(PIXTYPE));
+	// entries past the end of the file's palette come out black
+	const unsigned char white = 255;
+	
+	if(interleaved)
+	{
+		std::copy(order, order + 4, lut.order);
+		
+		const size_t pixelSize = (4 * sampleSize);
+		
+		lut.table[0].assign(J2K_CODEC_MAX_LUT_ENTRIES * pixelSize, 0);
+		
+		for(int e=0; e < J2K_CODEC_MAX_LUT_ENTRIES; e++)
+		{
+			unsigned char *pixel = &lut.table[0][e * pixelSize];
+			
+			for(int k=0; k < 4; k++)
+			{
+				const int c = order[k];
+				
+				const unsigned char val = (c == 3 ? white :
+											e < (int)info.LUTsize ? info.LUT[e].channel[ chanMap[c] ] :
+											0);
+				
+				StorePaletteSample(pixel + (k * sampleSize), val, lut);
+			}
+		}
+		
+		for(int c=1; c < 4; c++)
+			lut.table[c].clear();
+	}
+	else
+	{
+		for(int c=0; c < 3; c++)
+		{
+			lut.table[c].assign(J2K_CODEC_MAX_LUT_ENTRIES * sampleSize, 0);
+			
+			for(int e=0; e < J2K_CODEC_MAX_LUT_ENTRIES; e++)
+			{
+				const unsigned char val = (e < (int)info.LUTsize ? info.LUT[e].channel[ chanMap[c] ] : 0);
+				
+				StorePaletteSample(&lut.table[c][e * sampleSize], val, lut);
+			}
+		}
+		
+		lut.table[3].clear();
+	}
+}
+
+
+template <typename PIXTYPE>
+static void
+PaletteToChannel(const Channel &dest, const Channel &idxChan, const std::vector<unsigned char> &table)
+{
+	const PIXTYPE *samples = (const PIXTYPE *)&table[0];
 	
+	const int step = static_cast<const int>(dest.colbytes / sizeof(PIXTYPE));
 	
 	for(unsigned int y=0; y < idxChan.height; y++)
 	{
-		unsigned char *idx = (idxChan.buf + (y * idxChan.rowbytes));
-		PIXTYPE *r = (PIXTYPE *)(channels[0]->buf + (y * channels[0]->rowbytes));
-		PIXTYPE *g = (PIXTYPE *)(channels[1]->buf + (y * channels[1]->rowbytes));
-		PIXTYPE *b = (PIXTYPE *)(channels[2]->buf + (y * channels[2]->rowbytes));
+		const unsigned char *idx = (idxChan.buf + (y * idxChan.rowbytes));
+		PIXTYPE *pix = (PIXTYPE *)(dest.buf + (y * dest.rowbytes));
 		
 		for(unsigned int x=0; x < idxChan.width; x++)
 		{
-			const LUTentry &entry = LUT[*idx];
-			
-			*r = ConvertToType<PIXTYPE>(entry.channel[ chanMap[0] ]);
-			*g = ConvertToType<PIXTYPE>(entry.channel[ chanMap[1] ]);
-			*b = ConvertToType<PIXTYPE>(entry.channel[ chanMap[2] ]);
+			*pix = samples[*idx];
 			
-			idx += idxStep;
-			
-			r += rStep;
-			g += gStep;
-			b += bStep;
+			idx += idxChan.colbytes;
+			pix += step;
 		}
 	}
 }
 
-static void
-CopyWithLUT(const RGBAbuffer &buffer, const Channel &idxChan, LUTentry LUT[], unsigned int LUTsize, ChannelName LUTmap[])
+
+// Returns true if alpha got filled in too
+static bool
+CopyWithLUT(const RGBAbuffer &buffer, const Channel &idxChan, const PackedLUT &lut)
 {
 	assert(idxChan.sampleType == UCHAR);
 	assert(idxChan.width == buffer.r.width && idxChan.height == buffer.r.height);
 	assert(idxChan.width == buffer.g.width && idxChan.height == buffer.g.height);
 	assert(idxChan.width == buffer.b.width && idxChan.height == buffer.b.height);
 	
-	const SampleType sampleType = buffer.r.sampleType;
-	
-	assert(buffer.g.sampleType == sampleType && buffer.b.sampleType == sampleType);
+	assert(buffer.g.sampleType == lut.sampleType && buffer.b.sampleType == lut.sampleType);
 	
-	if(sampleType == USHORT)
+	if(lut.interleaved)
 	{
-		CopyWithLutType<unsigned short>(buffer, idxChan, LUT, LUTsize, LUTmap);
+		const size_t pixelSize = (4 * lut.sampleSize);
+		
+		int order[4];
+		
+		unsigned char *base = GetInterleaving(buffer, lut.sampleSize, order);
+		
+		assert(base != NULL);
+		
+		for(unsigned int y=0; y < idxChan.height; y++)
+		{
+			const unsigned char *idx = (idxChan.buf + (y * idxChan.rowbytes));
+			unsigned char *row = (base + (y * buffer.r.rowbytes));
+			
+			if(idxChan.colbytes == 1)
+			{
+				PaletteRow(row, idx, idxChan.width, &lut.table[0][0], static_cast<int>(pixelSize));
+			}
+			else
+			{
+				for(unsigned int x=0; x < idxChan.width; x++)
+					memcpy(row + (x * pixelSize), &lut.table[0][idx[x * idxChan.colbytes] * pixelSize], pixelSize);
+			}
+		}
+		
+		return true;
 	}
 	else
 	{
-		assert(sampleType == UCHAR);
+		const Channel *channels[3] = { &buffer.r, &buffer.g, &buffer.b };
 		
-		CopyWithLutType<unsigned char>(buffer, idxChan, LUT, LUTsize, LUTmap);
+		for(int c=0; c < 3; c++)
+		{
+			if(lut.sampleType == USHORT)
+				PaletteToChannel<unsigned short>(*channels[c], idxChan, lut.table[c]);
+			else if(lut.sampleType == FLOAT)
+				PaletteToChannel<float>(*channels[c], idxChan, lut.table[c]);
+			else if(lut.sampleType == HALF)
+				PaletteToChannel<Half>(*channels[c], idxChan, lut.table[c]);
+			else
+				PaletteToChannel<unsigned char>(*channels[c], idxChan, lut.table[c]);
+		}
+		
+		return false;
 	}
 }
 
@@ -176,244 +456,467 @@ enum YccChannelName
 	CR = BLUE
 };
 
-template <typename PIXTYPE>
-static PIXTYPE Clamp(const int &val, const int &max)
+static inline void
+StoreFloat(float &dest, float val)
 {
-	return std::min<int>(std::max<int>(val, 0), max);
+	dest = val;
 }
 
-template <typename PIXTYPE>
-static void
-FullsYCCtoRGBType(const RGBAbuffer &rgbBuffer, const YCCbuffer &yccBuffer, bool reversible)
+static inline void
+StoreFloat(Half &dest, float val)
 {
-#define ALPHA_R 0.299 // These are exact expressions from which the
-#define ALPHA_G 0.587 // ICT forward and reverse transform coefficients
-#define ALPHA_B 0.114 // may be expressed.
+	dest = FloatToHalf(val);
+}
 
-#define CR_FACT_R (2*(1-ALPHA_R))
-#define CB_FACT_B (2*(1-ALPHA_B))
-#define CR_FACT_G (2*ALPHA_R*(1-ALPHA_R)/ALPHA_G)
-#define CB_FACT_G (2*ALPHA_B*(1-ALPHA_B)/ALPHA_G)
 
-#define CR_FACT_R14 ((A_long)(0.5 + CR_FACT_R*(1<<14)))
-#define CB_FACT_B14 ((A_long)(0.5 + CB_FACT_B*(1<<14)))
-#define CR_FACT_G14 ((A_long)(0.5 + CR_FACT_G*(1<<14)))
-#define CB_FACT_G14 ((A_long)(0.5 + CB_FACT_G*(1<<14)))
+// sYCC is converted a few rows at a time on several threads.  Each row of
+// Y, Cb and Cr is brought up to full width in the output type by
+// Codec::CopyBuffer() (which also does the chroma upsampling), converted by
+// YCCtoRGBRow() and then written out, interleaved if the buffer is.
+// No full size temporary planes.
 
-	const int width = rgbBuffer.r.width;
-	const int height = rgbBuffer.r.height;
+typedef struct YCCcontext
+{
+	const RGBAbuffer *rgb;
+	const YCCbuffer *ycc;
+	const Channel *alpha; // NULL to fill with white
 	
-	const int depth = rgbBuffer.r.depth;
-	const bool sgnd = rgbBuffer.r.sgnd;
+	SampleType rowType; // output type, except FLOAT for HALF
+	unsigned char rowDepth;
 	
-	const int maxVal = static_cast<const int>(sgnd ? pow(2, depth - 1) - 1 : pow(2, depth) - 1);
-	const int signedDiff = static_cast<const int>(sgnd ? 0 : pow(2, depth - 1));
+	int center; // chroma center and white in the output depth
+	int maxVal;
+	float floatCenter;
 	
-	const Channel &yChan = yccBuffer.y;
-	const Channel &cbChan = yccBuffer.cb;
-	const Channel &crChan = yccBuffer.cr;
+	unsigned char *interleavedBase; // NULL if the RGBA channels aren't interleaved
+	int order[4]; // order[k] is the channel (r, g, b, a) at pixel position k
 	
-	const Channel &rChan = rgbBuffer.r;
-	const Channel &gChan = rgbBuffer.g;
-	const Channel &bChan = rgbBuffer.b;
+	unsigned int rowsPerJob;
 	
-	const int yStep = static_cast<const int>(yChan.colbytes / sizeof(PIXTYPE));
-	const int cbStep = static_cast<const int>(cbChan.colbytes / sizeof(PIXTYPE));
-	const int crStep = static_cast<const int>(crChan.colbytes / sizeof(PIXTYPE));
+	std::vector<unsigned char *> scratch; // for each thread
+	size_t copyScratchOffset; // where a thread's Codec::CopyRow() scratch starts
 	
-	const int rStep = static_cast<const int>(rChan.colbytes / sizeof(PIXTYPE));
-	const int gStep = static_cast<const int>(gChan.colbytes / sizeof(PIXTYPE));
-	const int bStep = static_cast<const int>(bChan.colbytes / sizeof(PIXTYPE));
+} YCCcontext;
+
+
+template <typename PIXTYPE>
+static inline void
+StoreRow(const Channel &dest, unsigned int y, const PIXTYPE *row)
+{
+	const int step = static_cast<const int>(dest.colbytes / sizeof(PIXTYPE));
 	
-	for(int y=0; y < height; y++)
+	PIXTYPE *pix = (PIXTYPE *)(dest.buf + (y * dest.rowbytes));
+	
+	for(unsigned int x=0; x < dest.width; x++)
 	{
-		const PIXTYPE *cy= (PIXTYPE *)(yChan.buf + (y * yChan.rowbytes));
-		const PIXTYPE *cb = (PIXTYPE *)(cbChan.buf + (y * cbChan.rowbytes));
-		const PIXTYPE *cr = (PIXTYPE *)(crChan.buf + (y * crChan.rowbytes));
+		*pix = row[x];
 		
-		PIXTYPE *r = (PIXTYPE *)(rChan.buf + (y * rChan.rowbytes));
-		PIXTYPE *g = (PIXTYPE *)(gChan.buf + (y * gChan.rowbytes));
-		PIXTYPE *b = (PIXTYPE *)(bChan.buf + (y * bChan.rowbytes));
+		pix += step;
+	}
+}
+
+static inline void
+StoreRow(const Channel &dest, unsigned int y, const float *row)
+{
+	// float rows can go to half channels
+	if(dest.sampleType == HALF)
+	{
+		const int step = static_cast<const int>(dest.colbytes / sizeof(Half));
+		
+		Half *pix = (Half *)(dest.buf + (y * dest.rowbytes));
 		
-		for(int x=0; x < width; x++)
+		for(unsigned int x=0; x < dest.width; x++)
 		{
-			// make signed
-			const int sY = (int)*cy - signedDiff;
-			const int sCb = (int)*cb - signedDiff;
-			const int sCr = (int)*cr - signedDiff;
+			*pix = FloatToHalf(row[x]);
 			
-			if(reversible)
-			{
-				const int sG = sY - ((sCb + sCr) >> 2);
-				const int sR = sG + sCr;
-				const int sB = sG + sCb;
-				
-				*r = Clamp<PIXTYPE>(sR + signedDiff, maxVal);
-				*g = Clamp<PIXTYPE>(sG + signedDiff, maxVal);
-				*b = Clamp<PIXTYPE>(sB + signedDiff, maxVal);
-			}
-			else
-			{
-				// TODO: is there something about R14 to go here?
-				
-				const float sR = (float)sY + ((float)CR_FACT_R * (float)sCr);
-				const float sG = (float)sY - ((float)CR_FACT_G * (float)sCr) - ((float)CB_FACT_G * (float)sCb);
-				const float sB = (float)sY + ((float)CB_FACT_B * (float)sCb);
-				
-				*r = Clamp<PIXTYPE>(static_cast<const int>(sR + signedDiff + 0.5f), maxVal);
-				*g = Clamp<PIXTYPE>(static_cast<const int>(sG + signedDiff + 0.5f), maxVal);
-				*b = Clamp<PIXTYPE>(static_cast<const int>(sB + signedDiff + 0.5f), maxVal);
-			}
-			
-			
-			cy += yStep;
-			cb += cbStep;
-			cr += crStep;
-			
-			r += rStep;
-			g += gStep;
-			b += bStep;
+			pix += step;
 		}
 	}
+	else
+		StoreRow<float>(dest, y, row);
+}
+
+
+static inline void
+ConvertRows(const YCCcontext &context, unsigned char *r, unsigned char *g, unsigned char *b,
+			const unsigned char *y, const unsigned char *cb, const unsigned char *cr, int count)
+{
+	YCCtoRGBRow(r, g, b, y, cb, cr, count, context.center, context.maxVal);
+}
+
+static inline void
+ConvertRows(const YCCcontext &context, unsigned short *r, unsigned short *g, unsigned short *b,
+			const unsigned short *y, const unsigned short *cb, const unsigned short *cr, int count)
+{
+	YCCtoRGBRow(r, g, b, y, cb, cr, count, context.center, context.maxVal);
+}
+
+static inline void
+ConvertRows(const YCCcontext &context, float *r, float *g, float *b,
+			const float *y, const float *cb, const float *cr, int count)
+{
+	YCCtoRGBRow(r, g, b, y, cb, cr, count, context.floatCenter);
+}
+
+
+template <typename PIXTYPE>
+static inline void
+SetWhite(PIXTYPE &white, const YCCcontext &context)
+{
+	white = static_cast<PIXTYPE>(context.maxVal);
+}
+
+static inline void
+SetWhite(float &white, const YCCcontext &context)
+{
+	white = 1.f;
 }
 
+
+// only 16-bit rows can be 15+1
+template <typename PIXTYPE>
+static inline void
+RowTo15PlusOne(PIXTYPE *row, unsigned int count)
+{
+	assert(false);
+}
+
+static inline void
+RowTo15PlusOne(unsigned short *row, unsigned int count)
+{
+	for(unsigned int x=0; x < count; x++)
+		row[x] = To15PlusOne(row[x]);
+}
+
+
+template <typename PIXTYPE>
 static void
-FullsYCCtoRGB(const RGBAbuffer &rgbBuffer, const YCCbuffer &yccBuffer, bool reversible)
+sYCCtoRGBRows(void *refCon, unsigned int index, unsigned int thread)
 {
-	const SampleType sampleType = rgbBuffer.r.sampleType;
+	const YCCcontext &context = *(const YCCcontext *)refCon;
 	
-	assert(yccBuffer.y.sampleType == sampleType);
+	const RGBAbuffer &rgb = *context.rgb;
+	const YCCbuffer &ycc = *context.ycc;
 	
-	assert(rgbBuffer.r.depth == yccBuffer.y.depth);
+	const unsigned int width = rgb.r.width;
 	
-	assert(yccBuffer.cb.subsampling.x == 1 && yccBuffer.cb.subsampling.y == 1);
-	assert(yccBuffer.cr.subsampling.x == 1 && yccBuffer.cr.subsampling.y == 1);
-
-	if(sampleType == USHORT)
+	PIXTYPE *scratch = (PIXTYPE *)context.scratch[thread];
+	void *copyScratch = (context.scratch[thread] + context.copyScratchOffset);
+	
+	PIXTYPE *yRow = scratch;
+	PIXTYPE *cbRow = yRow + width;
+	PIXTYPE *crRow = cbRow + width;
+	PIXTYPE *rows[4] = { crRow + width,
+							crRow + (2 * width),
+							crRow + (3 * width),
+							crRow + (4 * width) };
+	
+	if(context.alpha == NULL)
 	{
-		FullsYCCtoRGBType<unsigned short>(rgbBuffer, yccBuffer, reversible);
+		PIXTYPE white;
+		
+		SetWhite(white, context);
+		
+		std::fill(rows[3], rows[3] + width, white);
 	}
-	else
+	
+	const Channel *channels[4] = { &rgb.r, &rgb.g, &rgb.b, &rgb.a };
+	
+	const unsigned int y0 = (index * context.rowsPerJob);
+	const unsigned int y1 = std::min<unsigned int>(y0 + context.rowsPerJob, rgb.r.height);
+	
+	for(unsigned int y = y0; y < y1; y++)
 	{
-		assert(sampleType == UCHAR);
+		Codec::CopyRow(yRow, context.rowType, context.rowDepth, width, ycc.y, y, copyScratch);
+		Codec::CopyRow(cbRow, context.rowType, context.rowDepth, width, ycc.cb, y, copyScratch);
+		Codec::CopyRow(crRow, context.rowType, context.rowDepth, width, ycc.cr, y, copyScratch);
+		
+		if(context.alpha != NULL)
+			Codec::CopyRow(rows[3], context.rowType, context.rowDepth, width, *context.alpha, y, copyScratch);
 		
-		FullsYCCtoRGBType<unsigned char>(rgbBuffer, yccBuffer, reversible);
+		ConvertRows(context, rows[0], rows[1], rows[2], yRow, cbRow, crRow, width);
+		
+		if(rgb.r.fifteenPlusOne)
+		{
+			for(int c=0; c < 4; c++)
+				RowTo15PlusOne(rows[c], width);
+		}
+		
+		if(context.interleavedBase != NULL)
+		{
+			const PIXTYPE *pixelRows[4] = { rows[context.order[0]],
+											rows[context.order[1]],
+											rows[context.order[2]],
+											rows[context.order[3]] };
+			
+			InterleaveRows((PIXTYPE *)(context.interleavedBase + (y * rgb.r.rowbytes)), pixelRows, width);
+		}
+		else
+		{
+			for(int c=0; c < 4; c++)
+				StoreRow(*channels[c], y, rows[c]);
+		}
 	}
 }
 
+
 static void
-CopyBuffer(const YCCbuffer &yccDest, const YCCbuffer &yccSrc)
+sYCCtoRGB(const RGBAbuffer &rgbBuffer, const YCCbuffer &yccBuffer, const Channel *alpha,
+			unsigned char fileDepth, unsigned int threads)
 {
-	Buffer dst;
+	// for sYCC I think we always do irreversible
+	const SampleType sampleType = rgbBuffer.r.sampleType;
+	
+	YCCcontext context;
+	
+	context.rgb = &rgbBuffer;
+	context.ycc = &yccBuffer;
+	context.alpha = alpha;
+	
+	context.rowType = (sampleType == HALF ? FLOAT : sampleType);
+	context.rowDepth = (sampleType == HALF ? 32 : rgbBuffer.r.depth);
+	
+	// 15+1 gets converted at the end, so the math is true 16-bit
+	context.center = static_cast<int>(pow(2.0, context.rowDepth - 1));
+	context.maxVal = static_cast<int>(pow(2.0, context.rowDepth) - 1);
+	context.floatCenter = static_cast<float>(pow(2.0, fileDepth - 1) / (pow(2.0, fileDepth) - 1.0));
+	
+	context.interleavedBase = NULL;
+	
+	const size_t sampleSize = SizeOfSample(context.rowType);
+	
+	if(sampleType == HALF)
+		assert(sampleSize == sizeof(float));
+	else
+		context.interleavedBase = GetInterleaving(rgbBuffer, sampleSize, context.order);
+	
+	assert(!rgbBuffer.r.fifteenPlusOne || (sampleType == USHORT && rgbBuffer.r.depth == 16));
+	
+	// bands of rows, enough of them to keep the threads busy
+	const unsigned int height = rgbBuffer.r.height;
+	
+	if(threads < 1)
+		threads = 1;
+	
+	context.rowsPerJob = std::max<unsigned int>(1, height / (threads * 8));
+	
+	const unsigned int jobs = ((height + context.rowsPerJob - 1) / context.rowsPerJob);
 	
-	dst.channels = 3;
-	dst.channel[0] = yccDest.y;
-	dst.channel[1] = yccDest.cb;
-	dst.channel[2] = yccDest.cr;
+	threads = std::min<unsigned int>(threads, std::max<unsigned int>(jobs, 1));
 	
+	// one block for all the threads, each thread's rows on their own cache lines
+	context.copyScratchOffset = ((((7 * sampleSize * rgbBuffer.r.width) + 63) / 64) * 64);
 	
-	Buffer src;
+	const size_t scratchSize = ((((context.copyScratchOffset + Codec::RowScratchSize(rgbBuffer.r.width)) + 63) / 64) * 64);
 	
-	src.channels = 3;
-	src.channel[0] = yccSrc.y;
-	src.channel[1] = yccSrc.cb;
-	src.channel[2] = yccSrc.cr;
+	ScratchBuffer scratch(scratchSize * threads);
 	
+	for(unsigned int t=0; t < threads; t++)
+		context.scratch.push_back(scratch.Get() + (t * scratchSize));
 	
-	Codec::CopyBuffer(dst, src);
+	ParallelProc proc = (context.rowType == USHORT ? sYCCtoRGBRows<unsigned short> :
+							context.rowType == FLOAT ? sYCCtoRGBRows<float> :
+							sYCCtoRGBRows<unsigned char>);
+	
+	assert(context.rowType == UCHAR || context.rowType == USHORT || context.rowType == FLOAT);
+	
+	ParallelFor(proc, &context, jobs, threads);
 }
 
+
+typedef struct RGBtoYCCcontext
+{
+	const RGBAbuffer *rgb;
+	const YCCbuffer *ycc; // in the file depth, Cb and Cr subsampled
+	
+	SampleType rowType; // UCHAR or USHORT, same as the YCC planes
+	unsigned char rowDepth;
+	
+	int center;
+	int maxVal;
+	
+	unsigned int rowsPerJob; // in chroma rows
+	
+	std::vector<unsigned char *> scratch; // for each thread
+	size_t copyScratchOffset; // where a thread's Codec::CopyRow() scratch starts
+	
+} RGBtoYCCcontext;
+
+
+template <typename PIXTYPE>
 static void
-sYCCtoRGB(const RGBAbuffer &rgbBuffer, const YCCbuffer &yccBuffer, bool reversible)
+RGBtoYCCRows(void *refCon, unsigned int index, unsigned int thread)
 {
-	const SampleType sampleType = rgbBuffer.r.sampleType;
-	const unsigned char depth = rgbBuffer.r.depth;
-	const bool sgnd = rgbBuffer.r.sgnd;
+	const RGBtoYCCcontext &context = *(const RGBtoYCCcontext *)refCon;
 	
-	bool reuseBuffer = true;
+	const RGBAbuffer &rgb = *context.rgb;
+	const YCCbuffer &ycc = *context.ycc;
 	
-	const Channel *ycc_channels[3] = { &yccBuffer.y,
-										&yccBuffer.cb,
-										&yccBuffer.cr };
+	const unsigned int width = rgb.r.width;
+	const unsigned int height = rgb.r.height;
 	
-	for(int i=0; i < 3; i++)
+	const Subsampling &sub = ycc.cb.subsampling;
+	
+	assert(sub.x == ycc.cr.subsampling.x && sub.y == ycc.cr.subsampling.y);
+	
+	// ints first for alignment: Y, Cb, Cr, then the Cb and Cr sums, then the RGB rows
+	int *yRow = (int *)context.scratch[thread];
+	int *cbRow = yRow + width;
+	int *crRow = cbRow + width;
+	int *cbSum = crRow + width;
+	int *crSum = cbSum + width;
+	
+	PIXTYPE *rows[3] = { (PIXTYPE *)(crSum + width),
+							(PIXTYPE *)(crSum + width) + width,
+							(PIXTYPE *)(crSum + width) + (2 * width) };
+	
+	void *copyScratch = (context.scratch[thread] + context.copyScratchOffset);
+	
+	const Channel *channels[3] = { &rgb.r, &rgb.g, &rgb.b };
+	
+	const RowConversion straight;
+	
+	const unsigned int cy0 = (index * context.rowsPerJob);
+	const unsigned int cy1 = std::min<unsigned int>(cy0 + context.rowsPerJob, ycc.cb.height);
+	
+	for(unsigned int cy = cy0; cy < cy1; cy++)
 	{
-		const Channel &yccChan = *ycc_channels[i];
+		const unsigned int y0 = (cy * sub.y);
+		const unsigned int y1 = std::min<unsigned int>(y0 + sub.y, height);
+		
+		std::fill(cbSum, cbSum + width, 0);
+		std::fill(crSum, crSum + width, 0);
 		
-		if(yccChan.subsampling.x != 1 ||
-			yccChan.subsampling.y != 1 ||
-			yccChan.sampleType != sampleType ||
-			yccChan.depth != depth ||
-			yccChan.sgnd != sgnd)
+		for(unsigned int y = y0; y < y1; y++)
 		{
-			reuseBuffer = false;
+			for(int c=0; c < 3; c++)
+				Codec::CopyRow(rows[c], context.rowType, context.rowDepth, width, *channels[c], y, copyScratch);
+			
+			RGBtoYCCRow(yRow, cbRow, crRow, rows[0], rows[1], rows[2], width, context.center, context.maxVal);
+			
+			ConvertRow((PIXTYPE *)(ycc.y.buf + (y * ycc.y.rowbytes)), yRow, width, straight);
+			
+			for(unsigned int x=0; x < width; x++)
+			{
+				cbSum[x] += cbRow[x];
+				crSum[x] += crRow[x];
+			}
+		}
+		
+		// box filter the chroma, partial boxes at the right and bottom edges
+		PIXTYPE *cbOut = (PIXTYPE *)(ycc.cb.buf + (cy * ycc.cb.rowbytes));
+		PIXTYPE *crOut = (PIXTYPE *)(ycc.cr.buf + (cy * ycc.cr.rowbytes));
+		
+		for(unsigned int cx=0; cx < ycc.cb.width; cx++)
+		{
+			const unsigned int x0 = (cx * sub.x);
+			const unsigned int x1 = std::min<unsigned int>(x0 + sub.x, width);
+			
+			const int count = ((x1 - x0) * (y1 - y0));
+			
+			int cb = (count / 2);
+			int cr = (count / 2);
+			
+			for(unsigned int x = x0; x < x1; x++)
+			{
+				cb += cbSum[x];
+				cr += crSum[x];
+			}
+			
+			cbOut[cx] = static_cast<PIXTYPE>(cb / count);
+			crOut[cx] = static_cast<PIXTYPE>(cr / count);
 		}
 	}
+}
+
+
+// The YCC planes are already allocated, packed, UCHAR or USHORT in the file depth.
+static void
+RGBtoYCC(const YCCbuffer &yccBuffer, const RGBAbuffer &rgbBuffer, unsigned int threads)
+{
+	// always the irreversible transform, like sYCCtoRGB()
+	RGBtoYCCcontext context;
+	
+	context.rgb = &rgbBuffer;
+	context.ycc = &yccBuffer;
+	
+	context.rowType = yccBuffer.y.sampleType;
+	context.rowDepth = yccBuffer.y.depth;
+	
+	assert(context.rowType == UCHAR || context.rowType == USHORT);
+	assert(yccBuffer.cb.sampleType == context.rowType && yccBuffer.cr.sampleType == context.rowType);
+	
+	context.center = static_cast<int>(pow(2.0, context.rowDepth - 1));
+	context.maxVal = static_cast<int>(pow(2.0, context.rowDepth) - 1);
+	
+	const unsigned int chromaHeight = yccBuffer.cb.height;
+	
+	if(threads < 1)
+		threads = 1;
+	
+	context.rowsPerJob = std::max<unsigned int>(1, chromaHeight / (threads * 8));
+	
+	const unsigned int jobs = ((chromaHeight + context.rowsPerJob - 1) / context.rowsPerJob);
+	
+	threads = std::min<unsigned int>(threads, std::max<unsigned int>(jobs, 1));
+	
+	// one block for all the threads, each thread's rows on their own cache lines
+	context.copyScratchOffset = ((((((5 * sizeof(int)) + (3 * SizeOfSample(context.rowType))) * rgbBuffer.r.width) + 63) / 64) * 64);
+	
+	const size_t scratchSize = ((((context.copyScratchOffset + Codec::RowScratchSize(rgbBuffer.r.width)) + 63) / 64) * 64);
 	
+	ScratchBuffer scratch(scratchSize * threads);
 	
-	YCCbuffer tempBuffer;
+	for(unsigned int t=0; t < threads; t++)
+		context.scratch.push_back(scratch.Get() + (t * scratchSize));
+	
+	ParallelProc proc = (context.rowType == USHORT ? RGBtoYCCRows<unsigned short> : RGBtoYCCRows<unsigned char>);
+	
+	ParallelFor(proc, &context, jobs, threads);
+}
+
+template <typename PIXTYPE>
+static void
+FillChannelType(Channel &channel, bool fillWhite)
+{
+	if(channel.buf == NULL)
+		return;
 
-	const YCCbuffer &fullYccBuffer = (reuseBuffer ? yccBuffer : tempBuffer);
+	const int colstep = static_cast<const int>(channel.colbytes / sizeof(PIXTYPE));
+	
+	const PIXTYPE val = static_cast<const PIXTYPE>(!fillWhite ? 0 :
+													channel.fifteenPlusOne ? 32768 :
+													(pow(2, channel.depth) - 1));
 	
-	if(!reuseBuffer)
+	unsigned char *row = channel.buf;
+	
+	for(unsigned int y=0; y < channel.height; y++)
 	{
-		// need to make a non-subsampled YCC buffer with the same bit depth as the output
-		Channel *temp_channels[3] = { &tempBuffer.y,
-										&tempBuffer.cb,
-										&tempBuffer.cr };
+		PIXTYPE *pix = (PIXTYPE *)(row);
 		
-		for(int i=0; i < 3; i++)
+		for(unsigned int x=0; x < channel.width; x++)
 		{
-			const Channel &subsampledChannel = *ycc_channels[i];
-			
-			Channel &tempChannel = *temp_channels[i];
-			
-			tempChannel.width = (subsampledChannel.width * subsampledChannel.subsampling.x);
-			tempChannel.height = (subsampledChannel.height * subsampledChannel.subsampling.y);
-			
-			tempChannel.subsampling.x = tempChannel.subsampling.y = 1;
-			
-			tempChannel.sampleType = sampleType;
-			tempChannel.depth = depth;
-			tempChannel.sgnd = sgnd;
-			
-			tempChannel.colbytes = SizeOfSample(tempChannel.sampleType);
-			tempChannel.rowbytes = (tempChannel.colbytes * tempChannel.width);
-			tempChannel.buf = (unsigned char *)malloc(tempChannel.rowbytes * tempChannel.height);
+			*pix = val;
 			
-			if(tempChannel.buf == NULL)
-				throw Exception("out of memory");
+			pix += colstep;
 		}
 		
-		CopyBuffer(tempBuffer, yccBuffer);
+		row += channel.rowbytes;
 	}
-	
-	
-	FullsYCCtoRGB(rgbBuffer, fullYccBuffer, false); // for sYCC I think we always do irreversible
-	
-	
-	// free any temp buffers
-	if(tempBuffer.y.buf != NULL)
-		free(tempBuffer.y.buf);
-
-	if(tempBuffer.cb.buf != NULL)
-		free(tempBuffer.cb.buf);
-
-	if(tempBuffer.cr.buf != NULL)
-		free(tempBuffer.cr.buf);	
 }
 
-
 template <typename PIXTYPE>
 static void
-FillChannelType(Channel &channel, bool fillWhite)
+FillChannelFloat(Channel &channel, bool fillWhite)
 {
 	if(channel.buf == NULL)
 		return;
 
 	const int colstep = static_cast<const int>(channel.colbytes / sizeof(PIXTYPE));
 	
-	const PIXTYPE val = static_cast<const uint8_t>(fillWhite ? (pow(2, channel.depth) - 1) : 0);
+	PIXTYPE val;
+	
+	StoreFloat(val, fillWhite ? 1.f : 0.f);
 	
 	unsigned char *row = channel.buf;
 	
@@ -439,6 +942,14 @@ FillChannel(Channel &channel, bool fillWhite)
 	{
 		FillChannelType<unsigned short>(channel, fillWhite);
 	}
+	else if(channel.sampleType == FLOAT)
+	{
+		FillChannelFloat<float>(channel, fillWhite);
+	}
+	else if(channel.sampleType == HALF)
+	{
+		FillChannelFloat<Half>(channel, fillWhite);
+	}
 	else
 	{
 		assert(channel.sampleType == UCHAR);
@@ -448,8 +959,65 @@ FillChannel(Channel &channel, bool fillWhite)
 }
 
 void
-RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *progress)
+RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *progress, unsigned int layers)
+{
+	Read(buffer, NULL, subsample, progress, layers);
+}
+
+
+void
+RGBAinputFile::ReadRegion(RGBAbuffer &buffer, const Rect &region, unsigned int subsample, Progress *progress, unsigned int layers)
+{
+	const bool wholeImage = (region.x == 0 && region.y == 0 &&
+								region.width == _fileInfo.width && region.height == _fileInfo.height);
+
+	if(wholeImage)
+	{
+		Read(buffer, NULL, subsample, progress, layers);
+	}
+	else
+	{
+		if( !(ReadFlags() & Codec::J2K_CAN_READ_REGION) )
+			throw Exception("Codec can't read regions");
+	
+		Read(buffer, &region, subsample, progress, layers);
+	}
+}
+
+
+unsigned int
+RGBAinputFile::DraftLayers() const
+{
+	// Layers usually go up in bit rate geometrically, so the first quarter
+	// of them is well under a quarter of the code-block passes.
+	const unsigned int fileLayers = _fileInfo.settings.layers;
+	
+	return (fileLayers > 1 ? std::max<unsigned int>(1, (fileLayers + 3) / 4) : 0);
+}
+
+static inline unsigned int
+SubsampledRegionSize(unsigned int start, unsigned int size, int subsampling)
+{
+	// samples a subsampled component has between start and start + size
+	return (SubsampledSize(start + size, subsampling) - SubsampledSize(start, subsampling));
+}
+
+
+void
+RGBAinputFile::Read(RGBAbuffer &buffer, const Rect *region, unsigned int subsample, Progress *progress, unsigned int layers)
 {
+	const unsigned int readWidth = (region != NULL ? region->width : _fileInfo.width);
+	const unsigned int readHeight = (region != NULL ? region->height : _fileInfo.height);
+	
+	if(_selectCodec)
+	{
+		const Codec::ReadFlags flags = (Codec::J2K_CAN_READ |
+										(subsample > 1 ? Codec::J2K_CAN_SUBSAMPLE : 0) |
+										(region != NULL ? Codec::J2K_CAN_READ_REGION : 0));
+		
+		_codec = GetCodecSelector().ReadCodec(_fileInfo, subsample, flags);
+	}
+	
 	Channel *channels[4] = { &buffer.r,
 								&buffer.g,
 								&buffer.b,
@@ -469,13 +1037,15 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 	
 	for(int i=0; i < _fileInfo.channels; i++)
 	{
-		if(_fileInfo.subsampling[i].x != 1 || _fileInfo.subsampling[i].x != 1)
+		if(_fileInfo.subsampling[i].x != 1 || _fileInfo.subsampling[i].y != 1)
 			channelSubsampling = true;
 	}
 	
 	
 	const bool reuseChannels = (isRGB && !channelSubsampling);
 	
+	ScratchBuffer planes[J2K_CODEC_MAX_CHANNELS]; // when we can't decode right into the buffer
+	
 	Buffer j2kBuffer;
 	
 	if(reuseChannels)
@@ -507,8 +1077,8 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 						
 						assigned[i] = true;
 						
-						assert(subsample * rgbaChan.width == _fileInfo.width);
-						assert(subsample * rgbaChan.height == _fileInfo.height);
+						assert(rgbaChan.width == (region != NULL ? SubsampledRegionSize(region->x, readWidth, subsample) : SubsampledSize(readWidth, subsample)));
+						assert(rgbaChan.height == (region != NULL ? SubsampledRegionSize(region->y, readHeight, subsample) : SubsampledSize(readHeight, subsample)));
 					}
 					else
 						assert(false); // channel appears twice?
@@ -521,8 +1091,9 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 		// got to make our own
 		assert(effectiveChannels <= J2K_CODEC_MAX_CHANNELS);
 		
-		const SampleType destType = buffer.r.sampleType;
-		const unsigned char destDepth = buffer.r.depth;
+		// half output is done from float planes, which the decoder fills with SIMD
+		const SampleType destType = (buffer.r.sampleType == HALF ? FLOAT : buffer.r.sampleType);
+		const unsigned char destDepth = (buffer.r.sampleType == HALF ? 32 : buffer.r.depth);
 		const bool destSgnd = buffer.r.sgnd;
 		
 		j2kBuffer.channels = std::min<unsigned char>(effectiveChannels, J2K_CODEC_MAX_CHANNELS);
@@ -533,8 +1104,12 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 			
 			const Subsampling &sub = _fileInfo.subsampling[i];
 			
-			j2kChan.width = SubsampledSize(_fileInfo.width, sub.x);
-			j2kChan.height = SubsampledSize(_fileInfo.height, sub.y);
+			// the component's own subsampling on top of the reduction
+			const unsigned int subX = (sub.x * subsample);
+			const unsigned int subY = (sub.y * subsample);
+			
+			j2kChan.width = (region != NULL ? SubsampledRegionSize(region->x, region->width, subX) : SubsampledSize(_fileInfo.width, subX));
+			j2kChan.height = (region != NULL ? SubsampledRegionSize(region->y, region->height, subY) : SubsampledSize(_fileInfo.height, subY));
 			
 			j2kChan.subsampling = sub;
 			
@@ -545,15 +1120,43 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 			j2kChan.colbytes = SizeOfSample(j2kChan.sampleType);
 			j2kChan.rowbytes = (j2kChan.colbytes * j2kChan.width);
 			
-			j2kChan.buf = (unsigned char *)malloc(j2kChan.rowbytes * j2kChan.height);
-			
-			if(j2kChan.buf == NULL)
-				throw Exception("out of memory?");
+			j2kChan.buf = planes[i].Allocate(j2kChan.rowbytes * j2kChan.height);
 		}
 	}
 	
 	
-	_codec->ReadFile(_file, j2kBuffer, subsample, progress);
+	_readTimes = ReadTimes();
+	
+	DecodeSessionLease lease(_sessionPool, *_codec);
+	
+	DecodeSession *session = (lease.Get() != NULL ? lease.Get() : _session);
+	
+	const double startTime = CurrentSeconds();
+	
+	if(session != NULL)
+	{
+		if(region != NULL)
+			session->ReadRegion(_file, j2kBuffer, *region, subsample, progress, layers);
+		else
+			session->ReadFile(_file, j2kBuffer, subsample, progress, layers);
+	}
+	else
+	{
+		if(region != NULL)
+			_codec->ReadRegion(_file, j2kBuffer, *region, subsample, progress, layers);
+		else
+			_codec->ReadFile(_file, j2kBuffer, subsample, progress, layers);
+	}
+	
+	_readTimes.decode = (CurrentSeconds() - startTime);
+	
+	// a partial decode would make the codec look faster than it is
+	if(_session == NULL && _selectCodec && layers == 0 && (progress == NULL || progress->keepGoing))
+	{
+		const double pixels = ((double)j2kBuffer.channel[0].width * (double)j2kBuffer.channel[0].height);
+		
+		GetCodecSelector().ReportRead(_fileInfo, subsample, *_codec, _readTimes.decode, pixels);
+	}
 		
 	
 	
@@ -570,6 +1173,8 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 	}
 	else if( NOABORT() )
 	{
+		const double copyStart = CurrentSeconds();
+		
 		assert(effectiveChannels == j2kBuffer.channels);
 		
 		if(isRGB)
@@ -633,7 +1238,13 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 			{
 				assert(effectiveChannels == 1);
 			
-				CopyWithLUT(buffer, j2kBuffer.channel[0], _fileInfo.LUT, _fileInfo.LUTsize, _fileInfo.LUTmap);
+				// built once and kept for the next read
+				if(_packedLUT == NULL)
+					_packedLUT = new PackedLUT;
+				
+				PreparePackedLUT(*_packedLUT, _fileInfo, buffer);
+				
+				haveAlpha = CopyWithLUT(buffer, j2kBuffer.channel[0], *_packedLUT);
 			}
 			else
 			{
@@ -708,40 +1319,340 @@ RGBAinputFile::ReadFile(RGBAbuffer &buffer, unsigned int subsample, Progress *pr
 			
 			assert(ycc_assigned[0] == true && ycc_assigned[1] == true && ycc_assigned[2] == true);
 			
+			const Channel *alphaChan = NULL;
+			
+			for(int c=3; c < effectiveChannels; c++)
+			{
+				if(_fileInfo.channelMap[c] == ALPHA)
+					alphaChan = &j2kBuffer.channel[c];
+			}
+			
+			const unsigned int threads = ((session != NULL && session->GetThreads() > 0) ?
+											session->GetThreads() : Codec::NumberOfCPUs());
+			
+			sYCCtoRGB(buffer, yccBuffer, alphaChan, _fileInfo.depth, threads);
 			
-			sYCCtoRGB(buffer, yccBuffer, _fileInfo.settings.reversible);
+			haveAlpha = true; // filled in white if the file didn't have any
 		}
 		else
 			assert(false);
 		
+		if(_fileInfo.colorSpace == sYCC && !isRGB && effectiveChannels >= 3)
+			_readTimes.convert = (CurrentSeconds() - copyStart);
+		else
+			_readTimes.copy = (CurrentSeconds() - copyStart);
+	}
+	
+	if(!haveAlpha && NOABORT())
+		FillChannel(buffer.a, true);
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// Area-average resampling: each destination sample is the average of the
+// source area it covers, weighting the partially covered samples at the edges.
+// Also works when enlarging, where it becomes nearest neighbor with blended edges.
+
+typedef struct ResampleAxis
+{
+	std::vector<unsigned int> first;	// first source sample for each destination sample
+	std::vector<unsigned int> count;	// number of source samples
+	std::vector<unsigned int> offset;	// where its weights start
+	std::vector<float> weight;
+	
+	ResampleAxis(unsigned int srcSize, unsigned int destSize);
+	
+} ResampleAxis;
+
+ResampleAxis::ResampleAxis(unsigned int srcSize, unsigned int destSize) :
+	first(destSize),
+	count(destSize),
+	offset(destSize)
+{
+	const double scale = (double)srcSize / (double)destSize;
+	
+	for(unsigned int i=0; i < destSize; i++)
+	{
+		const double start = (i * scale);
+		const double end = std::min<double>((i + 1) * scale, srcSize);
+		
+		const unsigned int s0 = static_cast<unsigned int>(start);
+		const unsigned int s1 = std::min<unsigned int>(static_cast<unsigned int>(ceil(end)), srcSize);
+		
+		first[i] = s0;
+		count[i] = std::max<unsigned int>(s1 - s0, 1);
+		offset[i] = static_cast<unsigned int>(weight.size());
+		
+		const double area = (end - start);
 		
+		for(unsigned int s=s0; s < s0 + count[i]; s++)
+		{
+			const double covered = std::min<double>(s + 1, end) - std::max<double>(s, start);
+			
+			weight.push_back(static_cast<float>(area > 0.0 ? (covered / area) : 1.0));
+		}
 	}
+}
+
+
+template <typename PIXTYPE>
+static inline void
+StoreResampled(PIXTYPE &dest, float val, float maxVal, bool fifteenPlusOne)
+{
+	const PIXTYPE v = static_cast<PIXTYPE>(std::min<float>(std::max<float>(val + 0.5f, 0.f), maxVal));
+	
+	dest = (fifteenPlusOne ? To15PlusOne(v) : v);
+}
+
+static inline void
+StoreResampled(float &dest, float val, float maxVal, bool fifteenPlusOne)
+{
+	dest = val;
+}
+
+static inline void
+StoreResampled(Half &dest, float val, float maxVal, bool fifteenPlusOne)
+{
+	dest = FloatToHalf(val);
+}
+
+
+// source and destination hold the same values except for type (float for
+// half) and 15+1, so this is only filtering
+template <typename DESTTYPE, typename SRCTYPE>
+static void
+ResampleChannel(const Channel &dest, const Channel &src, const ResampleAxis &xAxis, const ResampleAxis &yAxis)
+{
+	if(dest.buf == NULL || src.buf == NULL)
+		return;
+	
+	assert(!dest.sgnd && !src.sgnd);
+	
+	const float maxVal = static_cast<float>(pow(2.0, dest.depth) - 1.0);
+	
+	const int destStep = static_cast<const int>(dest.colbytes / sizeof(DESTTYPE));
+	const int srcStep = static_cast<const int>(src.colbytes / sizeof(SRCTYPE));
 	
-	if(!reuseChannels)
+	std::vector<float> rowSum(src.width);
+	
+	for(unsigned int y=0; y < dest.height; y++)
 	{
-		for(int i=0; i < j2kBuffer.channels; i++)
+		// vertical pass for this row
+		std::fill(rowSum.begin(), rowSum.end(), 0.f);
+		
+		for(unsigned int j=0; j < yAxis.count[y]; j++)
 		{
-			Channel &j2kChan = j2kBuffer.channel[i];
+			const float w = yAxis.weight[yAxis.offset[y] + j];
 			
-			if(j2kChan.buf != NULL)
+			const SRCTYPE *s = (SRCTYPE *)(src.buf + ((yAxis.first[y] + j) * src.rowbytes));
+			
+			for(unsigned int x=0; x < src.width; x++)
 			{
-				free(j2kChan.buf);
+				rowSum[x] += (w * (float)*s);
+				
+				s += srcStep;
 			}
 		}
+		
+		// horizontal pass straight into the destination
+		DESTTYPE *d = (DESTTYPE *)(dest.buf + (y * dest.rowbytes));
+		
+		for(unsigned int x=0; x < dest.width; x++)
+		{
+			const float *r = &rowSum[xAxis.first[x]];
+			const float *w = &xAxis.weight[xAxis.offset[x]];
+			
+			float v = 0.f;
+			
+			for(unsigned int i=0; i < xAxis.count[x]; i++)
+				v += (w[i] * r[i]);
+			
+			StoreResampled(*d, v, maxVal, dest.fifteenPlusOne);
+			
+			d += destStep;
+		}
+	}
+}
+
+template <typename DESTTYPE>
+static void
+ResampleChannel(const Channel &dest, const Channel &src, const ResampleAxis &xAxis, const ResampleAxis &yAxis)
+{
+	if(src.sampleType == USHORT)
+	{
+		ResampleChannel<DESTTYPE, unsigned short>(dest, src, xAxis, yAxis);
 	}
+	else if(src.sampleType == FLOAT)
+	{
+		ResampleChannel<DESTTYPE, float>(dest, src, xAxis, yAxis);
+	}
+	else
+	{
+		assert(src.sampleType == UCHAR);
+		
+		ResampleChannel<DESTTYPE, unsigned char>(dest, src, xAxis, yAxis);
+	}
+}
+
+static void
+ResampleBuffer(const RGBAbuffer &dest, const RGBAbuffer &src)
+{
+	const ResampleAxis xAxis(src.r.width, dest.r.width);
+	const ResampleAxis yAxis(src.r.height, dest.r.height);
 	
-	if(!haveAlpha && NOABORT())
-		FillChannel(buffer.a, true);
+	const Channel *destChannels[4] = { &dest.r, &dest.g, &dest.b, &dest.a };
+	const Channel *srcChannels[4] = { &src.r, &src.g, &src.b, &src.a };
+	
+	for(int i=0; i < 4; i++)
+	{
+		const Channel &d = *destChannels[i];
+		const Channel &s = *srcChannels[i];
+		
+		assert(d.width == dest.r.width && d.height == dest.r.height);
+		assert(s.width == src.r.width && s.height == src.r.height);
+		
+		if(d.sampleType == USHORT)
+		{
+			ResampleChannel<unsigned short>(d, s, xAxis, yAxis);
+		}
+		else if(d.sampleType == FLOAT)
+		{
+			ResampleChannel<float>(d, s, xAxis, yAxis);
+		}
+		else if(d.sampleType == HALF)
+		{
+			ResampleChannel<Half>(d, s, xAxis, yAxis);
+		}
+		else
+		{
+			assert(d.sampleType == UCHAR);
+			
+			ResampleChannel<unsigned char>(d, s, xAxis, yAxis);
+		}
+	}
+}
+
+
+void
+RGBAinputFile::ReadFileScaled(RGBAbuffer &buffer, Progress *progress, unsigned int layers)
+{
+	unsigned int subsample = 1;
+	
+	// as many reductions as the file has wavelet levels, 5 if the codec didn't say
+	const unsigned int maxSubsample = (1U << (_fileInfo.resolutions > 0 ? (_fileInfo.resolutions - 1) : 5));
+	
+	if(ReadFlags() & Codec::J2K_CAN_SUBSAMPLE)
+	{
+		while((subsample * 2) <= maxSubsample &&
+				SubsampledSize(_fileInfo.width, subsample * 2) >= buffer.r.width &&
+				SubsampledSize(_fileInfo.height, subsample * 2) >= buffer.r.height &&
+				(subsample * 2) <= _fileInfo.width && (subsample * 2) <= _fileInfo.height)
+		{
+			subsample *= 2;
+		}
+	}
+	
+	const unsigned int decodeWidth = SubsampledSize(_fileInfo.width, subsample);
+	const unsigned int decodeHeight = SubsampledSize(_fileInfo.height, subsample);
+	
+	if(decodeWidth == buffer.r.width && decodeHeight == buffer.r.height)
+	{
+		Read(buffer, NULL, subsample, progress, layers);
+		
+		return;
+	}
+	
+	
+	// decode into planes at the reduced size, then filter into the buffer
+	RGBAbuffer decodeBuffer;
+	
+	Channel *destChannels[4] = { &buffer.r, &buffer.g, &buffer.b, &buffer.a };
+	Channel *decodeChannels[4] = { &decodeBuffer.r, &decodeBuffer.g, &decodeBuffer.b, &decodeBuffer.a };
+	
+	const SampleType sampleType = (buffer.r.sampleType == HALF ? FLOAT : buffer.r.sampleType);
+	
+	ScratchBuffer planes[4];
+	
+	for(int i=0; i < 4; i++)
+	{
+		Channel &chan = *decodeChannels[i];
+		
+		chan.width = decodeWidth;
+		chan.height = decodeHeight;
+		chan.sampleType = sampleType;
+		chan.depth = (sampleType == FLOAT ? 32 : destChannels[i]->depth);
+		chan.sgnd = destChannels[i]->sgnd;
+		
+		chan.colbytes = SizeOfSample(chan.sampleType);
+		chan.rowbytes = (chan.colbytes * chan.width);
+		
+		chan.buf = planes[i].Allocate(chan.rowbytes * chan.height);
+	}
+	
+	Read(decodeBuffer, NULL, subsample, progress, layers);
+	
+	if(progress == NULL || progress->keepGoing)
+		ResampleBuffer(buffer, decodeBuffer);
+}
+
+
+// The planes come from the ScratchPool, like the ones RGBAinputFile decodes into
+static void
+MakeYCCbuffer(YCCbuffer &ycc, ScratchBuffer scratch[3], const FileInfo &info)
+{
+	// planes in the file depth, Cb and Cr subsampled like their codestream channels
+	Channel *planes[3] = { &ycc.y, &ycc.cb, &ycc.cr };
+	
+	Subsampling sub[3];
+	
+	for(int c=0; c < info.channels; c++)
+	{
+		const ChannelName name = info.channelMap[c];
+		
+		if(name == (ChannelName)Y || name == (ChannelName)CB || name == (ChannelName)CR)
+			sub[name] = info.subsampling[c];
+		else if(info.subsampling[c].x != 1 || info.subsampling[c].y != 1)
+			throw Exception("Only chroma can be subsampled");
+	}
+	
+	if(sub[Y].x != 1 || sub[Y].y != 1)
+		throw Exception("Luminance can't be subsampled");
+	
+	if(sub[CB].x != sub[CR].x || sub[CB].y != sub[CR].y)
+		throw Exception("Cb and Cr must be subsampled the same");
+	
+	for(int i=0; i < 3; i++)
+	{
+		Channel &chan = *planes[i];
+		
+		chan.width = SubsampledSize(info.width, sub[i].x);
+		chan.height = SubsampledSize(info.height, sub[i].y);
+		chan.subsampling = sub[i];
+		
+		chan.sampleType = (info.depth > 8 ? USHORT : UCHAR);
+		chan.depth = info.depth;
+		chan.sgnd = false;
+		
+		chan.colbytes = SizeOfSample(chan.sampleType);
+		chan.rowbytes = (chan.colbytes * chan.width);
+		
+		chan.buf = scratch[i].Allocate(chan.rowbytes * chan.height);
+	}
 }
 
 
 RGBAoutputFile::RGBAoutputFile(OutputFile &file, const FileInfo &info, Codec *codec) :
 	_file(file),
-	_fileInfo(info),
-	_codec(codec)
+	_codec(codec),
+	_fileInfo(info)
 {
 	if(_codec == NULL)
 	{
+		// not the CodecSelector, its trials would switch encoders part way
+		// through a sequence and the frames wouldn't quite match
 		_codec = GetDefaultCodec();
 	}
 	
@@ -775,7 +1686,33 @@ RGBAoutputFile::WriteFile(RGBAbuffer &buffer, Progress *progress)
 	
 	assert(_fileInfo.channels <= J2K_CODEC_MAX_CHANNELS);
 	
-	assert(_fileInfo.colorSpace != sYCC); // TODO: RGB to sYCC conversion
+	
+	// for sYCC, Y, Cb, and Cr take the place of R, G, and B
+	YCCbuffer yccBuffer;
+	
+	ScratchBuffer yccPlanes[3];
+	
+	if(_fileInfo.colorSpace == sYCC)
+	{
+		MakeYCCbuffer(yccBuffer, yccPlanes, _fileInfo);
+		
+		channels[Y] = &yccBuffer.y;
+		channels[CB] = &yccBuffer.cb;
+		channels[CR] = &yccBuffer.cr;
+		
+		const unsigned int threads = (_fileInfo.settings.threads > 0 ? _fileInfo.settings.threads : Codec::NumberOfCPUs());
+		
+		RGBtoYCC(yccBuffer, buffer, threads);
+	}
+	else
+	{
+		for(int c=0; c < _fileInfo.channels; c++)
+		{
+			if(_fileInfo.subsampling[c].x != 1 || _fileInfo.subsampling[c].y != 1)
+				throw Exception("Only sYCC can be subsampled");
+		}
+	}
+	
 	
 	Buffer j2kBuffer;
 	
@@ -809,6 +1746,13 @@ RGBAoutputFile::WriteFile(RGBAbuffer &buffer, Progress *progress)
 	}
 	
 	
+	Write(j2kBuffer, progress);
+}
+
+
+void
+RGBAoutputFile::Write(const Buffer &j2kBuffer, Progress *progress)
+{
 	_codec->WriteFile(_file, _fileInfo, j2kBuffer, progress);
 }
 
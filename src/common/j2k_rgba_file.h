@@ -32,6 +32,9 @@
 namespace j2k
 {
 
+struct PackedLUT;
+class DecodeSessionPool;
+
 typedef struct
 {
 	Channel r;
@@ -42,21 +45,60 @@ typedef struct
 } RGBAbuffer;
 
 
+// Where the last read's time went, in seconds
+typedef struct ReadTimes
+{
+	double decode;	// the codec
+	double copy;	// into the RGBA buffer, through CopyBuffer() or the palette
+	double convert;	// sYCC to RGB, which also does the copy
+	
+	ReadTimes() : decode(0.0), copy(0.0), convert(0.0) {}
+	
+} ReadTimes;
+
+
 class RGBAinputFile
 {
   public:
 	RGBAinputFile(InputFile &file, Codec *codec = NULL);
+	RGBAinputFile(InputFile &file, DecodeSession &session); // reads with the session's codec
+	RGBAinputFile(InputFile &file, DecodeSessionPool &pool); // the selector picks, reads borrow a session for it
 	~RGBAinputFile();
 	
 	const FileInfo & GetFileInfo() const { return _fileInfo; }
 	
-	void ReadFile(RGBAbuffer &buffer, unsigned int subsample = 0, Progress *progress = NULL);
+	// layers caps the quality layers decoded, 0 for all, see DraftLayers()
+	void ReadFile(RGBAbuffer &buffer, unsigned int subsample = 0, Progress *progress = NULL, unsigned int layers = 0);
+	void ReadRegion(RGBAbuffer &buffer, const Rect &region, unsigned int subsample = 1, Progress *progress = NULL, unsigned int layers = 0);
+	
+	// Reads the whole image into a buffer of any size.  Decodes at the smallest
+	// reduction that's still at least as big as the buffer, then filters down.
+	void ReadFileScaled(RGBAbuffer &buffer, Progress *progress = NULL, unsigned int layers = 0);
+	
+	// Quality layers for a draft: enough for a recognizable image, a
+	// fraction of the time.  0 (all) when the file has one layer.
+	unsigned int DraftLayers() const;
+	
+	const ReadTimes & GetReadTimes() const { return _readTimes; }
 	
   private:
+	void Init();
+	void Read(RGBAbuffer &buffer, const Rect *region, unsigned int subsample, Progress *progress, unsigned int layers);
+	
+	Codec::ReadFlags ReadFlags() const;
+	
+
 	InputFile &_file;
 	Codec *_codec;
+	DecodeSession *_session;
+	DecodeSessionPool *_sessionPool;
+	bool _selectCodec; // nobody picked a codec, so the CodecSelector does for each read
 	
 	FileInfo _fileInfo;
+	
+	PackedLUT *_packedLUT; // palette files only
+	
+	ReadTimes _readTimes;
 };
 
 
@@ -69,6 +111,8 @@ class RGBAoutputFile
 	void WriteFile(RGBAbuffer &buffer, Progress *progress = NULL);
 	
   private:
+	void Write(const Buffer &j2kBuffer, Progress *progress);
+	
 	OutputFile &_file;
 	Codec *_codec;
 	
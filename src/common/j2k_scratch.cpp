@@ -0,0 +1,302 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#include "j2k_scratch.h"
+
+#include "j2k_exception.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+	#include <Windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+// blocks this big get mapped, in multiples of a huge page
+#define J2K_SCRATCH_MAP_SIZE (2 * 1024 * 1024)
+
+// small ones get rounded up to this, so slightly different sizes share
+#define J2K_SCRATCH_GRANULE (64 * 1024)
+
+
+namespace j2k
+{
+
+
+static size_t
+DefaultLimit()
+{
+	const char *env = getenv("J2K_SCRATCH_MB");
+	
+	const size_t megabytes = ((env != NULL && atoi(env) >= 0) ? atoi(env) : J2K_SCRATCH_LIMIT_MB);
+	
+	return (megabytes * 1024 * 1024);
+}
+
+
+ScratchPool::ScratchPool() :
+	_idleBytes(0),
+	_limit(DefaultLimit())
+{
+
+}
+
+
+ScratchPool::~ScratchPool()
+{
+	Clear();
+}
+
+
+ScratchPool::Block
+ScratchPool::Allocate(size_t size)
+{
+	Block block;
+	
+	block.ptr = NULL;
+	block.mapped = (size >= J2K_SCRATCH_MAP_SIZE);
+	
+	if(block.mapped)
+	{
+		block.size = (((size + J2K_SCRATCH_MAP_SIZE - 1) / J2K_SCRATCH_MAP_SIZE) * J2K_SCRATCH_MAP_SIZE);
+		
+	#ifdef WIN32
+		// large pages need SeLockMemoryPrivilege, which most users don't have
+		const SIZE_T largePage = GetLargePageMinimum();
+		
+		if(largePage > 0 && (block.size % largePage) == 0)
+			block.ptr = VirtualAlloc(NULL, block.size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+		
+		if(block.ptr == NULL)
+			block.ptr = VirtualAlloc(NULL, block.size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	#else
+		void *ptr = mmap(NULL, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		
+		if(ptr != MAP_FAILED)
+		{
+		#ifdef MADV_HUGEPAGE
+			madvise(ptr, block.size, MADV_HUGEPAGE); // just a hint, transparent huge pages might be off
+		#endif
+			block.ptr = ptr;
+		}
+	#endif
+	}
+	else
+	{
+		block.size = (((size + J2K_SCRATCH_GRANULE - 1) / J2K_SCRATCH_GRANULE) * J2K_SCRATCH_GRANULE);
+		
+		block.ptr = malloc(block.size);
+	}
+	
+	return block;
+}
+
+
+void
+ScratchPool::Free(const Block &block)
+{
+	if(block.mapped)
+	{
+	#ifdef WIN32
+		VirtualFree(block.ptr, 0, MEM_RELEASE);
+	#else
+		munmap(block.ptr, block.size);
+	#endif
+	}
+	else
+		free(block.ptr);
+}
+
+
+void *
+ScratchPool::Acquire(size_t size)
+{
+	if(size == 0)
+		size = 1;
+	
+	{
+		Lock lock(_mutex);
+		
+		// smallest idle block that fits, but not one that's way too big
+		std::list<Block>::iterator best = _idle.end();
+		
+		for(std::list<Block>::iterator i = _idle.begin(); i != _idle.end(); ++i)
+		{
+			if(i->size >= size && i->size <= (2 * size) + J2K_SCRATCH_GRANULE &&
+				(best == _idle.end() || i->size < best->size))
+			{
+				best = i;
+			}
+		}
+		
+		if(best != _idle.end())
+		{
+			const Block block = *best;
+			
+			_idle.erase(best);
+			_idleBytes -= block.size;
+			
+			_inUse[block.ptr] = block;
+			
+			return block.ptr;
+		}
+	}
+	
+	const Block block = Allocate(size);
+	
+	if(block.ptr == NULL)
+		return NULL;
+	
+	Lock lock(_mutex);
+	
+	_inUse[block.ptr] = block;
+	
+	return block.ptr;
+}
+
+
+void
+ScratchPool::Release(void *ptr)
+{
+	if(ptr == NULL)
+		return;
+	
+	std::vector<Block> toFree;
+	
+	{
+		Lock lock(_mutex);
+		
+		std::map<void *, Block>::iterator found = _inUse.find(ptr);
+		
+		assert(found != _inUse.end()); // not one of ours
+		
+		if(found == _inUse.end())
+			return;
+		
+		_idle.push_front(found->second);
+		_idleBytes += found->second.size;
+		
+		_inUse.erase(found);
+		
+		Trim(toFree);
+	}
+	
+	for(size_t i=0; i < toFree.size(); i++)
+		Free(toFree[i]);
+}
+
+
+// call with the mutex locked, frees outside it
+void
+ScratchPool::Trim(std::vector<Block> &toFree)
+{
+	// oldest first
+	while(_idleBytes > _limit && !_idle.empty())
+	{
+		toFree.push_back(_idle.back());
+		
+		_idleBytes -= _idle.back().size;
+		_idle.pop_back();
+	}
+}
+
+
+void
+ScratchPool::SetLimit(size_t bytes)
+{
+	std::vector<Block> toFree;
+	
+	{
+		Lock lock(_mutex);
+		
+		_limit = bytes;
+		
+		Trim(toFree);
+	}
+	
+	for(size_t i=0; i < toFree.size(); i++)
+		Free(toFree[i]);
+}
+
+
+void
+ScratchPool::Clear()
+{
+	std::list<Block> toFree;
+	
+	{
+		Lock lock(_mutex);
+		
+		toFree.swap(_idle);
+		
+		_idleBytes = 0;
+	}
+	
+	for(std::list<Block>::const_iterator i = toFree.begin(); i != toFree.end(); ++i)
+		Free(*i);
+}
+
+
+static ScratchPool g_ScratchPool;
+
+
+ScratchPool & GetScratchPool()
+{
+	return g_ScratchPool;
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+unsigned char *
+ScratchBuffer::Allocate(size_t size)
+{
+	Release();
+	
+	_block = GetScratchPool().Acquire(size);
+	
+	if(_block == NULL)
+		throw Exception("out of memory?");
+	
+	return Get();
+}
+
+
+void
+ScratchBuffer::Release()
+{
+	if(_block != NULL)
+	{
+		GetScratchPool().Release(_block);
+		
+		_block = NULL;
+	}
+}
+
+
+}; // namespace j2k
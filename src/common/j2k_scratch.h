@@ -0,0 +1,112 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef J2K_SCRATCH_H
+#define J2K_SCRATCH_H
+
+#include "j2k_thread.h"
+
+#include <stddef.h>
+#include <list>
+#include <map>
+#include <vector>
+
+#define J2K_SCRATCH_LIMIT_MB 512 // or set J2K_SCRATCH_MB
+
+
+namespace j2k
+{
+
+
+// Keeps the temporary planes RGBAinputFile decodes into from one frame to
+// the next, so a sequence doesn't malloc, page fault and free a few hundred
+// MB every second.  Big blocks are mapped, asking for huge pages where the
+// system has them.  Shared by all threads.
+
+class ScratchPool
+{
+  public:
+	ScratchPool();
+	~ScratchPool();
+	
+	void * Acquire(size_t size);
+	void Release(void *block);
+	
+	// Released blocks are kept until they add up to more than this.
+	// 0 keeps nothing, which is just like malloc and free.
+	void SetLimit(size_t bytes);
+	size_t GetLimit() const { return _limit; }
+	
+	void Clear(); // frees the idle blocks
+	
+  private:
+	typedef struct Block
+	{
+		void *ptr;
+		size_t size;
+		bool mapped;
+		
+	} Block;
+	
+	static Block Allocate(size_t size);
+	static void Free(const Block &block);
+	
+	void Trim(std::vector<Block> &toFree);
+	
+	std::list<Block> _idle; // most recently released at the front
+	std::map<void *, Block> _inUse;
+	
+	size_t _idleBytes;
+	size_t _limit;
+	
+	Mutex _mutex;
+};
+
+
+ScratchPool & GetScratchPool();
+
+
+// A block from the ScratchPool that goes back when this goes out of scope
+class ScratchBuffer
+{
+  public:
+	ScratchBuffer(size_t size = 0) : _block(NULL) { if(size > 0) Allocate(size); }
+	~ScratchBuffer() { Release(); }
+	
+	unsigned char * Allocate(size_t size); // throws if it can't
+	void Release();
+	
+	unsigned char * Get() const { return (unsigned char *)_block; }
+	
+  private:
+	ScratchBuffer(const ScratchBuffer &);
+	ScratchBuffer & operator=(const ScratchBuffer &);
+	
+	void *_block;
+};
+
+
+}; // namespace j2k
+
+#endif // J2K_SCRATCH_H
@@ -0,0 +1,292 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#include "j2k_selector.h"
+
+#ifndef WIN32
+	#include <sys/time.h>
+#endif
+
+#include <stdio.h>
+#include <assert.h>
+
+
+namespace j2k
+{
+
+
+CodecSelector::CodecSelector()
+{
+
+}
+
+
+CodecSelector::~CodecSelector()
+{
+
+}
+
+
+static void
+AppendSubsampling(std::string &group, const FileInfo &info)
+{
+	char sub[32];
+	
+	for(int i=0; i < info.channels; i++)
+	{
+		sprintf(sub, ":%dx%d", info.subsampling[i].x, info.subsampling[i].y);
+		
+		group += sub;
+	}
+}
+
+
+static std::string
+ReadGroup(const FileInfo &info, unsigned int subsample)
+{
+	char group[128];
+	
+	sprintf(group, "r:%d:%ux%u:%d:%d:%u:%d:%u",
+				(int)info.format, info.width, info.height,
+				(int)info.channels, (int)info.depth,
+				(unsigned int)info.settings.tileSize,
+				(int)info.settings.blockModes,
+				(subsample > 1 ? subsample : 1));
+	
+	std::string result = group;
+	
+	AppendSubsampling(result, info);
+	
+	return result;
+}
+
+
+static std::string
+TimingKey(const std::string &group, const Codec &codec)
+{
+	return (group + ":" + codec.FourCharCode());
+}
+
+
+Codec *
+CodecSelector::ReadCodec(const FileInfo &info, unsigned int subsample, Codec::ReadFlags flags)
+{
+	const CodecList &codecList = GetCodecList();
+	
+	std::vector<Codec *> candidates;
+	
+	for(CodecList::const_iterator i = codecList.begin(); i != codecList.end(); ++i)
+	{
+		if(((*i)->GetReadFlags() & flags) == flags)
+			candidates.push_back(*i);
+	}
+	
+	// nobody can do everything asked, so leave it to the default like before
+	if(candidates.empty())
+		return GetDefaultCodec();
+	
+	return Choose(ReadGroup(info, subsample), candidates);
+}
+
+
+void
+CodecSelector::ReportRead(const FileInfo &info, unsigned int subsample, const Codec &codec, double seconds, double pixels)
+{
+	Report(ReadGroup(info, subsample), codec, seconds, pixels);
+}
+
+
+void
+CodecSelector::Clear()
+{
+	Lock lock(_mutex);
+	
+	_timings.clear();
+}
+
+
+Codec *
+CodecSelector::Choose(const std::string &group, const std::vector<Codec *> &candidates)
+{
+	assert(!candidates.empty());
+	
+	if(candidates.size() == 1)
+		return candidates.front();
+	
+	Lock lock(_mutex);
+	
+	Codec *untried = NULL;
+	unsigned int untriedTrials = 0;
+	
+	Codec *fastest = NULL;
+	double fastestTime = 0.0;
+	
+	for(std::vector<Codec *>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		Codec *codec = *i;
+		
+		TimingMap::const_iterator found = _timings.find( TimingKey(group, *codec) );
+		
+		const Timing timing = (found != _timings.end() ? found->second : Timing());
+		
+		if(timing.trials < J2K_SELECTOR_TRIALS)
+		{
+			if(untried == NULL || timing.trials < untriedTrials)
+			{
+				untried = codec;
+				untriedTrials = timing.trials;
+			}
+		}
+		else if(fastest == NULL || timing.secondsPerPixel < fastestTime)
+		{
+			fastest = codec;
+			fastestTime = timing.secondsPerPixel;
+		}
+	}
+	
+	return (untried != NULL ? untried : fastest);
+}
+
+
+void
+CodecSelector::Report(const std::string &group, const Codec &codec, double seconds, double pixels)
+{
+	if(pixels <= 0.0 || seconds < 0.0)
+		return;
+	
+	const double secondsPerPixel = (seconds / pixels);
+	
+	Lock lock(_mutex);
+	
+	Timing &timing = _timings[ TimingKey(group, codec) ];
+	
+	// The best time rather than the average, so the first trial paying
+	// for a codec's start-up or another render hogging the CPU don't count.
+	if(timing.trials == 0 || secondsPerPixel < timing.secondsPerPixel)
+		timing.secondsPerPixel = secondsPerPixel;
+	
+	timing.trials++;
+}
+
+
+static CodecSelector g_CodecSelector;
+
+
+CodecSelector & GetCodecSelector()
+{
+	return g_CodecSelector;
+}
+
+
+DecodeSession *
+DecodeSessionPool::Acquire(Codec &codec)
+{
+	{
+		Lock lock(_mutex);
+		
+		for(std::list<DecodeSession *>::iterator i = _idle.begin(); i != _idle.end(); ++i)
+		{
+			if(&(*i)->GetCodec() == &codec)
+			{
+				DecodeSession *session = *i;
+				
+				_idle.erase(i);
+				
+				return session;
+			}
+		}
+	}
+	
+	return codec.CreateDecodeSession();
+}
+
+
+void
+DecodeSessionPool::Release(DecodeSession *session)
+{
+	DecodeSession *oldest = NULL;
+	
+	{
+		Lock lock(_mutex);
+		
+		_idle.push_front(session);
+		
+		if(_idle.size() > J2K_SESSION_POOL_SIZE)
+		{
+			oldest = _idle.back();
+			
+			_idle.pop_back();
+		}
+	}
+	
+	delete oldest;
+}
+
+
+void
+DecodeSessionPool::Clear()
+{
+	std::list<DecodeSession *> idle;
+	
+	{
+		Lock lock(_mutex);
+		
+		idle.swap(_idle);
+	}
+	
+	for(std::list<DecodeSession *>::iterator i = idle.begin(); i != idle.end(); ++i)
+		delete *i;
+}
+
+
+static DecodeSessionPool g_DecodeSessionPool;
+
+
+DecodeSessionPool & GetDecodeSessionPool()
+{
+	return g_DecodeSessionPool;
+}
+
+
+double
+CurrentSeconds()
+{
+#ifdef WIN32
+	LARGE_INTEGER frequency, count;
+	
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&count);
+	
+	return ((double)count.QuadPart / (double)frequency.QuadPart);
+#else
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	
+	return ((double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0));
+#endif
+}
+
+
+}; // namespace j2k
@@ -0,0 +1,141 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef J2K_SELECTOR_H
+#define J2K_SELECTOR_H
+
+#include "j2k_codec.h"
+#include "j2k_thread.h"
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+
+// times each codec gets to show what it can do on a kind of file
+#define J2K_SELECTOR_TRIALS 2
+
+#define J2K_SESSION_POOL_SIZE 16
+
+
+namespace j2k
+{
+
+
+// Picks the fastest codec for each kind of file by timing the reads we
+// were going to do anyway.  Files are grouped by resolution, tiling and
+// precision.  Until every codec that can do the job has had
+// J2K_SELECTOR_TRIALS turns on a group, the one with the fewest turns gets
+// the next frame.  After that the one with the best time per pixel does.
+// Writes always go to the default codec, so every frame of an export comes
+// from the same encoder.
+
+class CodecSelector
+{
+  public:
+	CodecSelector();
+	~CodecSelector();
+	
+	Codec * ReadCodec(const FileInfo &info, unsigned int subsample, Codec::ReadFlags flags);
+	
+	// only report jobs that finished, pixels is what was decoded
+	void ReportRead(const FileInfo &info, unsigned int subsample, const Codec &codec, double seconds, double pixels);
+	
+	void Clear();
+	
+  private:
+	typedef struct Timing
+	{
+		unsigned int trials;
+		double secondsPerPixel; // best so far
+		
+		Timing() : trials(0), secondsPerPixel(0.0) {}
+		
+	} Timing;
+	
+	typedef std::map<std::string, Timing> TimingMap; // keyed by group and codec
+	
+	Codec * Choose(const std::string &group, const std::vector<Codec *> &candidates);
+	void Report(const std::string &group, const Codec &codec, double seconds, double pixels);
+	
+	TimingMap _timings;
+	
+	Mutex _mutex;
+};
+
+
+CodecSelector & GetCodecSelector();
+
+
+// Idle DecodeSessions for hosts that read a sequence's frames from
+// whichever thread asks, like After Effects.  Each read borrows a session
+// for the codec the selector picked and gives it back afterwards.
+class DecodeSessionPool
+{
+  public:
+	DecodeSessionPool() {}
+	~DecodeSessionPool() { Clear(); }
+	
+	DecodeSession * Acquire(Codec &codec);
+	void Release(DecodeSession *session);
+	
+	void Clear();
+	
+  private:
+	std::list<DecodeSession *> _idle; // most recently released at the front
+	
+	Mutex _mutex;
+};
+
+
+DecodeSessionPool & GetDecodeSessionPool();
+
+
+// A session from the pool that goes back when this goes out of scope.
+// A NULL pool gets no session.
+class DecodeSessionLease
+{
+  public:
+	DecodeSessionLease(DecodeSessionPool *pool, Codec &codec) :
+		_pool(pool), _session(pool != NULL ? pool->Acquire(codec) : NULL) {}
+	~DecodeSessionLease() { if(_session != NULL) _pool->Release(_session); }
+	
+	DecodeSession * Get() const { return _session; }
+	
+  private:
+	DecodeSessionLease(const DecodeSessionLease &);
+	DecodeSessionLease & operator=(const DecodeSessionLease &);
+	
+	DecodeSessionPool *_pool;
+	DecodeSession *_session;
+};
+
+
+// wall clock time, only good for measuring how long something took
+double CurrentSeconds();
+
+
+}; // namespace j2k
+
+#endif // J2K_SELECTOR_H
@@ -0,0 +1,1169 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#include "j2k_simd.h"
+
+#include <algorithm>
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define J2K_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+#if defined(J2K_SSE2) && ((defined(_MSC_VER) && _MSC_VER >= 1700) || defined(__clang__) || \
+		(defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+	#define J2K_AVX2 1
+	#include <immintrin.h>
+	
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define J2K_AVX2_FUNC
+	#else
+		#include <cpuid.h>
+		#define J2K_AVX2_FUNC __attribute__((target("avx2")))
+	#endif
+#endif
+
+namespace j2k
+{
+
+
+#ifdef J2K_AVX2
+static bool
+CPUHasAVX2()
+{
+	unsigned int a, b, c, d;
+	
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	
+	if(info[0] < 7)
+		return false;
+	
+	__cpuid(info, 1);
+	c = info[2];
+#else
+	__cpuid(0, a, b, c, d);
+	
+	if(a < 7)
+		return false;
+	
+	__cpuid(1, a, b, c, d);
+#endif
+
+	const unsigned int OSXSAVE = (1 << 27);
+	const unsigned int AVX = (1 << 28);
+	
+	if((c & (OSXSAVE | AVX)) != (OSXSAVE | AVX))
+		return false;
+	
+	// make sure the OS saves the YMM registers
+#ifdef _MSC_VER
+	const unsigned long long xcr0 = _xgetbv(0);
+#else
+	__asm__ __volatile__ ("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+	const unsigned long long xcr0 = a;
+#endif
+
+	if((xcr0 & 0x6) != 0x6)
+		return false;
+
+#ifdef _MSC_VER
+	__cpuidex(info, 7, 0);
+	b = info[1];
+#else
+	__cpuid_count(7, 0, a, b, c, d);
+#endif
+
+	const unsigned int AVX2 = (1 << 5);
+	
+	return !!(b & AVX2);
+}
+#endif // J2K_AVX2
+
+
+static SIMDLevel
+DetectSIMDLevel()
+{
+#if defined(J2K_AVX2)
+	return (CPUHasAVX2() ? SIMD_AVX2 : SIMD_SSE2);
+#elif defined(J2K_SSE2)
+	return SIMD_SSE2;
+#else
+	return SIMD_NONE;
+#endif
+}
+
+static const SIMDLevel gCPULevel = DetectSIMDLevel();
+static SIMDLevel gSIMDLevel = gCPULevel;
+
+
+SIMDLevel
+GetSIMDLevel()
+{
+	return gSIMDLevel;
+}
+
+
+void
+SetSIMDLevel(SIMDLevel level)
+{
+	gSIMDLevel = (level < gCPULevel ? level : gCPULevel);
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+
+// These have to give exactly the same results as CopyChannel() in j2k_codec.cpp
+template <typename DESTTYPE, typename SRCTYPE>
+static inline void
+ConvertRowScalar(DESTTYPE *dest, const SRCTYPE *src, int count, const RowConversion &conv)
+{
+	if(conv.upShift > 0)
+	{
+		for(int x=0; x < count; x++)
+		{
+			const int v = (src[x] + conv.offset);
+			
+			dest[x] = ((v << conv.upShift) | (v >> conv.fillShift));
+		}
+	}
+	else
+	{
+		for(int x=0; x < count; x++)
+		{
+			const int v = (src[x] + conv.offset);
+			
+			dest[x] = (v >> conv.downShift);
+		}
+	}
+	
+	if(conv.fifteenPlusOne)
+	{
+		for(int x=0; x < count; x++)
+			dest[x] = To15PlusOne(dest[x]);
+	}
+}
+
+
+// int to float goes through the same (float) conversion and one multiply
+// in every version, so these match too
+template <typename SRCTYPE>
+static inline void
+ConvertRowScalar(float *dest, const SRCTYPE *src, int count, const RowConversion &conv)
+{
+	for(int x=0; x < count; x++)
+		dest[x] = ((float)(src[x] + conv.offset) * conv.scale);
+}
+
+
+#ifdef J2K_SSE2
+
+static inline void
+LoadSSE2(__m128i v[4], const unsigned char *src)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i x = _mm_loadu_si128((const __m128i *)src);
+	const __m128i lo = _mm_unpacklo_epi8(x, zero);
+	const __m128i hi = _mm_unpackhi_epi8(x, zero);
+	
+	v[0] = _mm_unpacklo_epi16(lo, zero);
+	v[1] = _mm_unpackhi_epi16(lo, zero);
+	v[2] = _mm_unpacklo_epi16(hi, zero);
+	v[3] = _mm_unpackhi_epi16(hi, zero);
+}
+
+static inline void
+LoadSSE2(__m128i v[4], const unsigned short *src)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i x0 = _mm_loadu_si128((const __m128i *)src);
+	const __m128i x1 = _mm_loadu_si128((const __m128i *)(src + 8));
+	
+	v[0] = _mm_unpacklo_epi16(x0, zero);
+	v[1] = _mm_unpackhi_epi16(x0, zero);
+	v[2] = _mm_unpacklo_epi16(x1, zero);
+	v[3] = _mm_unpackhi_epi16(x1, zero);
+}
+
+static inline void
+LoadSSE2(__m128i v[4], const int *src)
+{
+	for(int i=0; i < 4; i++)
+		v[i] = _mm_loadu_si128((const __m128i *)(src + (4 * i)));
+}
+
+// the packs saturate, so mask or sign extend first to get plain truncation
+static inline void
+StoreSSE2(unsigned char *dest, const __m128i v[4])
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	
+	const __m128i a = _mm_packs_epi32(_mm_and_si128(v[0], mask), _mm_and_si128(v[1], mask));
+	const __m128i b = _mm_packs_epi32(_mm_and_si128(v[2], mask), _mm_and_si128(v[3], mask));
+	
+	_mm_storeu_si128((__m128i *)dest, _mm_packus_epi16(a, b));
+}
+
+static inline __m128i
+Truncate16SSE2(const __m128i &v)
+{
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+// To15PlusOne() on the low 16 bits: (v + (v > 32768)) >> 1
+static inline __m128i
+To15PlusOneSSE2(const __m128i &v)
+{
+	const __m128i t = _mm_and_si128(v, _mm_set1_epi32(0xffff));
+	
+	return _mm_srli_epi32(_mm_sub_epi32(t, _mm_cmpgt_epi32(t, _mm_set1_epi32(32768))), 1);
+}
+
+static inline void
+StoreSSE2(unsigned short *dest, const __m128i v[4])
+{
+	_mm_storeu_si128((__m128i *)dest, _mm_packs_epi32(Truncate16SSE2(v[0]), Truncate16SSE2(v[1])));
+	_mm_storeu_si128((__m128i *)(dest + 8), _mm_packs_epi32(Truncate16SSE2(v[2]), Truncate16SSE2(v[3])));
+}
+
+template <typename DESTTYPE, typename SRCTYPE>
+static int
+ConvertRowSSE2(DESTTYPE *dest, const SRCTYPE *src, int count, const RowConversion &conv)
+{
+	const __m128i offset = _mm_set1_epi32(conv.offset);
+	const __m128i upShift = _mm_cvtsi32_si128(conv.upShift);
+	const __m128i fillShift = _mm_cvtsi32_si128(conv.fillShift);
+	const __m128i downShift = _mm_cvtsi32_si128(conv.downShift);
+	
+	const bool up = (conv.upShift > 0);
+	
+	int x = 0;
+	
+	for(; x + 16 <= count; x += 16)
+	{
+		__m128i v[4];
+		
+		LoadSSE2(v, src + x);
+		
+		for(int i=0; i < 4; i++)
+		{
+			const __m128i t = _mm_add_epi32(v[i], offset);
+			
+			v[i] = up ? _mm_or_si128(_mm_sll_epi32(t, upShift), _mm_sra_epi32(t, fillShift)) :
+						_mm_sra_epi32(t, downShift);
+			
+			if(conv.fifteenPlusOne)
+				v[i] = To15PlusOneSSE2(v[i]);
+		}
+		
+		StoreSSE2(dest + x, v);
+	}
+	
+	return x;
+}
+
+template <typename SRCTYPE>
+static int
+ConvertRowSSE2(float *dest, const SRCTYPE *src, int count, const RowConversion &conv)
+{
+	const __m128i offset = _mm_set1_epi32(conv.offset);
+	const __m128 scale = _mm_set1_ps(conv.scale);
+	
+	int x = 0;
+	
+	for(; x + 16 <= count; x += 16)
+	{
+		__m128i v[4];
+		
+		LoadSSE2(v, src + x);
+		
+		for(int i=0; i < 4; i++)
+			_mm_storeu_ps(dest + x + (4 * i), _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(v[i], offset)), scale));
+	}
+	
+	return x;
+}
+
+#endif // J2K_SSE2
+
+
+#ifdef J2K_AVX2
+
+static inline J2K_AVX2_FUNC void
+LoadAVX2(__m256i v[4], const unsigned char *src)
+{
+	for(int i=0; i < 4; i++)
+		v[i] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + (8 * i))));
+}
+
+static inline J2K_AVX2_FUNC void
+LoadAVX2(__m256i v[4], const unsigned short *src)
+{
+	for(int i=0; i < 4; i++)
+		v[i] = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + (8 * i))));
+}
+
+static inline J2K_AVX2_FUNC void
+LoadAVX2(__m256i v[4], const int *src)
+{
+	for(int i=0; i < 4; i++)
+		v[i] = _mm256_loadu_si256((const __m256i *)(src + (8 * i)));
+}
+
+// AVX2 packs work within each 128-bit lane, so the results need a permute
+static inline J2K_AVX2_FUNC void
+StoreAVX2(unsigned char *dest, const __m256i v[4])
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	
+	const __m256i a = _mm256_packs_epi32(_mm256_and_si256(v[0], mask), _mm256_and_si256(v[1], mask));
+	const __m256i b = _mm256_packs_epi32(_mm256_and_si256(v[2], mask), _mm256_and_si256(v[3], mask));
+	
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	
+	_mm256_storeu_si256((__m256i *)dest, _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), order));
+}
+
+static inline J2K_AVX2_FUNC __m256i
+Truncate16AVX2(const __m256i &v)
+{
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+static inline J2K_AVX2_FUNC __m256i
+To15PlusOneAVX2(const __m256i &v)
+{
+	const __m256i t = _mm256_and_si256(v, _mm256_set1_epi32(0xffff));
+	
+	return _mm256_srli_epi32(_mm256_sub_epi32(t, _mm256_cmpgt_epi32(t, _mm256_set1_epi32(32768))), 1);
+}
+
+static inline J2K_AVX2_FUNC void
+StoreAVX2(unsigned short *dest, const __m256i v[4])
+{
+	const __m256i a = _mm256_packs_epi32(Truncate16AVX2(v[0]), Truncate16AVX2(v[1]));
+	const __m256i b = _mm256_packs_epi32(Truncate16AVX2(v[2]), Truncate16AVX2(v[3]));
+	
+	_mm256_storeu_si256((__m256i *)dest, _mm256_permute4x64_epi64(a, 0xd8));
+	_mm256_storeu_si256((__m256i *)(dest + 16), _mm256_permute4x64_epi64(b, 0xd8));
+}
+
+template <typename DESTTYPE, typename SRCTYPE>
+static J2K_AVX2_FUNC int
+ConvertRowAVX2(DESTTYPE *dest, const SRCTYPE *src, int count, const RowConversion &conv)
+{
+	const __m256i offset = _mm256_set1_epi32(conv.offset);
+	const __m128i upShift = _mm_cvtsi32_si128(conv.upShift);
+	const __m128i fillShift = _mm_cvtsi32_si128(conv.fillShift);
+	const __m128i downShift = _mm_cvtsi32_si128(conv.downShift);
+	
+	const bool up = (conv.upShift > 0);
+	
+	int x = 0;
+	
+	for(; x + 32 <= count; x += 32)
+	{
+		__m256i v[4];
+		
+		LoadAVX2(v, src + x);
+		
+		for(int i=0; i < 4; i++)
+		{
+			const __m256i t = _mm256_add_epi32(v[i], offset);
+			
+			v[i] = up ? _mm256_or_si256(_mm256_sll_epi32(t, upShift), _mm256_sra_epi32(t, fillShift)) :
+						_mm256_sra_epi32(t, downShift);
+			
+			if(conv.fifteenPlusOne)
+				v[i] = To15PlusOneAVX2(v[i]);
+		}
+		
+		StoreAVX2(dest + x, v);
+	}
+	
+	return x;
+}
+
+template <typename SRCTYPE>
+static J2K_AVX2_FUNC int
+ConvertRowAVX2(float *dest, const SRCTYPE *src, int count, const RowConversion &conv)
+{
+	const __m256i offset = _mm256_set1_epi32(conv.offset);
+	const __m256 scale = _mm256_set1_ps(conv.scale);
+	
+	int x = 0;
+	
+	for(; x + 32 <= count; x += 32)
+	{
+		__m256i v[4];
+		
+		LoadAVX2(v, src + x);
+		
+		for(int i=0; i < 4; i++)
+			_mm256_storeu_ps(dest + x + (8 * i), _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(v[i], offset)), scale));
+	}
+	
+	return x;
+}
+
+#endif // J2K_AVX2
+
+
+template <typename DESTTYPE, typename SRCTYPE>
+static inline void
+ConvertRowDispatch(DESTTYPE *dest, const SRCTYPE *src, int count, const RowConversion &conv)
+{
+	int done = 0;
+	
+#ifdef J2K_AVX2
+	if(gSIMDLevel >= SIMD_AVX2)
+		done = ConvertRowAVX2(dest, src, count, conv);
+#endif
+
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+		done += ConvertRowSSE2(dest + done, src + done, count - done, conv);
+#endif
+
+	ConvertRowScalar(dest + done, src + done, count - done, conv);
+}
+
+
+void
+ConvertRow(unsigned char *dest, const unsigned char *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(unsigned char *dest, const unsigned short *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(unsigned char *dest, const int *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(unsigned short *dest, const unsigned char *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(unsigned short *dest, const unsigned short *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(unsigned short *dest, const int *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(float *dest, const unsigned char *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(float *dest, const unsigned short *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+void
+ConvertRow(float *dest, const int *src, int count, const RowConversion &conv)
+{
+	ConvertRowDispatch(dest, src, count, conv);
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+
+void
+UpsampleRow2x(unsigned char *dest, const unsigned char *src, int count)
+{
+	int x = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+	{
+		for(; x + 16 <= count; x += 16)
+		{
+			const __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+			
+			_mm_storeu_si128((__m128i *)(dest + (2 * x)), _mm_unpacklo_epi8(v, v));
+			_mm_storeu_si128((__m128i *)(dest + (2 * x) + 16), _mm_unpackhi_epi8(v, v));
+		}
+	}
+#endif
+
+	for(; x < count; x++)
+		dest[2 * x] = dest[(2 * x) + 1] = src[x];
+}
+
+
+void
+UpsampleRow2x(unsigned short *dest, const unsigned short *src, int count)
+{
+	int x = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+	{
+		for(; x + 8 <= count; x += 8)
+		{
+			const __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+			
+			_mm_storeu_si128((__m128i *)(dest + (2 * x)), _mm_unpacklo_epi16(v, v));
+			_mm_storeu_si128((__m128i *)(dest + (2 * x) + 8), _mm_unpackhi_epi16(v, v));
+		}
+	}
+#endif
+
+	for(; x < count; x++)
+		dest[2 * x] = dest[(2 * x) + 1] = src[x];
+}
+
+
+void
+UpsampleRow2x(float *dest, const float *src, int count)
+{
+	int x = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+	{
+		for(; x + 4 <= count; x += 4)
+		{
+			const __m128 v = _mm_loadu_ps(src + x);
+			
+			_mm_storeu_ps(dest + (2 * x), _mm_unpacklo_ps(v, v));
+			_mm_storeu_ps(dest + (2 * x) + 4, _mm_unpackhi_ps(v, v));
+		}
+	}
+#endif
+
+	for(; x < count; x++)
+		dest[2 * x] = dest[(2 * x) + 1] = src[x];
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+
+void
+InterleaveRows(unsigned char *dest, const unsigned char * const rows[4], int count)
+{
+	int x = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+	{
+		for(; x + 16 <= count; x += 16)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i *)(rows[0] + x));
+			const __m128i b = _mm_loadu_si128((const __m128i *)(rows[1] + x));
+			const __m128i c = _mm_loadu_si128((const __m128i *)(rows[2] + x));
+			const __m128i d = _mm_loadu_si128((const __m128i *)(rows[3] + x));
+			
+			const __m128i ab_lo = _mm_unpacklo_epi8(a, b);
+			const __m128i ab_hi = _mm_unpackhi_epi8(a, b);
+			const __m128i cd_lo = _mm_unpacklo_epi8(c, d);
+			const __m128i cd_hi = _mm_unpackhi_epi8(c, d);
+			
+			__m128i *out = (__m128i *)(dest + (4 * x));
+			
+			_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(ab_lo, cd_lo));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(ab_lo, cd_lo));
+			_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(ab_hi, cd_hi));
+			_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(ab_hi, cd_hi));
+		}
+	}
+#endif
+
+	for(; x < count; x++)
+	{
+		unsigned char *pix = dest + (4 * x);
+		
+		pix[0] = rows[0][x];
+		pix[1] = rows[1][x];
+		pix[2] = rows[2][x];
+		pix[3] = rows[3][x];
+	}
+}
+
+
+void
+InterleaveRows(unsigned short *dest, const unsigned short * const rows[4], int count)
+{
+	int x = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+	{
+		for(; x + 8 <= count; x += 8)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i *)(rows[0] + x));
+			const __m128i b = _mm_loadu_si128((const __m128i *)(rows[1] + x));
+			const __m128i c = _mm_loadu_si128((const __m128i *)(rows[2] + x));
+			const __m128i d = _mm_loadu_si128((const __m128i *)(rows[3] + x));
+			
+			const __m128i ab_lo = _mm_unpacklo_epi16(a, b);
+			const __m128i ab_hi = _mm_unpackhi_epi16(a, b);
+			const __m128i cd_lo = _mm_unpacklo_epi16(c, d);
+			const __m128i cd_hi = _mm_unpackhi_epi16(c, d);
+			
+			__m128i *out = (__m128i *)(dest + (4 * x));
+			
+			_mm_storeu_si128(out + 0, _mm_unpacklo_epi32(ab_lo, cd_lo));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi32(ab_lo, cd_lo));
+			_mm_storeu_si128(out + 2, _mm_unpacklo_epi32(ab_hi, cd_hi));
+			_mm_storeu_si128(out + 3, _mm_unpackhi_epi32(ab_hi, cd_hi));
+		}
+	}
+#endif
+
+	for(; x < count; x++)
+	{
+		unsigned short *pix = dest + (4 * x);
+		
+		pix[0] = rows[0][x];
+		pix[1] = rows[1][x];
+		pix[2] = rows[2][x];
+		pix[3] = rows[3][x];
+	}
+}
+
+
+void
+InterleaveRows(float *dest, const float * const rows[4], int count)
+{
+	int x = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+	{
+		for(; x + 4 <= count; x += 4)
+		{
+			__m128 a = _mm_loadu_ps(rows[0] + x);
+			__m128 b = _mm_loadu_ps(rows[1] + x);
+			__m128 c = _mm_loadu_ps(rows[2] + x);
+			__m128 d = _mm_loadu_ps(rows[3] + x);
+			
+			_MM_TRANSPOSE4_PS(a, b, c, d);
+			
+			float *out = dest + (4 * x);
+			
+			_mm_storeu_ps(out + 0, a);
+			_mm_storeu_ps(out + 4, b);
+			_mm_storeu_ps(out + 8, c);
+			_mm_storeu_ps(out + 12, d);
+		}
+	}
+#endif
+
+	for(; x < count; x++)
+	{
+		float *pix = dest + (4 * x);
+		
+		pix[0] = rows[0][x];
+		pix[1] = rows[1][x];
+		pix[2] = rows[2][x];
+		pix[3] = rows[3][x];
+	}
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+#ifdef J2K_AVX2
+
+static J2K_AVX2_FUNC int
+PaletteRow4AVX2(unsigned int *dest, const unsigned char *idx, int count, const unsigned int *table)
+{
+	int x = 0;
+	
+	for(; x + 8 <= count; x += 8)
+	{
+		const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(idx + x)));
+		
+		_mm256_storeu_si256((__m256i *)(dest + x), _mm256_i32gather_epi32((const int *)table, index, 4));
+	}
+	
+	return x;
+}
+
+static J2K_AVX2_FUNC int
+PaletteRow8AVX2(unsigned char *dest, const unsigned char *idx, int count, const unsigned char *table)
+{
+	int x = 0;
+	
+	for(; x + 4 <= count; x += 4)
+	{
+		int four;
+		
+		memcpy(&four, idx + x, 4);
+		
+		const __m128i index = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(four));
+		
+		_mm256_storeu_si256((__m256i *)(dest + (8 * x)), _mm256_i32gather_epi64((const long long *)table, index, 8));
+	}
+	
+	return x;
+}
+
+#endif // J2K_AVX2
+
+
+void
+PaletteRow(void *dest, const unsigned char *idx, int count, const void *table, int pixelSize)
+{
+	unsigned char *out = (unsigned char *)dest;
+	const unsigned char *entries = (const unsigned char *)table;
+	
+	int x = 0;
+	
+	if(pixelSize == 4)
+	{
+	#ifdef J2K_AVX2
+		if(gSIMDLevel >= SIMD_AVX2)
+			x = PaletteRow4AVX2((unsigned int *)out, idx, count, (const unsigned int *)entries);
+	#endif
+		for(; x < count; x++)
+			memcpy(out + (4 * x), entries + (4 * idx[x]), 4);
+	}
+	else if(pixelSize == 8)
+	{
+	#ifdef J2K_AVX2
+		if(gSIMDLevel >= SIMD_AVX2)
+			x = PaletteRow8AVX2(out, idx, count, entries);
+	#endif
+		for(; x < count; x++)
+			memcpy(out + (8 * x), entries + (8 * idx[x]), 8);
+	}
+	else
+	{
+		assert(pixelSize == 16);
+		
+	#ifdef J2K_SSE2
+		if(gSIMDLevel >= SIMD_SSE2)
+		{
+			for(; x < count; x++)
+				_mm_storeu_si128((__m128i *)(out + (16 * x)), _mm_loadu_si128((const __m128i *)(entries + (16 * idx[x]))));
+		}
+	#endif
+		for(; x < count; x++)
+			memcpy(out + (16 * x), entries + (16 * idx[x]), 16);
+	}
+}
+
+
+#ifdef __APPLE__
+#pragma mark-
+#endif
+
+// ICT inverse coefficients, from the same expressions Kakadu uses
+#define ALPHA_R 0.299
+#define ALPHA_G 0.587
+#define ALPHA_B 0.114
+
+static const double CR_FACT_R = (2 * (1 - ALPHA_R));
+static const double CB_FACT_B = (2 * (1 - ALPHA_B));
+static const double CR_FACT_G = (2 * ALPHA_R * (1 - ALPHA_R) / ALPHA_G);
+static const double CB_FACT_G = (2 * ALPHA_B * (1 - ALPHA_B) / ALPHA_G);
+
+// 15-bit fixed point, with R and B's whole parts (both 1) split off so every
+// factor fits in a short, which the SSE2 version needs
+static const int CR_FRAC_R15 = static_cast<int>(0.5 + (CR_FACT_R - 1) * (1 << 15));
+static const int CB_FRAC_B15 = static_cast<int>(0.5 + (CB_FACT_B - 1) * (1 << 15));
+static const int CR_FACT_G15 = static_cast<int>(0.5 + CR_FACT_G * (1 << 15));
+static const int CB_FACT_G15 = static_cast<int>(0.5 + CB_FACT_G * (1 << 15));
+
+
+template <typename PIXTYPE>
+static inline void
+YCCtoRGBRowScalar(PIXTYPE *r, PIXTYPE *g, PIXTYPE *b,
+					const PIXTYPE *y, const PIXTYPE *cb, const PIXTYPE *cr,
+					int count, int center, int maxVal)
+{
+	for(int x=0; x < count; x++)
+	{
+		const int sY = y[x];
+		const int sCb = (cb[x] - center);
+		const int sCr = (cr[x] - center);
+		
+		const int R = sY + sCr + (((CR_FRAC_R15 * sCr) + (1 << 14)) >> 15);
+		const int G = sY + (((-CR_FACT_G15 * sCr) + (-CB_FACT_G15 * sCb) + (1 << 14)) >> 15);
+		const int B = sY + sCb + (((CB_FRAC_B15 * sCb) + (1 << 14)) >> 15);
+		
+		r[x] = std::min<int>(std::max<int>(R, 0), maxVal);
+		g[x] = std::min<int>(std::max<int>(G, 0), maxVal);
+		b[x] = std::min<int>(std::max<int>(B, 0), maxVal);
+	}
+}
+
+
+#ifdef J2K_SSE2
+
+static inline __m128i
+Load8SSE2(const unsigned char *src)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src), _mm_setzero_si128());
+}
+
+static inline __m128i
+Load8SSE2(const unsigned short *src)
+{
+	return _mm_loadu_si128((const __m128i *)src);
+}
+
+// the unsigned packs and min are SSE4, so go through signed with a bias
+static inline void
+Store8SSE2(unsigned char *dest, const __m128i &lo, const __m128i &hi, const __m128i &maxVal)
+{
+	const __m128i v = _mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128());
+	
+	_mm_storel_epi64((__m128i *)dest, _mm_min_epu8(v, maxVal));
+}
+
+static inline void
+Store8SSE2(unsigned short *dest, const __m128i &lo, const __m128i &hi, const __m128i &maxVal)
+{
+	const __m128i bias = _mm_set1_epi32(32768);
+	
+	const __m128i v = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+	
+	_mm_storeu_si128((__m128i *)dest, _mm_xor_si128(_mm_min_epi16(v, maxVal), _mm_set1_epi16((short)0x8000)));
+}
+
+// base + ((pairs . coefficients + round) >> 15)
+static inline __m128i
+FixedPointSSE2(const __m128i &pairs, const __m128i &coefficients, const __m128i &base)
+{
+	const __m128i round = _mm_set1_epi32(1 << 14);
+	
+	return _mm_add_epi32(base, _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(pairs, coefficients), round), 15));
+}
+
+// sign extend the low or high four shorts
+static inline __m128i
+Signed32LoSSE2(const __m128i &v)
+{
+	return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+
+static inline __m128i
+Signed32HiSSE2(const __m128i &v)
+{
+	return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+
+// 16-bit lanes, so Cb and Cr minus center have to fit in a short
+template <typename PIXTYPE>
+static int
+YCCtoRGBRowSSE2(PIXTYPE *r, PIXTYPE *g, PIXTYPE *b,
+				const PIXTYPE *y, const PIXTYPE *cb, const PIXTYPE *cr,
+				int count, int center, int maxVal)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i centerVec = _mm_set1_epi16((short)center);
+	
+	// madd multiplies (Cr, Cb) pairs by these
+	const __m128i rFact = _mm_unpacklo_epi16(_mm_set1_epi16((short)CR_FRAC_R15), zero);
+	const __m128i gFact = _mm_unpacklo_epi16(_mm_set1_epi16((short)-CR_FACT_G15), _mm_set1_epi16((short)-CB_FACT_G15));
+	const __m128i bFact = _mm_unpacklo_epi16(zero, _mm_set1_epi16((short)CB_FRAC_B15));
+	
+	const __m128i maxVec = (sizeof(PIXTYPE) == 1 ? _mm_set1_epi8((char)maxVal) : _mm_set1_epi16((short)(maxVal - 32768)));
+	
+	int x = 0;
+	
+	for(; x + 8 <= count; x += 8)
+	{
+		const __m128i y16 = Load8SSE2(y + x);
+		const __m128i cb16 = _mm_sub_epi16(Load8SSE2(cb + x), centerVec);
+		const __m128i cr16 = _mm_sub_epi16(Load8SSE2(cr + x), centerVec);
+		
+		const __m128i yLo = _mm_unpacklo_epi16(y16, zero);
+		const __m128i yHi = _mm_unpackhi_epi16(y16, zero);
+		
+		const __m128i pairsLo = _mm_unpacklo_epi16(cr16, cb16);
+		const __m128i pairsHi = _mm_unpackhi_epi16(cr16, cb16);
+		
+		const __m128i rBaseLo = _mm_add_epi32(yLo, Signed32LoSSE2(cr16));
+		const __m128i rBaseHi = _mm_add_epi32(yHi, Signed32HiSSE2(cr16));
+		const __m128i bBaseLo = _mm_add_epi32(yLo, Signed32LoSSE2(cb16));
+		const __m128i bBaseHi = _mm_add_epi32(yHi, Signed32HiSSE2(cb16));
+		
+		Store8SSE2(r + x, FixedPointSSE2(pairsLo, rFact, rBaseLo), FixedPointSSE2(pairsHi, rFact, rBaseHi), maxVec);
+		Store8SSE2(g + x, FixedPointSSE2(pairsLo, gFact, yLo), FixedPointSSE2(pairsHi, gFact, yHi), maxVec);
+		Store8SSE2(b + x, FixedPointSSE2(pairsLo, bFact, bBaseLo), FixedPointSSE2(pairsHi, bFact, bBaseHi), maxVec);
+	}
+	
+	return x;
+}
+
+#endif // J2K_SSE2
+
+
+template <typename PIXTYPE>
+static inline void
+YCCtoRGBRowDispatch(PIXTYPE *r, PIXTYPE *g, PIXTYPE *b,
+					const PIXTYPE *y, const PIXTYPE *cb, const PIXTYPE *cr,
+					int count, int center, int maxVal)
+{
+	int done = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2 && center <= 32768)
+		done = YCCtoRGBRowSSE2(r, g, b, y, cb, cr, count, center, maxVal);
+#endif
+
+	YCCtoRGBRowScalar(r + done, g + done, b + done, y + done, cb + done, cr + done, count - done, center, maxVal);
+}
+
+
+void
+YCCtoRGBRow(unsigned char *r, unsigned char *g, unsigned char *b,
+			const unsigned char *y, const unsigned char *cb, const unsigned char *cr,
+			int count, int center, int maxVal)
+{
+	YCCtoRGBRowDispatch(r, g, b, y, cb, cr, count, center, maxVal);
+}
+
+void
+YCCtoRGBRow(unsigned short *r, unsigned short *g, unsigned short *b,
+			const unsigned short *y, const unsigned short *cb, const unsigned short *cr,
+			int count, int center, int maxVal)
+{
+	YCCtoRGBRowDispatch(r, g, b, y, cb, cr, count, center, maxVal);
+}
+
+
+void
+YCCtoRGBRow(float *r, float *g, float *b,
+			const float *y, const float *cb, const float *cr,
+			int count, float center)
+{
+	const float crR = static_cast<float>(CR_FACT_R);
+	const float crG = static_cast<float>(CR_FACT_G);
+	const float cbG = static_cast<float>(CB_FACT_G);
+	const float cbB = static_cast<float>(CB_FACT_B);
+
+	int x = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+	{
+		const __m128 centerVec = _mm_set1_ps(center);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.f);
+		
+		const __m128 crRVec = _mm_set1_ps(crR);
+		const __m128 crGVec = _mm_set1_ps(crG);
+		const __m128 cbGVec = _mm_set1_ps(cbG);
+		const __m128 cbBVec = _mm_set1_ps(cbB);
+		
+		for(; x + 4 <= count; x += 4)
+		{
+			const __m128 yVec = _mm_loadu_ps(y + x);
+			const __m128 sCb = _mm_sub_ps(_mm_loadu_ps(cb + x), centerVec);
+			const __m128 sCr = _mm_sub_ps(_mm_loadu_ps(cr + x), centerVec);
+			
+			const __m128 R = _mm_add_ps(yVec, _mm_mul_ps(crRVec, sCr));
+			const __m128 G = _mm_sub_ps(_mm_sub_ps(yVec, _mm_mul_ps(crGVec, sCr)), _mm_mul_ps(cbGVec, sCb));
+			const __m128 B = _mm_add_ps(yVec, _mm_mul_ps(cbBVec, sCb));
+			
+			_mm_storeu_ps(r + x, _mm_min_ps(_mm_max_ps(R, zero), one));
+			_mm_storeu_ps(g + x, _mm_min_ps(_mm_max_ps(G, zero), one));
+			_mm_storeu_ps(b + x, _mm_min_ps(_mm_max_ps(B, zero), one));
+		}
+	}
+#endif
+
+	for(; x < count; x++)
+	{
+		const float sCb = (cb[x] - center);
+		const float sCr = (cr[x] - center);
+		
+		const float R = y[x] + (crR * sCr);
+		const float G = (y[x] - (crG * sCr)) - (cbG * sCb);
+		const float B = y[x] + (cbB * sCb);
+		
+		r[x] = std::min<float>(std::max<float>(R, 0.f), 1.f);
+		g[x] = std::min<float>(std::max<float>(G, 0.f), 1.f);
+		b[x] = std::min<float>(std::max<float>(B, 0.f), 1.f);
+	}
+}
+
+
+
+// ICT forward coefficients, Cb and Cr are just the inverse factors turned around
+static const float Y_R = static_cast<float>(ALPHA_R);
+static const float Y_G = static_cast<float>(ALPHA_G);
+static const float Y_B = static_cast<float>(ALPHA_B);
+static const float CB_R = static_cast<float>(-ALPHA_R / CB_FACT_B);
+static const float CB_G = static_cast<float>(-ALPHA_G / CB_FACT_B);
+static const float CB_B = 0.5f;
+static const float CR_R = 0.5f;
+static const float CR_G = static_cast<float>(-ALPHA_G / CR_FACT_R);
+static const float CR_B = static_cast<float>(-ALPHA_B / CR_FACT_R);
+
+
+// rounding is add 0.5 and truncate, after clamping, so SSE2 gets the same answers
+template <typename PIXTYPE>
+static inline void
+RGBtoYCCRowScalar(int *y, int *cb, int *cr,
+					const PIXTYPE *r, const PIXTYPE *g, const PIXTYPE *b,
+					int count, int center, int maxVal)
+{
+	const float yOffset = 0.5f;
+	const float cOffset = (static_cast<float>(center) + 0.5f);
+	const float maxFloat = static_cast<float>(maxVal);
+	
+	for(int x=0; x < count; x++)
+	{
+		const float R = r[x];
+		const float G = g[x];
+		const float B = b[x];
+		
+		const float Y = (((Y_R * R) + (Y_G * G)) + (Y_B * B)) + yOffset;
+		const float Cb = (((CB_R * R) + (CB_G * G)) + (CB_B * B)) + cOffset;
+		const float Cr = (((CR_R * R) + (CR_G * G)) + (CR_B * B)) + cOffset;
+		
+		y[x] = static_cast<int>(std::min<float>(std::max<float>(Y, 0.f), maxFloat));
+		cb[x] = static_cast<int>(std::min<float>(std::max<float>(Cb, 0.f), maxFloat));
+		cr[x] = static_cast<int>(std::min<float>(std::max<float>(Cr, 0.f), maxFloat));
+	}
+}
+
+
+#ifdef J2K_SSE2
+
+static inline __m128i
+RGBtoYCCSSE2(const __m128 &R, const __m128 &G, const __m128 &B,
+				float rFact, float gFact, float bFact, const __m128 &offset, const __m128 &maxVal)
+{
+	const __m128 v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(rFact), R),
+														_mm_mul_ps(_mm_set1_ps(gFact), G)),
+											_mm_mul_ps(_mm_set1_ps(bFact), B)),
+								offset);
+	
+	return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), maxVal));
+}
+
+template <typename PIXTYPE>
+static int
+RGBtoYCCRowSSE2(int *y, int *cb, int *cr,
+				const PIXTYPE *r, const PIXTYPE *g, const PIXTYPE *b,
+				int count, int center, int maxVal)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 yOffset = _mm_set1_ps(0.5f);
+	const __m128 cOffset = _mm_set1_ps(static_cast<float>(center) + 0.5f);
+	const __m128 maxVec = _mm_set1_ps(static_cast<float>(maxVal));
+	
+	int x = 0;
+	
+	for(; x + 8 <= count; x += 8)
+	{
+		const __m128i r16 = Load8SSE2(r + x);
+		const __m128i g16 = Load8SSE2(g + x);
+		const __m128i b16 = Load8SSE2(b + x);
+		
+		for(int half=0; half < 2; half++)
+		{
+			const __m128 R = _mm_cvtepi32_ps(half ? _mm_unpackhi_epi16(r16, zero) : _mm_unpacklo_epi16(r16, zero));
+			const __m128 G = _mm_cvtepi32_ps(half ? _mm_unpackhi_epi16(g16, zero) : _mm_unpacklo_epi16(g16, zero));
+			const __m128 B = _mm_cvtepi32_ps(half ? _mm_unpackhi_epi16(b16, zero) : _mm_unpacklo_epi16(b16, zero));
+			
+			const int i = x + (4 * half);
+			
+			_mm_storeu_si128((__m128i *)(y + i), RGBtoYCCSSE2(R, G, B, Y_R, Y_G, Y_B, yOffset, maxVec));
+			_mm_storeu_si128((__m128i *)(cb + i), RGBtoYCCSSE2(R, G, B, CB_R, CB_G, CB_B, cOffset, maxVec));
+			_mm_storeu_si128((__m128i *)(cr + i), RGBtoYCCSSE2(R, G, B, CR_R, CR_G, CR_B, cOffset, maxVec));
+		}
+	}
+	
+	return x;
+}
+
+#endif // J2K_SSE2
+
+
+template <typename PIXTYPE>
+static inline void
+RGBtoYCCRowDispatch(int *y, int *cb, int *cr,
+					const PIXTYPE *r, const PIXTYPE *g, const PIXTYPE *b,
+					int count, int center, int maxVal)
+{
+	int done = 0;
+	
+#ifdef J2K_SSE2
+	if(gSIMDLevel >= SIMD_SSE2)
+		done = RGBtoYCCRowSSE2(y, cb, cr, r, g, b, count, center, maxVal);
+#endif
+
+	RGBtoYCCRowScalar(y + done, cb + done, cr + done, r + done, g + done, b + done, count - done, center, maxVal);
+}
+
+
+void
+RGBtoYCCRow(int *y, int *cb, int *cr,
+			const unsigned char *r, const unsigned char *g, const unsigned char *b,
+			int count, int center, int maxVal)
+{
+	RGBtoYCCRowDispatch(y, cb, cr, r, g, b, count, center, maxVal);
+}
+
+void
+RGBtoYCCRow(int *y, int *cb, int *cr,
+			const unsigned short *r, const unsigned short *g, const unsigned short *b,
+			int count, int center, int maxVal)
+{
+	RGBtoYCCRowDispatch(y, cb, cr, r, g, b, count, center, maxVal);
+}
+
+}; // namespace j2k
@@ -0,0 +1,127 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef J2K_SIMD_H
+#define J2K_SIMD_H
+
+// Row kernels used by Codec::CopyBuffer().  Each one has a scalar version,
+// plus SSE2 and AVX2 versions picked at runtime when the CPU has them.
+
+namespace j2k
+{
+
+
+typedef struct RowConversion
+{
+	int offset;		// added to every sample first (sign conversion)
+	int upShift;	// if > 0: out = (v << upShift) | (v >> fillShift)
+	int fillShift;
+	int downShift;	// otherwise: out = v >> downShift
+	float scale;	// float destinations: out = v * scale
+	bool fifteenPlusOne; // 16-bit destinations: then converted to 0 - 32768
+	
+	RowConversion() : offset(0), upShift(0), fillShift(0), downShift(0), scale(1.f), fifteenPlusOne(false) {}
+	
+} RowConversion;
+
+
+// true 16-bit to After Effects 15+1 and back, same as FrameSeq's DemoteWorld()/PromoteWorld()
+inline unsigned short
+To15PlusOne(unsigned short val)
+{
+	return (val > 32768 ? ((val - 1) >> 1) + 1 : val >> 1);
+}
+
+inline unsigned short
+From15PlusOne(unsigned short val)
+{
+	return (val > 16384 ? ((val - 1) << 1) + 1 : val << 1);
+}
+
+
+// contiguous source, contiguous destination, count samples
+void ConvertRow(unsigned char *dest, const unsigned char *src, int count, const RowConversion &conv);
+void ConvertRow(unsigned char *dest, const unsigned short *src, int count, const RowConversion &conv);
+void ConvertRow(unsigned char *dest, const int *src, int count, const RowConversion &conv);
+void ConvertRow(unsigned short *dest, const unsigned char *src, int count, const RowConversion &conv);
+void ConvertRow(unsigned short *dest, const unsigned short *src, int count, const RowConversion &conv);
+void ConvertRow(unsigned short *dest, const int *src, int count, const RowConversion &conv);
+void ConvertRow(float *dest, const unsigned char *src, int count, const RowConversion &conv);
+void ConvertRow(float *dest, const unsigned short *src, int count, const RowConversion &conv);
+void ConvertRow(float *dest, const int *src, int count, const RowConversion &conv);
+
+// dest[2x] = dest[2x + 1] = src[x]
+void UpsampleRow2x(unsigned char *dest, const unsigned char *src, int count);
+void UpsampleRow2x(unsigned short *dest, const unsigned short *src, int count);
+void UpsampleRow2x(float *dest, const float *src, int count);
+
+// Packs 4 planar rows into 4-channel pixels.  pixel[k] of each output pixel
+// comes from rows[k].
+void InterleaveRows(unsigned char *dest, const unsigned char * const rows[4], int count);
+void InterleaveRows(unsigned short *dest, const unsigned short * const rows[4], int count);
+void InterleaveRows(float *dest, const float * const rows[4], int count);
+
+// Palette lookup, pixel x of dest = table[idx[x]].  Table entries are whole
+// pixels of pixelSize bytes (4, 8 or 16), AVX2 gathers the 4 and 8 byte ones.
+void PaletteRow(void *dest, const unsigned char *idx, int count, const void *table, int pixelSize);
+
+
+// sYCC to RGB with the irreversible (ICT) coefficients in 14-bit fixed
+// point.  center is 2^(depth - 1), results are clamped to 0 - maxVal.
+// The float version works in 0.0 - 1.0 and takes the normalized center.
+void YCCtoRGBRow(unsigned char *r, unsigned char *g, unsigned char *b,
+					const unsigned char *y, const unsigned char *cb, const unsigned char *cr,
+					int count, int center, int maxVal);
+void YCCtoRGBRow(unsigned short *r, unsigned short *g, unsigned short *b,
+					const unsigned short *y, const unsigned short *cb, const unsigned short *cr,
+					int count, int center, int maxVal);
+void YCCtoRGBRow(float *r, float *g, float *b,
+					const float *y, const float *cb, const float *cr,
+					int count, float center);
+
+// RGB to sYCC with the forward ICT coefficients.  Done in float so 16-bit
+// fits in the SSE2 version, results are rounded and clamped to 0 - maxVal.
+// The int rows are full size, chroma subsampling is up to the caller.
+void RGBtoYCCRow(int *y, int *cb, int *cr,
+					const unsigned char *r, const unsigned char *g, const unsigned char *b,
+					int count, int center, int maxVal);
+void RGBtoYCCRow(int *y, int *cb, int *cr,
+					const unsigned short *r, const unsigned short *g, const unsigned short *b,
+					int count, int center, int maxVal);
+
+
+enum SIMDLevel
+{
+	SIMD_NONE,
+	SIMD_SSE2,
+	SIMD_AVX2
+};
+
+SIMDLevel GetSIMDLevel();
+void SetSIMDLevel(SIMDLevel level); // can only go down from what the CPU supports
+
+
+}; // namespace j2k
+
+#endif // J2K_SIMD_H
@@ -0,0 +1,336 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#include "j2k_thread.h"
+
+#include <vector>
+
+#ifdef WIN32
+	#include <process.h>
+#endif
+
+#include <assert.h>
+
+
+namespace j2k
+{
+
+
+#ifdef WIN32
+
+Mutex::Mutex()
+{
+	InitializeCriticalSection(&_cs);
+}
+
+
+Mutex::~Mutex()
+{
+	DeleteCriticalSection(&_cs);
+}
+
+
+void
+Mutex::Lock()
+{
+	EnterCriticalSection(&_cs);
+}
+
+
+void
+Mutex::Unlock()
+{
+	LeaveCriticalSection(&_cs);
+}
+
+#else
+
+Mutex::Mutex()
+{
+	int result = pthread_mutex_init(&_mutex, NULL);
+	
+	assert(result == 0);
+}
+
+
+Mutex::~Mutex()
+{
+	int result = pthread_mutex_destroy(&_mutex);
+	
+	assert(result == 0);
+}
+
+
+void
+Mutex::Lock()
+{
+	int result = pthread_mutex_lock(&_mutex);
+	
+	assert(result == 0);
+}
+
+
+void
+Mutex::Unlock()
+{
+	int result = pthread_mutex_unlock(&_mutex);
+	
+	assert(result == 0);
+}
+
+#endif // WIN32
+
+
+typedef struct ThreadStart
+{
+	ThreadProc proc;
+	void *refCon;
+	
+	ThreadStart(ThreadProc p = NULL, void *r = NULL) : proc(p), refCon(r) {}
+	
+} ThreadStart;
+
+#ifdef WIN32
+static unsigned __stdcall
+ThreadMain(void *param)
+{
+	ThreadStart *start = (ThreadStart *)param;
+	
+	start->proc(start->refCon);
+	
+	return 0;
+}
+#else
+static void *
+ThreadMain(void *param)
+{
+	ThreadStart *start = (ThreadStart *)param;
+	
+	start->proc(start->refCon);
+	
+	return NULL;
+}
+#endif
+
+
+#ifdef WIN32
+typedef HANDLE ThreadHandle;
+#else
+typedef pthread_t ThreadHandle;
+#endif
+
+static void
+StartThreads(std::vector<ThreadHandle> &threads, ThreadStart &start, unsigned int count)
+{
+	for(unsigned int i=0; i < count; i++)
+	{
+	#ifdef WIN32
+		HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, ThreadMain, &start, 0, NULL);
+		
+		if(thread != NULL)
+			threads.push_back(thread);
+	#else
+		pthread_t thread;
+		
+		if(pthread_create(&thread, NULL, ThreadMain, &start) == 0)
+			threads.push_back(thread);
+	#endif
+	}
+}
+
+static void
+JoinThreads(std::vector<ThreadHandle> &threads)
+{
+	for(std::vector<ThreadHandle>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+	#ifdef WIN32
+		WaitForSingleObject(*i, INFINITE);
+		
+		CloseHandle(*i);
+	#else
+		pthread_join(*i, NULL);
+	#endif
+	}
+	
+	threads.clear();
+}
+
+
+void
+RunThreads(ThreadProc proc, void *refCon, unsigned int count)
+{
+	ThreadStart start(proc, refCon);
+	
+	std::vector<ThreadHandle> threads;
+	
+	if(count > 1)
+		StartThreads(threads, start, count - 1);
+	
+	proc(refCon);
+	
+	JoinThreads(threads);
+}
+
+
+typedef struct WorkRange
+{
+	Mutex mutex;
+	unsigned int begin;
+	unsigned int end;
+	
+	WorkRange() : begin(0), end(0) {}
+	
+} WorkRange;
+
+typedef struct ParallelContext
+{
+	ParallelProc proc;
+	void *refCon;
+	
+	std::vector<WorkRange *> ranges;
+	
+	Mutex threadMutex;
+	unsigned int nextThread;
+	
+	ParallelContext(ParallelProc p, void *r) : proc(p), refCon(r), nextThread(1) {}
+	
+} ParallelContext;
+
+
+static bool
+TakeFront(WorkRange &range, unsigned int &index)
+{
+	Lock lock(range.mutex);
+	
+	if(range.begin >= range.end)
+		return false;
+	
+	index = range.begin++;
+	
+	return true;
+}
+
+static bool
+TakeBack(WorkRange &range, unsigned int &index)
+{
+	Lock lock(range.mutex);
+	
+	if(range.begin >= range.end)
+		return false;
+	
+	index = --range.end;
+	
+	return true;
+}
+
+
+static void
+ParallelWorker(ParallelContext &context, unsigned int thread)
+{
+	const unsigned int threads = static_cast<unsigned int>(context.ranges.size());
+	
+	unsigned int index = 0;
+	
+	while(true)
+	{
+		if( TakeFront(*context.ranges[thread], index) )
+		{
+			context.proc(context.refCon, index, thread);
+		}
+		else
+		{
+			bool stole = false;
+			
+			for(unsigned int i=1; i < threads && !stole; i++)
+			{
+				stole = TakeBack(*context.ranges[(thread + i) % threads], index);
+			}
+			
+			if(stole)
+				context.proc(context.refCon, index, thread);
+			else
+				break;
+		}
+	}
+}
+
+static void
+ParallelThread(void *refCon)
+{
+	ParallelContext &context = *(ParallelContext *)refCon;
+	
+	unsigned int thread = 0;
+	
+	{
+		Lock lock(context.threadMutex);
+		
+		thread = context.nextThread++;
+	}
+	
+	ParallelWorker(context, thread);
+}
+
+
+void
+ParallelFor(ParallelProc proc, void *refCon, unsigned int count, unsigned int threads)
+{
+	if(threads > count)
+		threads = count;
+	
+	if(threads <= 1)
+	{
+		for(unsigned int i=0; i < count; i++)
+			proc(refCon, i, 0);
+		
+		return;
+	}
+	
+	ParallelContext context(proc, refCon);
+	
+	for(unsigned int t=0; t < threads; t++)
+	{
+		WorkRange *range = new WorkRange;
+		
+		range->begin = ((unsigned long long)count * t) / threads;
+		range->end = ((unsigned long long)count * (t + 1)) / threads;
+		
+		context.ranges.push_back(range);
+	}
+	
+	ThreadStart start(ParallelThread, &context);
+	
+	std::vector<ThreadHandle> workers;
+	
+	StartThreads(workers, start, threads - 1);
+	
+	ParallelWorker(context, 0);
+	
+	JoinThreads(workers);
+	
+	for(std::vector<WorkRange *>::iterator i = context.ranges.begin(); i != context.ranges.end(); ++i)
+		delete *i;
+}
+
+
+}; // namespace j2k
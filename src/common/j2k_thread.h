@@ -0,0 +1,93 @@
+
+/* ---------------------------------------------------------------------
+// 
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+// Copyright (c) 2016,       Aaron Boxer,    http://grokimagecompression.github.io/grok
+// 
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef J2K_THREAD_H
+#define J2K_THREAD_H
+
+#ifdef WIN32
+	#include <Windows.h>
+#else
+	#include <pthread.h>
+#endif
+
+
+namespace j2k
+{
+
+
+class Mutex
+{
+  public:
+	Mutex();
+	~Mutex();
+	
+	void Lock();
+	void Unlock();
+	
+  private:
+	Mutex(const Mutex &);
+	Mutex & operator=(const Mutex &);
+	
+#ifdef WIN32
+	CRITICAL_SECTION _cs;
+#else
+	pthread_mutex_t _mutex;
+#endif
+};
+
+
+// locks for as long as it's in scope
+class Lock
+{
+  public:
+	Lock(Mutex &mutex) : _mutex(mutex) { _mutex.Lock(); }
+	~Lock() { _mutex.Unlock(); }
+	
+  private:
+	Lock(const Lock &);
+	Lock & operator=(const Lock &);
+	
+	Mutex &_mutex;
+};
+
+
+// Calls proc(refCon) on count threads at once (one of them is the calling
+// thread) and returns when they have all finished.
+typedef void (*ThreadProc)(void *refCon);
+
+void RunThreads(ThreadProc proc, void *refCon, unsigned int count);
+
+
+// Calls proc(refCon, index, thread) for every index in [0, count) using the
+// given number of threads.  Each thread starts with its own run of indices
+// and steals from the end of the others' when it runs out.  Thread 0 is the
+// calling thread.
+typedef void (*ParallelProc)(void *refCon, unsigned int index, unsigned int thread);
+
+void ParallelFor(ParallelProc proc, void *refCon, unsigned int count, unsigned int threads);
+
+
+}; // namespace j2k
+
+#endif // J2K_THREAD_H
@@ -69,6 +69,10 @@ j2k_OutUI(
 												subsampling:params->sub
 												order:params->order
 												tileSize:params->tileSize
+												codeBlock:params->codeBlock
+												bypass:params->bypass
+												reset:params->reset
+												precinctSize:params->precinctSize
 												iccProfile:params->icc_profile
 												dciProfile:params->dci_profile
 												dciDataRate:params->dci_data_rate
@@ -115,6 +119,10 @@ j2k_OutUI(
 					params->sub = [ui_controller getSubsample];
 					params->order = [ui_controller getOrder];
 					params->tileSize = [ui_controller getTileSize];
+					params->codeBlock = [ui_controller getCodeBlock];
+					params->bypass = [ui_controller getBypass];
+					params->reset = [ui_controller getReset];
+					params->precinctSize = [ui_controller getPrecinctSize];
 					params->icc_profile = [ui_controller getProfile];
 					params->dci_profile = [ui_controller getDCIProfile];
 					params->dci_data_rate = [ui_controller getDCIDataRate];
@@ -55,6 +55,12 @@ typedef enum {
     IBOutlet NSPopUpButton *orderMenu;
     IBOutlet NSTextField *tileSizeLabel;
     IBOutlet NSPopUpButton *tileSizeMenu;
+    IBOutlet NSTextField *codeBlockLabel;
+    IBOutlet NSPopUpButton *codeBlockMenu;
+    IBOutlet NSTextField *precinctLabel;
+    IBOutlet NSPopUpButton *precinctMenu;
+    IBOutlet NSButton *bypassCheck;
+    IBOutlet NSButton *resetCheck;
     IBOutlet NSTextField *profileLabel;
     IBOutlet NSPopUpButton *profileMenu;
 	IBOutlet NSTextField *subsampleLabel;
@@ -74,6 +80,7 @@ typedef enum {
 	IBOutlet NSButton *cancelButton;
 	
 	DialogResult theResult;
+	BOOL showSubsample;
 }
 - (id)init:(DialogMethod)method
 	size:(long)the_size
@@ -87,6 +94,10 @@ typedef enum {
 	subsampling:(DialogSubsample)sub
 	order:(DialogOrder)the_order
 	tileSize:(int)tile_size
+	codeBlock:(DialogCodeBlock)code_block
+	bypass:(BOOL)use_bypass
+	reset:(BOOL)use_reset
+	precinctSize:(int)precinct_size
 	iccProfile:(DialogProfile)icc_profile
 	dciProfile:(DialogDCIProfile)dci_profile
 	dciDataRate:(int)dci_data_rate
@@ -114,6 +125,8 @@ typedef enum {
 - (void)setSubsample:(DialogSubsample)sub;
 - (void)setOrder:(DialogOrder)the_order;
 - (void)setTileSize:(int)tile_size;
+- (void)setCodeBlock:(DialogCodeBlock)code_block;
+- (void)setPrecinctSize:(int)precinct_size;
 - (void)setProfile:(DialogProfile)icc_profile;
 - (void)setDCIProfile:(DialogDCIProfile)dci_profile;
 - (void)setDCIRate:(int)dci_data_rate;
@@ -133,6 +146,10 @@ typedef enum {
 - (DialogSubsample)getSubsample;
 - (DialogOrder)getOrder;
 - (int)getTileSize;
+- (DialogCodeBlock)getCodeBlock;
+- (BOOL)getBypass;
+- (BOOL)getReset;
+- (int)getPrecinctSize;
 - (DialogProfile)getProfile;
 - (DialogDCIProfile)getDCIProfile;
 - (int)getDCIDataRate;
@@ -36,6 +36,10 @@
 	subsampling:(DialogSubsample)sub
 	order:(DialogOrder)the_order
 	tileSize:(int)tile_size
+	codeBlock:(DialogCodeBlock)code_block
+	bypass:(BOOL)use_bypass
+	reset:(BOOL)use_reset
+	precinctSize:(int)precinct_size
 	iccProfile:(DialogProfile)icc_profile
 	dciProfile:(DialogDCIProfile)dci_profile
 	dciDataRate:(int)dci_data_rate
@@ -55,6 +59,9 @@
 	
 	theResult = DIALOG_RESULT_CONTINUE;
 	
+	// with subsampling, trackMethod swaps it with the DCI profile
+	showSubsample = show_sub;
+	
 	[self setMethod:method];
 	[fileSizeField setIntValue:the_size];
 	[qualitySlider setIntValue:the_quality];
@@ -69,6 +76,10 @@
 	[self setSubsample:sub];
 	[self setOrder:the_order];
 	[self setTileSize:tile_size];
+	[self setCodeBlock:code_block];
+	[bypassCheck setState:(use_bypass ? NSOnState : NSOffState)];
+	[resetCheck setState:(use_reset ? NSOnState : NSOffState)];
+	[self setPrecinctSize:precinct_size];
 	[self setProfile:icc_profile];
 	[self setDCIProfile:dci_profile];
 	[self setDCIPerFrame:dci_per_frame];
@@ -102,13 +113,7 @@
 		[profileMenu selectItemAtIndex:0];
 	}
 	
-	if(show_sub)
-	{
-		[dciProfileLabel setHidden:TRUE];
-		[dciProfileMenu setHidden:TRUE];
-		[digitalCinemaRadio setEnabled:FALSE];
-	}
-	else
+	if(!show_sub)
 	{
 		[subsampleLabel setHidden:TRUE];
 		[subsampleMenu setHidden:TRUE];
@@ -237,6 +242,12 @@
 	[profileLabel setHidden:!enable_controls];
 	[tileSizeMenu setHidden:!enable_controls];
 	[tileSizeLabel setHidden:!enable_controls];
+	[codeBlockMenu setHidden:!enable_controls];
+	[codeBlockLabel setHidden:!enable_controls];
+	[precinctMenu setHidden:!enable_controls];
+	[precinctLabel setHidden:!enable_controls];
+	[bypassCheck setHidden:!enable_controls];
+	[resetCheck setHidden:!enable_controls];
 	[dciProfileMenu setEnabled:!enable_controls];
 	[dciRateSlider setHidden:enable_controls];
 	[dciRateField setHidden:enable_controls];
@@ -245,6 +256,15 @@
 	[dciFPSmenu setHidden:enable_controls];
 	[dciFPSlabel setHidden:enable_controls];
 	[dciStereoCheck setHidden:enable_controls];
+	
+	if(showSubsample)
+	{
+		// they share a spot
+		[dciProfileLabel setHidden:enable_controls];
+		[dciProfileMenu setHidden:enable_controls];
+		[subsampleLabel setHidden:!enable_controls];
+		[subsampleMenu setHidden:!enable_controls];
+	}
 
 	[formatLabel setTextColor:label_color];
 	[dciProfileLabel setTextColor:not_label_color];
@@ -357,6 +377,16 @@
 	[tileSizeMenu selectItem:[tileSizeMenu itemAtIndex:menu_index]];
 }
 
+- (void)setCodeBlock:(DialogCodeBlock)code_block {
+	[codeBlockMenu selectItemWithTag:code_block];
+}
+
+- (void)setPrecinctSize:(int)precinct_size {
+	// tags are the sizes, 0 for full
+	if(![precinctMenu selectItemWithTag:precinct_size])
+		[precinctMenu selectItemAtIndex:0];
+}
+
 - (void)setProfile:(DialogProfile)icc_profile {
 	int menu_index = (icc_profile == DIALOG_PROFILE_ICC ? 1 : 0);
 	
@@ -467,6 +497,22 @@
 	}
 }
 
+- (DialogCodeBlock)getCodeBlock {
+	return [[codeBlockMenu selectedItem] tag];
+}
+
+- (BOOL)getBypass {
+	return ([bypassCheck state] == NSOnState);
+}
+
+- (BOOL)getReset {
+	return ([resetCheck state] == NSOnState);
+}
+
+- (int)getPrecinctSize {
+	return [[precinctMenu selectedItem] tag];
+}
+
 - (DialogProfile)getProfile {
 	if([profileMenu indexOfSelectedItem] >= 1)
 		return DIALOG_PROFILE_ICC;
@@ -72,7 +72,13 @@ enum {
 	OUT_DCI_Per_Frame,
 	OUT_DCI_Frame_Rate,
 	OUT_DCI_Frame_Rate_Label,
-	OUT_DCI_Stereo
+	OUT_DCI_Stereo,
+	OUT_Code_Blocks,
+	OUT_Code_Blocks_Label,
+	OUT_Precincts,
+	OUT_Precincts_Label,
+	OUT_Bypass,
+	OUT_Reset
 };
 
 static const char			*g_generic_profile = NULL;
@@ -91,6 +97,10 @@ static bool					g_ycc;
 static DialogSubsample		g_sub;
 static DialogOrder			g_order;
 static int					g_tile_size;
+static DialogCodeBlock		g_code_block;
+static bool					g_bypass;
+static bool					g_reset;
+static int					g_precinct_size;
 static DialogProfile		g_profile;
 static DialogDCIProfile		g_dci_profile;
 static int					g_dci_data_rate;
@@ -270,12 +280,27 @@ static void TrackMethod(HWND hwndDlg)
 	ENABLE_ITEM(OUT_DCI_Profile, !enable_controls);
 	ENABLE_ITEM(OUT_DCI_Profile_Label, !enable_controls);
 	
+	if(g_show_subsample)
+	{
+		// they share a spot
+		SHOW_ITEM(OUT_DCI_Profile, !enable_controls);
+		SHOW_ITEM(OUT_DCI_Profile_Label, !enable_controls);
+		SHOW_ITEM(OUT_Subsample, enable_controls);
+		SHOW_ITEM(OUT_Subsample_Label, enable_controls);
+	}
+	
 	SHOW_ITEM(OUT_Tiles, enable_controls);
 	SHOW_ITEM(OUT_Tiles_Label, enable_controls);
 	SHOW_ITEM(OUT_Order, enable_controls);
 	SHOW_ITEM(OUT_Order_Label, enable_controls);
 	SHOW_ITEM(OUT_Profile, enable_controls);
 	SHOW_ITEM(OUT_Profile_Label, enable_controls);
+	SHOW_ITEM(OUT_Code_Blocks, enable_controls);
+	SHOW_ITEM(OUT_Code_Blocks_Label, enable_controls);
+	SHOW_ITEM(OUT_Precincts, enable_controls);
+	SHOW_ITEM(OUT_Precincts_Label, enable_controls);
+	SHOW_ITEM(OUT_Bypass, enable_controls);
+	SHOW_ITEM(OUT_Reset, enable_controls);
 
 	SHOW_ITEM(OUT_DCI_Data_Rate_Slider, !enable_controls);
 	SHOW_ITEM(OUT_DCI_Data_Rate, !enable_controls);
@@ -321,6 +346,8 @@ BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARAM lPara
 				SET_CHECK(OUT_Ycc, g_ycc);
 				SET_CHECK(OUT_Float, !g_reversible);
 				SET_CHECK(OUT_DCI_Stereo, g_dci_stereo);
+				SET_CHECK(OUT_Bypass, g_bypass);
+				SET_CHECK(OUT_Reset, g_reset);
 
 
 				// spinner (up-down control)
@@ -362,6 +389,16 @@ BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARAM lPara
 				ADD_MENU_ITEM(OUT_Tiles, 5, "64", 64, g_tile_size == 64);
 				ADD_MENU_ITEM(OUT_Tiles, 6, "No Tiles", 0, g_tile_size == 0);
 
+				ADD_MENU_ITEM(OUT_Code_Blocks, 0, "64x64", DIALOG_CODE_BLOCK_64x64, g_code_block == DIALOG_CODE_BLOCK_64x64);
+				ADD_MENU_ITEM(OUT_Code_Blocks, 1, "32x32", DIALOG_CODE_BLOCK_32x32, g_code_block == DIALOG_CODE_BLOCK_32x32);
+				ADD_MENU_ITEM(OUT_Code_Blocks, 2, "128x32", DIALOG_CODE_BLOCK_128x32, g_code_block == DIALOG_CODE_BLOCK_128x32);
+				ADD_MENU_ITEM(OUT_Code_Blocks, 3, "32x128", DIALOG_CODE_BLOCK_32x128, g_code_block == DIALOG_CODE_BLOCK_32x128);
+
+				ADD_MENU_ITEM(OUT_Precincts, 0, "Full", 0, g_precinct_size == 0);
+				ADD_MENU_ITEM(OUT_Precincts, 1, "256", 256, g_precinct_size == 256);
+				ADD_MENU_ITEM(OUT_Precincts, 2, "128", 128, g_precinct_size == 128);
+				ADD_MENU_ITEM(OUT_Precincts, 3, "64", 64, g_precinct_size == 64);
+
 				ADD_MENU_ITEM(OUT_Order, 0, "Layer", DIALOG_ORDER_LRCP, g_order == DIALOG_ORDER_LRCP);
 				ADD_MENU_ITEM(OUT_Order, 1, "Resolution, Layer", DIALOG_ORDER_RLCP, g_order == DIALOG_ORDER_RLCP);
 				ADD_MENU_ITEM(OUT_Order, 2, "Resolution, Position", DIALOG_ORDER_RPCL, g_order == DIALOG_ORDER_RPCL);
@@ -395,14 +432,8 @@ BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARAM lPara
 				}
 
 
-				if(g_show_subsample)
-				{
-					SHOW_ITEM(OUT_DCI_Profile, FALSE);
-					SHOW_ITEM(OUT_DCI_Profile_Label, FALSE);
-					ENABLE_ITEM(OUT_Cinema, FALSE);
-					ENABLE_ITEM(OUT_Ycc, FALSE);
-				}
-				else
+				// with subsampling, TrackMethod() swaps it with the DCI profile
+				if(!g_show_subsample)
 				{
 					SHOW_ITEM(OUT_Subsample, FALSE);
 					SHOW_ITEM(OUT_Subsample_Label, FALSE);
@@ -460,10 +491,14 @@ BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARAM lPara
 					g_ycc = GET_CHECK(OUT_Ycc) ? true : false;
 					g_reversible = !GET_CHECK(OUT_Float);
 					g_dci_stereo = GET_CHECK(OUT_DCI_Stereo) ? true : false;
+					g_bypass = GET_CHECK(OUT_Bypass) ? true : false;
+					g_reset = GET_CHECK(OUT_Reset) ? true : false;
 
 					// menus
 					g_format = (DialogFormat)GET_MENU_VALUE(OUT_Format);
 					g_tile_size = static_cast<int>(GET_MENU_VALUE(OUT_Tiles));
+					g_code_block = (DialogCodeBlock)GET_MENU_VALUE(OUT_Code_Blocks);
+					g_precinct_size = static_cast<int>(GET_MENU_VALUE(OUT_Precincts));
 					g_order = (DialogOrder)GET_MENU_VALUE(OUT_Order);
 					g_profile = (DialogProfile)GET_MENU_VALUE(OUT_Profile);
 					g_dci_profile = (DialogDCIProfile)GET_MENU_VALUE(OUT_DCI_Profile);
@@ -642,6 +677,10 @@ j2k_OutUI(
 	g_sub				= params->sub;
 	g_order				= params->order;
 	g_tile_size			= params->tileSize;
+	g_code_block		= params->codeBlock;
+	g_bypass			= params->bypass;
+	g_reset				= params->reset;
+	g_precinct_size		= params->precinctSize;
 	g_profile			= params->icc_profile;
 	g_dci_profile		= params->dci_profile;
 	g_dci_data_rate		= params->dci_data_rate;
@@ -667,6 +706,10 @@ j2k_OutUI(
 		params->sub				= g_sub;
 		params->order			= g_order;
 		params->tileSize		= g_tile_size;
+		params->codeBlock		= g_code_block;
+		params->bypass			= g_bypass;
+		params->reset			= g_reset;
+		params->precinctSize	= g_precinct_size;
 		params->icc_profile		= g_profile;
 		params->dci_profile		= g_dci_profile;
 		params->dci_data_rate	= g_dci_data_rate;
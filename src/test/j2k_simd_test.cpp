@@ -0,0 +1,459 @@
+/* ---------------------------------------------------------------------
+//
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+//
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -------------------------------------------------------------------*/
+
+// The SSE2 and AVX2 row kernels have to match the scalar ones byte for byte.
+// Runs every kernel at every SIMD level this CPU has, over random rows with
+// the edge values mixed in, at lengths and alignments that hit the tails.
+
+#include "j2k_simd.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+
+using namespace j2k;
+
+
+static const int kCounts[] = { 0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 1023 };
+static const int kNumCounts = (sizeof(kCounts) / sizeof(kCounts[0]));
+static const int kMaxOffset = 3; // start this many samples into the buffers
+
+static std::vector<SIMDLevel> gLevels; // what we compare against SIMD_NONE
+
+static int gFailures = 0;
+
+
+static unsigned int gSeed = 1;
+
+static unsigned int
+Random()
+{
+	gSeed = (gSeed * 1103515245U) + 12345U;
+
+	return (gSeed >> 8);
+}
+
+static int
+RandomSample(int minVal, int maxVal)
+{
+	// edges a quarter of the time
+	switch(Random() % 8)
+	{
+		case 0:		return minVal;
+		case 1:		return maxVal;
+		default:	return minVal + (int)(Random() % (unsigned int)(maxVal - minVal + 1));
+	}
+}
+
+template <typename T>
+static void
+FillRow(std::vector<T> &row, int minVal, int maxVal)
+{
+	for(size_t i=0; i < row.size(); i++)
+		row[i] = (T)RandomSample(minVal, maxVal);
+}
+
+static void
+FillRow(std::vector<float> &row)
+{
+	for(size_t i=0; i < row.size(); i++)
+		row[i] = (float)RandomSample(0, 65535) / 65535.f;
+}
+
+template <typename T>
+static bool
+Same(const std::vector<T> &a, const std::vector<T> &b)
+{
+	return (a.size() == b.size() && memcmp(&a[0], &b[0], a.size() * sizeof(T)) == 0);
+}
+
+static const char *
+LevelName(SIMDLevel level)
+{
+	return (level == SIMD_AVX2 ? "AVX2" : level == SIMD_SSE2 ? "SSE2" : "scalar");
+}
+
+static void
+Fail(const char *kernel, const char *variant, SIMDLevel level, int count, int offset)
+{
+	printf("FAIL: %s (%s) %s doesn't match scalar, count %d offset %d\n",
+			kernel, variant, LevelName(level), count, offset);
+
+	gFailures++;
+}
+
+
+template <typename DESTTYPE, typename SRCTYPE>
+static void
+TestConvertRow(const char *variant, const RowConversion &conv, int minVal, int maxVal)
+{
+	for(int c=0; c < kNumCounts; c++)
+	{
+		for(int offset=0; offset <= kMaxOffset; offset++)
+		{
+			const int count = kCounts[c];
+			const size_t size = (count + offset + 1);
+
+			std::vector<SRCTYPE> src(size);
+
+			FillRow(src, minVal, maxVal);
+
+			std::vector<DESTTYPE> ref(size, 0);
+
+			SetSIMDLevel(SIMD_NONE);
+			ConvertRow(&ref[offset], &src[offset], count, conv);
+
+			for(size_t l=0; l < gLevels.size(); l++)
+			{
+				std::vector<DESTTYPE> out(size, 0);
+
+				SetSIMDLevel(gLevels[l]);
+				ConvertRow(&out[offset], &src[offset], count, conv);
+
+				if( !Same(ref, out) )
+					Fail("ConvertRow", variant, gLevels[l], count, offset);
+			}
+		}
+	}
+}
+
+
+template <typename T>
+static void
+TestUpsampleAndInterleave(const char *variant, int maxVal)
+{
+	for(int c=0; c < kNumCounts; c++)
+	{
+		for(int offset=0; offset <= kMaxOffset; offset++)
+		{
+			const int count = kCounts[c];
+			const size_t size = (count + offset + 1);
+
+			std::vector<T> src[4];
+			const T *rows[4];
+
+			for(int i=0; i < 4; i++)
+			{
+				src[i].resize(size);
+				FillRow(src[i], 0, maxVal);
+				rows[i] = &src[i][offset];
+			}
+
+			std::vector<T> refUp(2 * size, 0);
+			std::vector<T> refPixels(4 * size, 0);
+
+			SetSIMDLevel(SIMD_NONE);
+			UpsampleRow2x(&refUp[2 * offset], &src[0][offset], count);
+			InterleaveRows(&refPixels[4 * offset], rows, count);
+
+			for(size_t l=0; l < gLevels.size(); l++)
+			{
+				std::vector<T> up(2 * size, 0);
+				std::vector<T> pixels(4 * size, 0);
+
+				SetSIMDLevel(gLevels[l]);
+				UpsampleRow2x(&up[2 * offset], &src[0][offset], count);
+				InterleaveRows(&pixels[4 * offset], rows, count);
+
+				if( !Same(refUp, up) )
+					Fail("UpsampleRow2x", variant, gLevels[l], count, offset);
+
+				if( !Same(refPixels, pixels) )
+					Fail("InterleaveRows", variant, gLevels[l], count, offset);
+			}
+		}
+	}
+}
+
+
+static void
+TestPaletteRow(int pixelSize)
+{
+	char variant[32];
+	sprintf(variant, "%d-byte pixels", pixelSize);
+
+	std::vector<unsigned char> table(256 * pixelSize);
+
+	FillRow(table, 0, 255);
+
+	for(int c=0; c < kNumCounts; c++)
+	{
+		for(int offset=0; offset <= kMaxOffset; offset++)
+		{
+			const int count = kCounts[c];
+			const size_t size = (count + offset + 1);
+
+			std::vector<unsigned char> idx(size);
+
+			FillRow(idx, 0, 255);
+
+			std::vector<unsigned char> ref(size * pixelSize, 0);
+
+			SetSIMDLevel(SIMD_NONE);
+			PaletteRow(&ref[offset * pixelSize], &idx[offset], count, &table[0], pixelSize);
+
+			for(size_t l=0; l < gLevels.size(); l++)
+			{
+				std::vector<unsigned char> out(size * pixelSize, 0);
+
+				SetSIMDLevel(gLevels[l]);
+				PaletteRow(&out[offset * pixelSize], &idx[offset], count, &table[0], pixelSize);
+
+				if( !Same(ref, out) )
+					Fail("PaletteRow", variant, gLevels[l], count, offset);
+			}
+		}
+	}
+}
+
+
+template <typename T>
+static void
+TestYCCtoRGBRow(int depth)
+{
+	char variant[32];
+	sprintf(variant, "%d-bit", depth);
+
+	const int maxVal = ((1 << depth) - 1);
+	const int center = (1 << (depth - 1));
+
+	for(int c=0; c < kNumCounts; c++)
+	{
+		for(int offset=0; offset <= kMaxOffset; offset++)
+		{
+			const int count = kCounts[c];
+			const size_t size = (count + offset + 1);
+
+			std::vector<T> y(size), cb(size), cr(size);
+
+			FillRow(y, 0, maxVal);
+			FillRow(cb, 0, maxVal);
+			FillRow(cr, 0, maxVal);
+
+			std::vector<T> refR(size, 0), refG(size, 0), refB(size, 0);
+
+			SetSIMDLevel(SIMD_NONE);
+			YCCtoRGBRow(&refR[offset], &refG[offset], &refB[offset], &y[offset], &cb[offset], &cr[offset], count, center, maxVal);
+
+			for(size_t l=0; l < gLevels.size(); l++)
+			{
+				std::vector<T> r(size, 0), g(size, 0), b(size, 0);
+
+				SetSIMDLevel(gLevels[l]);
+				YCCtoRGBRow(&r[offset], &g[offset], &b[offset], &y[offset], &cb[offset], &cr[offset], count, center, maxVal);
+
+				if(!Same(refR, r) || !Same(refG, g) || !Same(refB, b))
+					Fail("YCCtoRGBRow", variant, gLevels[l], count, offset);
+			}
+		}
+	}
+}
+
+
+static void
+TestYCCtoRGBRowFloat()
+{
+	for(int c=0; c < kNumCounts; c++)
+	{
+		for(int offset=0; offset <= kMaxOffset; offset++)
+		{
+			const int count = kCounts[c];
+			const size_t size = (count + offset + 1);
+
+			std::vector<float> y(size), cb(size), cr(size);
+
+			FillRow(y);
+			FillRow(cb);
+			FillRow(cr);
+
+			std::vector<float> refR(size, 0.f), refG(size, 0.f), refB(size, 0.f);
+
+			SetSIMDLevel(SIMD_NONE);
+			YCCtoRGBRow(&refR[offset], &refG[offset], &refB[offset], &y[offset], &cb[offset], &cr[offset], count, 0.5f);
+
+			for(size_t l=0; l < gLevels.size(); l++)
+			{
+				std::vector<float> r(size, 0.f), g(size, 0.f), b(size, 0.f);
+
+				SetSIMDLevel(gLevels[l]);
+				YCCtoRGBRow(&r[offset], &g[offset], &b[offset], &y[offset], &cb[offset], &cr[offset], count, 0.5f);
+
+				if(!Same(refR, r) || !Same(refG, g) || !Same(refB, b))
+					Fail("YCCtoRGBRow", "float", gLevels[l], count, offset);
+			}
+		}
+	}
+}
+
+
+template <typename T>
+static void
+TestRGBtoYCCRow(int depth)
+{
+	char variant[32];
+	sprintf(variant, "%d-bit", depth);
+
+	const int maxVal = ((1 << depth) - 1);
+	const int center = (1 << (depth - 1));
+
+	for(int c=0; c < kNumCounts; c++)
+	{
+		for(int offset=0; offset <= kMaxOffset; offset++)
+		{
+			const int count = kCounts[c];
+			const size_t size = (count + offset + 1);
+
+			std::vector<T> r(size), g(size), b(size);
+
+			FillRow(r, 0, maxVal);
+			FillRow(g, 0, maxVal);
+			FillRow(b, 0, maxVal);
+
+			std::vector<int> refY(size, 0), refCb(size, 0), refCr(size, 0);
+
+			SetSIMDLevel(SIMD_NONE);
+			RGBtoYCCRow(&refY[offset], &refCb[offset], &refCr[offset], &r[offset], &g[offset], &b[offset], count, center, maxVal);
+
+			for(size_t l=0; l < gLevels.size(); l++)
+			{
+				std::vector<int> y(size, 0), cb(size, 0), cr(size, 0);
+
+				SetSIMDLevel(gLevels[l]);
+				RGBtoYCCRow(&y[offset], &cb[offset], &cr[offset], &r[offset], &g[offset], &b[offset], count, center, maxVal);
+
+				if(!Same(refY, y) || !Same(refCb, cb) || !Same(refCr, cr))
+					Fail("RGBtoYCCRow", variant, gLevels[l], count, offset);
+			}
+		}
+	}
+}
+
+
+static RowConversion
+UpConversion(int upShift, int fillShift, int offset = 0)
+{
+	RowConversion conv;
+
+	conv.upShift = upShift;
+	conv.fillShift = fillShift;
+	conv.offset = offset;
+
+	return conv;
+}
+
+static RowConversion
+DownConversion(int downShift, int offset = 0)
+{
+	RowConversion conv;
+
+	conv.downShift = downShift;
+	conv.offset = offset;
+
+	return conv;
+}
+
+static RowConversion
+FloatConversion(int depth, int offset = 0)
+{
+	RowConversion conv;
+
+	conv.offset = offset;
+	conv.scale = (1.f / (float)((1 << depth) - 1));
+
+	return conv;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	const SIMDLevel cpuLevel = GetSIMDLevel();
+
+	if(cpuLevel >= SIMD_SSE2)
+		gLevels.push_back(SIMD_SSE2);
+
+	if(cpuLevel >= SIMD_AVX2)
+		gLevels.push_back(SIMD_AVX2);
+
+	if(gLevels.empty())
+	{
+		printf("No SIMD on this CPU, nothing to compare\n");
+
+		return 0;
+	}
+
+	printf("Comparing scalar against %s\n", LevelName(cpuLevel));
+
+
+	TestConvertRow<unsigned char, unsigned char>("8 to 8", DownConversion(0), 0, 255);
+	TestConvertRow<unsigned char, unsigned short>("16 to 8", DownConversion(8), 0, 65535);
+	TestConvertRow<unsigned char, int>("12 to 8", DownConversion(4), 0, 4095);
+	TestConvertRow<unsigned char, int>("signed 12 to 8", DownConversion(4, 2048), -2048, 2047);
+	TestConvertRow<unsigned short, unsigned char>("8 to 16", UpConversion(8, 0), 0, 255);
+	TestConvertRow<unsigned short, unsigned short>("16 to 16", DownConversion(0), 0, 65535);
+	TestConvertRow<unsigned short, int>("12 to 16", UpConversion(4, 8), 0, 4095);
+	TestConvertRow<unsigned short, int>("signed 12 to 16", UpConversion(4, 8, 2048), -2048, 2047);
+	TestConvertRow<unsigned short, int>("10 to 16", UpConversion(6, 4), 0, 1023);
+	TestConvertRow<float, unsigned char>("8 to float", FloatConversion(8), 0, 255);
+	TestConvertRow<float, unsigned short>("16 to float", FloatConversion(16), 0, 65535);
+	TestConvertRow<float, int>("signed 12 to float", FloatConversion(12, 2048), -2048, 2047);
+
+	RowConversion fifteenPlusOne;
+	fifteenPlusOne.fifteenPlusOne = true;
+
+	TestConvertRow<unsigned short, unsigned short>("16 to 15+1", fifteenPlusOne, 0, 65535);
+	TestConvertRow<unsigned short, int>("16 to 15+1", fifteenPlusOne, 0, 65535);
+
+	TestUpsampleAndInterleave<unsigned char>("8-bit", 255);
+	TestUpsampleAndInterleave<unsigned short>("16-bit", 65535);
+	TestUpsampleAndInterleave<float>("float", 65535);
+
+	TestPaletteRow(4);
+	TestPaletteRow(8);
+	TestPaletteRow(16);
+
+	TestYCCtoRGBRow<unsigned char>(8);
+	TestYCCtoRGBRow<unsigned short>(10);
+	TestYCCtoRGBRow<unsigned short>(12);
+	TestYCCtoRGBRow<unsigned short>(16);
+	TestYCCtoRGBRowFloat();
+
+	TestRGBtoYCCRow<unsigned char>(8);
+	TestRGBtoYCCRow<unsigned short>(10);
+	TestRGBtoYCCRow<unsigned short>(12);
+	TestRGBtoYCCRow<unsigned short>(16);
+
+
+	SetSIMDLevel(cpuLevel);
+
+	if(gFailures > 0)
+	{
+		printf("%d failures\n", gFailures);
+
+		return 1;
+	}
+
+	printf("All kernels match\n");
+
+	return 0;
+}
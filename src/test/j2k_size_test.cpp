@@ -0,0 +1,249 @@
+/* ---------------------------------------------------------------------
+//
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+//
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -------------------------------------------------------------------*/
+
+// Files written with a target size have to come out near that size, at
+// every bit depth and with subsampled chroma.  And quality 100 has to be
+// lossless.
+
+#include "j2k_rgba_file.h"
+#include "j2k_exception.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+
+using namespace j2k;
+
+
+static int gFailures = 0;
+
+
+// Planar RGBA, with enough noise on the ramps that a lossless file is
+// much bigger than any of the targets.
+typedef struct TestImage
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned char depth;
+
+	std::vector<unsigned char> planes[4];
+
+	TestImage(unsigned int w, unsigned int h, unsigned char d) : width(w), height(h), depth(d)
+	{
+		const size_t sampleSize = (depth > 8 ? 2 : 1);
+		const unsigned int maxVal = ((1U << depth) - 1);
+
+		unsigned int seed = 1;
+
+		for(int c=0; c < 4; c++)
+		{
+			planes[c].resize((size_t)width * height * sampleSize);
+
+			for(unsigned int y=0; y < height; y++)
+			{
+				for(unsigned int x=0; x < width; x++)
+				{
+					seed = (seed * 1103515245U) + 12345U;
+
+					const double ramp = (c == 0 ? (double)x / width :
+											c == 1 ? (double)y / height :
+											c == 2 ? (double)(x + y) / (width + height) :
+											1.0);
+
+					const double noise = (c == 3 ? 0.0 : ((double)((seed >> 16) & 0xff) / 255.0 - 0.5) * 0.2);
+
+					const double val = std::max(0.0, std::min(ramp + noise, 1.0));
+
+					const unsigned int sample = (unsigned int)((val * maxVal) + 0.5);
+
+					const size_t index = (((size_t)y * width) + x);
+
+					if(depth > 8)
+						((unsigned short *)&planes[c][0])[index] = sample;
+					else
+						planes[c][index] = sample;
+				}
+			}
+		}
+	}
+
+	RGBAbuffer Buffer()
+	{
+		RGBAbuffer buffer;
+
+		Channel *chans[4] = { &buffer.r, &buffer.g, &buffer.b, &buffer.a };
+
+		for(int c=0; c < 4; c++)
+		{
+			Channel &chan = *chans[c];
+
+			chan.width = width;
+			chan.height = height;
+			chan.sampleType = (depth > 8 ? USHORT : UCHAR);
+			chan.depth = depth;
+			chan.buf = &planes[c][0];
+			chan.colbytes = (depth > 8 ? 2 : 1);
+			chan.rowbytes = (chan.colbytes * width);
+		}
+
+		return buffer;
+	}
+
+} TestImage;
+
+
+static std::vector<unsigned char>
+Encode(TestImage &image, const CompressionSettings &settings, bool ycc420)
+{
+	FileInfo info;
+
+	info.width = image.width;
+	info.height = image.height;
+	info.channels = 3;
+	info.depth = image.depth;
+	info.format = J2C;
+	info.alpha = NO_ALPHA;
+
+	if(ycc420)
+	{
+		info.colorSpace = sYCC;
+		info.subsampling[1] = Subsampling(2, 2);
+		info.subsampling[2] = Subsampling(2, 2);
+	}
+	else
+		info.colorSpace = sRGB;
+
+	info.settings = settings;
+
+	MemoryOutputFile file;
+
+	RGBAoutputFile output(file, info);
+
+	RGBAbuffer buffer = image.Buffer();
+
+	output.WriteFile(buffer);
+
+	return file.Data();
+}
+
+
+static void
+TestSize(unsigned char depth, bool ycc420, unsigned int tileSize)
+{
+	TestImage image(1024, 768, depth);
+
+	CompressionSettings settings;
+
+	settings.method = SIZE;
+	settings.fileSize = 100; // KB
+	settings.tileSize = tileSize;
+
+	const std::vector<unsigned char> codestream = Encode(image, settings, ycc420);
+
+	const double ratio = ((double)codestream.size() / (settings.fileSize * 1024.0));
+
+	// the rate allocator stops short rather than going over, and the headers are extra
+	const bool ok = (ratio > 0.8 && ratio < 1.05);
+
+	printf("%s %2u-bit %s tile %4u: %6lu bytes, %.2f of the target\n", (ok ? "ok  " : "FAIL"),
+			(unsigned int)depth, (ycc420 ? "sYCC 4:2:0" : "RGB       "), tileSize,
+			(unsigned long)codestream.size(), ratio);
+
+	if(!ok)
+		gFailures++;
+}
+
+
+static void
+TestQuality100(unsigned char depth, bool ycc420, unsigned int tileSize)
+{
+	TestImage image(512, 384, depth);
+
+	CompressionSettings settings;
+
+	settings.method = QUALITY;
+	settings.quality = 100;
+	settings.tileSize = tileSize;
+
+	const std::vector<unsigned char> codestream = Encode(image, settings, ycc420);
+
+	MemoryInputFile file(&codestream[0], codestream.size());
+
+	RGBAinputFile input(file);
+
+	TestImage decoded(image.width, image.height, depth);
+
+	RGBAbuffer buffer = decoded.Buffer();
+
+	input.ReadFile(buffer);
+
+	bool ok = true;
+
+	for(int c=0; c < 3; c++)
+		ok = (ok && image.planes[c] == decoded.planes[c]);
+
+	printf("%s %2u-bit quality 100 is lossless\n", (ok ? "ok  " : "FAIL"), (unsigned int)depth);
+
+	if(!ok)
+		gFailures++;
+}
+
+
+typedef void (*TestProc)(unsigned char depth, bool ycc420, unsigned int tileSize);
+
+static void
+Run(TestProc proc, unsigned char depth, bool ycc420, unsigned int tileSize)
+{
+	// a codec that throws fails that test and the rest still run
+	try
+	{
+		proc(depth, ycc420, tileSize);
+	}
+	catch(std::exception &e)
+	{
+		printf("FAIL %2u-bit: %s\n", (unsigned int)depth, e.what());
+
+		gFailures++;
+	}
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	const unsigned char depths[] = { 8, 12, 16 };
+
+	for(int d=0; d < 3; d++)
+	{
+		Run(TestSize, depths[d], false, 0);
+		Run(TestSize, depths[d], true, 0);
+		Run(TestSize, depths[d], false, 256);
+
+		Run(TestQuality100, depths[d], false, 0);
+	}
+
+	if(gFailures > 0)
+		printf("%d failures\n", gFailures);
+
+	return (gFailures > 0 ? 1 : 0);
+}
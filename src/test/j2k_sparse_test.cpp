@@ -0,0 +1,268 @@
+/* ---------------------------------------------------------------------
+//
+// j2k - JPEG 2000 plug-ins for Adobe programs
+// Copyright (c) 2002-2016,  Brendan Bolles, http://www.fnordware.com
+//
+// This file is part of j2k.
+//
+// j2k is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -------------------------------------------------------------------*/
+
+// Sparse reads hand OpenJPEG only the tiles and packets a read needs, so
+// they have to decode exactly what reading the whole codestream does.
+// Writes tiled files with TLM and PLT in each progression order, then
+// reads them both ways at several reductions, layer counts and regions.
+
+#include "j2k_openjpeg_codec.h"
+#include "j2k_rgba_file.h"
+#include "j2k_exception.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+
+using namespace j2k;
+
+
+static int gFailures = 0;
+
+
+// Seekable like a file on disk, but without J2K_READ_MEMORY, which would
+// have the codec skip the sparse path.  Counts what gets read.
+class SeekableInputFile : public InputFile
+{
+  public:
+	SeekableInputFile(const std::vector<unsigned char> &data) : _data(data), _position(0), _bytesRead(0) {}
+	virtual ~SeekableInputFile() {}
+
+	virtual ReadFlags Flags() const { return J2K_READ_SEEKABLE; }
+
+	virtual size_t FileSize() { return _data.size(); }
+
+	virtual size_t Read(void *buf, size_t num_bytes)
+	{
+		const size_t count = std::min(num_bytes, (_position < _data.size() ? (_data.size() - _position) : 0));
+
+		if(count > 0)
+			memcpy(buf, &_data[_position], count);
+
+		_position += count;
+		_bytesRead += count;
+
+		return count;
+	}
+
+	virtual bool Seek(size_t position) { _position = position; return (position <= _data.size()); }
+	virtual size_t Tell() { return _position; }
+
+	size_t BytesRead() const { return _bytesRead; }
+
+  private:
+	const std::vector<unsigned char> &_data;
+	size_t _position;
+	size_t _bytesRead;
+};
+
+
+typedef struct Planes
+{
+	std::vector<unsigned char> data[3];
+
+	Buffer Make(unsigned int width, unsigned int height)
+	{
+		Buffer buffer;
+
+		buffer.channels = 3;
+
+		for(int c=0; c < 3; c++)
+		{
+			data[c].assign((size_t)width * height, 0);
+
+			Channel &chan = buffer.channel[c];
+
+			chan.width = width;
+			chan.height = height;
+			chan.sampleType = UCHAR;
+			chan.depth = 8;
+			chan.buf = (width * height > 0 ? &data[c][0] : NULL);
+			chan.colbytes = 1;
+			chan.rowbytes = width;
+		}
+
+		return buffer;
+	}
+
+} Planes;
+
+
+static std::vector<unsigned char>
+Encode(OpenJPEGCodec &codec, unsigned int width, unsigned int height, Order order)
+{
+	std::vector<unsigned char> pixels[4];
+
+	unsigned int seed = 1;
+
+	for(int c=0; c < 4; c++)
+	{
+		pixels[c].resize((size_t)width * height);
+
+		for(size_t i=0; i < pixels[c].size(); i++)
+		{
+			seed = (seed * 1103515245U) + 12345U;
+
+			const unsigned int x = (i % width);
+			const unsigned int y = (i / width);
+
+			pixels[c][i] = (c == 3 ? 255 : static_cast<unsigned char>(((x * (c + 1)) + y + ((seed >> 16) & 0x1f)) & 0xff));
+		}
+	}
+
+	RGBAbuffer rgba;
+
+	Channel *chans[4] = { &rgba.r, &rgba.g, &rgba.b, &rgba.a };
+
+	for(int c=0; c < 4; c++)
+	{
+		chans[c]->width = width;
+		chans[c]->height = height;
+		chans[c]->buf = &pixels[c][0];
+		chans[c]->colbytes = 1;
+		chans[c]->rowbytes = width;
+	}
+
+	FileInfo info;
+
+	info.width = width;
+	info.height = height;
+	info.channels = 3;
+	info.depth = 8;
+	info.format = J2C;
+	info.alpha = NO_ALPHA;
+	info.colorSpace = sRGB;
+
+	info.settings.method = QUALITY;
+	info.settings.quality = 80;
+	info.settings.layers = 4;
+	info.settings.order = order;
+	info.settings.tileSize = 128;
+	info.settings.lengthMarkers = true;
+
+	MemoryOutputFile file;
+
+	RGBAoutputFile output(file, info, &codec);
+
+	output.WriteFile(rgba);
+
+	return file.Data();
+}
+
+
+static void
+Compare(OpenJPEGCodec &codec, const std::vector<unsigned char> &codestream, const char *orderName,
+		const Rect *region, unsigned int reduce, unsigned int layers)
+{
+	const unsigned int subsample = (1U << reduce);
+
+	const unsigned int x = (region != NULL ? region->x : 0);
+	const unsigned int y = (region != NULL ? region->y : 0);
+	const unsigned int fullWidth = 512;
+	const unsigned int fullHeight = 384;
+	const unsigned int w = (region != NULL ? region->width : fullWidth);
+	const unsigned int h = (region != NULL ? region->height : fullHeight);
+
+	const unsigned int width = (SubsampledSize(x + w, subsample) - SubsampledSize(x, subsample));
+	const unsigned int height = (SubsampledSize(y + h, subsample) - SubsampledSize(y, subsample));
+
+	Planes results[2];
+	size_t bytesRead[2] = { 0, 0 };
+
+	for(int sparse=0; sparse < 2; sparse++)
+	{
+		codec.SetSparseReads(sparse != 0);
+
+		SeekableInputFile file(codestream);
+
+		Buffer buffer = results[sparse].Make(width, height);
+
+		if(region != NULL)
+			codec.ReadRegion(file, buffer, *region, subsample, NULL, layers);
+		else
+			codec.ReadFile(file, buffer, subsample, NULL, layers);
+
+		bytesRead[sparse] = file.BytesRead();
+	}
+
+	bool same = true;
+
+	for(int c=0; c < 3; c++)
+		same = (same && results[0].data[c] == results[1].data[c]);
+
+	// a sparse read that quietly fell back to reading everything doesn't count
+	const bool smaller = ((region == NULL && reduce == 0) || bytesRead[1] < bytesRead[0]);
+
+	const bool ok = (same && smaller);
+
+	printf("%s %s reduce %u layers %u %s: read %lu of %lu bytes%s\n", (ok ? "ok  " : "FAIL"),
+			orderName, reduce, layers, (region != NULL ? "region" : "whole "),
+			(unsigned long)bytesRead[1], (unsigned long)bytesRead[0],
+			(same ? "" : ", decoded differently"));
+
+	if(!ok)
+		gFailures++;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	OpenJPEGCodec codec;
+
+	const Order orders[] = { RPCL, RLCP, LRCP };
+	const char *orderNames[] = { "RPCL", "RLCP", "LRCP" };
+
+	const Rect region(100, 70, 200, 150);
+
+	for(int o=0; o < 3; o++)
+	{
+		try
+		{
+			codec.SetSparseReads(false);
+
+			const std::vector<unsigned char> codestream = Encode(codec, 512, 384, orders[o]);
+
+			for(unsigned int reduce=0; reduce <= 2; reduce++)
+			{
+				for(unsigned int layers=0; layers <= 2; layers += 2)
+				{
+					Compare(codec, codestream, orderNames[o], NULL, reduce, layers);
+					Compare(codec, codestream, orderNames[o], &region, reduce, layers);
+				}
+			}
+		}
+		catch(std::exception &e)
+		{
+			printf("FAIL %s: %s\n", orderNames[o], e.what());
+
+			gFailures++;
+		}
+	}
+
+	if(gFailures > 0)
+		printf("%d failures\n", gFailures);
+
+	return (gFailures > 0 ? 1 : 0);
+}